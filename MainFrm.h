@@ -86,7 +86,7 @@ public:
 	{
 		int m_nStartChar;
 		int m_nEndChar;
-		std::string m_strText;
+		SecureString m_strText;
 	};
 
 	std::list<UndoBuffer> m_listUndo;
@@ -98,9 +98,16 @@ public:
 	CFont m_fontTitleBarIcons;
 	CFont m_fontFindPanelText;
 	CFont m_fontFindPanelIcons;
-	std::string m_text;
+	SecureString m_text;
+	// a long note whose first screen is shown while the rest decrypts,
+	// owned by Run(); the editor stays read-only until the text arrives
+	Utils::AsyncCryptoTask* m_pLoadTask{ nullptr };
+	// the KDF calibration running off the UI thread and the payload the
+	// note was opened from, both owned by Run(); see GetSaveKdfParameters()
+	Utils::KdfCalibrationTask* m_pKdfCalibration{ nullptr };
+	AESLayer::PayloadInfo m_payloadInfo;
 	UndoBuffer m_currentBuffer;
-	std::string m_password;
+	SecureString m_password;
 
 	DWORD m_dwSearchFlags = FR_DOWN;
 	std::string m_strSearchString;
@@ -147,6 +154,8 @@ public:
 	static constexpr UINT_PTR kFindPanelAnimationTimerId = 0xE92D;
 	static constexpr UINT kFindPanelAnimationIntervalMs = 16;
 	static constexpr UINT kFindPanelAnimationDurationMs = 120;
+	static constexpr UINT_PTR kNoteLoadTimerId = 0xE92E;
+	static constexpr UINT kNoteLoadIntervalMs = 50;
 	static constexpr size_t kFindPanelAnimatedButtonCount = 9;
 	static constexpr int kMinimumWindowTrackWidth = 680;
 	static constexpr int kMinimumWindowTrackHeight = 440;
@@ -442,6 +451,7 @@ public:
 		COMMAND_ID_HANDLER(LANG_RUSSIAN, OnChangeLanguage)
 		COMMAND_ID_HANDLER(ID_STEGANOS_PASSWORD_MANAGER, OnSetEncryptionMode)
 		COMMAND_ID_HANDLER(ID_STEGANOS_SAFE, OnSetEncryptionMode)
+		COMMAND_ID_HANDLER(ID_STEGANOS_PRIVACYSUITE, OnSetEncryptionMode)
 		COMMAND_ID_HANDLER(ID_THEME_SYSTEM, OnChangeTheme)
 		COMMAND_ID_HANDLER(ID_THEME_LIGHT, OnChangeTheme)
 		COMMAND_ID_HANDLER(ID_THEME_DARK, OnChangeTheme)
@@ -463,10 +473,10 @@ public:
 		CHAIN_MSG_MAP(CFrameWindowImpl<CMainFrame>)
 	END_MSG_MAP()
 
-	std::string GetText()
+	SecureString GetText()
 	{
 		const int length = m_view.GetWindowTextLength();
-		std::wstring wideText(static_cast<size_t>(length) + 1, L'\0');
+		SecureWString wideText(static_cast<size_t>(length) + 1, L'\0');
 		if (length > 0)
 		{
 			::GetWindowTextW(m_view, wideText.data(), length + 1);
@@ -475,10 +485,10 @@ public:
 		{
 			wideText.pop_back();
 		}
-		return wstring_to_utf8(wideText);
+		return wchar_to_utf8<SecureString>(wideText.c_str());
 	}
 
-	bool SaveTextToFile(const std::string& path, const std::string& text, std::string& password, HWND hWnd = 0)
+	bool SaveTextToFile(const std::string& path, const std::string_view text, SecureString& password, HWND hWnd = 0)
 	{
 		LOCKNOTEWINTRAITS wintraits;
 		wintraits.m_nFontSize = m_nFontSize;
@@ -488,7 +498,16 @@ public:
 		wintraits.m_nKdfMode = static_cast<int>(m_kdfMode);
 		wintraits.m_nThemeMode = m_nThemeMode;
 		wintraits.m_strFontName = m_strFontName;
-		return Utils::SaveTextToFile(path, text, password, *this, &wintraits);
+		return Utils::SaveTextToFile(path, text, password, GetSaveKdfParameters(), *this, &wintraits);
+	}
+
+	// KDF parameters for saving in the current mode: calibrated, and never
+	// weaker than those the note was opened with
+	AESLayer::KdfParameters GetSaveKdfParameters() const
+	{
+		const AESLayer::KdfParameters calibrated = m_pKdfCalibration != nullptr ?
+			m_pKdfCalibration->Get(m_kdfMode) : AESLayer::DefaultKdfParameters(m_kdfMode);
+		return Utils::SaveKdfParameters(m_kdfMode, calibrated, m_payloadInfo);
 	}
 
 	void SetKdfMode(const int rawMode)
@@ -579,6 +598,13 @@ public:
 			: L"Compatibility encryption (PBKDF2-SHA256)";
 	}
 
+	std::wstring GetEncryptionArgon2Caption() const
+	{
+		return IsRussianUi()
+			? L"\u0420\u0435\u0441\u0443\u0440\u0441\u043E\u0435\u043C\u043A\u043E\u0435 \u0448\u0438\u0444\u0440\u043E\u0432\u0430\u043D\u0438\u0435 (Argon2id)"
+			: L"Memory-hard encryption (Argon2id)";
+	}
+
 	std::wstring GetFindPanelMatchCaseCaption() const
 	{
 		return IsRussianUi() ? L"\u0421 \u0443\u0447\u0435\u0442\u043E\u043C \u0440\u0435\u0433\u0438\u0441\u0442\u0440\u0430" : L"Match case";
@@ -5202,6 +5228,7 @@ public:
 		::AppendMenuW(paletteMenu, MF_SEPARATOR, 0, nullptr);
 		::AppendMenuW(paletteMenu, MF_STRING, ID_STEGANOS_PASSWORD_MANAGER, isRu ? L"\u0428\u0438\u0444\u0440\u043E\u0432\u0430\u043D\u0438\u0435: \u041C\u0435\u043D\u0435\u0434\u0436\u0435\u0440 \u043F\u0430\u0440\u043E\u043B\u0435\u0439" : L"Encryption: Password Manager");
 		::AppendMenuW(paletteMenu, MF_STRING, ID_STEGANOS_SAFE, isRu ? L"\u0428\u0438\u0444\u0440\u043E\u0432\u0430\u043D\u0438\u0435: Safe" : L"Encryption: Safe");
+		::AppendMenuW(paletteMenu, MF_STRING, ID_STEGANOS_PRIVACYSUITE, isRu ? L"\u0428\u0438\u0444\u0440\u043E\u0432\u0430\u043D\u0438\u0435: Argon2id" : L"Encryption: Argon2id");
 		::AppendMenuW(paletteMenu, MF_SEPARATOR, 0, nullptr);
 		::AppendMenuW(paletteMenu, MF_STRING, ID_THEME_SYSTEM, isRu ? L"\u0422\u0435\u043C\u0430: \u0421\u0438\u0441\u0442\u0435\u043C\u043D\u0430\u044F" : L"Theme: System");
 		::AppendMenuW(paletteMenu, MF_STRING, ID_THEME_LIGHT, isRu ? L"\u0422\u0435\u043C\u0430: \u0421\u0432\u0435\u0442\u043B\u0430\u044F" : L"Theme: Light");
@@ -5710,6 +5737,11 @@ public:
 			UpdateFindPanelAnimationState();
 			return 0;
 		}
+		if (wParam == kNoteLoadTimerId)
+		{
+			UpdateNoteLoadState();
+			return 0;
+		}
 
 		bHandled = FALSE;
 		return 0;
@@ -5980,13 +6012,49 @@ public:
 		return 0;
 	}
 
-	void SetViewTextWithoutTracking(const std::string& text)
+	void SetViewTextWithoutTracking(const SecureString& text)
 	{
 		m_ignoreEditNotifications = true;
-		m_view.SetWindowText(utf8_to_wstring(text).c_str());
+		m_view.SetWindowText(utf8_to_wstring<SecureWString>(text.c_str()).c_str());
 		m_view.SetModify(FALSE);
 		m_ignoreEditNotifications = false;
 	}
+
+	// swaps the first screen for the whole note once m_pLoadTask is done,
+	// keeping the caret and scroll position; closes the window if the rest
+	// of the note failed to decrypt, and Run() then saves nothing
+	void UpdateNoteLoadState()
+	{
+		if (m_pLoadTask == nullptr || m_pLoadTask->GetStatus() == Utils::AsyncCryptoTask::Status::Running)
+		{
+			return;
+		}
+
+		::KillTimer(m_hWnd, kNoteLoadTimerId);
+		if (m_pLoadTask->GetStatus() != Utils::AsyncCryptoTask::Status::Succeeded)
+		{
+			Utils::MessageBox(*this, L"The rest of the note could not be decrypted; it may be damaged.", MB_OK | MB_ICONERROR);
+			PostMessage(WM_CLOSE);
+			return;
+		}
+
+		int selectionStart = 0;
+		int selectionEnd = 0;
+		m_view.GetSel(selectionStart, selectionEnd);
+		const int firstVisibleLine = m_view.GetFirstVisibleLine();
+		m_text = m_pLoadTask->GetText();
+		m_pLoadTask = nullptr;
+		SetViewTextWithoutTracking(m_text);
+		m_view.SetSel(selectionStart, selectionEnd, TRUE);
+		m_view.LineScroll(firstVisibleLine - m_view.GetFirstVisibleLine());
+		m_view.SetReadOnly(FALSE);
+		m_currentBuffer.m_strText = m_text;
+		m_currentBuffer.m_nStartChar = selectionStart;
+		m_currentBuffer.m_nEndChar = selectionEnd;
+		// anything recorded so far holds only the first screen
+		m_listUndo.clear();
+		UpdateStatusBar();
+	}
 
 // Handler prototypes (uncomment arguments if needed):
 //	LRESULT MessageHandler(UINT /*uMsg*/, WPARAM /*wParam*/, LPARAM /*lParam*/, BOOL& /*bHandled*/)
@@ -6141,7 +6209,7 @@ public:
 		UpdateEditorVerticalScrollbarVisibility();
 
 		// Reset text to force realignment to margins without creating fake edit changes.
-		const std::string currentText = GetText();
+		const SecureString currentText = GetText();
 		if (!currentText.empty())
 		{
 			SetViewTextWithoutTracking(currentText);
@@ -6260,7 +6328,7 @@ public:
 		UpdateEditorVerticalScrollbarVisibility();
 		
 		// Reset text to force realignment to margins without creating fake edit changes.
-		const std::string currentText = GetText();
+		const SecureString currentText = GetText();
 		if (!currentText.empty())
 		{
 			SetViewTextWithoutTracking(currentText);
@@ -6313,7 +6381,7 @@ public:
 	LRESULT OnChangeLanguage(WORD wNotifyCode, WORD wID, HWND /*hWndCtl*/, BOOL& /*bHandled*/)
 	{
 		// does the edit window still contain the default text? make sure to refresh it with the selected language
-		bool bTextUnchanged = GetText() == STR(IDS_WELCOME);
+		bool bTextUnchanged = GetText().compare(STR(IDS_WELCOME)) == 0;
 
 		// set UI language
 		const auto langIt = m_languages.find(wID);
@@ -6720,7 +6788,7 @@ public:
 			if (nResult == IDYES)
 			{
 				int nConverted = 0;
-				std::string encryptPassword;
+				SecureString encryptPassword;
 				for (UINT uIndex = 0; uIndex < uFileCount; ++uIndex)
 				{
 					const UINT uLength = DragQueryFileW(hDrop, uIndex, nullptr, 0);
@@ -6732,8 +6800,8 @@ public:
 					{
 						std::string newfilename = filename.substr(0, filename.size() - 4);
 						newfilename += ".exe";
-						std::string text;
-						std::string password;
+						SecureString text;
+						SecureString password;
 						if (LoadTextFromFile(filename, text, password) && SaveTextToFile(newfilename, text, encryptPassword))
 						{
 							++nConverted;
@@ -6761,7 +6829,7 @@ public:
 
 	LRESULT OnFileSave(WORD /*wNotifyCode*/, WORD /*wID*/, HWND /*hWndCtl*/, BOOL& /*bHandled*/)
 	{
-		const std::string currentText = GetText();
+		const SecureString currentText = GetText();
 		if (currentText == m_text && !m_bTraitsChanged)
 		{
 			return 0;
@@ -6784,12 +6852,24 @@ public:
 
 	LRESULT OnFileSaveAs(WORD /*wNotifyCode*/, WORD /*wID*/, HWND /*hWndCtl*/, BOOL& /*bHandled*/)
 	{
-		std::string encryptPassword;
+		// the editor holds only the first screen of a long note until
+		// m_pLoadTask is done, so wait for the rest before saving a copy
+		if (m_pLoadTask != nullptr)
+		{
+			m_pLoadTask->Wait();
+			UpdateNoteLoadState();
+			if (m_pLoadTask != nullptr)
+			{
+				return 0;
+			}
+		}
+
+		SecureString encryptPassword;
 
 		CFileDialog dlg(FALSE, _T("exe"), NULL, OFN_HIDEREADONLY | OFN_OVERWRITEPROMPT, NULL, *this);
 		if (dlg.DoModal() == IDOK)
 		{
-			std::string text;
+			SecureString text;
 			text = GetText();
 			if (SaveTextToFile(wstring_to_utf8(dlg.m_szFileName), text, encryptPassword))
 			{
@@ -6802,7 +6882,7 @@ public:
 
 	LRESULT OnClose(UINT /*uMsg*/, WPARAM /*wParam*/, LPARAM /*lParam*/, BOOL& bHandled)
 	{
-		const std::string text = GetText();
+		const SecureString text = GetText();
 		const bool textChanged = (m_text != text);
 		if (textChanged)
 		{
@@ -7150,6 +7230,11 @@ public:
 			{
 				SetViewTextWithoutTracking(m_text);
 			}
+			if (m_pLoadTask != nullptr)
+			{
+				m_view.SetReadOnly(TRUE);
+				::SetTimer(m_hWnd, kNoteLoadTimerId, kNoteLoadIntervalMs, nullptr);
+			}
 
 			std::array<wchar_t, MAX_PATH> modulePath{};
 			const DWORD modulePathLength = ::GetModuleFileNameW(Utils::GetModuleHandle(), modulePath.data(), static_cast<DWORD>(modulePath.size()));
@@ -7348,8 +7433,8 @@ public:
 			return;
 		}
 
-		const std::array<UINT, 4> menuItemsToRemove{
-			ID_STEGANOS_PRIVACYSUITE,
+		// ID_STEGANOS_PRIVACYSUITE is kept and becomes the Argon2id item
+		const std::array<UINT, 3> menuItemsToRemove{
 			ID_STEGANOS_ONLINESHIELD,
 			ID_STEGANOS_LATESTOFFERS,
 			ID_STEGANOS_CHECKFORLOCKNOTEUPDATES
@@ -7394,6 +7479,7 @@ public:
 
 		ChangeMenuItemText(ID_STEGANOS_PASSWORD_MANAGER, GetEncryptionModernCaption());
 		ChangeMenuItemText(ID_STEGANOS_SAFE, GetEncryptionCompatibilityCaption());
+		ChangeMenuItemText(ID_STEGANOS_PRIVACYSUITE, GetEncryptionArgon2Caption());
 		RefreshToolbarLayout();
 		RefreshTopMenuLayout();
 		InvalidateTopBar();
@@ -7414,6 +7500,9 @@ public:
 		menu.CheckMenuItem(
 			ID_STEGANOS_SAFE,
 			MF_BYCOMMAND | (m_kdfMode == AESLayer::KdfMode::Pbkdf2Sha256 ? MF_CHECKED : MF_UNCHECKED));
+		menu.CheckMenuItem(
+			ID_STEGANOS_PRIVACYSUITE,
+			MF_BYCOMMAND | (m_kdfMode == AESLayer::KdfMode::Argon2id ? MF_CHECKED : MF_UNCHECKED));
 	}
 
 	// change the text of the given menu
@@ -7501,7 +7590,8 @@ public:
 
 	LRESULT OnEditUndo(WORD /*wNotifyCode*/, WORD /*wID*/, HWND /*hWndCtl*/, BOOL& /*bHandled*/)
 	{
-		if (!m_listUndo.empty())
+		// SetWindowText() bypasses the read-only editor of a loading note
+		if (m_pLoadTask == nullptr && !m_listUndo.empty())
 		{
 			UndoBuffer undo = m_listUndo.back();
 			m_listUndo.pop_back();
@@ -7534,7 +7624,8 @@ public:
 		return text;
 	}
 
-	static std::wstring ToLowerWide(std::wstring value)
+	template <class WideString>
+	static WideString ToLowerWide(WideString value)
 	{
 		std::transform(
 			value.begin(),
@@ -7680,6 +7771,13 @@ public:
 
 	bool ReplaceCurrentSelection()
 	{
+		// ReplaceSel() bypasses the read-only editor of a loading note,
+		// which holds only its first screen
+		if (m_pLoadTask != nullptr)
+		{
+			return false;
+		}
+
 		SyncSearchTextFromFindPanel();
 		const std::wstring findText = utf8_to_wstring(m_strSearchString);
 		if (findText.empty())
@@ -7704,6 +7802,12 @@ public:
 
 	void ReplaceAllSelections()
 	{
+		// as in ReplaceCurrentSelection()
+		if (m_pLoadTask != nullptr)
+		{
+			return;
+		}
+
 		SyncSearchTextFromFindPanel();
 		const std::wstring findText = utf8_to_wstring(m_strSearchString);
 		const std::wstring replaceText = GetControlText(m_hFindPanelReplaceEdit);
@@ -7712,8 +7816,8 @@ public:
 			return;
 		}
 
-		std::wstring document = utf8_to_wstring(GetText());
-		std::wstring lookupDocument = document;
+		SecureWString document = utf8_to_wstring<SecureWString>(GetText().c_str());
+		SecureWString lookupDocument = document;
 		std::wstring lookupFind = findText;
 		std::wstring lookupReplace = replaceText;
 		if (!(m_dwSearchFlags & FR_MATCHCASE))
@@ -7767,7 +7871,7 @@ public:
 		}
 		int nBegin = 0;
 		int nEnd = 0;
-		std::string text = GetText();
+		SecureString text = GetText();
 		std::string searchtext = m_strSearchString;
 		if (searchtext.empty())
 		{
@@ -7779,7 +7883,7 @@ public:
 			text = str_tolower(text);
 			searchtext = str_tolower(searchtext);
 		}
-		const std::wstring wtext = utf8_to_wstring(text);
+		const SecureWString wtext = utf8_to_wstring<SecureWString>(text.c_str());
 		const std::wstring wsearchtext = utf8_to_wstring(searchtext);
 		m_view.GetSel(nBegin, nEnd);
 
@@ -7981,7 +8085,7 @@ public:
 		{
 			if (!m_password.empty())
 			{
-				std::string strOldPassword = GetPasswordDlg(*this);
+				const SecureString strOldPassword = GetPasswordDlg(*this);
 				if (strOldPassword.empty())
 				{
 					return 0;
@@ -7993,7 +8097,7 @@ public:
 				}
 			}
 
-		std::string strNewPassword = GetNewPasswordDlg(*this);
+		const SecureString strNewPassword = GetNewPasswordDlg(*this);
 		if (strNewPassword.empty())
 		{
 			return 0;
@@ -8014,9 +8118,18 @@ public:
 	LRESULT OnSetEncryptionMode(WORD /*wNotifyCode*/, WORD wID, HWND /*hWndCtl*/, BOOL& /*bHandled*/)
 	{
 		const AESLayer::KdfMode oldMode = m_kdfMode;
-		m_kdfMode = (wID == ID_STEGANOS_SAFE)
-			? AESLayer::KdfMode::Pbkdf2Sha256
-			: AESLayer::KdfMode::Scrypt;
+		if (wID == ID_STEGANOS_SAFE)
+		{
+			m_kdfMode = AESLayer::KdfMode::Pbkdf2Sha256;
+		}
+		else if (wID == ID_STEGANOS_PRIVACYSUITE)
+		{
+			m_kdfMode = AESLayer::KdfMode::Argon2id;
+		}
+		else
+		{
+			m_kdfMode = AESLayer::KdfMode::Scrypt;
+		}
 
 		if (m_kdfMode != oldMode)
 		{
@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <memory>
 #include <vector>
 
 #include "utils.h"
@@ -30,10 +31,24 @@ public:
 	std::string m_strCaption;
 	std::string m_strPasswordCaption1;
 	std::string m_strPasswordCaption2;
-	std::string m_strPassword1;
-	std::string m_strPassword2;
+	SecureString m_strPassword1;
+	SecureString m_strPassword2;
 	std::string m_strText;
 
+	// unlock mode: OK decrypts m_encryptedPayload on a worker thread while
+	// the dialog shows the KDF progress; Cancel stops the derivation
+	std::span<const byte> m_encryptedPayload;
+	SecureString m_strDecryptedText;
+	AESLayer::PayloadInfo m_payloadInfo;
+	std::unique_ptr<AESLayer::IncrementalPayload> m_session;
+	std::unique_ptr<Utils::AsyncCryptoTask> m_unlockTask;
+	// set instead of m_session when the dialog closed on the first screen
+	std::unique_ptr<Utils::AsyncCryptoTask> m_loadTask;
+
+	static constexpr UINT_PTR UNLOCK_TIMER_ID = 1;
+	static constexpr UINT UNLOCK_TIMER_INTERVAL = 50;
+	static constexpr int UNLOCK_PROGRESS_RANGE = 1000;
+
 	CPasswordDlg()
 	{
 		m_strCaption = STR(IDR_MAINFRAME);
@@ -45,6 +60,7 @@ public:
 
 	BEGIN_MSG_MAP(CPasswordDlg)
 		MESSAGE_HANDLER(WM_INITDIALOG, OnInitDialog)
+		MESSAGE_HANDLER(WM_TIMER, OnTimer)
 		COMMAND_ID_HANDLER(IDOK, OnCloseCmd)
 		COMMAND_ID_HANDLER(IDCANCEL, OnCloseCmd)
 	END_MSG_MAP()
@@ -61,8 +77,8 @@ public:
 		SetDlgItemText(IDC_STATIC_PASSWORD2, utf8_to_wstring(m_strPasswordCaption2).c_str());
 		SetDlgItemText(IDC_INFOTEXT, utf8_to_wstring(m_strText).c_str());
 		SetDlgItemText(IDCANCEL, WSTR(IDS_CANCEL).c_str());
-		SetDlgItemText(IDC_PASSWORD1, utf8_to_wstring(m_strPassword1).c_str());
-		SetDlgItemText(IDC_PASSWORD2, utf8_to_wstring(m_strPassword2).c_str());
+		SetDlgItemText(IDC_PASSWORD1, utf8_to_wstring<SecureWString>(m_strPassword1.c_str()).c_str());
+		SetDlgItemText(IDC_PASSWORD2, utf8_to_wstring<SecureWString>(m_strPassword2.c_str()).c_str());
 		if (!m_bDualInput)
 		{
 			GetDlgItem(IDC_PASSWORD2).ShowWindow(SW_HIDE);
@@ -72,37 +88,128 @@ public:
 		return TRUE;
 	}
 
+	LRESULT OnTimer(UINT /*uMsg*/, WPARAM wParam, LPARAM /*lParam*/, BOOL& bHandled)
+	{
+		if (wParam != UNLOCK_TIMER_ID || !m_unlockTask)
+		{
+			bHandled = FALSE;
+			return 0;
+		}
+
+		CProgressBarCtrl progress(GetDlgItem(IDC_UNLOCK_PROGRESS));
+		progress.SetPos(static_cast<int>(m_unlockTask->GetProgress() * UNLOCK_PROGRESS_RANGE));
+		const Utils::AsyncCryptoTask::Status status = m_unlockTask->GetStatus();
+		if (status == Utils::AsyncCryptoTask::Status::Running && m_unlockTask->HasFirstScreen())
+		{
+			// a long note: show its beginning now, the main window takes
+			// over the task and the rest of the text when it is done
+			KillTimer(UNLOCK_TIMER_ID);
+			m_strDecryptedText = m_unlockTask->TakeFirstScreen();
+			m_payloadInfo = m_unlockTask->GetPayloadInfo();
+			m_loadTask = std::move(m_unlockTask);
+			EndDialog(IDOK);
+			return 0;
+		}
+		if (status == Utils::AsyncCryptoTask::Status::Running)
+		{
+			return 0;
+		}
+
+		KillTimer(UNLOCK_TIMER_ID);
+		if (status == Utils::AsyncCryptoTask::Status::Succeeded)
+		{
+			m_strDecryptedText = m_unlockTask->TakeText();
+			m_payloadInfo = m_unlockTask->GetPayloadInfo();
+			m_session = m_unlockTask->TakeIncrementalPayload();
+		}
+		m_unlockTask.reset();
+		EndDialog(status == Utils::AsyncCryptoTask::Status::Succeeded ? IDOK : status == Utils::AsyncCryptoTask::Status::Cancelled ? IDCANCEL : IDABORT);
+		return 0;
+	}
+
 	LRESULT OnCloseCmd(WORD /*wNotifyCode*/, WORD wID, HWND /*hWndCtl*/, BOOL& /*bHandled*/)
 	{
+		if (m_unlockTask)
+		{
+			// still deriving: OK is disabled, Cancel stops the KDF and the
+			// timer ends the dialog once the worker has noticed
+			if (wID == IDCANCEL)
+			{
+				m_unlockTask->Cancel();
+			}
+			return 0;
+		}
+
 		const int password1Length = GetDlgItem(IDC_PASSWORD1).GetWindowTextLength();
 		const int password2Length = GetDlgItem(IDC_PASSWORD2).GetWindowTextLength();
-		std::vector<wchar_t> password1(static_cast<size_t>(password1Length) + 1, L'\0');
-		std::vector<wchar_t> password2(static_cast<size_t>(password2Length) + 1, L'\0');
+		// wiped by the allocator when they go out of scope
+		std::vector<wchar_t, SecureAllocator<wchar_t>> password1(static_cast<size_t>(password1Length) + 1, L'\0');
+		std::vector<wchar_t, SecureAllocator<wchar_t>> password2(static_cast<size_t>(password2Length) + 1, L'\0');
 
 		GetDlgItemText(IDC_PASSWORD1, password1.data(), static_cast<int>(password1.size()));
 		GetDlgItemText(IDC_PASSWORD2, password2.data(), static_cast<int>(password2.size()));
 
-		m_strPassword1 = wchar_to_utf8(password1.data());
-		m_strPassword2 = wchar_to_utf8(password2.data());
-
-		SecureZeroMemory(password1.data(), password1.size() * sizeof(wchar_t));
-		SecureZeroMemory(password2.data(), password2.size() * sizeof(wchar_t));
+		m_strPassword1 = wchar_to_utf8<SecureString>(password1.data());
+		m_strPassword2 = wchar_to_utf8<SecureString>(password2.data());
+		if (wID == IDOK && !m_encryptedPayload.empty() && !m_strPassword1.empty())
+		{
+			StartUnlock();
+			return 0;
+		}
 		EndDialog(wID);
 		return 0;
 	}
+
+	void StartUnlock()
+	{
+		m_unlockTask = Utils::AsyncCryptoTask::StartDecrypt(m_encryptedPayload, m_strPassword1);
+		GetDlgItem(IDOK).EnableWindow(FALSE);
+		GetDlgItem(IDC_PASSWORD1).EnableWindow(FALSE);
+		CProgressBarCtrl progress(GetDlgItem(IDC_UNLOCK_PROGRESS));
+		progress.SetRange32(0, UNLOCK_PROGRESS_RANGE);
+		progress.SetPos(0);
+		progress.ShowWindow(SW_SHOW);
+		SetTimer(UNLOCK_TIMER_ID, UNLOCK_TIMER_INTERVAL);
+	}
 };
 
-std::string GetPasswordDlg(HWND hWnd)
+SecureString GetPasswordDlg(HWND hWnd)
 {
 	CPasswordDlg dlg;
 	if (dlg.DoModal(hWnd) == IDCANCEL)
 	{
-		return "";
+		return {};
 	}
 	return dlg.m_strPassword1;
 }
 
-std::string GetNewPasswordDlg(HWND hWnd)
+// asks for the password and decrypts encryptedPayload (the mapped payload
+// resource, see Utils::LoadResourceView() and Utils::DecryptPayload()),
+// which is read in place and must outlive session and loadTask; IDOK when
+// unlocked, IDCANCEL when cancelled (or no password was entered) and
+// IDABORT for a wrong password. session receives the payload of an indexed
+// note, so the save on exit can reuse its keys and unchanged segments. For
+// a long indexed note strText may be only its first screen: loadTask then
+// receives the task still decrypting the rest, which provides the text and
+// the session once it succeeds.
+INT_PTR UnlockDlg(const std::span<const byte> encryptedPayload, SecureString& strPassword, SecureString& strText, AESLayer::PayloadInfo& payloadInfo, std::unique_ptr<AESLayer::IncrementalPayload>& session, std::unique_ptr<Utils::AsyncCryptoTask>& loadTask, HWND hWnd)
+{
+	CPasswordDlg dlg;
+	dlg.m_encryptedPayload = encryptedPayload;
+	const INT_PTR result = dlg.DoModal(hWnd);
+	if (result == IDOK && !dlg.m_strPassword1.empty())
+	{
+		strPassword = dlg.m_strPassword1;
+		strText = std::move(dlg.m_strDecryptedText);
+		payloadInfo = dlg.m_payloadInfo;
+		session = std::move(dlg.m_session);
+		loadTask = std::move(dlg.m_loadTask);
+		return IDOK;
+	}
+	return result == IDABORT ? IDABORT : IDCANCEL;
+}
+
+SecureString GetNewPasswordDlg(HWND hWnd)
 {
 	CPasswordDlg dlg;
 	dlg.m_strText = STR(IDS_ENTER_NEW_PASSWORD);
@@ -111,12 +218,12 @@ std::string GetNewPasswordDlg(HWND hWnd)
 	{
 		if (dlg.DoModal(hWnd) == IDCANCEL)
 		{
-			return "";
+			return {};
 		}
 		if (dlg.m_strPassword1 != dlg.m_strPassword2)
 		{
-			dlg.m_strPassword1 = "";
-			dlg.m_strPassword2 = "";
+			dlg.m_strPassword1.clear();
+			dlg.m_strPassword2.clear();
 			MessageBox(hWnd, WSTR(IDS_PASSWORD_MISMATCH), MB_OK | MB_ICONERROR);
 		}
 		else if (dlg.m_strPassword1.empty())
@@ -128,5 +235,5 @@ std::string GetNewPasswordDlg(HWND hWnd)
 			return dlg.m_strPassword1;
 		}
 	}
-	return "";
+	return {};
 }
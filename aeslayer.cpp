@@ -1,15 +1,34 @@
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <tuple>
 #include <vector>
 #include <cstring>
 #include <algorithm>
 
 #include "cryptopp/sha.h"
+#include "cryptopp/blake2.h"
+#include "cryptopp/hkdf.h"
 #include "cryptopp/pwdbased.h"
 #include "cryptopp/scrypt.h"
+#include "cryptopp/salsa.h"
 #include "cryptopp/aes.h"
 #include "cryptopp/modes.h"
+#include "cryptopp/gcm.h"
 #include "cryptopp/hmac.h"
+#include "cryptopp/filters.h"
 #include "cryptopp/misc.h"
+#include "cryptopp/cpu.h"
+#include "cryptopp/zlib.h"
 
 #include "aeslayer.h"
 
@@ -18,71 +37,223 @@ NAMESPACE_BEGIN(CryptoPP)
 namespace
 {
 	constexpr std::array<byte, AESLayer::FORMAT_HEADER_SIZE - 1> kFormatMagic{ 'L', 'N', '2', 0x02 };
+	constexpr std::array<byte, AESLayer::FORMAT_HEADER_SIZE - 1> kSegmentedFormatMagic{ 'L', 'N', '2', 0x03 };
+	constexpr size_t kCipherModeOffset = AESLayer::FORMAT_HEADER_SIZE;
+	// set in the cipher mode byte of compressed segmented payloads
+	constexpr byte kCompressedFlag = 0x80;
+	constexpr size_t kSegmentSizeOffset = kCipherModeOffset + 1;
+	constexpr size_t kKdfParametersOffset = kSegmentSizeOffset + 4;
+	constexpr size_t kSegmentedSaltOffset = kKdfParametersOffset + 12;
+	constexpr size_t kKeyCheckOffset = kSegmentedSaltOffset + AESLayer::SALT_SIZE;
+	constexpr std::array<byte, AESLayer::FORMAT_HEADER_SIZE - 1> kIndexedFormatMagic{ 'L', 'N', '2', 0x04 };
+	constexpr size_t kIndexedFlagsOffset = AESLayer::FORMAT_HEADER_SIZE;
+	constexpr size_t kIndexedKdfParametersOffset = kIndexedFlagsOffset + 1;
+	constexpr size_t kIndexedSaltOffset = kIndexedKdfParametersOffset + 12;
+	constexpr size_t kIndexedKeyCheckOffset = kIndexedSaltOffset + AESLayer::SALT_SIZE;
+	constexpr size_t kSegmentCountOffset = kIndexedKeyCheckOffset + AESLayer::KEY_CHECK_SIZE;
+	constexpr size_t kRootTagOffset = kSegmentCountOffset + 4;
+	constexpr byte kIndexedCompressedFlag = 0x01;
+	constexpr size_t kIndexPlainTextLengthOffset = 4;
+	constexpr size_t kIndexNonceOffset = 8;
+	constexpr size_t kIndexTagOffset = 20;
+	constexpr unsigned int kMaxWorkerCount = 64;
+	constexpr size_t kSegmentsPerWorker = 4;
 	constexpr unsigned int kScryptBlockSize = 8;
 	constexpr unsigned int kScryptParallelization = 5;
 	constexpr unsigned int kIvDerivationCost = 2;
+	constexpr size_t kGcmNonceSize = 12;
+	// Argon2id defaults (RFC 9106 second recommended option): 64 MiB, three
+	// passes, four lanes
+	constexpr word32 kArgon2Memory = 0x10000;
+	constexpr word32 kArgon2Passes = 3;
+	constexpr word32 kArgon2Lanes = 4;
+	constexpr word32 kArgon2Version = 0x13;
+	constexpr word32 kArgon2idType = 2;
+	constexpr word32 kArgon2SyncPoints = 4;
+	constexpr size_t kArgon2BlockWords = 128;
+	constexpr size_t kArgon2BlockSize = kArgon2BlockWords * 8;
+	constexpr size_t kArgon2AddressesPerBlock = kArgon2BlockWords;
+	constexpr int kDiagnosticsPasses = 3;
+	// KDF loops report to a ProgressMonitor (and check for cancellation)
+	// every this many units of work
+	constexpr word64 kProgressStride = 1024;
+	// legacy/v2 payloads are encrypted and MACed (or MACed and decrypted)
+	// in blocks of this size, so each block is still in L1/L2 for the
+	// second operation instead of making two passes over the whole buffer
+	constexpr size_t kFusedBlockSize = 0x4000;
+	constexpr std::array<byte, 19> kSegmentedKeyLabel{ 'L', 'o', 'c', 'k', 'N', 'o', 't', 'e', '2', ' ', 's', 'e', 'g', 'm', 'e', 'n', 't', 'e', 'd' };
 
-	bool IsKnownKdfMode(const byte modeValue)
+	unsigned int ResolveWorkerCount(const unsigned int requestedWorkers)
+	{
+		const unsigned int workers = requestedWorkers != 0
+			? requestedWorkers
+			: std::thread::hardware_concurrency();
+		return std::clamp(workers, 1u, kMaxWorkerCount);
+	}
+
+	// KDFs legacy and v2 payloads can be written with
+	bool IsCompatibleKdfMode(const byte modeValue)
 	{
 		return modeValue == static_cast<byte>(AESLayer::KdfMode::Scrypt) ||
 			modeValue == static_cast<byte>(AESLayer::KdfMode::Pbkdf2Sha256);
 	}
 
+	bool IsKnownKdfMode(const byte modeValue)
+	{
+		return IsCompatibleKdfMode(modeValue) ||
+			modeValue == static_cast<byte>(AESLayer::KdfMode::Argon2id);
+	}
+
 	AESLayer::KdfMode ToKdfMode(const byte modeValue)
 	{
-		return modeValue == static_cast<byte>(AESLayer::KdfMode::Pbkdf2Sha256)
-			? AESLayer::KdfMode::Pbkdf2Sha256
-			: AESLayer::KdfMode::Scrypt;
+		if (modeValue == static_cast<byte>(AESLayer::KdfMode::Pbkdf2Sha256))
+		{
+			return AESLayer::KdfMode::Pbkdf2Sha256;
+		}
+		if (modeValue == static_cast<byte>(AESLayer::KdfMode::Argon2id))
+		{
+			return AESLayer::KdfMode::Argon2id;
+		}
+		return AESLayer::KdfMode::Scrypt;
 	}
 
-	void DeriveKeyAndIv(
-		const AESLayer::KdfMode mode,
+	// batches single units of work into ProgressMonitor::Advance() calls;
+	// does nothing without a monitor
+	class ProgressCounter
+	{
+	public:
+		explicit ProgressCounter(AESLayer::ProgressMonitor* progress) : m_progress(progress) {}
+
+		void Step()
+		{
+			if (m_progress && ++m_pending == kProgressStride)
+			{
+				Flush();
+			}
+		}
+
+		void Flush()
+		{
+			if (m_progress && m_pending != 0)
+			{
+				const word64 pending = m_pending;
+				m_pending = 0;
+				m_progress->Advance(pending);
+			}
+		}
+
+	private:
+		AESLayer::ProgressMonitor* m_progress;
+		word64 m_pending{ 0 };
+	};
+
+	// PKCS5_PBKDF2_HMAC<SHA256>::DeriveKey, or the same RFC 8018 loop spelled
+	// out when there is a monitor to report the iterations to
+	void DerivePbkdf2Sha256(
+		byte* derived,
+		size_t derivedLength,
 		ConstByteArrayParameter const& passphrase,
 		const byte* salt,
-		const byte* ivSeed,
-		SecByteBlock& key,
-		SecByteBlock& iv)
+		const size_t saltLength,
+		const word32 iterations,
+		AESLayer::ProgressMonitor* progress)
 	{
-		if (mode == AESLayer::KdfMode::Pbkdf2Sha256)
+		if (!progress)
 		{
 			PKCS5_PBKDF2_HMAC<SHA256> pbkdf;
 			const byte purposeUnused = 0;
-			pbkdf.DeriveKey(
+			pbkdf.DeriveKey(derived, derivedLength, purposeUnused, passphrase.begin(), passphrase.size(), salt, saltLength, iterations, 0.0);
+			return;
+		}
+
+		const word64 blocks = (derivedLength + SHA256::DIGESTSIZE - 1) / SHA256::DIGESTSIZE;
+		progress->AddWork(blocks * iterations);
+		HMAC<SHA256> hmac(passphrase.begin(), passphrase.size());
+		std::array<byte, SHA256::DIGESTSIZE> u{};
+		std::array<byte, SHA256::DIGESTSIZE> t{};
+		ProgressCounter counter(progress);
+		for (word32 block = 1; derivedLength > 0; ++block)
+		{
+			const std::array<byte, 4> blockIndex{
+				static_cast<byte>(block >> 24), static_cast<byte>(block >> 16), static_cast<byte>(block >> 8), static_cast<byte>(block) };
+			hmac.Update(salt, saltLength);
+			hmac.Update(blockIndex.data(), blockIndex.size());
+			hmac.Final(u.data());
+			t = u;
+			counter.Step();
+			for (word32 i = 1; i < iterations; ++i)
+			{
+				hmac.Update(u.data(), u.size());
+				hmac.Final(u.data());
+				for (size_t k = 0; k < t.size(); ++k)
+				{
+					t[k] ^= u[k];
+				}
+				counter.Step();
+			}
+
+			const size_t chunk = (std::min)(derivedLength, t.size());
+			std::copy_n(t.begin(), chunk, derived);
+			derived += chunk;
+			derivedLength -= chunk;
+		}
+		counter.Flush();
+		SecureWipeBuffer(u.data(), u.size());
+		SecureWipeBuffer(t.data(), t.size());
+	}
+
+	// the password-hardening step: scrypt, PBKDF2-SHA256 or Argon2id over the salt
+	void DeriveHardenedKey(
+		const AESLayer::KdfMode mode,
+		const AESLayer::KdfParameters& parameters,
+		ConstByteArrayParameter const& passphrase,
+		const byte* salt,
+		SecByteBlock& key,
+		AESLayer::ProgressMonitor* progress = nullptr)
+	{
+		if (mode == AESLayer::KdfMode::Argon2id)
+		{
+			AESLayer::DeriveArgon2id(
 				key.begin(),
 				key.size(),
-				purposeUnused,
-				passphrase.begin(),
-				passphrase.size(),
-				salt,
-				AESLayer::SALT_SIZE,
-				AESLayer::KEY_ITERATIONS,
-				0.0);
-
-			pbkdf.DeriveKey(
-				iv.begin(),
-				iv.size(),
-				purposeUnused,
-				passphrase.begin(),
-				passphrase.size(),
-				ivSeed,
-				AESLayer::IV_SEED_SIZE,
-				AESLayer::KEY_ITERATIONS,
-				0.0);
+				passphrase,
+				ConstByteArrayParameter(salt, AESLayer::SALT_SIZE),
+				ConstByteArrayParameter(),
+				ConstByteArrayParameter(),
+				parameters,
+				progress);
 			return;
 		}
 
-		Scrypt scrypt;
-		scrypt.DeriveKey(
+		if (mode == AESLayer::KdfMode::Pbkdf2Sha256)
+		{
+			DerivePbkdf2Sha256(key.begin(), key.size(), passphrase, salt, AESLayer::SALT_SIZE, parameters.m_cost, progress);
+			return;
+		}
+
+		AESLayer::DeriveScrypt(
 			key.begin(),
 			key.size(),
-			passphrase.begin(),
-			passphrase.size(),
-			salt,
-			AESLayer::SALT_SIZE,
-			AESLayer::DERIVATION_COST,
-			kScryptBlockSize,
-			kScryptParallelization);
+			passphrase,
+			ConstByteArrayParameter(salt, AESLayer::SALT_SIZE),
+			parameters,
+			progress);
+	}
+
+	void DeriveIv(
+		const AESLayer::KdfMode mode,
+		ConstByteArrayParameter const& passphrase,
+		const byte* ivSeed,
+		SecByteBlock& iv,
+		AESLayer::ProgressMonitor* progress)
+	{
+		if (mode == AESLayer::KdfMode::Pbkdf2Sha256)
+		{
+			DerivePbkdf2Sha256(iv.begin(), iv.size(), passphrase, ivSeed, AESLayer::IV_SEED_SIZE, AESLayer::KEY_ITERATIONS, progress);
+			return;
+		}
 
+		Scrypt scrypt;
 		scrypt.DeriveKey(
 			iv.begin(),
 			iv.size(),
@@ -95,6 +266,129 @@ namespace
 			kScryptParallelization);
 	}
 
+	// legacy and v2 payloads only: the IV comes from a second derivation over
+	// the IV seed. In PBKDF2 mode that one costs as much as the key, so it
+	// runs on its own thread when there is a second hardware thread; the
+	// scrypt IV derivation (N=2) is cheaper than starting a thread.
+	void DeriveKeyAndIv(
+		const AESLayer::KdfMode mode,
+		ConstByteArrayParameter const& passphrase,
+		const byte* salt,
+		const byte* ivSeed,
+		SecByteBlock& key,
+		SecByteBlock& iv,
+		AESLayer::ProgressMonitor* progress = nullptr)
+	{
+		std::thread ivThread;
+		std::exception_ptr ivError;
+		if (mode == AESLayer::KdfMode::Pbkdf2Sha256 && ResolveWorkerCount(0) > 1)
+		{
+			try
+			{
+				ivThread = std::thread([&]()
+				{
+					try
+					{
+						DeriveIv(mode, passphrase, ivSeed, iv, progress);
+					}
+					catch (...)
+					{
+						ivError = std::current_exception();
+					}
+				});
+			}
+			catch (const std::system_error&)
+			{
+			}
+		}
+
+		try
+		{
+			DeriveHardenedKey(mode, AESLayer::DefaultKdfParameters(mode), passphrase, salt, key, progress);
+		}
+		catch (...)
+		{
+			if (ivThread.joinable())
+			{
+				ivThread.join();
+			}
+			throw;
+		}
+
+		if (!ivThread.joinable())
+		{
+			DeriveIv(mode, passphrase, ivSeed, iv, progress);
+			return;
+		}
+
+		ivThread.join();
+		if (ivError)
+		{
+			std::rethrow_exception(ivError);
+		}
+	}
+
+	// segmented and indexed payloads: HKDF-SHA256 expands the hardened key
+	// into the encryption key, the IV base, the MAC key and the key check
+	// value. The header parameters in front of the key check (magic
+	// included) are part of the HKDF info, so the keys are bound to them.
+	void ExpandSegmentedKeys(
+		const SecByteBlock& masterKey,
+		const byte* header,
+		SecByteBlock& key,
+		SecByteBlock& iv,
+		SecByteBlock& macKey,
+		byte* keyCheck,
+		const size_t keyCheckOffset = kKeyCheckOffset)
+	{
+		static_assert(kIndexedKeyCheckOffset <= kKeyCheckOffset);
+		std::array<byte, kSegmentedKeyLabel.size() + kKeyCheckOffset> info{};
+		std::copy(kSegmentedKeyLabel.begin(), kSegmentedKeyLabel.end(), info.begin());
+		std::copy_n(header, keyCheckOffset, info.begin() + kSegmentedKeyLabel.size());
+
+		key.New(SHA256::DIGESTSIZE);
+		iv.New(AESLayer::IV_SIZE);
+		macKey.New(HMAC<SHA256>::DIGESTSIZE);
+		SecByteBlock expanded(key.size() + iv.size() + macKey.size() + AESLayer::KEY_CHECK_SIZE);
+		HKDF<SHA256> hkdf;
+		hkdf.DeriveKey(
+			expanded.begin(),
+			expanded.size(),
+			masterKey.begin(),
+			masterKey.size(),
+			nullptr,
+			0,
+			info.data(),
+			kSegmentedKeyLabel.size() + keyCheckOffset);
+
+		const byte* next = expanded.begin();
+		std::copy_n(next, key.size(), key.begin());
+		next += key.size();
+		std::copy_n(next, iv.size(), iv.begin());
+		next += iv.size();
+		std::copy_n(next, macKey.size(), macKey.begin());
+		next += macKey.size();
+		std::copy_n(next, AESLayer::KEY_CHECK_SIZE, keyCheck);
+	}
+
+	// segmented payloads: one hardened derivation over the header's salt,
+	// expanded as above
+	void DeriveSegmentedKeys(
+		const AESLayer::KdfMode mode,
+		const AESLayer::KdfParameters& parameters,
+		ConstByteArrayParameter const& passphrase,
+		const byte* header,
+		SecByteBlock& key,
+		SecByteBlock& iv,
+		SecByteBlock& macKey,
+		byte* keyCheck,
+		AESLayer::ProgressMonitor* progress)
+	{
+		SecByteBlock masterKey(SHA256::DIGESTSIZE);
+		DeriveHardenedKey(mode, parameters, passphrase, header + kSegmentedSaltOffset, masterKey, progress);
+		ExpandSegmentedKeys(masterKey, header, key, iv, macKey, keyCheck);
+	}
+
 	bool ValidatePkcs7Padding(const byte* buffer, const size_t bufferSize, size_t& plainTextLength)
 	{
 		if (buffer == nullptr || bufferSize == 0)
@@ -120,6 +414,61 @@ namespace
 		return true;
 	}
 
+	bool VerifyAndDecryptWithKey(
+		const SecByteBlock& key,
+		const SecByteBlock& iv,
+		const byte* authenticatedBegin,
+		const size_t authenticatedSize,
+		const byte* payload,
+		const size_t payloadSize,
+		const byte* digest,
+		byte* output,
+		size_t& plainTextLength)
+	{
+		// In place, the ciphertext must survive a mismatch so the next KDF
+		// candidate can still be tried: verify the whole range first.
+		if (output == payload)
+		{
+			std::array<byte, HMAC<SHA256>::DIGESTSIZE> checkDigest{};
+			HMAC<SHA256>(key.begin(), key.size()).CalculateDigest(checkDigest.data(), authenticatedBegin, authenticatedSize);
+			if (!VerifyBufsEqual(checkDigest.data(), digest, checkDigest.size()))
+			{
+				return false;
+			}
+
+			CBC_Mode<AES>::Decryption decryptor(key.begin(), key.size(), iv.begin());
+			decryptor.ProcessData(output, payload, payloadSize);
+			return ValidatePkcs7Padding(output, payloadSize, plainTextLength);
+		}
+
+		// The payload lies inside the authenticated range. Each block is
+		// MACed and then decrypted while it is cached; the plaintext is
+		// wiped again if the digest turns out not to match.
+		HMAC<SHA256> hmac(key.begin(), key.size());
+		hmac.Update(authenticatedBegin, static_cast<size_t>(payload - authenticatedBegin));
+
+		CBC_Mode<AES>::Decryption decryptor(key.begin(), key.size(), iv.begin());
+		for (size_t offset = 0; offset < payloadSize; offset += kFusedBlockSize)
+		{
+			const size_t blockSize = (std::min)(kFusedBlockSize, payloadSize - offset);
+			hmac.Update(payload + offset, blockSize);
+			decryptor.ProcessData(output + offset, payload + offset, blockSize);
+		}
+
+		const byte* payloadEnd = payload + payloadSize;
+		hmac.Update(payloadEnd, static_cast<size_t>((authenticatedBegin + authenticatedSize) - payloadEnd));
+
+		std::array<byte, HMAC<SHA256>::DIGESTSIZE> checkDigest{};
+		hmac.Final(checkDigest.data());
+		if (!VerifyBufsEqual(checkDigest.data(), digest, checkDigest.size()))
+		{
+			SecureWipeBuffer(output, payloadSize);
+			return false;
+		}
+
+		return ValidatePkcs7Padding(output, payloadSize, plainTextLength);
+	}
+
 	bool VerifyAndDecrypt(
 		const AESLayer::KdfMode mode,
 		ConstByteArrayParameter const& passphrase,
@@ -131,7 +480,8 @@ namespace
 		const byte* ivSeed,
 		const byte* digest,
 		byte* output,
-		size_t& plainTextLength)
+		size_t& plainTextLength,
+		AESLayer::ProgressMonitor* progress)
 	{
 		if (payloadSize == 0 || (payloadSize % AES::BLOCKSIZE) != 0)
 		{
@@ -140,182 +490,2882 @@ namespace
 
 		SecByteBlock key(SHA256::DIGESTSIZE);
 		SecByteBlock iv(AESLayer::IV_SIZE);
-		DeriveKeyAndIv(mode, passphrase, salt, ivSeed, key, iv);
+		DeriveKeyAndIv(mode, passphrase, salt, ivSeed, key, iv, progress);
 
-		std::array<byte, HMAC<SHA256>::DIGESTSIZE> checkDigest{};
-		HMAC<SHA256>(key.begin(), key.size()).CalculateDigest(
-			checkDigest.data(),
+		return VerifyAndDecryptWithKey(
+			key,
+			iv,
 			authenticatedBegin,
-			authenticatedSize);
+			authenticatedSize,
+			payload,
+			payloadSize,
+			digest,
+			output,
+			plainTextLength);
+	}
 
-		if (!VerifyBufsEqual(checkDigest.data(), digest, checkDigest.size()))
+	bool IsValidSegmentSize(const size_t segmentSize)
+	{
+		return segmentSize != 0 &&
+			(segmentSize % AES::BLOCKSIZE) == 0 &&
+			segmentSize <= AESLayer::MAX_SEGMENT_SIZE;
+	}
+
+	void PutLittleEndian32(byte* output, const word32 value)
+	{
+		for (unsigned int i = 0; i < 4; ++i)
 		{
-			return false;
+			output[i] = static_cast<byte>(value >> (8 * i));
 		}
+	}
 
-		CBC_Mode<AES>::Decryption decryptor(key.begin(), key.size(), iv.begin());
-		decryptor.ProcessData(output, payload, payloadSize);
-
-		return ValidatePkcs7Padding(output, payloadSize, plainTextLength);
+	word32 GetLittleEndian32(const byte* input)
+	{
+		word32 value = 0;
+		for (unsigned int i = 0; i < 4; ++i)
+		{
+			value |= static_cast<word32>(input[i]) << (8 * i);
+		}
+		return value;
 	}
-}
 
-unsigned int AESLayer::Encrypt(
-	RandomNumberGenerator& rng,
-	ConstByteArrayParameter const& passphrase,
-	byte* output,
-	const std::string& plaintext,
-	const EncryptionOptions& options)
-{
-	const unsigned int paddingLength = AES::BLOCKSIZE - (plaintext.size() % AES::BLOCKSIZE);
-	const unsigned int paddedSize = static_cast<unsigned int>(plaintext.size()) + paddingLength;
+	void WriteKdfParameters(byte* output, const AESLayer::KdfParameters& parameters)
+	{
+		PutLittleEndian32(output, parameters.m_cost);
+		PutLittleEndian32(output + 4, parameters.m_blockSize);
+		PutLittleEndian32(output + 8, parameters.m_parallelism);
+	}
 
-	std::vector<byte> paddedPlainText(paddedSize, 0);
-	if (!plaintext.empty())
+	AESLayer::KdfParameters ReadKdfParameters(const byte* input)
 	{
-		std::memcpy(paddedPlainText.data(), plaintext.data(), plaintext.size());
+		AESLayer::KdfParameters parameters;
+		parameters.m_cost = GetLittleEndian32(input);
+		parameters.m_blockSize = GetLittleEndian32(input + 4);
+		parameters.m_parallelism = GetLittleEndian32(input + 8);
+		return parameters;
 	}
-	std::fill_n(paddedPlainText.data() + plaintext.size(), paddingLength, static_cast<byte>(paddingLength));
 
-	byte* authenticatedBegin = nullptr;
-	size_t authenticatedSize = 0;
-	byte* salt = nullptr;
-	byte* payload = nullptr;
-	byte* ivSeed = nullptr;
-	byte* digest = nullptr;
+	// Each segment gets its own CBC IV: the derived IV with the segment index
+	// mixed into its last eight bytes, run through the block cipher.
+	void DeriveSegmentIv(const SecByteBlock& key, const SecByteBlock& baseIv, const word64 segmentIndex, byte* segmentIv)
+	{
+		std::array<byte, AES::BLOCKSIZE> block{};
+		std::copy(baseIv.begin(), baseIv.end(), block.begin());
+		for (unsigned int i = 0; i < 8; ++i)
+		{
+			block[AES::BLOCKSIZE - 1 - i] ^= static_cast<byte>(segmentIndex >> (8 * i));
+		}
+
+		AES::Encryption cipher(key.begin(), key.size());
+		cipher.ProcessBlock(block.data(), segmentIv);
+	}
 
-	// Keep default scrypt output in legacy format for backward compatibility.
-	if (options.m_kdfMode == KdfMode::Scrypt)
+	bool IsKnownCipherMode(const byte modeValue)
 	{
-		salt = output;
-		payload = salt + AESLayer::SALT_SIZE;
-		ivSeed = payload + paddedSize;
-		digest = ivSeed + AESLayer::IV_SEED_SIZE;
-		authenticatedBegin = payload;
-		authenticatedSize = static_cast<size_t>(digest - payload);
+		return modeValue == static_cast<byte>(AESLayer::CipherMode::AesCbcHmacSha256) ||
+			modeValue == static_cast<byte>(AESLayer::CipherMode::AesGcm);
 	}
-	else
+
+	bool IsKnownCompression(const AESLayer::Compression compression)
 	{
-		// New payload format:
-		// [magic "LN2\x02"][kdf_mode][salt][ciphertext][iv_seed][digest]
-		byte* magic = output;
-		std::copy(kFormatMagic.begin(), kFormatMagic.end(), magic);
-		byte* modeByte = magic + kFormatMagic.size();
-		*modeByte = static_cast<byte>(options.m_kdfMode);
-		salt = modeByte + 1;
-		payload = salt + AESLayer::SALT_SIZE;
-		ivSeed = payload + paddedSize;
-		digest = ivSeed + AESLayer::IV_SEED_SIZE;
-		authenticatedBegin = output;
-		authenticatedSize = static_cast<size_t>(digest - output);
+		return compression == AESLayer::Compression::None || compression == AESLayer::Compression::Zlib;
 	}
 
-	rng.GenerateBlock(salt, AESLayer::SALT_SIZE);
-	rng.GenerateBlock(ivSeed, AESLayer::IV_SEED_SIZE);
+	// the KDF parameters new segmented and indexed payloads are written
+	// with: the requested ones, or the defaults if they are all zero
+	AESLayer::KdfParameters ResolveKdfParameters(const AESLayer::EncryptionOptions& options)
+	{
+		const AESLayer::KdfParameters& requested = options.m_kdfParameters;
+		const AESLayer::KdfParameters kdfParameters = (requested.m_cost == 0 && requested.m_blockSize == 0 && requested.m_parallelism == 0)
+			? AESLayer::DefaultKdfParameters(options.m_kdfMode)
+			: requested;
+		if (!AESLayer::IsValidKdfParameters(options.m_kdfMode, kdfParameters))
+		{
+			throw InvalidArgument("AESLayer: KDF parameters out of range");
+		}
+		return kdfParameters;
+	}
 
-	SecByteBlock key(SHA256::DIGESTSIZE);
-	SecByteBlock iv(AESLayer::IV_SIZE);
-	DeriveKeyAndIv(options.m_kdfMode, passphrase, salt, ivSeed, key, iv);
+	// passes everything put into it to a callback, e.g. the compressor's
+	// output on to the segment batches
+	class CallbackSink : public Bufferless<Sink>
+	{
+	public:
+		explicit CallbackSink(std::function<void(const byte*, size_t)> callback)
+			: m_callback(std::move(callback))
+		{
+		}
 
-	CBC_Mode<AES>::Encryption encryptor(key.begin(), key.size(), iv.begin());
-	encryptor.ProcessData(payload, paddedPlainText.data(), paddedSize);
+		size_t Put2(const byte* inString, const size_t length, int, bool) override
+		{
+			if (length != 0)
+			{
+				m_callback(inString, length);
+			}
+			return 0;
+		}
 
-	HMAC<SHA256>(key.begin(), key.size()).CalculateDigest(
-		digest,
-		authenticatedBegin,
-		authenticatedSize);
+	private:
+		std::function<void(const byte*, size_t)> m_callback;
+	};
 
-	SecureWipeBuffer(paddedPlainText.data(), paddedPlainText.size());
+	// DecryptBatch(): hands an opened payload's plaintext to the entry's
+	// sink, decompressing it on the way if the payload was compressed
+	DecodingResult PassPlaintext(
+		const AESLayer::Compression compression,
+		const byte* plainText,
+		const size_t plainTextLength,
+		BufferedTransformation& sink)
+	{
+		if (compression == AESLayer::Compression::None)
+		{
+			sink.Put(plainText, plainTextLength);
+			sink.MessageEnd();
+			return DecodingResult(plainTextLength);
+		}
 
-	return static_cast<unsigned int>((digest + HMAC<SHA256>::DIGESTSIZE) - output);
-}
+		size_t passed = 0;
+		try
+		{
+			ZlibDecompressor decompressor(new CallbackSink([&](const byte* data, const size_t size)
+			{
+				sink.Put(data, size);
+				passed += size;
+			}));
+			decompressor.Put(plainText, plainTextLength);
+			decompressor.MessageEnd();
+		}
+		catch (const ZlibDecompressor::Err&)
+		{
+			return DecodingResult();
+		}
+		sink.MessageEnd();
+		return DecodingResult(passed);
+	}
 
-DecodingResult AESLayer::Decrypt(ConstByteArrayParameter const& passphrase, byte* output, ConstByteArrayParameter const& input)
-{
-	if (input.size() < LEGACY_MINIMUM_CIPHERTEXT_LENGTH)
+	// big-endian segment index followed by the final-segment flag
+	std::array<byte, 9> EncodeSegmentPosition(const word64 segmentIndex, const bool finalSegment)
 	{
-		return DecodingResult();
+		std::array<byte, 9> position{};
+		for (unsigned int i = 0; i < 8; ++i)
+		{
+			position[i] = static_cast<byte>(segmentIndex >> (56 - 8 * i));
+		}
+		position[8] = finalSegment ? 1 : 0;
+		return position;
 	}
 
-	const byte* begin = input.begin();
-	const byte* end = input.end();
-
-	// Preferred modern format with embedded KDF metadata.
-	if (input.size() >= MINIMUM_CIPHERTEXT_LENGTH && std::equal(kFormatMagic.begin(), kFormatMagic.end(), begin))
+	// GCM nonce: the first 12 bytes of the IV base with the segment index
+	// XORed into the last 8 of them; unique per segment under a per-file key.
+	std::array<byte, kGcmNonceSize> DeriveSegmentNonce(const SecByteBlock& baseIv, const word64 segmentIndex)
 	{
-		const byte modeValue = begin[kFormatMagic.size()];
-		if (IsKnownKdfMode(modeValue))
+		std::array<byte, kGcmNonceSize> nonce{};
+		std::copy_n(baseIv.begin(), nonce.size(), nonce.begin());
+		for (unsigned int i = 0; i < 8; ++i)
 		{
-			const byte* salt = begin + FORMAT_HEADER_SIZE;
-			const byte* payload = salt + AESLayer::SALT_SIZE;
-			const byte* digest = end - HMAC<SHA256>::DIGESTSIZE;
-			const byte* ivSeed = digest - AESLayer::IV_SEED_SIZE;
-			if (ivSeed > payload)
-			{
-				size_t plainTextLength = 0;
-				if (VerifyAndDecrypt(
-					ToKdfMode(modeValue),
-					passphrase,
-					begin,
-					static_cast<size_t>(digest - begin),
-					payload,
-					static_cast<size_t>(ivSeed - payload),
-					salt,
-					ivSeed,
-					digest,
-					output,
-					plainTextLength))
-				{
-					return DecodingResult(plainTextLength);
-				}
-			}
+			nonce[kGcmNonceSize - 1 - i] ^= static_cast<byte>(segmentIndex >> (8 * i));
 		}
+		return nonce;
 	}
 
-	// Legacy format fallback (without format header) for backward compatibility.
-	const byte* salt = begin;
-	const byte* payload = salt + AESLayer::SALT_SIZE;
-	const byte* digest = end - HMAC<SHA256>::DIGESTSIZE;
-	const byte* ivSeed = digest - AESLayer::IV_SEED_SIZE;
-	if (ivSeed <= payload)
+	// GCM additional data: the header and the segment position, the same
+	// inputs the HMAC tag covers in CBC mode
+	std::array<byte, AESLayer::SEGMENTED_HEADER_SIZE + 9> SegmentAssociatedData(
+		const byte* header,
+		const word64 segmentIndex,
+		const bool finalSegment)
 	{
-		return DecodingResult();
+		std::array<byte, AESLayer::SEGMENTED_HEADER_SIZE + 9> associatedData{};
+		std::copy_n(header, AESLayer::SEGMENTED_HEADER_SIZE, associatedData.begin());
+		const std::array<byte, 9> position = EncodeSegmentPosition(segmentIndex, finalSegment);
+		std::copy(position.begin(), position.end(), associatedData.begin() + AESLayer::SEGMENTED_HEADER_SIZE);
+		return associatedData;
 	}
 
-	size_t plainTextLength = 0;
-	if (VerifyAndDecrypt(
-		KdfMode::Scrypt,
-		passphrase,
-		payload,
-		static_cast<size_t>(digest - payload),
-		payload,
-		static_cast<size_t>(ivSeed - payload),
-		salt,
-		ivSeed,
-		digest,
-		output,
-		plainTextLength))
+	// The segment tag covers the header, the segment position and whether
+	// it is the last one, so segments cannot be reordered or cut off.
+	void ComputeSegmentTag(
+		const SecByteBlock& macKey,
+		const byte* header,
+		const word64 segmentIndex,
+		const bool finalSegment,
+		const byte* cipher,
+		const size_t cipherSize,
+		byte* tag)
 	{
-		return DecodingResult(plainTextLength);
+		const std::array<byte, 9> position = EncodeSegmentPosition(segmentIndex, finalSegment);
+
+		HMAC<SHA256> hmac(macKey.begin(), macKey.size());
+		hmac.Update(header, AESLayer::SEGMENTED_HEADER_SIZE);
+		hmac.Update(position.data(), position.size());
+		hmac.Update(cipher, cipherSize);
+		hmac.Final(tag);
 	}
 
-	if (VerifyAndDecrypt(
-		KdfMode::Pbkdf2Sha256,
-		passphrase,
-		payload,
-		static_cast<size_t>(digest - payload),
-		payload,
-		static_cast<size_t>(ivSeed - payload),
-		salt,
-		ivSeed,
-		digest,
-		output,
-		plainTextLength))
+	void EncryptSegment(
+		const AESLayer::CipherMode cipherMode,
+		const SecByteBlock& key,
+		const SecByteBlock& baseIv,
+		const SecByteBlock& macKey,
+		const byte* header,
+		const word64 segmentIndex,
+		const bool finalSegment,
+		byte* segment,
+		const size_t segmentLength,
+		byte* tag)
+	{
+		if (cipherMode == AESLayer::CipherMode::AesGcm)
+		{
+			const std::array<byte, kGcmNonceSize> nonce = DeriveSegmentNonce(baseIv, segmentIndex);
+			const auto associatedData = SegmentAssociatedData(header, segmentIndex, finalSegment);
+			GCM<AES>::Encryption encryptor;
+			encryptor.SetKey(key.begin(), key.size());
+			encryptor.EncryptAndAuthenticate(
+				segment,
+				tag,
+				AESLayer::AEAD_TAG_SIZE,
+				nonce.data(),
+				static_cast<int>(nonce.size()),
+				associatedData.data(),
+				associatedData.size(),
+				segment,
+				segmentLength);
+			return;
+		}
+
+		std::array<byte, AES::BLOCKSIZE> segmentIv{};
+		DeriveSegmentIv(key, baseIv, segmentIndex, segmentIv.data());
+
+		CBC_Mode<AES>::Encryption encryptor(key.begin(), key.size(), segmentIv.data());
+		encryptor.ProcessData(segment, segment, segmentLength);
+
+		ComputeSegmentTag(macKey, header, segmentIndex, finalSegment, segment, segmentLength, tag);
+	}
+
+	// verifies and decrypts one [ciphertext][tag] segment in place
+	bool OpenSegment(
+		const AESLayer::CipherMode cipherMode,
+		const SecByteBlock& key,
+		const SecByteBlock& baseIv,
+		const SecByteBlock& macKey,
+		const byte* header,
+		const word64 segmentIndex,
+		const bool finalSegment,
+		const size_t segmentSize,
+		byte* segment,
+		const size_t segmentLength,
+		size_t& plainTextLength)
+	{
+		if (cipherMode == AESLayer::CipherMode::AesGcm)
+		{
+			if (segmentLength < AESLayer::AEAD_TAG_SIZE)
+			{
+				return false;
+			}
+
+			// no padding: only the last segment is short, and it may be empty
+			const size_t cipherSize = segmentLength - AESLayer::AEAD_TAG_SIZE;
+			if (finalSegment ? cipherSize >= segmentSize : cipherSize != segmentSize)
+			{
+				return false;
+			}
+
+			const std::array<byte, kGcmNonceSize> nonce = DeriveSegmentNonce(baseIv, segmentIndex);
+			const auto associatedData = SegmentAssociatedData(header, segmentIndex, finalSegment);
+			GCM<AES>::Decryption decryptor;
+			decryptor.SetKey(key.begin(), key.size());
+			plainTextLength = cipherSize;
+			return decryptor.DecryptAndVerify(
+				segment,
+				segment + cipherSize,
+				AESLayer::AEAD_TAG_SIZE,
+				nonce.data(),
+				static_cast<int>(nonce.size()),
+				associatedData.data(),
+				associatedData.size(),
+				segment,
+				cipherSize);
+		}
+
+		if (segmentLength < AESLayer::SEGMENT_TAG_SIZE)
+		{
+			return false;
+		}
+
+		const size_t cipherSize = segmentLength - AESLayer::SEGMENT_TAG_SIZE;
+		if (cipherSize == 0 || (cipherSize % AES::BLOCKSIZE) != 0)
+		{
+			return false;
+		}
+		if (finalSegment ? cipherSize > segmentSize : cipherSize != segmentSize)
+		{
+			return false;
+		}
+
+		std::array<byte, AESLayer::SEGMENT_TAG_SIZE> checkTag{};
+		ComputeSegmentTag(macKey, header, segmentIndex, finalSegment, segment, cipherSize, checkTag.data());
+		if (!VerifyBufsEqual(checkTag.data(), segment + cipherSize, checkTag.size()))
+		{
+			return false;
+		}
+
+		std::array<byte, AES::BLOCKSIZE> segmentIv{};
+		DeriveSegmentIv(key, baseIv, segmentIndex, segmentIv.data());
+		CBC_Mode<AES>::Decryption decryptor(key.begin(), key.size(), segmentIv.data());
+		decryptor.ProcessData(segment, segment, cipherSize);
+
+		plainTextLength = cipherSize;
+		return !finalSegment || ValidatePkcs7Padding(segment, cipherSize, plainTextLength);
+	}
+
+	size_t BatchSegmentCount(const unsigned int workerCount)
+	{
+		return workerCount == 1 ? 1 : workerCount * kSegmentsPerWorker;
+	}
+
+	// Runs task(0) ... task(count - 1) on up to workerCount threads, the
+	// calling thread included. The first exception thrown by a task is
+	// rethrown after all threads have been joined.
+	void ParallelFor(const size_t count, const unsigned int workerCount, const std::function<void(size_t)>& task)
+	{
+		const size_t threadCount = (std::min)(static_cast<size_t>(workerCount), count);
+		if (threadCount <= 1)
+		{
+			for (size_t i = 0; i < count; ++i)
+			{
+				task(i);
+			}
+			return;
+		}
+
+		std::atomic<size_t> next{ 0 };
+		std::exception_ptr error;
+		std::mutex errorMutex;
+		const auto worker = [&]()
+		{
+			try
+			{
+				for (size_t i = next++; i < count; i = next++)
+				{
+					task(i);
+				}
+			}
+			catch (...)
+			{
+				const std::lock_guard<std::mutex> lock(errorMutex);
+				if (!error)
+				{
+					error = std::current_exception();
+				}
+				next = count;
+			}
+		};
+
+		std::vector<std::thread> threads;
+		threads.reserve(threadCount - 1);
+		for (size_t i = 1; i < threadCount; ++i)
+		{
+			try
+			{
+				threads.emplace_back(worker);
+			}
+			catch (const std::system_error&)
+			{
+				// out of threads: the ones already running share the rest
+				break;
+			}
+		}
+
+		worker();
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+
+		if (error)
+		{
+			std::rethrow_exception(error);
+		}
+	}
+
+	word64 RotateRight64(const word64 value, const unsigned int bits)
+	{
+		return (value >> bits) | (value << (64 - bits));
+	}
+
+	// BLAKE2b's G with the BlaMka multiplication added to every addition
+	void Argon2Mix(word64& a, word64& b, word64& c, word64& d)
+	{
+		const auto blaMka = [](const word64 x, const word64 y)
+		{
+			return x + y + 2 * (x & 0xFFFFFFFF) * (y & 0xFFFFFFFF);
+		};
+
+		a = blaMka(a, b);
+		d = RotateRight64(d ^ a, 32);
+		c = blaMka(c, d);
+		b = RotateRight64(b ^ c, 24);
+		a = blaMka(a, b);
+		d = RotateRight64(d ^ a, 16);
+		c = blaMka(c, d);
+		b = RotateRight64(b ^ c, 63);
+	}
+
+	// the BLAKE2b round over 16 words, taken in pairs Stride words apart:
+	// Stride 2 is one row of the block, Stride 16 one column
+	template <size_t Stride>
+	void Argon2Round(word64* v)
+	{
+		const auto at = [v](const size_t k) -> word64&
+		{
+			return v[(k >> 1) * Stride + (k & 1)];
+		};
+
+		Argon2Mix(at(0), at(4), at(8), at(12));
+		Argon2Mix(at(1), at(5), at(9), at(13));
+		Argon2Mix(at(2), at(6), at(10), at(14));
+		Argon2Mix(at(3), at(7), at(11), at(15));
+		Argon2Mix(at(0), at(5), at(10), at(15));
+		Argon2Mix(at(1), at(6), at(11), at(12));
+		Argon2Mix(at(2), at(7), at(8), at(13));
+		Argon2Mix(at(3), at(4), at(9), at(14));
+	}
+
+	// next = G(previous, reference), XORed into the old contents of next
+	// from the second pass on. next may be the same block as reference.
+	void Argon2FillBlock(const word64* previous, const word64* reference, word64* next, const bool withXor)
+	{
+		std::array<word64, kArgon2BlockWords> r;
+		for (size_t i = 0; i < kArgon2BlockWords; ++i)
+		{
+			r[i] = previous[i] ^ reference[i];
+		}
+
+		std::array<word64, kArgon2BlockWords> z = r;
+		for (size_t i = 0; i < 8; ++i)
+		{
+			Argon2Round<2>(z.data() + 16 * i);
+		}
+		for (size_t i = 0; i < 8; ++i)
+		{
+			Argon2Round<16>(z.data() + 2 * i);
+		}
+
+		for (size_t i = 0; i < kArgon2BlockWords; ++i)
+		{
+			next[i] = (withXor ? next[i] : 0) ^ r[i] ^ z[i];
+		}
+	}
+
+	// H' from RFC 9106: BLAKE2b stretched to any output length
+	void Argon2Hash(byte* output, const size_t outputLength, const byte* input, const size_t inputLength)
+	{
+		std::array<byte, 4> lengthPrefix{};
+		PutLittleEndian32(lengthPrefix.data(), static_cast<word32>(outputLength));
+		if (outputLength <= BLAKE2b::DIGESTSIZE)
+		{
+			BLAKE2b hash(false, static_cast<unsigned int>(outputLength));
+			hash.Update(lengthPrefix.data(), lengthPrefix.size());
+			hash.Update(input, inputLength);
+			hash.Final(output);
+			return;
+		}
+
+		// 32 bytes from each chained 64-byte hash, the last one in full
+		std::array<byte, BLAKE2b::DIGESTSIZE> chain{};
+		BLAKE2b hash;
+		hash.Update(lengthPrefix.data(), lengthPrefix.size());
+		hash.Update(input, inputLength);
+		hash.Final(chain.data());
+		size_t written = 0;
+		while (outputLength - written > BLAKE2b::DIGESTSIZE)
+		{
+			std::copy_n(chain.begin(), BLAKE2b::DIGESTSIZE / 2, output + written);
+			written += BLAKE2b::DIGESTSIZE / 2;
+			if (outputLength - written > BLAKE2b::DIGESTSIZE)
+			{
+				hash.Update(chain.data(), chain.size());
+				hash.Final(chain.data());
+			}
+		}
+
+		BLAKE2b last(false, static_cast<unsigned int>(outputLength - written));
+		last.Update(chain.data(), chain.size());
+		last.Final(output + written);
+		SecureWipeBuffer(chain.data(), chain.size());
+	}
+
+	void LoadArgon2Block(word64* block, const byte* input)
+	{
+		for (size_t i = 0; i < kArgon2BlockWords; ++i)
+		{
+			word64 value = 0;
+			for (unsigned int j = 0; j < 8; ++j)
+			{
+				value |= static_cast<word64>(input[i * 8 + j]) << (8 * j);
+			}
+			block[i] = value;
+		}
+	}
+
+	void StoreArgon2Block(byte* output, const word64* block)
+	{
+		for (size_t i = 0; i < kArgon2BlockWords; ++i)
+		{
+			for (unsigned int j = 0; j < 8; ++j)
+			{
+				output[i * 8 + j] = static_cast<byte>(block[i] >> (8 * j));
+			}
+		}
+	}
+
+	struct Argon2Instance
+	{
+		word64* m_memory;
+		word32 m_passes;
+		word32 m_lanes;
+		word32 m_laneLength;
+		word32 m_segmentLength;
+	};
+
+	// column of the block a new block is mixed with, chosen from the blocks
+	// every lane has finished before this slice (RFC 9106 section 3.4.2)
+	word32 Argon2ReferenceIndex(
+		const Argon2Instance& instance,
+		const word32 pass,
+		const word32 slice,
+		const word32 index,
+		const word32 pseudoRandom,
+		const bool sameLane)
+	{
+		const word32 finished = pass == 0
+			? slice * instance.m_segmentLength
+			: instance.m_laneLength - instance.m_segmentLength;
+		const word32 areaSize = sameLane
+			? finished + index - 1
+			: finished - (index == 0 ? 1 : 0);
+
+		word64 relative = pseudoRandom;
+		relative = (relative * relative) >> 32;
+		relative = areaSize - 1 - ((areaSize * relative) >> 32);
+
+		const word32 start = (pass == 0 || slice == kArgon2SyncPoints - 1)
+			? 0
+			: (slice + 1) * instance.m_segmentLength;
+		return static_cast<word32>((start + relative) % instance.m_laneLength);
+	}
+
+	// Fills one segment of one lane. Argon2id takes reference indices from a
+	// counter-driven block (independent of the password) in the first half
+	// of the first pass, and from the previous block everywhere else.
+	void FillArgon2Segment(const Argon2Instance& instance, const word32 pass, const word32 slice, const word32 lane)
+	{
+		const bool independentAddressing = pass == 0 && slice < kArgon2SyncPoints / 2;
+		const std::array<word64, kArgon2BlockWords> zeroBlock{};
+		std::array<word64, kArgon2BlockWords> inputBlock{};
+		std::array<word64, kArgon2BlockWords> addressBlock{};
+		inputBlock[0] = pass;
+		inputBlock[1] = lane;
+		inputBlock[2] = slice;
+		inputBlock[3] = static_cast<word64>(instance.m_laneLength) * instance.m_lanes;
+		inputBlock[4] = instance.m_passes;
+		inputBlock[5] = kArgon2idType;
+		const auto nextAddresses = [&]()
+		{
+			++inputBlock[6];
+			Argon2FillBlock(zeroBlock.data(), inputBlock.data(), addressBlock.data(), false);
+			Argon2FillBlock(zeroBlock.data(), addressBlock.data(), addressBlock.data(), false);
+		};
+
+		// the first two blocks of every lane come from the prehash
+		word32 startIndex = 0;
+		if (pass == 0 && slice == 0)
+		{
+			startIndex = 2;
+			if (independentAddressing)
+			{
+				nextAddresses();
+			}
+		}
+
+		const size_t laneBegin = static_cast<size_t>(lane) * instance.m_laneLength;
+		for (word32 index = startIndex; index < instance.m_segmentLength; ++index)
+		{
+			const word32 column = slice * instance.m_segmentLength + index;
+			const size_t current = laneBegin + column;
+			const size_t previous = column == 0 ? laneBegin + instance.m_laneLength - 1 : current - 1;
+
+			word64 pseudoRandom = 0;
+			if (independentAddressing)
+			{
+				if (index % kArgon2AddressesPerBlock == 0)
+				{
+					nextAddresses();
+				}
+				pseudoRandom = addressBlock[index % kArgon2AddressesPerBlock];
+			}
+			else
+			{
+				pseudoRandom = instance.m_memory[previous * kArgon2BlockWords];
+			}
+
+			const word32 referenceLane = (pass == 0 && slice == 0)
+				? lane
+				: static_cast<word32>((pseudoRandom >> 32) % instance.m_lanes);
+			const word32 referenceIndex = Argon2ReferenceIndex(
+				instance,
+				pass,
+				slice,
+				index,
+				static_cast<word32>(pseudoRandom),
+				referenceLane == lane);
+			const size_t reference = static_cast<size_t>(referenceLane) * instance.m_laneLength + referenceIndex;
+
+			Argon2FillBlock(
+				instance.m_memory + previous * kArgon2BlockWords,
+				instance.m_memory + reference * kArgon2BlockWords,
+				instance.m_memory + current * kArgon2BlockWords,
+				pass != 0);
+		}
+	}
+
+	// scrypt's BlockMix: Salsa20/8 over the 2 * r 64-byte blocks of input,
+	// even results to the first half of output and odd ones to the second
+	void ScryptBlockMix(const word32* input, word32* output, const size_t blockSize)
+	{
+		std::array<word32, 16> x{};
+		std::copy_n(input + (2 * blockSize - 1) * 16, x.size(), x.begin());
+		for (size_t i = 0; i < 2 * blockSize; ++i)
+		{
+			for (size_t j = 0; j < x.size(); ++j)
+			{
+				x[j] ^= input[i * 16 + j];
+			}
+			Salsa20_Core(x.data(), 8);
+			std::copy(x.begin(), x.end(), output + ((i & 1) * blockSize + i / 2) * 16);
+		}
+	}
+
+	// scrypt's ROMix over one lane of 128 * r bytes, in place
+	void ScryptRoMix(byte* lane, const size_t blockSize, const word64 cost, AESLayer::ProgressMonitor* progress)
+	{
+		ProgressCounter counter(progress);
+		const size_t laneWords = 32 * blockSize;
+		SecBlock<word32> table(static_cast<size_t>(cost) * laneWords);
+		SecBlock<word32> buffers(2 * laneWords);
+		word32* x = buffers.begin();
+		word32* y = x + laneWords;
+		for (size_t i = 0; i < laneWords; ++i)
+		{
+			x[i] = GetLittleEndian32(lane + 4 * i);
+		}
+
+		for (word64 i = 0; i < cost; ++i)
+		{
+			std::copy_n(x, laneWords, table.begin() + static_cast<size_t>(i) * laneWords);
+			ScryptBlockMix(x, y, blockSize);
+			std::swap(x, y);
+			counter.Step();
+		}
+		for (word64 i = 0; i < cost; ++i)
+		{
+			const word32* last = x + (2 * blockSize - 1) * 16;
+			const word64 j = ((static_cast<word64>(last[1]) << 32) | last[0]) & (cost - 1);
+			const word32* entry = table.begin() + static_cast<size_t>(j) * laneWords;
+			for (size_t k = 0; k < laneWords; ++k)
+			{
+				x[k] ^= entry[k];
+			}
+			ScryptBlockMix(x, y, blockSize);
+			std::swap(x, y);
+			counter.Step();
+		}
+		counter.Flush();
+
+		for (size_t i = 0; i < laneWords; ++i)
+		{
+			PutLittleEndian32(lane + 4 * i, x[i]);
+		}
+	}
+
+	// best of kDiagnosticsPasses runs of pass() over byteCount bytes
+	double BestMegabytesPerSecond(const size_t byteCount, const std::function<void()>& pass)
+	{
+		double bestMilliseconds = 0.0;
+		for (int run = 0; run < kDiagnosticsPasses; ++run)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			pass();
+			const double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			if (run == 0 || milliseconds < bestMilliseconds)
+			{
+				bestMilliseconds = milliseconds;
+			}
+		}
+		return (byteCount / (1024.0 * 1024.0)) / ((std::max)(bestMilliseconds, 0.001) / 1000.0);
+	}
+
+	// DecryptInPlace: moves the plaintext from where the ciphertext was to
+	// the front of the buffer
+	DecodingResult MoveToFront(byte* front, const byte* plainText, const size_t plainTextLength)
 	{
+		if (front != plainText)
+		{
+			std::memmove(front, plainText, plainTextLength);
+		}
 		return DecodingResult(plainTextLength);
 	}
 
-	return DecodingResult();
+	// Scrypt candidate for a legacy payload, derived on its own thread.
+	// Destroying it cancels the derivation through m_monitor, which
+	// ScryptRoMix polls, and joins the thread, so no return or throw path of
+	// Decrypt() leaves scrypt running or the passphrase copy alive.
+	struct BackgroundLegacyDerivation
+	{
+		BackgroundLegacyDerivation() = default;
+		BackgroundLegacyDerivation(const BackgroundLegacyDerivation&) = delete;
+		BackgroundLegacyDerivation& operator=(const BackgroundLegacyDerivation&) = delete;
+
+		~BackgroundLegacyDerivation()
+		{
+			m_monitor.Cancel();
+			if (m_thread.joinable())
+			{
+				m_thread.join();
+			}
+		}
+
+		AESLayer::ProgressMonitor m_monitor;
+		std::thread m_thread;
+		SecByteBlock m_passphrase;
+		std::array<byte, AESLayer::SALT_SIZE> m_salt{};
+		std::array<byte, AESLayer::IV_SEED_SIZE> m_ivSeed{};
+		SecByteBlock m_key{ SHA256::DIGESTSIZE };
+		SecByteBlock m_iv{ AESLayer::IV_SIZE };
+		std::mutex m_mutex;
+		std::condition_variable m_finishedEvent;
+		bool m_finished{ false };
+		bool m_succeeded{ false };
+	};
+
+	// Returns null when there is only one hardware thread or no thread could
+	// be started; the caller then tries the candidates one after the other.
+	std::unique_ptr<BackgroundLegacyDerivation> StartLegacyScryptDerivation(
+		ConstByteArrayParameter const& passphrase,
+		const byte* salt,
+		const byte* ivSeed)
+	{
+		if (ResolveWorkerCount(0) < 2)
+		{
+			return nullptr;
+		}
+
+		auto derivation = std::make_unique<BackgroundLegacyDerivation>();
+		derivation->m_passphrase.Assign(passphrase.begin(), passphrase.size());
+		std::copy_n(salt, derivation->m_salt.size(), derivation->m_salt.begin());
+		std::copy_n(ivSeed, derivation->m_ivSeed.size(), derivation->m_ivSeed.begin());
+
+		try
+		{
+			derivation->m_thread = std::thread([derivation = derivation.get()]()
+			{
+				bool succeeded = false;
+				try
+				{
+					DeriveKeyAndIv(
+						AESLayer::KdfMode::Scrypt,
+						ConstByteArrayParameter(static_cast<const byte*>(derivation->m_passphrase.begin()), derivation->m_passphrase.size()),
+						derivation->m_salt.data(),
+						derivation->m_ivSeed.data(),
+						derivation->m_key,
+						derivation->m_iv,
+						&derivation->m_monitor);
+					succeeded = true;
+				}
+				catch (const std::exception&)
+				{
+				}
+				derivation->m_passphrase.New(0);
+
+				{
+					const std::lock_guard<std::mutex> lock(derivation->m_mutex);
+					derivation->m_finished = true;
+					derivation->m_succeeded = succeeded;
+				}
+				derivation->m_finishedEvent.notify_all();
+			});
+		}
+		catch (const std::system_error&)
+		{
+			return nullptr;
+		}
+
+		return derivation;
+	}
+
+	// bytes in front of the ciphertext: the salt, plus the format header in PBKDF2 mode
+	size_t CompatiblePrefixSize(const AESLayer::KdfMode mode)
+	{
+		return mode == AESLayer::KdfMode::Scrypt
+			? AESLayer::SALT_SIZE
+			: AESLayer::FORMAT_HEADER_SIZE + AESLayer::SALT_SIZE;
+	}
+
+	// Writes a legacy (scrypt) or v2 payload. plainText may point into
+	// output, exactly CompatiblePrefixSize() bytes in (EncryptInPlace).
+	unsigned int EncryptCompatiblePayload(
+		RandomNumberGenerator& rng,
+		ConstByteArrayParameter const& passphrase,
+		byte* output,
+		const byte* plainText,
+		const size_t plainTextLength,
+		const AESLayer::EncryptionOptions& options)
+	{
+		if (!IsCompatibleKdfMode(static_cast<byte>(options.m_kdfMode)))
+		{
+			throw InvalidArgument("AESLayer: this KDF is only supported in the segmented format");
+		}
+
+		const unsigned int paddingLength = AES::BLOCKSIZE - (plainTextLength % AES::BLOCKSIZE);
+		const unsigned int paddedSize = static_cast<unsigned int>(plainTextLength) + paddingLength;
+
+		byte* authenticatedBegin = nullptr;
+		size_t authenticatedSize = 0;
+		byte* salt = nullptr;
+		byte* payload = nullptr;
+		byte* ivSeed = nullptr;
+		byte* digest = nullptr;
+
+		// Keep default scrypt output in legacy format for backward compatibility.
+		if (options.m_kdfMode == AESLayer::KdfMode::Scrypt)
+		{
+			salt = output;
+			payload = salt + AESLayer::SALT_SIZE;
+			ivSeed = payload + paddedSize;
+			digest = ivSeed + AESLayer::IV_SEED_SIZE;
+			authenticatedBegin = payload;
+			authenticatedSize = static_cast<size_t>(digest - payload);
+		}
+		else
+		{
+			// New payload format:
+			// [magic "LN2\x02"][kdf_mode][salt][ciphertext][iv_seed][digest]
+			byte* magic = output;
+			std::copy(kFormatMagic.begin(), kFormatMagic.end(), magic);
+			byte* modeByte = magic + kFormatMagic.size();
+			*modeByte = static_cast<byte>(options.m_kdfMode);
+			salt = modeByte + 1;
+			payload = salt + AESLayer::SALT_SIZE;
+			ivSeed = payload + paddedSize;
+			digest = ivSeed + AESLayer::IV_SEED_SIZE;
+			authenticatedBegin = output;
+			authenticatedSize = static_cast<size_t>(digest - output);
+		}
+
+		rng.GenerateBlock(salt, AESLayer::SALT_SIZE);
+		rng.GenerateBlock(ivSeed, AESLayer::IV_SEED_SIZE);
+
+		SecByteBlock key(SHA256::DIGESTSIZE);
+		SecByteBlock iv(AESLayer::IV_SIZE);
+		DeriveKeyAndIv(options.m_kdfMode, passphrase, salt, ivSeed, key, iv, options.m_progress);
+
+		// Encrypt-then-MAC one cache-sized block at a time. Whole blocks are
+		// encrypted straight from the plaintext; only the last (padded) block
+		// is assembled separately.
+		HMAC<SHA256> hmac(key.begin(), key.size());
+		hmac.Update(authenticatedBegin, static_cast<size_t>(payload - authenticatedBegin));
+
+		CBC_Mode<AES>::Encryption encryptor(key.begin(), key.size(), iv.begin());
+		const size_t wholeBlocksSize = paddedSize - AES::BLOCKSIZE;
+		for (size_t offset = 0; offset < wholeBlocksSize; offset += kFusedBlockSize)
+		{
+			const size_t blockSize = (std::min)(kFusedBlockSize, wholeBlocksSize - offset);
+			encryptor.ProcessData(payload + offset, plainText + offset, blockSize);
+			hmac.Update(payload + offset, blockSize);
+		}
+
+		std::array<byte, AES::BLOCKSIZE> lastBlock{};
+		const size_t lastBlockLength = AES::BLOCKSIZE - paddingLength;
+		std::copy_n(plainText + wholeBlocksSize, lastBlockLength, lastBlock.begin());
+		std::fill(lastBlock.begin() + lastBlockLength, lastBlock.end(), static_cast<byte>(paddingLength));
+		encryptor.ProcessData(payload + wholeBlocksSize, lastBlock.data(), lastBlock.size());
+		SecureWipeBuffer(lastBlock.data(), lastBlock.size());
+
+		hmac.Update(payload + wholeBlocksSize, static_cast<size_t>((authenticatedBegin + authenticatedSize) - (payload + wholeBlocksSize)));
+		hmac.Final(digest);
+
+		return static_cast<unsigned int>((digest + HMAC<SHA256>::DIGESTSIZE) - output);
+	}
+
+	// validates the fixed part of a segmented header; the key check needs
+	// the password and is left to the caller
+	bool ReadSegmentedHeader(
+		const byte* header,
+		AESLayer::KdfMode& kdfMode,
+		AESLayer::CipherMode& cipherMode,
+		AESLayer::Compression& compression,
+		size_t& segmentSize,
+		AESLayer::KdfParameters& parameters)
+	{
+		if (!AESLayer::IsSegmentedPayload(header, AESLayer::SEGMENTED_HEADER_SIZE))
+		{
+			return false;
+		}
+
+		const byte modeValue = header[kSegmentedFormatMagic.size()];
+		const byte cipherModeValue = header[kCipherModeOffset] & static_cast<byte>(~kCompressedFlag);
+		segmentSize = GetLittleEndian32(header + kSegmentSizeOffset);
+		parameters = ReadKdfParameters(header + kKdfParametersOffset);
+		if (!IsKnownKdfMode(modeValue) ||
+			!IsKnownCipherMode(cipherModeValue) ||
+			!IsValidSegmentSize(segmentSize) ||
+			!AESLayer::IsValidKdfParameters(ToKdfMode(modeValue), parameters))
+		{
+			return false;
+		}
+
+		kdfMode = ToKdfMode(modeValue);
+		cipherMode = static_cast<AESLayer::CipherMode>(cipherModeValue);
+		compression = (header[kCipherModeOffset] & kCompressedFlag) != 0 ? AESLayer::Compression::Zlib : AESLayer::Compression::None;
+		return true;
+	}
+
+	// DecryptBatch(): everything a hardened key depends on besides the
+	// password. Segmented and v2 payloads with equal requests share one key.
+	struct HardenedKeyRequest
+	{
+		AESLayer::KdfMode m_mode{ AESLayer::KdfMode::Scrypt };
+		AESLayer::KdfParameters m_parameters;
+		std::array<byte, AESLayer::SALT_SIZE> m_salt{};
+
+		bool operator<(const HardenedKeyRequest& other) const
+		{
+			return std::tie(m_mode, m_parameters.m_cost, m_parameters.m_blockSize, m_parameters.m_parallelism, m_salt) <
+				std::tie(other.m_mode, other.m_parameters.m_cost, other.m_parameters.m_blockSize, other.m_parameters.m_parallelism, other.m_salt);
+		}
+	};
+
+	// DecryptBatch(): how one entry is opened. m_key indexes the shared
+	// hardened keys; legacy payloads don't record their KDF and go through
+	// DecryptPayload() instead.
+	struct BatchPlan
+	{
+		AESLayer::PayloadFormat m_format{ AESLayer::PayloadFormat::Legacy };
+		AESLayer::CipherMode m_cipherMode{ AESLayer::CipherMode::AesCbcHmacSha256 };
+		AESLayer::Compression m_compression{ AESLayer::Compression::None };
+		size_t m_segmentSize{ 0 };
+		size_t m_key{ (std::numeric_limits<size_t>::max)() };
+	};
+
+	// memory one derivation holds at its peak, to bound how many of them
+	// DecryptBatch() runs at once
+	size_t HardenedKeyMemory(const AESLayer::KdfMode mode, const AESLayer::KdfParameters& parameters)
+	{
+		if (mode == AESLayer::KdfMode::Argon2id)
+		{
+			return size_t{ parameters.m_cost } * 1024;
+		}
+		if (mode == AESLayer::KdfMode::Scrypt)
+		{
+			// as many lanes at once as DeriveScrypt() runs
+			const size_t laneMemory = size_t{ 128 } * parameters.m_blockSize * parameters.m_cost;
+			const size_t lanes = (std::min)({
+				size_t{ parameters.m_parallelism },
+				static_cast<size_t>(ResolveWorkerCount(0)),
+				(std::max)(AESLayer::MAX_SCRYPT_MEMORY / laneMemory, size_t{ 1 }) });
+			return laneMemory * lanes;
+		}
+		return 0;
+	}
+
+	// a whole segmented payload with its hardened key already derived:
+	// expands and checks the keys, then opens the segments one after the
+	// other and moves every plaintext to the front of the buffer. On
+	// failure the buffer is wiped.
+	DecodingResult OpenSegmentedPayload(
+		const SecByteBlock& masterKey,
+		const AESLayer::CipherMode cipherMode,
+		const size_t segmentSize,
+		byte* buffer,
+		const size_t size)
+	{
+		// the plaintext overwrites the header, which is authenticated with every segment
+		std::array<byte, AESLayer::SEGMENTED_HEADER_SIZE> header{};
+		std::copy_n(buffer, header.size(), header.begin());
+
+		SecByteBlock key;
+		SecByteBlock iv;
+		SecByteBlock macKey;
+		std::array<byte, AESLayer::KEY_CHECK_SIZE> keyCheck{};
+		ExpandSegmentedKeys(masterKey, header.data(), key, iv, macKey, keyCheck.data());
+		if (!VerifyBufsEqual(keyCheck.data(), header.data() + kKeyCheckOffset, keyCheck.size()))
+		{
+			return DecodingResult();
+		}
+
+		const size_t segmentStride = segmentSize + AESLayer::SegmentTagSize(cipherMode);
+		const size_t bodySize = size - header.size();
+		const size_t segmentCount = (bodySize + segmentStride - 1) / segmentStride;
+		size_t written = 0;
+		for (size_t i = 0; i < segmentCount; ++i)
+		{
+			const size_t offset = i * segmentStride;
+			byte* segment = buffer + header.size() + offset;
+			size_t plainTextLength = 0;
+			if (!OpenSegment(
+				cipherMode,
+				key,
+				iv,
+				macKey,
+				header.data(),
+				i,
+				(i + 1) == segmentCount,
+				segmentSize,
+				segment,
+				(std::min)(segmentStride, bodySize - offset),
+				plainTextLength))
+			{
+				SecureWipeBuffer(buffer, size);
+				return DecodingResult();
+			}
+			std::memmove(buffer + written, segment, plainTextLength);
+			written += plainTextLength;
+		}
+
+		return segmentCount != 0 ? DecodingResult(written) : DecodingResult();
+	}
+
+	// a whole v2 payload with its key already derived: only the IV
+	// derivation is left, then it is verified and decrypted in place
+	DecodingResult OpenCompatiblePayload(
+		const AESLayer::KdfMode mode,
+		ConstByteArrayParameter const& passphrase,
+		const SecByteBlock& key,
+		byte* buffer,
+		const size_t size,
+		AESLayer::ProgressMonitor* progress)
+	{
+		byte* payload = buffer + AESLayer::FORMAT_HEADER_SIZE + AESLayer::SALT_SIZE;
+		const byte* digest = buffer + size - HMAC<SHA256>::DIGESTSIZE;
+		const byte* ivSeed = digest - AESLayer::IV_SEED_SIZE;
+		if (ivSeed <= payload)
+		{
+			return DecodingResult();
+		}
+
+		const size_t payloadSize = static_cast<size_t>(ivSeed - payload);
+		if ((payloadSize % AES::BLOCKSIZE) != 0)
+		{
+			return DecodingResult();
+		}
+
+		SecByteBlock iv(AESLayer::IV_SIZE);
+		DeriveIv(mode, passphrase, ivSeed, iv, progress);
+
+		size_t plainTextLength = 0;
+		if (!VerifyAndDecryptWithKey(
+			key,
+			iv,
+			buffer,
+			static_cast<size_t>(digest - buffer),
+			payload,
+			payloadSize,
+			digest,
+			payload,
+			plainTextLength))
+		{
+			return DecodingResult();
+		}
+		return MoveToFront(buffer, payload, plainTextLength);
+	}
+
+	// indexed payloads: one segment as listed in the index
+	struct IndexedSegment
+	{
+		// of the stored bytes within the payload
+		size_t m_offset{ 0 };
+		size_t m_storedLength{ 0 };
+		size_t m_plainTextLength{ 0 };
+	};
+
+	// zlib's worst case for one segment: stored blocks, header and checksum
+	size_t MaxCompressedSegmentLength(const size_t plainTextLength)
+	{
+		return plainTextLength + (plainTextLength >> 12) + (plainTextLength >> 14) + 64;
+	}
+
+	// validates the fixed part of an indexed header and the index against
+	// the payload size and lists where the segments are; the key check and
+	// the root tag need the keys and are left to the caller
+	bool ReadIndexedLayout(
+		const byte* payload,
+		const size_t size,
+		AESLayer::KdfMode& kdfMode,
+		AESLayer::KdfParameters& parameters,
+		AESLayer::Compression& compression,
+		std::vector<IndexedSegment>& segments)
+	{
+		if (size < AESLayer::INDEXED_HEADER_SIZE || !AESLayer::IsIndexedPayload(payload, size))
+		{
+			return false;
+		}
+
+		const byte modeValue = payload[kIndexedFormatMagic.size()];
+		const byte flags = payload[kIndexedFlagsOffset];
+		parameters = ReadKdfParameters(payload + kIndexedKdfParametersOffset);
+		if (!IsKnownKdfMode(modeValue) ||
+			(flags & static_cast<byte>(~kIndexedCompressedFlag)) != 0 ||
+			!AESLayer::IsValidKdfParameters(ToKdfMode(modeValue), parameters))
+		{
+			return false;
+		}
+
+		const size_t segmentCount = GetLittleEndian32(payload + kSegmentCountOffset);
+		if (segmentCount > (size - AESLayer::INDEXED_HEADER_SIZE) / AESLayer::INDEX_ENTRY_SIZE)
+		{
+			return false;
+		}
+
+		kdfMode = ToKdfMode(modeValue);
+		compression = (flags & kIndexedCompressedFlag) != 0 ? AESLayer::Compression::Zlib : AESLayer::Compression::None;
+		segments.clear();
+		segments.reserve(segmentCount);
+		size_t offset = AESLayer::INDEXED_HEADER_SIZE + segmentCount * AESLayer::INDEX_ENTRY_SIZE;
+		for (size_t i = 0; i < segmentCount; ++i)
+		{
+			const byte* entry = payload + AESLayer::INDEXED_HEADER_SIZE + i * AESLayer::INDEX_ENTRY_SIZE;
+			IndexedSegment segment;
+			segment.m_offset = offset;
+			segment.m_storedLength = GetLittleEndian32(entry);
+			segment.m_plainTextLength = GetLittleEndian32(entry + kIndexPlainTextLengthOffset);
+			const bool storedLengthValid = compression == AESLayer::Compression::None
+				? segment.m_storedLength == segment.m_plainTextLength
+				: segment.m_storedLength <= MaxCompressedSegmentLength(segment.m_plainTextLength);
+			if (segment.m_plainTextLength == 0 ||
+				segment.m_plainTextLength > AESLayer::MAX_SEGMENT_SIZE ||
+				!storedLengthValid ||
+				segment.m_storedLength > size - offset)
+			{
+				return false;
+			}
+			segments.push_back(segment);
+			offset += segment.m_storedLength;
+		}
+		return offset == size;
+	}
+
+	// HMAC-SHA256 over the header in front of the root tag and the index
+	void ComputeRootTag(const SecByteBlock& macKey, const byte* header, const byte* index, const size_t segmentCount, byte* tag)
+	{
+		HMAC<SHA256> hmac(macKey.begin(), macKey.size());
+		hmac.Update(header, kRootTagOffset);
+		hmac.Update(index, segmentCount * AESLayer::INDEX_ENTRY_SIZE);
+		hmac.Final(tag);
+	}
+
+	// expands the keys of an indexed payload and checks the key check
+	// value, then the root tag
+	bool UnlockIndexedPayload(
+		const SecByteBlock& masterKey,
+		const byte* payload,
+		const size_t segmentCount,
+		SecByteBlock& key,
+		SecByteBlock& macKey,
+		bool& passwordRejected)
+	{
+		SecByteBlock iv;
+		std::array<byte, AESLayer::KEY_CHECK_SIZE> keyCheck{};
+		ExpandSegmentedKeys(masterKey, payload, key, iv, macKey, keyCheck.data(), kIndexedKeyCheckOffset);
+		passwordRejected = !VerifyBufsEqual(keyCheck.data(), payload + kIndexedKeyCheckOffset, keyCheck.size());
+		if (passwordRejected)
+		{
+			return false;
+		}
+
+		std::array<byte, HMAC<SHA256>::DIGESTSIZE> rootTag{};
+		ComputeRootTag(macKey, payload, payload + AESLayer::INDEXED_HEADER_SIZE, segmentCount, rootTag.data());
+		return VerifyBufsEqual(rootTag.data(), payload + kRootTagOffset, rootTag.size());
+	}
+
+	// compresses (optionally) and encrypts one segment into stored; the
+	// nonce must already be in the index entry, which receives the lengths
+	// and the tag. The fixed header is the additional data.
+	void SealIndexedSegment(
+		const SecByteBlock& key,
+		const byte* header,
+		const bool compress,
+		const byte* plainText,
+		const size_t plainTextLength,
+		byte* entry,
+		std::vector<byte>& stored)
+	{
+		stored.clear();
+		if (compress)
+		{
+			// reserved up front, so no compressed plaintext is left behind in
+			// a reallocated buffer
+			stored.reserve(MaxCompressedSegmentLength(plainTextLength));
+			ZlibCompressor compressor(new CallbackSink([&stored](const byte* data, const size_t size)
+			{
+				stored.insert(stored.end(), data, data + size);
+			}));
+			compressor.Put(plainText, plainTextLength);
+			compressor.MessageEnd();
+		}
+		else
+		{
+			stored.assign(plainText, plainText + plainTextLength);
+		}
+
+		PutLittleEndian32(entry, static_cast<word32>(stored.size()));
+		PutLittleEndian32(entry + kIndexPlainTextLengthOffset, static_cast<word32>(plainTextLength));
+		GCM<AES>::Encryption encryptor;
+		encryptor.SetKey(key.begin(), key.size());
+		encryptor.EncryptAndAuthenticate(
+			stored.data(),
+			entry + kIndexTagOffset,
+			AESLayer::AEAD_TAG_SIZE,
+			entry + kIndexNonceOffset,
+			static_cast<int>(kGcmNonceSize),
+			header,
+			kSegmentCountOffset,
+			stored.data(),
+			stored.size());
+	}
+
+	// verifies and decrypts one segment into plainText, decompressing it
+	// if need be
+	bool OpenIndexedSegment(
+		const SecByteBlock& key,
+		const byte* header,
+		const byte* entry,
+		const byte* stored,
+		const IndexedSegment& segment,
+		const bool compressed,
+		SecByteBlock& plainText)
+	{
+		SecByteBlock opened(segment.m_storedLength);
+		GCM<AES>::Decryption decryptor;
+		decryptor.SetKey(key.begin(), key.size());
+		if (!decryptor.DecryptAndVerify(
+			opened.begin(),
+			entry + kIndexTagOffset,
+			AESLayer::AEAD_TAG_SIZE,
+			entry + kIndexNonceOffset,
+			static_cast<int>(kGcmNonceSize),
+			header,
+			kSegmentCountOffset,
+			stored,
+			segment.m_storedLength))
+		{
+			return false;
+		}
+		if (!compressed)
+		{
+			plainText.swap(opened);
+			return true;
+		}
+
+		plainText.New(segment.m_plainTextLength);
+		size_t length = 0;
+		bool overflow = false;
+		try
+		{
+			ZlibDecompressor decompressor(new CallbackSink([&](const byte* data, const size_t size)
+			{
+				overflow = overflow || size > plainText.size() - length;
+				if (!overflow)
+				{
+					std::memcpy(plainText.begin() + length, data, size);
+					length += size;
+				}
+			}));
+			decompressor.Put(opened.begin(), opened.size());
+			decompressor.MessageEnd();
+		}
+		catch (const ZlibDecompressor::Err&)
+		{
+			return false;
+		}
+		return !overflow && length == plainText.size();
+	}
+
+	// authenticates and decrypts the listed segments into sink, a batch of
+	// them at a time on the worker threads. header and index may be copies
+	// (decrypting in place overwrites them), stored bytes are read from payload.
+	bool DecryptIndexedSegments(
+		const SecByteBlock& key,
+		const byte* header,
+		const byte* index,
+		const byte* payload,
+		const std::vector<IndexedSegment>& segments,
+		const bool compressed,
+		const unsigned int workerCount,
+		BufferedTransformation& sink)
+	{
+		const size_t batchSegments = BatchSegmentCount(workerCount);
+		std::vector<SecByteBlock> plainTexts(batchSegments);
+		std::vector<byte> segmentValid(batchSegments, 0);
+		for (size_t first = 0; first < segments.size(); first += batchSegments)
+		{
+			const size_t count = (std::min)(batchSegments, segments.size() - first);
+			ParallelFor(count, workerCount, [&](const size_t i)
+			{
+				const IndexedSegment& segment = segments[first + i];
+				segmentValid[i] = OpenIndexedSegment(
+					key,
+					header,
+					index + (first + i) * AESLayer::INDEX_ENTRY_SIZE,
+					payload + segment.m_offset,
+					segment,
+					compressed,
+					plainTexts[i]) ? 1 : 0;
+			});
+
+			for (size_t i = 0; i < count; ++i)
+			{
+				if (!segmentValid[i])
+				{
+					return false;
+				}
+				sink.Put(plainTexts[i].begin(), plainTexts[i].size());
+			}
+		}
+		return true;
+	}
+
+	// a whole indexed payload with its hardened key already derived:
+	// expands and checks the keys and the root tag, then decrypts every
+	// segment into sink. sink may write over the payload itself (in place)
+	// unless the payload is compressed; header and index are copied first.
+	DecodingResult OpenIndexedPayload(
+		const SecByteBlock& masterKey,
+		const byte* payload,
+		const size_t size,
+		BufferedTransformation& sink,
+		const unsigned int workerCount,
+		bool& passwordRejected)
+	{
+		passwordRejected = false;
+		AESLayer::KdfMode kdfMode = AESLayer::KdfMode::Scrypt;
+		AESLayer::KdfParameters parameters;
+		AESLayer::Compression compression = AESLayer::Compression::None;
+		std::vector<IndexedSegment> segments;
+		SecByteBlock key;
+		SecByteBlock macKey;
+		if (!ReadIndexedLayout(payload, size, kdfMode, parameters, compression, segments) ||
+			!UnlockIndexedPayload(masterKey, payload, segments.size(), key, macKey, passwordRejected))
+		{
+			return DecodingResult();
+		}
+
+		const std::vector<byte> headerAndIndex(payload, payload + AESLayer::INDEXED_HEADER_SIZE + segments.size() * AESLayer::INDEX_ENTRY_SIZE);
+		if (!DecryptIndexedSegments(
+			key,
+			headerAndIndex.data(),
+			headerAndIndex.data() + AESLayer::INDEXED_HEADER_SIZE,
+			payload,
+			segments,
+			compression != AESLayer::Compression::None,
+			workerCount,
+			sink))
+		{
+			return DecodingResult();
+		}
+
+		size_t plainTextLength = 0;
+		for (const IndexedSegment& segment : segments)
+		{
+			plainTextLength += segment.m_plainTextLength;
+		}
+		sink.MessageEnd();
+		return DecodingResult(plainTextLength);
+	}
+}
+
+double AESLayer::ProgressMonitor::GetFraction() const
+{
+	const word64 total = m_total;
+	if (total == 0)
+	{
+		return 0.0;
+	}
+	return (std::min)(static_cast<double>(m_completed) / static_cast<double>(total), 1.0);
+}
+
+void AESLayer::ProgressMonitor::AddWork(const word64 units)
+{
+	m_total += units;
+	ThrowIfCancelled();
+}
+
+void AESLayer::ProgressMonitor::Advance(const word64 units)
+{
+	const word64 completed = m_completed += units;
+	if (m_callback)
+	{
+		m_callback(completed, m_total);
+	}
+	ThrowIfCancelled();
+}
+
+void AESLayer::ProgressMonitor::ThrowIfCancelled() const
+{
+	if (m_cancelled)
+	{
+		throw OperationCancelled();
+	}
+}
+
+AESLayer::KdfParameters AESLayer::DefaultKdfParameters(const KdfMode mode)
+{
+	KdfParameters parameters;
+	if (mode == KdfMode::Pbkdf2Sha256)
+	{
+		parameters.m_cost = KEY_ITERATIONS;
+		return parameters;
+	}
+	if (mode == KdfMode::Argon2id)
+	{
+		parameters.m_cost = kArgon2Memory;
+		parameters.m_blockSize = kArgon2Passes;
+		parameters.m_parallelism = kArgon2Lanes;
+		return parameters;
+	}
+
+	parameters.m_cost = DERIVATION_COST;
+	parameters.m_blockSize = kScryptBlockSize;
+	parameters.m_parallelism = kScryptParallelization;
+	return parameters;
+}
+
+bool AESLayer::IsValidKdfParameters(const KdfMode mode, const KdfParameters& parameters)
+{
+	if (mode == KdfMode::Pbkdf2Sha256)
+	{
+		return parameters.m_cost >= MIN_KEY_ITERATIONS &&
+			parameters.m_cost <= MAX_KEY_ITERATIONS &&
+			parameters.m_blockSize == 0 &&
+			parameters.m_parallelism == 0;
+	}
+	if (mode == KdfMode::Argon2id)
+	{
+		return parameters.m_cost >= MIN_ARGON2_MEMORY &&
+			parameters.m_cost <= MAX_ARGON2_MEMORY &&
+			parameters.m_blockSize >= 1 &&
+			parameters.m_blockSize <= MAX_ARGON2_PASSES &&
+			parameters.m_parallelism >= 1 &&
+			parameters.m_parallelism <= MAX_ARGON2_LANES;
+	}
+
+	// scrypt: N a power of two, and one lane's memory (128 * r * N) bounded
+	const word32 cost = parameters.m_cost;
+	return cost >= MIN_SCRYPT_COST &&
+		cost <= MAX_SCRYPT_COST &&
+		(cost & (cost - 1)) == 0 &&
+		parameters.m_blockSize >= 1 &&
+		parameters.m_blockSize <= MAX_SCRYPT_BLOCK_SIZE &&
+		parameters.m_parallelism >= 1 &&
+		parameters.m_parallelism <= MAX_SCRYPT_PARALLELISM &&
+		size_t{ 128 } * parameters.m_blockSize * cost <= MAX_SCRYPT_MEMORY;
+}
+
+double AESLayer::MeasureKdf(const KdfMode mode, const KdfParameters& parameters)
+{
+	const std::array<byte, 8> passphrase{ 'c', 'a', 'l', 'i', 'b', 'r', 'a', 't' };
+	const std::array<byte, SALT_SIZE> salt{};
+	SecByteBlock key(SHA256::DIGESTSIZE);
+
+	const auto start = std::chrono::steady_clock::now();
+	DeriveHardenedKey(
+		mode,
+		parameters,
+		ConstByteArrayParameter(passphrase.data(), passphrase.size()),
+		salt.data(),
+		key);
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+AESLayer::BackendInfo AESLayer::DescribeBackends()
+{
+	BackendInfo info;
+	info.m_aesProvider = AES::Encryption().AlgorithmProvider();
+	info.m_gcmProvider = GCM<AES>::Encryption().AlgorithmProvider();
+	info.m_sha256Provider = SHA256().AlgorithmProvider();
+#if (CRYPTOPP_BOOL_X86 || CRYPTOPP_BOOL_X32 || CRYPTOPP_BOOL_X64)
+	info.m_hasAesNi = HasAESNI();
+	info.m_hasClmul = HasCLMUL();
+	info.m_hasSha = HasSHA();
+	info.m_hasSsse3 = HasSSSE3();
+	info.m_hasAvx2 = HasAVX2();
+#endif
+	info.m_hardwareThreads = std::thread::hardware_concurrency();
+	return info;
+}
+
+AESLayer::PrimitiveTimings AESLayer::MeasurePrimitives(const size_t bufferSize)
+{
+	const size_t size = bufferSize - (bufferSize % AES::BLOCKSIZE);
+	SecByteBlock buffer(size);
+	std::fill(buffer.begin(), buffer.end(), static_cast<byte>(0));
+	const std::array<byte, SHA256::DIGESTSIZE> key{};
+	const std::array<byte, IV_SIZE> iv{};
+	std::array<byte, HMAC<SHA256>::DIGESTSIZE> digest{};
+
+	PrimitiveTimings timings;
+	timings.m_aesCbcMegabytesPerSecond = BestMegabytesPerSecond(size, [&]()
+	{
+		CBC_Mode<AES>::Encryption encryptor(key.data(), key.size(), iv.data());
+		encryptor.ProcessData(buffer.begin(), buffer.begin(), buffer.size());
+	});
+	timings.m_aesGcmMegabytesPerSecond = BestMegabytesPerSecond(size, [&]()
+	{
+		GCM<AES>::Encryption encryptor;
+		encryptor.SetKey(key.data(), key.size());
+		encryptor.EncryptAndAuthenticate(
+			buffer.begin(),
+			digest.data(),
+			AEAD_TAG_SIZE,
+			iv.data(),
+			static_cast<int>(kGcmNonceSize),
+			nullptr,
+			0,
+			buffer.begin(),
+			buffer.size());
+	});
+	timings.m_hmacSha256MegabytesPerSecond = BestMegabytesPerSecond(size, [&]()
+	{
+		HMAC<SHA256> hmac(key.data(), key.size());
+		hmac.CalculateDigest(digest.data(), buffer.begin(), buffer.size());
+	});
+
+	timings.m_scryptMilliseconds = MeasureKdf(KdfMode::Scrypt, DefaultKdfParameters(KdfMode::Scrypt));
+	timings.m_pbkdf2Milliseconds = MeasureKdf(KdfMode::Pbkdf2Sha256, DefaultKdfParameters(KdfMode::Pbkdf2Sha256));
+	timings.m_argon2idMilliseconds = MeasureKdf(KdfMode::Argon2id, DefaultKdfParameters(KdfMode::Argon2id));
+	return timings;
+}
+
+void AESLayer::DeriveArgon2id(
+	byte* derived,
+	const size_t derivedLength,
+	ConstByteArrayParameter const& passphrase,
+	ConstByteArrayParameter const& salt,
+	ConstByteArrayParameter const& secret,
+	ConstByteArrayParameter const& associatedData,
+	const KdfParameters& parameters,
+	ProgressMonitor* progress)
+{
+	const word32 memory = parameters.m_cost;
+	const word32 passes = parameters.m_blockSize;
+	const word32 lanes = parameters.m_parallelism;
+	if (derivedLength < 4 || salt.size() < 8 || passes == 0 || lanes == 0 || lanes > 0xFFFFFF ||
+		memory < 8 * lanes || memory > MAX_ARGON2_MEMORY)
+	{
+		throw InvalidArgument("AESLayer: Argon2id parameters out of range");
+	}
+
+	// H0 over the parameters and inputs, followed by room for the column
+	// and lane of the first two blocks of every lane
+	std::array<byte, BLAKE2b::DIGESTSIZE + 8> seed{};
+	{
+		BLAKE2b hash;
+		const auto update32 = [&hash](const size_t value)
+		{
+			std::array<byte, 4> encoded{};
+			PutLittleEndian32(encoded.data(), static_cast<word32>(value));
+			hash.Update(encoded.data(), encoded.size());
+		};
+		const auto updateInput = [&](ConstByteArrayParameter const& input)
+		{
+			update32(input.size());
+			hash.Update(input.begin(), input.size());
+		};
+
+		update32(lanes);
+		update32(derivedLength);
+		update32(memory);
+		update32(passes);
+		update32(kArgon2Version);
+		update32(kArgon2idType);
+		updateInput(passphrase);
+		updateInput(salt);
+		updateInput(secret);
+		updateInput(associatedData);
+		hash.Final(seed.data());
+	}
+
+	Argon2Instance instance{};
+	instance.m_passes = passes;
+	instance.m_lanes = lanes;
+	instance.m_segmentLength = memory / (kArgon2SyncPoints * lanes);
+	instance.m_laneLength = instance.m_segmentLength * kArgon2SyncPoints;
+	SecBlock<word64> memoryBlocks(static_cast<size_t>(instance.m_laneLength) * lanes * kArgon2BlockWords);
+	if (progress)
+	{
+		progress->AddWork(static_cast<word64>(instance.m_laneLength) * lanes * passes);
+	}
+	instance.m_memory = memoryBlocks.begin();
+
+	SecByteBlock blockBytes(kArgon2BlockSize);
+	for (word32 lane = 0; lane < lanes; ++lane)
+	{
+		for (word32 column = 0; column < 2; ++column)
+		{
+			PutLittleEndian32(seed.data() + BLAKE2b::DIGESTSIZE, column);
+			PutLittleEndian32(seed.data() + BLAKE2b::DIGESTSIZE + 4, lane);
+			Argon2Hash(blockBytes.begin(), blockBytes.size(), seed.data(), seed.size());
+			LoadArgon2Block(instance.m_memory + (static_cast<size_t>(lane) * instance.m_laneLength + column) * kArgon2BlockWords, blockBytes.begin());
+		}
+	}
+	SecureWipeBuffer(seed.data(), seed.size());
+
+	// lanes only read each other's blocks from finished slices, so every
+	// slice is filled with one thread per lane
+	for (word32 pass = 0; pass < passes; ++pass)
+	{
+		for (word32 slice = 0; slice < kArgon2SyncPoints; ++slice)
+		{
+			ParallelFor(lanes, lanes, [&](const size_t lane)
+			{
+				FillArgon2Segment(instance, pass, slice, static_cast<word32>(lane));
+				if (progress)
+				{
+					progress->Advance(instance.m_segmentLength);
+				}
+			});
+		}
+	}
+
+	// XOR of the last block of every lane, stretched to the output length
+	std::array<word64, kArgon2BlockWords> finalBlock{};
+	for (word32 lane = 0; lane < lanes; ++lane)
+	{
+		const word64* last = instance.m_memory + (static_cast<size_t>(lane) * instance.m_laneLength + instance.m_laneLength - 1) * kArgon2BlockWords;
+		for (size_t i = 0; i < kArgon2BlockWords; ++i)
+		{
+			finalBlock[i] ^= last[i];
+		}
+	}
+	StoreArgon2Block(blockBytes.begin(), finalBlock.data());
+	SecureWipeBuffer(finalBlock.data(), finalBlock.size());
+	Argon2Hash(derived, derivedLength, blockBytes.begin(), blockBytes.size());
+}
+
+void AESLayer::DeriveScrypt(
+	byte* derived,
+	const size_t derivedLength,
+	ConstByteArrayParameter const& passphrase,
+	ConstByteArrayParameter const& salt,
+	const KdfParameters& parameters,
+	ProgressMonitor* progress)
+{
+	const word32 cost = parameters.m_cost;
+	const size_t blockSize = parameters.m_blockSize;
+	const size_t lanes = parameters.m_parallelism;
+	if (cost < 2 || (cost & (cost - 1)) != 0 || blockSize == 0 || lanes == 0 ||
+		blockSize > (std::numeric_limits<size_t>::max)() / 128 / cost)
+	{
+		throw InvalidArgument("AESLayer: scrypt parameters out of range");
+	}
+
+	// B = PBKDF2-HMAC-SHA256(P, S, 1, p * 128 * r), then ROMix on every
+	// 128 * r byte lane of B independently, then
+	// DK = PBKDF2-HMAC-SHA256(P, B, 1, dkLen)
+	const size_t laneSize = 128 * blockSize;
+	SecByteBlock lanesBlock(laneSize * lanes);
+	if (progress)
+	{
+		progress->AddWork(2 * static_cast<word64>(cost) * lanes);
+	}
+	PKCS5_PBKDF2_HMAC<SHA256> pbkdf;
+	const byte purposeUnused = 0;
+	pbkdf.DeriveKey(
+		lanesBlock.begin(),
+		lanesBlock.size(),
+		purposeUnused,
+		passphrase.begin(),
+		passphrase.size(),
+		salt.begin(),
+		salt.size(),
+		1,
+		0.0);
+
+	// every running lane holds its own 128 * r * N table, so no more run at
+	// once than hardware threads and MAX_SCRYPT_MEMORY allow
+	const size_t laneMemory = laneSize * cost;
+	const size_t affordableLanes = (std::max)(MAX_SCRYPT_MEMORY / laneMemory, size_t{ 1 });
+	const unsigned int workerCount = static_cast<unsigned int>((std::min)(static_cast<size_t>(ResolveWorkerCount(0)), affordableLanes));
+	ParallelFor(lanes, workerCount, [&](const size_t lane)
+	{
+		ScryptRoMix(lanesBlock.begin() + lane * laneSize, blockSize, cost, progress);
+	});
+
+	pbkdf.DeriveKey(
+		derived,
+		derivedLength,
+		purposeUnused,
+		passphrase.begin(),
+		passphrase.size(),
+		lanesBlock.begin(),
+		lanesBlock.size(),
+		1,
+		0.0);
+}
+
+AESLayer::KdfCalibration AESLayer::CalibrateKdf(const KdfMode mode, const unsigned int targetMilliseconds)
+{
+	// Double the cost from the minimum until one probe takes an eighth of
+	// the target, so timer noise and cache effects at tiny costs don't
+	// dominate, then scale linearly: all three KDFs are linear in N, the
+	// iteration count or the memory size. Argon2id gets one lane per
+	// hardware thread; the lane count only changes how the work is split.
+	const bool pbkdf2 = mode == KdfMode::Pbkdf2Sha256;
+	const bool argon2 = mode == KdfMode::Argon2id;
+	const word32 minCost = pbkdf2 ? MIN_KEY_ITERATIONS : (argon2 ? MIN_ARGON2_MEMORY : MIN_SCRYPT_COST);
+	const word32 maxCost = pbkdf2 ? MAX_KEY_ITERATIONS : (argon2 ? MAX_ARGON2_MEMORY : MAX_SCRYPT_COST);
+	KdfParameters probe = DefaultKdfParameters(mode);
+	probe.m_cost = minCost;
+	if (argon2)
+	{
+		probe.m_parallelism = std::clamp(std::thread::hardware_concurrency(), 1u, static_cast<unsigned int>(MAX_ARGON2_LANES));
+	}
+	double probeMilliseconds = MeasureKdf(mode, probe);
+	while (probeMilliseconds < targetMilliseconds / 8.0 && probe.m_cost <= maxCost / 2)
+	{
+		probe.m_cost *= 2;
+		probeMilliseconds = MeasureKdf(mode, probe);
+	}
+	const double millisecondsPerCost = (std::max)(probeMilliseconds, 0.001) / probe.m_cost;
+	const double affordableCost = targetMilliseconds / millisecondsPerCost;
+
+	KdfCalibration calibration;
+	calibration.m_parameters = probe;
+	if (pbkdf2 || argon2)
+	{
+		word32 cost = static_cast<word32>(std::clamp(
+			affordableCost,
+			static_cast<double>(minCost),
+			static_cast<double>(maxCost)));
+		if (argon2)
+		{
+			// whole MiB; the minimum is one as well
+			cost -= cost % 1024;
+		}
+		calibration.m_parameters.m_cost = cost;
+	}
+	else
+	{
+		// largest power of two that stays within the target
+		word32 cost = MIN_SCRYPT_COST;
+		while (cost < MAX_SCRYPT_COST && cost * 2.0 <= affordableCost)
+		{
+			cost *= 2;
+		}
+		calibration.m_parameters.m_cost = cost;
+	}
+	// never below the compile-time defaults the calibration replaces, so a
+	// slow machine doesn't save notes weaker than before
+	calibration.m_parameters.m_cost = (std::max)(calibration.m_parameters.m_cost, DefaultKdfParameters(mode).m_cost);
+
+	calibration.m_estimatedMilliseconds = millisecondsPerCost * calibration.m_parameters.m_cost;
+	return calibration;
+}
+
+unsigned int AESLayer::Encrypt(
+	RandomNumberGenerator& rng,
+	ConstByteArrayParameter const& passphrase,
+	byte* output,
+	const std::string& plaintext,
+	const EncryptionOptions& options)
+{
+	return EncryptCompatiblePayload(
+		rng,
+		passphrase,
+		output,
+		reinterpret_cast<const byte*>(plaintext.data()),
+		plaintext.size(),
+		options);
+}
+
+unsigned int AESLayer::Encrypt(
+	RandomNumberGenerator& rng,
+	ConstByteArrayParameter const& passphrase,
+	const std::span<byte> output,
+	const std::span<const byte> plaintext,
+	const EncryptionOptions& options)
+{
+	if (output.size() < MaxCiphertextLen(static_cast<unsigned int>(plaintext.size())))
+	{
+		throw InvalidArgument("AESLayer: output buffer is smaller than MaxCiphertextLen()");
+	}
+	return EncryptCompatiblePayload(rng, passphrase, output.data(), plaintext.data(), plaintext.size(), options);
+}
+
+unsigned int AESLayer::EncryptInPlace(
+	RandomNumberGenerator& rng,
+	ConstByteArrayParameter const& passphrase,
+	const std::span<byte> buffer,
+	const size_t plaintextLength,
+	const EncryptionOptions& options)
+{
+	if (plaintextLength > buffer.size() || buffer.size() < MaxCiphertextLen(static_cast<unsigned int>(plaintextLength)))
+	{
+		throw InvalidArgument("AESLayer: buffer is smaller than MaxCiphertextLen()");
+	}
+
+	if (!IsCompatibleKdfMode(static_cast<byte>(options.m_kdfMode)))
+	{
+		throw InvalidArgument("AESLayer: this KDF is only supported in the segmented format");
+	}
+
+	// make room for the salt (and header); whole blocks are then encrypted
+	// where they lie
+	const size_t prefixSize = CompatiblePrefixSize(options.m_kdfMode);
+	std::memmove(buffer.data() + prefixSize, buffer.data(), plaintextLength);
+	return EncryptCompatiblePayload(rng, passphrase, buffer.data(), buffer.data() + prefixSize, plaintextLength, options);
+}
+
+DecodingResult AESLayer::Decrypt(ConstByteArrayParameter const& passphrase, byte* output, ConstByteArrayParameter const& input)
+{
+	PayloadInfo payloadInfo;
+	return Decrypt(passphrase, output, input, payloadInfo);
+}
+
+DecodingResult AESLayer::Decrypt(ConstByteArrayParameter const& passphrase, byte* output, ConstByteArrayParameter const& input, PayloadInfo& payloadInfo, ProgressMonitor* progress)
+{
+	return DecryptPayload(passphrase, output, input, payloadInfo, false, progress);
+}
+
+DecodingResult AESLayer::DecryptInPlace(ConstByteArrayParameter const& passphrase, const std::span<byte> buffer, PayloadInfo& payloadInfo, ProgressMonitor* progress)
+{
+	return DecryptPayload(
+		passphrase,
+		buffer.data(),
+		ConstByteArrayParameter(static_cast<const byte*>(buffer.data()), buffer.size()),
+		payloadInfo,
+		true,
+		progress);
+}
+
+// In place, output is the start of input: segments are written behind the
+// read position, legacy/v2 payloads are decrypted where the ciphertext is
+// and then moved to the front.
+DecodingResult AESLayer::DecryptPayload(
+	ConstByteArrayParameter const& passphrase,
+	byte* output,
+	ConstByteArrayParameter const& input,
+	PayloadInfo& payloadInfo,
+	const bool inPlace,
+	ProgressMonitor* progress)
+{
+	const byte* begin = input.begin();
+	const byte* end = input.end();
+
+	if (IsIndexedPayload(begin, input.size()))
+	{
+		KdfMode kdfMode = KdfMode::Scrypt;
+		KdfParameters parameters;
+		Compression compression = Compression::None;
+		std::vector<IndexedSegment> segments;
+		if (ReadIndexedLayout(begin, input.size(), kdfMode, parameters, compression, segments))
+		{
+			// decompressed plaintext may outgrow the input-sized output
+			if (compression != Compression::None)
+			{
+				return DecodingResult();
+			}
+
+			SecByteBlock masterKey(SHA256::DIGESTSIZE);
+			DeriveHardenedKey(kdfMode, parameters, passphrase, begin + kIndexedSaltOffset, masterKey, progress);
+			ArraySink sink(output, input.size());
+			bool passwordRejected = false;
+			const DecodingResult result = OpenIndexedPayload(masterKey, begin, input.size(), sink, ResolveWorkerCount(0), passwordRejected);
+			if (result.isValidCoding)
+			{
+				payloadInfo = { PayloadFormat::Indexed, kdfMode, CipherMode::AesGcm, parameters, compression };
+				return result;
+			}
+			SecureWipeBuffer(output, static_cast<size_t>(sink.TotalPutLength()));
+			if (passwordRejected || inPlace)
+			{
+				return DecodingResult();
+			}
+		}
+	}
+
+	if (IsSegmentedPayload(begin, input.size()))
+	{
+		// the decompressed plaintext may outgrow the input-sized output, and
+		// in place it would overtake the ciphertext still to be read
+		if (input.size() > kCipherModeOffset && (begin[kCipherModeOffset] & kCompressedFlag) != 0)
+		{
+			return DecodingResult();
+		}
+
+		ArraySink sink(output, input.size());
+		StreamDecryptor decryptor(passphrase, sink, 0, progress);
+		bool opened = false;
+		try
+		{
+			opened = decryptor.Put(begin, input.size()) && decryptor.Finish();
+		}
+		catch (const OperationCancelled&)
+		{
+			SecureWipeBuffer(output, static_cast<size_t>(sink.TotalPutLength()));
+			throw;
+		}
+		if (opened)
+		{
+			payloadInfo = { PayloadFormat::Segmented, decryptor.GetKdfMode(), decryptor.GetCipherMode(), decryptor.GetKdfParameters(), decryptor.GetCompression() };
+			return DecodingResult(static_cast<size_t>(sink.TotalPutLength()));
+		}
+		SecureWipeBuffer(output, static_cast<size_t>(sink.TotalPutLength()));
+
+		// A well-formed header with a mismatching key check means a wrong
+		// password; don't pay for the legacy KDF fallbacks as well. In place,
+		// the input may already be overwritten.
+		if (decryptor.PasswordRejected() || inPlace)
+		{
+			return DecodingResult();
+		}
+	}
+
+	if (input.size() < LEGACY_MINIMUM_CIPHERTEXT_LENGTH)
+	{
+		return DecodingResult();
+	}
+
+	// Preferred modern format with embedded KDF metadata.
+	if (input.size() >= MINIMUM_CIPHERTEXT_LENGTH && std::equal(kFormatMagic.begin(), kFormatMagic.end(), begin))
+	{
+		const byte modeValue = begin[kFormatMagic.size()];
+		if (IsCompatibleKdfMode(modeValue))
+		{
+			const byte* salt = begin + FORMAT_HEADER_SIZE;
+			const byte* payload = salt + AESLayer::SALT_SIZE;
+			const byte* digest = end - HMAC<SHA256>::DIGESTSIZE;
+			const byte* ivSeed = digest - AESLayer::IV_SEED_SIZE;
+			if (ivSeed > payload)
+			{
+				byte* payloadOutput = inPlace ? output + (payload - begin) : output;
+				size_t plainTextLength = 0;
+				if (VerifyAndDecrypt(
+					ToKdfMode(modeValue),
+					passphrase,
+					begin,
+					static_cast<size_t>(digest - begin),
+					payload,
+					static_cast<size_t>(ivSeed - payload),
+					salt,
+					ivSeed,
+					digest,
+					payloadOutput,
+					plainTextLength,
+					progress))
+				{
+					payloadInfo = { PayloadFormat::Compatible, ToKdfMode(modeValue), CipherMode::AesCbcHmacSha256, DefaultKdfParameters(ToKdfMode(modeValue)) };
+					return MoveToFront(output, payloadOutput, plainTextLength);
+				}
+			}
+		}
+	}
+
+	// Legacy format fallback (without format header) for backward compatibility.
+	const byte* salt = begin;
+	const byte* payload = salt + AESLayer::SALT_SIZE;
+	const byte* digest = end - HMAC<SHA256>::DIGESTSIZE;
+	const byte* ivSeed = digest - AESLayer::IV_SEED_SIZE;
+	if (ivSeed <= payload)
+	{
+		return DecodingResult();
+	}
+
+	const size_t payloadSize = static_cast<size_t>(ivSeed - payload);
+	byte* payloadOutput = inPlace ? output + (payload - begin) : output;
+	if ((payloadSize % AES::BLOCKSIZE) != 0)
+	{
+		return DecodingResult();
+	}
+
+	// The legacy layout doesn't record its KDF. With a second hardware thread
+	// the scrypt candidate is derived in the background while PBKDF2-SHA256
+	// is tried here, so unlocking waits for one KDF instead of both.
+	size_t plainTextLength = 0;
+	const std::unique_ptr<BackgroundLegacyDerivation> scryptCandidate = StartLegacyScryptDerivation(passphrase, salt, ivSeed);
+	if (scryptCandidate)
+	{
+		if (VerifyAndDecrypt(
+			KdfMode::Pbkdf2Sha256,
+			passphrase,
+			payload,
+			static_cast<size_t>(digest - payload),
+			payload,
+			payloadSize,
+			salt,
+			ivSeed,
+			digest,
+			payloadOutput,
+			plainTextLength,
+			progress))
+		{
+			payloadInfo = { PayloadFormat::Legacy, KdfMode::Pbkdf2Sha256, CipherMode::AesCbcHmacSha256, DefaultKdfParameters(KdfMode::Pbkdf2Sha256) };
+			return MoveToFront(output, payloadOutput, plainTextLength);
+		}
+
+		// the background candidate reports to its own monitor, not to
+		// progress, but waiting for it can still be cancelled
+		std::unique_lock<std::mutex> lock(scryptCandidate->m_mutex);
+		while (!scryptCandidate->m_finishedEvent.wait_for(lock, std::chrono::milliseconds(50), [&scryptCandidate]() { return scryptCandidate->m_finished; }))
+		{
+			if (progress)
+			{
+				progress->ThrowIfCancelled();
+			}
+		}
+		if (scryptCandidate->m_succeeded && VerifyAndDecryptWithKey(
+			scryptCandidate->m_key,
+			scryptCandidate->m_iv,
+			payload,
+			static_cast<size_t>(digest - payload),
+			payload,
+			payloadSize,
+			digest,
+			payloadOutput,
+			plainTextLength))
+		{
+			payloadInfo = { PayloadFormat::Legacy, KdfMode::Scrypt, CipherMode::AesCbcHmacSha256, DefaultKdfParameters(KdfMode::Scrypt) };
+			return MoveToFront(output, payloadOutput, plainTextLength);
+		}
+
+		return DecodingResult();
+	}
+
+	if (VerifyAndDecrypt(
+		KdfMode::Scrypt,
+		passphrase,
+		payload,
+		static_cast<size_t>(digest - payload),
+		payload,
+		payloadSize,
+		salt,
+		ivSeed,
+		digest,
+		payloadOutput,
+		plainTextLength,
+		progress))
+	{
+		payloadInfo = { PayloadFormat::Legacy, KdfMode::Scrypt, CipherMode::AesCbcHmacSha256, DefaultKdfParameters(KdfMode::Scrypt) };
+		return MoveToFront(output, payloadOutput, plainTextLength);
+	}
+
+	if (VerifyAndDecrypt(
+		KdfMode::Pbkdf2Sha256,
+		passphrase,
+		payload,
+		static_cast<size_t>(digest - payload),
+		payload,
+		payloadSize,
+		salt,
+		ivSeed,
+		digest,
+		payloadOutput,
+		plainTextLength,
+		progress))
+	{
+		payloadInfo = { PayloadFormat::Legacy, KdfMode::Pbkdf2Sha256, CipherMode::AesCbcHmacSha256, DefaultKdfParameters(KdfMode::Pbkdf2Sha256) };
+		return MoveToFront(output, payloadOutput, plainTextLength);
+	}
+
+	return DecodingResult();
+}
+
+// Three passes: sort the entries into shared hardened keys, derive every
+// distinct key once (several at a time), then open the entries in parallel.
+size_t AESLayer::DecryptBatch(ConstByteArrayParameter const& passphrase, const std::span<BatchEntry> entries, const unsigned int workerCount, ProgressMonitor* progress)
+{
+	std::vector<BatchPlan> plans(entries.size());
+	std::vector<HardenedKeyRequest> requests;
+	std::map<HardenedKeyRequest, size_t> requestIndices;
+	const auto addRequest = [&](const HardenedKeyRequest& request)
+	{
+		const auto inserted = requestIndices.emplace(request, requests.size());
+		if (inserted.second)
+		{
+			requests.push_back(request);
+		}
+		return inserted.first->second;
+	};
+
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		entries[i].m_result = DecodingResult();
+		const byte* begin = entries[i].m_buffer.data();
+		const size_t size = entries[i].m_buffer.size();
+		BatchPlan& plan = plans[i];
+		HardenedKeyRequest request;
+
+		// as in DecryptInPlace(), a payload with the segmented or indexed
+		// magic is never retried as a legacy one
+		if (IsIndexedPayload(begin, size))
+		{
+			plan.m_format = PayloadFormat::Indexed;
+			plan.m_cipherMode = CipherMode::AesGcm;
+			std::vector<IndexedSegment> segments;
+			if (ReadIndexedLayout(begin, size, request.m_mode, request.m_parameters, plan.m_compression, segments))
+			{
+				std::copy_n(begin + kIndexedSaltOffset, request.m_salt.size(), request.m_salt.begin());
+				plan.m_key = addRequest(request);
+			}
+		}
+		else if (IsSegmentedPayload(begin, size))
+		{
+			plan.m_format = PayloadFormat::Segmented;
+			if (size >= SEGMENTED_HEADER_SIZE &&
+				ReadSegmentedHeader(begin, request.m_mode, plan.m_cipherMode, plan.m_compression, plan.m_segmentSize, request.m_parameters))
+			{
+				std::copy_n(begin + kSegmentedSaltOffset, request.m_salt.size(), request.m_salt.begin());
+				plan.m_key = addRequest(request);
+			}
+		}
+		else if (size >= MINIMUM_CIPHERTEXT_LENGTH &&
+			std::equal(kFormatMagic.begin(), kFormatMagic.end(), begin) &&
+			IsCompatibleKdfMode(begin[kFormatMagic.size()]))
+		{
+			plan.m_format = PayloadFormat::Compatible;
+			request.m_mode = ToKdfMode(begin[kFormatMagic.size()]);
+			request.m_parameters = DefaultKdfParameters(request.m_mode);
+			std::copy_n(begin + FORMAT_HEADER_SIZE, request.m_salt.size(), request.m_salt.begin());
+			plan.m_key = addRequest(request);
+		}
+	}
+
+	// Every derivation already spreads its own lanes over the hardware
+	// threads; running several at once fills the gaps between them, but
+	// only as many as MAX_SCRYPT_MEMORY allows.
+	const unsigned int workers = ResolveWorkerCount(workerCount);
+	size_t derivationMemory = 1;
+	for (const HardenedKeyRequest& request : requests)
+	{
+		derivationMemory = (std::max)(derivationMemory, HardenedKeyMemory(request.m_mode, request.m_parameters));
+	}
+	const unsigned int derivationWorkers = static_cast<unsigned int>((std::min)(
+		static_cast<size_t>(workers),
+		(std::max)(MAX_SCRYPT_MEMORY / derivationMemory, size_t{ 1 })));
+
+	std::vector<SecByteBlock> keys(requests.size());
+	ParallelFor(requests.size(), derivationWorkers, [&](const size_t i)
+	{
+		keys[i].New(SHA256::DIGESTSIZE);
+		DeriveHardenedKey(requests[i].m_mode, requests[i].m_parameters, passphrase, requests[i].m_salt.data(), keys[i], progress);
+	});
+
+	std::atomic<size_t> decrypted{ 0 };
+	ParallelFor(entries.size(), workers, [&](const size_t i)
+	{
+		if (progress)
+		{
+			progress->ThrowIfCancelled();
+		}
+
+		BatchEntry& entry = entries[i];
+		const BatchPlan& plan = plans[i];
+		if (plan.m_format == PayloadFormat::Legacy)
+		{
+			entry.m_result = DecryptPayload(
+				passphrase,
+				entry.m_buffer.data(),
+				ConstByteArrayParameter(static_cast<const byte*>(entry.m_buffer.data()), entry.m_buffer.size()),
+				entry.m_payloadInfo,
+				true,
+				progress);
+		}
+		else if (plan.m_format == PayloadFormat::Indexed && plan.m_key < requests.size())
+		{
+			// decrypted straight into the sink, or in place unless compressed
+			const HardenedKeyRequest& request = requests[plan.m_key];
+			bool passwordRejected = false;
+			if (entry.m_sink != nullptr)
+			{
+				entry.m_result = OpenIndexedPayload(keys[plan.m_key], entry.m_buffer.data(), entry.m_buffer.size(), *entry.m_sink, 1, passwordRejected);
+			}
+			else if (plan.m_compression == Compression::None)
+			{
+				ArraySink sink(entry.m_buffer.data(), entry.m_buffer.size());
+				entry.m_result = OpenIndexedPayload(keys[plan.m_key], entry.m_buffer.data(), entry.m_buffer.size(), sink, 1, passwordRejected);
+				if (!entry.m_result.isValidCoding)
+				{
+					SecureWipeBuffer(entry.m_buffer.data(), entry.m_buffer.size());
+				}
+			}
+			if (entry.m_result.isValidCoding)
+			{
+				entry.m_payloadInfo = { plan.m_format, request.m_mode, plan.m_cipherMode, request.m_parameters, plan.m_compression };
+			}
+		}
+		else if (plan.m_key < requests.size())
+		{
+			const HardenedKeyRequest& request = requests[plan.m_key];
+			entry.m_result = plan.m_format == PayloadFormat::Segmented
+				? OpenSegmentedPayload(keys[plan.m_key], plan.m_cipherMode, plan.m_segmentSize, entry.m_buffer.data(), entry.m_buffer.size())
+				: OpenCompatiblePayload(request.m_mode, passphrase, keys[plan.m_key], entry.m_buffer.data(), entry.m_buffer.size(), progress);
+			if (entry.m_result.isValidCoding)
+			{
+				entry.m_payloadInfo = { plan.m_format, request.m_mode, plan.m_cipherMode, request.m_parameters, plan.m_compression };
+			}
+		}
+
+		// the opened (possibly compressed) plaintext is at the front of the
+		// buffer; indexed payloads have already been passed on
+		if (entry.m_result.isValidCoding &&
+			plan.m_format != PayloadFormat::Indexed &&
+			(entry.m_sink != nullptr || plan.m_compression != Compression::None))
+		{
+			const size_t plainTextLength = entry.m_result.messageLength;
+			entry.m_result = entry.m_sink != nullptr
+				? PassPlaintext(plan.m_compression, entry.m_buffer.data(), plainTextLength, *entry.m_sink)
+				: DecodingResult();
+			SecureWipeBuffer(entry.m_buffer.data(), plainTextLength);
+		}
+
+		if (entry.m_result.isValidCoding)
+		{
+			++decrypted;
+		}
+	});
+	return decrypted;
+}
+
+bool AESLayer::IsSegmentedPayload(const byte* data, const size_t size)
+{
+	return data != nullptr &&
+		size >= kSegmentedFormatMagic.size() &&
+		std::equal(kSegmentedFormatMagic.begin(), kSegmentedFormatMagic.end(), data);
+}
+
+bool AESLayer::IsIndexedPayload(const byte* data, const size_t size)
+{
+	return data != nullptr &&
+		size >= kIndexedFormatMagic.size() &&
+		std::equal(kIndexedFormatMagic.begin(), kIndexedFormatMagic.end(), data);
+}
+
+AESLayer::IncrementalPayload::IncrementalPayload(
+	RandomNumberGenerator& rng,
+	ConstByteArrayParameter const& passphrase,
+	const EncryptionOptions& options)
+	: m_kdfMode(options.m_kdfMode)
+	, m_kdfParameters(ResolveKdfParameters(options))
+	, m_compression(options.m_compression)
+	, m_segmentSize(options.m_segmentSize)
+	, m_workerCount(ResolveWorkerCount(options.m_workerCount))
+{
+	if (!IsValidSegmentSize(m_segmentSize))
+	{
+		throw InvalidArgument("AESLayer: segment size must be a non-zero multiple of the AES block size");
+	}
+	if (!IsKnownCompression(m_compression))
+	{
+		throw InvalidArgument("AESLayer: unknown compression");
+	}
+
+	m_payload.assign(INDEXED_HEADER_SIZE, 0);
+	std::copy(kIndexedFormatMagic.begin(), kIndexedFormatMagic.end(), m_payload.begin());
+	m_payload[kIndexedFormatMagic.size()] = static_cast<byte>(m_kdfMode);
+	m_payload[kIndexedFlagsOffset] = m_compression != Compression::None ? kIndexedCompressedFlag : 0;
+	WriteKdfParameters(m_payload.data() + kIndexedKdfParametersOffset, m_kdfParameters);
+	rng.GenerateBlock(m_payload.data() + kIndexedSaltOffset, SALT_SIZE);
+
+	SecByteBlock masterKey(SHA256::DIGESTSIZE);
+	DeriveHardenedKey(m_kdfMode, m_kdfParameters, passphrase, m_payload.data() + kIndexedSaltOffset, masterKey, options.m_progress);
+	SecByteBlock iv;
+	ExpandSegmentedKeys(masterKey, m_payload.data(), m_key, iv, m_macKey, m_payload.data() + kIndexedKeyCheckOffset, kIndexedKeyCheckOffset);
+	ComputeRootTag(m_macKey, m_payload.data(), m_payload.data() + INDEXED_HEADER_SIZE, 0, m_payload.data() + kRootTagOffset);
+	m_view = m_payload;
+}
+
+AESLayer::IncrementalPayload::IncrementalPayload(
+	ConstByteArrayParameter const& passphrase,
+	ConstByteArrayParameter const& payload,
+	const unsigned int workerCount,
+	ProgressMonitor* progress,
+	const bool borrowPayload)
+	: m_workerCount(ResolveWorkerCount(workerCount))
+{
+	std::vector<IndexedSegment> segments;
+	if (!ReadIndexedLayout(payload.begin(), payload.size(), m_kdfMode, m_kdfParameters, m_compression, segments))
+	{
+		m_failed = true;
+		return;
+	}
+
+	SecByteBlock masterKey(SHA256::DIGESTSIZE);
+	DeriveHardenedKey(m_kdfMode, m_kdfParameters, passphrase, payload.begin() + kIndexedSaltOffset, masterKey, progress);
+	if (!UnlockIndexedPayload(masterKey, payload.begin(), segments.size(), m_key, m_macKey, m_passwordRejected))
+	{
+		m_failed = true;
+		return;
+	}
+	if (borrowPayload)
+	{
+		m_view = std::span<const byte>(payload.begin(), payload.size());
+		return;
+	}
+	m_payload.assign(payload.begin(), payload.end());
+	m_view = m_payload;
+}
+
+AESLayer::PayloadInfo AESLayer::IncrementalPayload::GetPayloadInfo() const
+{
+	return { PayloadFormat::Indexed, m_kdfMode, CipherMode::AesGcm, m_kdfParameters, m_compression };
+}
+
+size_t AESLayer::IncrementalPayload::GetPlaintextLength() const
+{
+	KdfMode kdfMode = KdfMode::Scrypt;
+	KdfParameters parameters;
+	Compression compression = Compression::None;
+	std::vector<IndexedSegment> segments;
+	size_t plainTextLength = 0;
+	if (!m_failed && ReadIndexedLayout(m_view.data(), m_view.size(), kdfMode, parameters, compression, segments))
+	{
+		for (const IndexedSegment& segment : segments)
+		{
+			plainTextLength += segment.m_plainTextLength;
+		}
+	}
+	return plainTextLength;
+}
+
+bool AESLayer::IncrementalPayload::Decrypt(BufferedTransformation& sink) const
+{
+	KdfMode kdfMode = KdfMode::Scrypt;
+	KdfParameters parameters;
+	Compression compression = Compression::None;
+	std::vector<IndexedSegment> segments;
+	if (m_failed ||
+		!ReadIndexedLayout(m_view.data(), m_view.size(), kdfMode, parameters, compression, segments) ||
+		!DecryptIndexedSegments(
+			m_key,
+			m_view.data(),
+			m_view.data() + INDEXED_HEADER_SIZE,
+			m_view.data(),
+			segments,
+			compression != Compression::None,
+			m_workerCount,
+			sink))
+	{
+		return false;
+	}
+	sink.MessageEnd();
+	return true;
+}
+
+bool AESLayer::IncrementalPayload::DecryptRange(const size_t offset, const size_t length, BufferedTransformation& sink) const
+{
+	KdfMode kdfMode = KdfMode::Scrypt;
+	KdfParameters parameters;
+	Compression compression = Compression::None;
+	std::vector<IndexedSegment> segments;
+	if (m_failed || !ReadIndexedLayout(m_view.data(), m_view.size(), kdfMode, parameters, compression, segments))
+	{
+		return false;
+	}
+
+	// the segments [first, last) overlap the range; the first one starts
+	// at plaintext offset start
+	size_t first = 0;
+	size_t start = 0;
+	while (first < segments.size() && start + segments[first].m_plainTextLength <= offset)
+	{
+		start += segments[first++].m_plainTextLength;
+	}
+	const size_t rangeEnd = offset + (std::min)(length, (std::numeric_limits<size_t>::max)() - offset);
+	size_t last = first;
+	size_t end = start;
+	while (last < segments.size() && end < rangeEnd)
+	{
+		end += segments[last++].m_plainTextLength;
+	}
+
+	size_t skip = first < segments.size() ? offset - start : 0;
+	size_t remaining = first < segments.size() ? (std::min)(rangeEnd, end) - offset : 0;
+	CallbackSink range([&sink, &skip, &remaining](const byte* data, size_t size)
+	{
+		const size_t skipped = (std::min)(skip, size);
+		skip -= skipped;
+		const size_t count = (std::min)(size - skipped, remaining);
+		remaining -= count;
+		sink.Put(data + skipped, count);
+	});
+	if (!DecryptIndexedSegments(
+		m_key,
+		m_view.data(),
+		m_view.data() + INDEXED_HEADER_SIZE + first * INDEX_ENTRY_SIZE,
+		m_view.data(),
+		std::vector<IndexedSegment>(segments.begin() + first, segments.begin() + last),
+		compression != Compression::None,
+		m_workerCount,
+		range))
+	{
+		return false;
+	}
+	sink.MessageEnd();
+	return true;
+}
+
+// The segments that lie entirely within the common prefix of previous and
+// plaintext are kept at the front and those within the common suffix at the
+// back, stored bytes, nonces and tags unchanged. The plaintext between them
+// is cut into new segments, which get fresh nonces and are sealed a batch
+// at a time on the worker threads; then the index and the root tag are
+// rewritten.
+void AESLayer::IncrementalPayload::Update(RandomNumberGenerator& rng, const std::span<const byte> previous, const std::span<const byte> plaintext)
+{
+	KdfMode kdfMode = KdfMode::Scrypt;
+	KdfParameters parameters;
+	Compression compression = Compression::None;
+	std::vector<IndexedSegment> segments;
+	if (m_failed || !ReadIndexedLayout(m_view.data(), m_view.size(), kdfMode, parameters, compression, segments))
+	{
+		throw InvalidArgument("AESLayer: IncrementalPayload holds no valid payload");
+	}
+
+	size_t previousLength = 0;
+	for (const IndexedSegment& segment : segments)
+	{
+		previousLength += segment.m_plainTextLength;
+	}
+	if (previous.size() != previousLength)
+	{
+		throw InvalidArgument("AESLayer: previous plaintext does not match the payload");
+	}
+
+	// common prefix and suffix; the suffix never overlaps the prefix
+	const size_t common = (std::min)(previous.size(), plaintext.size());
+	const size_t prefix = static_cast<size_t>(std::mismatch(previous.begin(), previous.begin() + common, plaintext.begin()).first - previous.begin());
+	const size_t suffix = static_cast<size_t>(std::mismatch(previous.rbegin(), previous.rbegin() + (common - prefix), plaintext.rbegin()).first - previous.rbegin());
+
+	size_t head = 0;
+	size_t headLength = 0;
+	while (head < segments.size() && headLength + segments[head].m_plainTextLength <= prefix)
+	{
+		headLength += segments[head++].m_plainTextLength;
+	}
+	size_t tail = segments.size();
+	size_t tailLength = 0;
+	while (tail > head && tailLength + segments[tail - 1].m_plainTextLength <= suffix)
+	{
+		tailLength += segments[--tail].m_plainTextLength;
+	}
+
+	// Every edit may leave one short segment behind; once the payload has
+	// twice as many segments as it needs, it is re-encrypted as a whole.
+	const auto segmentsFor = [this](const size_t length) { return (length + m_segmentSize - 1) / m_segmentSize; };
+	if (head + segmentsFor(plaintext.size() - headLength - tailLength) + (segments.size() - tail) > 2 * segmentsFor(plaintext.size()) + 1)
+	{
+		head = 0;
+		headLength = 0;
+		tail = segments.size();
+		tailLength = 0;
+	}
+
+	const size_t middleLength = plaintext.size() - headLength - tailLength;
+	const size_t newSegments = segmentsFor(middleLength);
+	const size_t keptTail = segments.size() - tail;
+	const size_t segmentCount = head + newSegments + keptTail;
+	if (segmentCount > (std::numeric_limits<word32>::max)())
+	{
+		throw InvalidArgument("AESLayer: plaintext needs too many segments");
+	}
+
+	const size_t indexSize = segmentCount * INDEX_ENTRY_SIZE;
+	const byte* oldIndex = m_view.data() + INDEXED_HEADER_SIZE;
+	std::vector<byte> payload(m_view.begin(), m_view.begin() + INDEXED_HEADER_SIZE);
+	payload.resize(INDEXED_HEADER_SIZE + indexSize);
+	PutLittleEndian32(payload.data() + kSegmentCountOffset, static_cast<word32>(segmentCount));
+	std::copy_n(oldIndex, head * INDEX_ENTRY_SIZE, payload.begin() + INDEXED_HEADER_SIZE);
+	std::copy_n(oldIndex + tail * INDEX_ENTRY_SIZE, keptTail * INDEX_ENTRY_SIZE, payload.begin() + INDEXED_HEADER_SIZE + (head + newSegments) * INDEX_ENTRY_SIZE);
+	if (head != 0)
+	{
+		payload.insert(payload.end(), m_view.begin() + segments.front().m_offset, m_view.begin() + segments[head - 1].m_offset + segments[head - 1].m_storedLength);
+	}
+
+	// the generator is not shared with the worker threads
+	std::vector<byte> newIndex(newSegments * INDEX_ENTRY_SIZE, 0);
+	for (size_t i = 0; i < newSegments; ++i)
+	{
+		rng.GenerateBlock(newIndex.data() + i * INDEX_ENTRY_SIZE + kIndexNonceOffset, kGcmNonceSize);
+	}
+
+	const size_t batchSegments = BatchSegmentCount(m_workerCount);
+	std::vector<std::vector<byte>> stored(batchSegments);
+	const byte* middle = plaintext.data() + headLength;
+	for (size_t first = 0; first < newSegments; first += batchSegments)
+	{
+		const size_t count = (std::min)(batchSegments, newSegments - first);
+		ParallelFor(count, m_workerCount, [&](const size_t i)
+		{
+			const size_t offset = (first + i) * m_segmentSize;
+			SealIndexedSegment(
+				m_key,
+				m_view.data(),
+				m_compression != Compression::None,
+				middle + offset,
+				(std::min)(m_segmentSize, middleLength - offset),
+				newIndex.data() + (first + i) * INDEX_ENTRY_SIZE,
+				stored[i]);
+		});
+		for (size_t i = 0; i < count; ++i)
+		{
+			payload.insert(payload.end(), stored[i].begin(), stored[i].end());
+		}
+	}
+	std::copy(newIndex.begin(), newIndex.end(), payload.begin() + INDEXED_HEADER_SIZE + head * INDEX_ENTRY_SIZE);
+
+	if (keptTail != 0)
+	{
+		payload.insert(payload.end(), m_view.begin() + segments[tail].m_offset, m_view.end());
+	}
+	ComputeRootTag(m_macKey, payload.data(), payload.data() + INDEXED_HEADER_SIZE, segmentCount, payload.data() + kRootTagOffset);
+
+	m_payload.swap(payload);
+	m_view = m_payload;
+	m_reusedSegments = head + keptTail;
+	m_encryptedSegments = newSegments;
+}
+
+AESLayer::StreamEncryptor::StreamEncryptor(
+	RandomNumberGenerator& rng,
+	ConstByteArrayParameter const& passphrase,
+	BufferedTransformation& sink,
+	const EncryptionOptions& options)
+	: m_sink(sink)
+	, m_segmentSize(options.m_segmentSize)
+	, m_workerCount(ResolveWorkerCount(options.m_workerCount))
+	, m_cipherMode(options.m_cipherMode)
+	, m_progress(options.m_progress)
+{
+	if (!IsValidSegmentSize(m_segmentSize))
+	{
+		throw InvalidArgument("AESLayer: segment size must be a non-zero multiple of the AES block size");
+	}
+	if (!IsKnownCipherMode(static_cast<byte>(m_cipherMode)))
+	{
+		throw InvalidArgument("AESLayer: unknown cipher mode");
+	}
+	if (!IsKnownCompression(options.m_compression))
+	{
+		throw InvalidArgument("AESLayer: unknown compression");
+	}
+
+	const KdfParameters kdfParameters = ResolveKdfParameters(options);
+
+	std::copy(kSegmentedFormatMagic.begin(), kSegmentedFormatMagic.end(), m_header.begin());
+	m_header[kSegmentedFormatMagic.size()] = static_cast<byte>(options.m_kdfMode);
+	m_header[kCipherModeOffset] = static_cast<byte>(m_cipherMode);
+	if (options.m_compression != Compression::None)
+	{
+		m_header[kCipherModeOffset] |= kCompressedFlag;
+	}
+	PutLittleEndian32(m_header.data() + kSegmentSizeOffset, static_cast<word32>(m_segmentSize));
+	WriteKdfParameters(m_header.data() + kKdfParametersOffset, kdfParameters);
+	rng.GenerateBlock(m_header.data() + kSegmentedSaltOffset, AESLayer::SALT_SIZE);
+
+	DeriveSegmentedKeys(options.m_kdfMode, kdfParameters, passphrase, m_header.data(), m_key, m_iv, m_macKey, m_header.data() + kKeyCheckOffset, m_progress);
+
+	m_batchSegments = BatchSegmentCount(m_workerCount);
+	m_batch.New(m_batchSegments * m_segmentSize);
+	m_tags.New(m_batchSegments * SegmentTagSize(m_cipherMode));
+	m_sink.Put(m_header.data(), m_header.size());
+
+	if (options.m_compression == Compression::Zlib)
+	{
+		m_compressor.reset(new ZlibCompressor(new CallbackSink([this](const byte* data, const size_t size)
+		{
+			PutSegmentData(data, size);
+		})));
+	}
+}
+
+void AESLayer::StreamEncryptor::Put(const byte* data, const size_t size)
+{
+	if (m_finished)
+	{
+		return;
+	}
+
+	if (m_compressor)
+	{
+		m_compressor->Put(data, size);
+	}
+	else
+	{
+		PutSegmentData(data, size);
+	}
+}
+
+void AESLayer::StreamEncryptor::PutSegmentData(const byte* data, size_t size)
+{
+	const size_t batchSize = m_batch.size();
+	while (!m_finished && size > 0)
+	{
+		const size_t chunk = (std::min)(size, batchSize - m_buffered);
+		std::memcpy(m_batch.begin() + m_buffered, data, chunk);
+		m_buffered += chunk;
+		data += chunk;
+		size -= chunk;
+
+		// A full batch never holds the last segment: the final segment always
+		// carries less than a segment of plaintext plus its padding.
+		if (m_buffered == batchSize)
+		{
+			FlushBatch(m_batchSegments, false);
+		}
+	}
+}
+
+void AESLayer::StreamEncryptor::Finish()
+{
+	if (m_finished)
+	{
+		return;
+	}
+
+	if (m_compressor)
+	{
+		// flushes the rest of the compressed stream into the batch
+		m_compressor->MessageEnd();
+		m_compressor.reset();
+	}
+
+	// full segments, then the final one with less than a segment of plaintext
+	const size_t segmentCount = m_buffered / m_segmentSize + 1;
+	if (m_cipherMode == CipherMode::AesCbcHmacSha256)
+	{
+		const size_t paddingLength = AES::BLOCKSIZE - (m_buffered % AES::BLOCKSIZE);
+		std::fill_n(m_batch.begin() + m_buffered, paddingLength, static_cast<byte>(paddingLength));
+		m_buffered += paddingLength;
+	}
+	FlushBatch(segmentCount, true);
+
+	m_finished = true;
+	m_sink.MessageEnd();
+}
+
+void AESLayer::StreamEncryptor::FlushBatch(const size_t segmentCount, const bool containsFinalSegment)
+{
+	if (m_progress)
+	{
+		m_progress->ThrowIfCancelled();
+	}
+
+	const size_t tagSize = SegmentTagSize(m_cipherMode);
+	ParallelFor(segmentCount, m_workerCount, [&](const size_t i)
+	{
+		const size_t offset = i * m_segmentSize;
+		EncryptSegment(
+			m_cipherMode,
+			m_key,
+			m_iv,
+			m_macKey,
+			m_header.data(),
+			m_segmentIndex + i,
+			containsFinalSegment && (i + 1) == segmentCount,
+			m_batch.begin() + offset,
+			(std::min)(m_segmentSize, m_buffered - offset),
+			m_tags.begin() + i * tagSize);
+	});
+
+	for (size_t i = 0; i < segmentCount; ++i)
+	{
+		const size_t offset = i * m_segmentSize;
+		m_sink.Put(m_batch.begin() + offset, (std::min)(m_segmentSize, m_buffered - offset));
+		m_sink.Put(m_tags.begin() + i * tagSize, tagSize);
+	}
+
+	m_segmentIndex += segmentCount;
+	m_buffered = 0;
+}
+
+AESLayer::StreamDecryptor::StreamDecryptor(ConstByteArrayParameter const& passphrase, BufferedTransformation& sink, const unsigned int workerCount, ProgressMonitor* progress)
+	: m_sink(sink)
+	, m_passphrase(passphrase.begin(), passphrase.size())
+	, m_workerCount(ResolveWorkerCount(workerCount))
+	, m_progress(progress)
+{
+}
+
+bool AESLayer::StreamDecryptor::Put(const byte* data, size_t size)
+{
+	if (m_failed || m_finished)
+	{
+		return false;
+	}
+
+	if (m_headerLength < m_header.size())
+	{
+		const size_t chunk = (std::min)(size, m_header.size() - m_headerLength);
+		std::copy_n(data, chunk, m_header.begin() + m_headerLength);
+		m_headerLength += chunk;
+		data += chunk;
+		size -= chunk;
+
+		if (m_headerLength < m_header.size())
+		{
+			return true;
+		}
+		if (!ParseHeader())
+		{
+			m_failed = true;
+			return false;
+		}
+	}
+
+	const size_t batchSize = m_batch.size();
+	while (size > 0)
+	{
+		// More input follows, so the buffered batch cannot hold the last segment.
+		if (m_buffered == batchSize && !OpenBatch(false))
+		{
+			m_failed = true;
+			return false;
+		}
+
+		const size_t chunk = (std::min)(size, batchSize - m_buffered);
+		std::memcpy(m_batch.begin() + m_buffered, data, chunk);
+		m_buffered += chunk;
+		data += chunk;
+		size -= chunk;
+	}
+	return true;
+}
+
+bool AESLayer::StreamDecryptor::Finish()
+{
+	if (m_failed || m_finished)
+	{
+		return false;
+	}
+
+	if (m_headerLength < m_header.size() || !OpenBatch(true))
+	{
+		m_failed = true;
+		return false;
+	}
+
+	if (m_decompressor)
+	{
+		// also ends the message on m_sink; a truncated stream throws
+		try
+		{
+			m_decompressor->MessageEnd();
+		}
+		catch (const ZlibDecompressor::Err&)
+		{
+			m_failed = true;
+			return false;
+		}
+	}
+	else
+	{
+		m_sink.MessageEnd();
+	}
+	m_finished = true;
+	return true;
+}
+
+bool AESLayer::StreamDecryptor::ParseHeader()
+{
+	if (!ReadSegmentedHeader(m_header.data(), m_kdfMode, m_cipherMode, m_compression, m_segmentSize, m_kdfParameters))
+	{
+		return false;
+	}
+
+	std::array<byte, KEY_CHECK_SIZE> keyCheck{};
+	DeriveSegmentedKeys(
+		m_kdfMode,
+		m_kdfParameters,
+		ConstByteArrayParameter(static_cast<const byte*>(m_passphrase.begin()), m_passphrase.size()),
+		m_header.data(),
+		m_key,
+		m_iv,
+		m_macKey,
+		keyCheck.data(),
+		m_progress);
+	m_passphrase.New(0);
+
+	if (!VerifyBufsEqual(keyCheck.data(), m_header.data() + kKeyCheckOffset, keyCheck.size()))
+	{
+		m_passwordRejected = true;
+		return false;
+	}
+
+	m_batchSegments = BatchSegmentCount(m_workerCount);
+	m_batch.New(m_batchSegments * (m_segmentSize + SegmentTagSize(m_cipherMode)));
+	if (m_compression == Compression::Zlib)
+	{
+		m_decompressor.reset(new ZlibDecompressor(new Redirector(m_sink)));
+	}
+	return true;
+}
+
+bool AESLayer::StreamDecryptor::OpenBatch(const bool containsFinalSegment)
+{
+	if (m_progress)
+	{
+		m_progress->ThrowIfCancelled();
+	}
+
+	const size_t segmentStride = m_segmentSize + SegmentTagSize(m_cipherMode);
+	const size_t segmentCount = (m_buffered + segmentStride - 1) / segmentStride;
+	if (segmentCount == 0)
+	{
+		return false;
+	}
+
+	std::vector<size_t> plainTextLengths(segmentCount, 0);
+	std::vector<byte> segmentValid(segmentCount, 0);
+	ParallelFor(segmentCount, m_workerCount, [&](const size_t i)
+	{
+		const size_t offset = i * segmentStride;
+		segmentValid[i] = OpenSegment(
+			m_cipherMode,
+			m_key,
+			m_iv,
+			m_macKey,
+			m_header.data(),
+			m_segmentIndex + i,
+			containsFinalSegment && (i + 1) == segmentCount,
+			m_segmentSize,
+			m_batch.begin() + offset,
+			(std::min)(segmentStride, m_buffered - offset),
+			plainTextLengths[i]) ? 1 : 0;
+	});
+
+	bool result = true;
+	BufferedTransformation& output = m_decompressor ? *m_decompressor : m_sink;
+	for (size_t i = 0; result && i < segmentCount; ++i)
+	{
+		if (!segmentValid[i])
+		{
+			result = false;
+			break;
+		}
+
+		try
+		{
+			output.Put(m_batch.begin() + i * segmentStride, plainTextLengths[i]);
+		}
+		catch (const ZlibDecompressor::Err&)
+		{
+			result = false;
+		}
+	}
+
+	SecureWipeBuffer(m_batch.begin(), m_buffered);
+	m_segmentIndex += segmentCount;
+	m_buffered = 0;
+	return result;
 }
 
 NAMESPACE_END
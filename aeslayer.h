@@ -3,10 +3,18 @@
 
 #include "cryptopp/algparam.h"
 #include "cryptopp/aes.h"
+#include "cryptopp/cryptlib.h"
 #include "cryptopp/hmac.h"
+#include "cryptopp/secblock.h"
 #include "cryptopp/sha.h"
 
+#include <array>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <span>
 #include <string>
+#include <vector>
 
 NAMESPACE_BEGIN(CryptoPP)
 
@@ -20,6 +28,15 @@ NAMESPACE_BEGIN(CryptoPP)
 // being standard PKCS#7 padding at the end of the plaintext, more resilient
 // password derivation, use of CBC instead of CFB, and a modern hashing algo
 // for HMAC generation.
+//
+// Large notes can be written in a segmented format ("LN2\x03") instead: the
+// plaintext is cut into fixed-size segments and every segment is encrypted
+// and authenticated on its own, so StreamEncryptor/StreamDecryptor only ever
+// hold about one segment in memory.
+//
+// The indexed format ("LN2\x04") keeps a table of segments in front of
+// their ciphertext, so IncrementalPayload can save an edit by re-encrypting
+// only the segments it touched.
 
 class AESLayer
 {
@@ -27,12 +44,135 @@ public:
 	enum class KdfMode : byte
 	{
 		Scrypt = 1,
-		Pbkdf2Sha256 = 2
+		Pbkdf2Sha256 = 2,
+		// segmented format only
+		Argon2id = 3
 	};
 
-	struct EncryptionOptions
+	// segmented format only: how each segment is encrypted and authenticated
+	enum class CipherMode : byte
+	{
+		// AES-256-CBC, then HMAC-SHA256 over the ciphertext (two passes)
+		AesCbcHmacSha256 = 1,
+		// AES-256-GCM, encrypts and authenticates in one pass
+		AesGcm = 2
+	};
+
+	// segmented format only: applied to the plaintext before it is cut into
+	// segments, and undone as the segments are decrypted
+	enum class Compression : byte
+	{
+		None = 0,
+		// zlib (RFC 1950) at the default deflate level
+		Zlib = 1
+	};
+
+	// KDF cost. scrypt: N, r and p; PBKDF2-SHA256: the iteration count in
+	// m_cost, the other fields are zero; Argon2id: memory in KiB, passes
+	// (time cost) and lanes. Recorded in the segmented header.
+	struct KdfParameters
+	{
+		word32 m_cost{ 0 };
+		word32 m_blockSize{ 0 };
+		word32 m_parallelism{ 0 };
+	};
+
+	// result of CalibrateKdf(): the chosen parameters and the unlock time
+	// they are expected to take on this machine
+	struct KdfCalibration
+	{
+		KdfParameters m_parameters;
+		double m_estimatedMilliseconds{ 0.0 };
+	};
+
+	// diagnostics: the implementation the linked Crypto++ build picked for
+	// each primitive on this CPU ("AESNI", "SHANI", "SSE2", "C++", ...) and
+	// the CPU features it could have used
+	struct BackendInfo
+	{
+		std::string m_aesProvider;
+		std::string m_gcmProvider;
+		std::string m_sha256Provider;
+		bool m_hasAesNi{ false };
+		bool m_hasClmul{ false };
+		bool m_hasSha{ false };
+		bool m_hasSsse3{ false };
+		bool m_hasAvx2{ false };
+		unsigned int m_hardwareThreads{ 0 };
+	};
+
+	// diagnostics: bulk throughput in MB/s and the time of one derivation
+	// with DefaultKdfParameters() in milliseconds
+	struct PrimitiveTimings
+	{
+		double m_aesCbcMegabytesPerSecond{ 0.0 };
+		double m_aesGcmMegabytesPerSecond{ 0.0 };
+		double m_hmacSha256MegabytesPerSecond{ 0.0 };
+		double m_scryptMilliseconds{ 0.0 };
+		double m_pbkdf2Milliseconds{ 0.0 };
+		double m_argon2idMilliseconds{ 0.0 };
+	};
+
+	// on-disk layout a payload was read from
+	enum class PayloadFormat : byte
+	{
+		Legacy = 1,
+		Compatible = 2,
+		Segmented = 3,
+		Indexed = 4
+	};
+
+	// what Decrypt() found out about a payload, e.g. to upgrade legacy
+	// payloads (which don't record their KDF) on the next save
+	struct PayloadInfo
 	{
+		PayloadFormat m_format{ PayloadFormat::Segmented };
 		KdfMode m_kdfMode{ KdfMode::Scrypt };
+		CipherMode m_cipherMode{ CipherMode::AesCbcHmacSha256 };
+		KdfParameters m_kdfParameters;
+		Compression m_compression{ Compression::None };
+	};
+
+	// thrown out of a derivation or a segment batch once Cancel() was
+	// called on the operation's ProgressMonitor
+	class OperationCancelled : public Exception
+	{
+	public:
+		OperationCancelled() : Exception(OTHER_ERROR, "AESLayer: operation cancelled") {}
+	};
+
+	// progress and cancellation of a KDF or a decryption running on another
+	// thread. Every derivation adds its work to the total when it starts
+	// (scrypt BlockMix calls, Argon2id blocks, PBKDF2 iterations) and
+	// reports it as it goes; each report checks for cancellation. The
+	// callback runs on the deriving threads, possibly several at once.
+	class ProgressMonitor
+	{
+	public:
+		using Callback = std::function<void(word64 completed, word64 total)>;
+
+		ProgressMonitor() = default;
+		explicit ProgressMonitor(Callback callback) : m_callback(std::move(callback)) {}
+		ProgressMonitor(const ProgressMonitor&) = delete;
+		ProgressMonitor& operator=(const ProgressMonitor&) = delete;
+
+		void Cancel() { m_cancelled = true; }
+		bool IsCancelled() const { return m_cancelled; }
+		word64 GetCompleted() const { return m_completed; }
+		word64 GetTotal() const { return m_total; }
+		// 0.0 to 1.0; steps back when a fallback KDF adds its work
+		double GetFraction() const;
+
+		void AddWork(word64 units);
+		// both throw OperationCancelled once Cancel() was called
+		void Advance(word64 units);
+		void ThrowIfCancelled() const;
+
+	private:
+		Callback m_callback;
+		std::atomic<word64> m_completed{ 0 };
+		std::atomic<word64> m_total{ 0 };
+		std::atomic<bool> m_cancelled{ false };
 	};
 
 	static constexpr unsigned int MAX_PADDING_BYTES = AES::BLOCKSIZE;
@@ -47,6 +187,23 @@ public:
 #endif
 	static constexpr unsigned int KEY_ITERATIONS = 0x10000;
 
+	// bounds for calibrated and header-supplied KDF parameters; the upper
+	// ones keep a crafted header from asking for unbounded memory or time
+	static constexpr word32 MIN_SCRYPT_COST = 0x1000;
+	static constexpr word32 MAX_SCRYPT_COST = 0x40000;
+	static constexpr word32 MAX_SCRYPT_BLOCK_SIZE = 32;
+	static constexpr word32 MAX_SCRYPT_PARALLELISM = 16;
+	static constexpr size_t MAX_SCRYPT_MEMORY = 0x20000000;
+	static constexpr word32 MIN_KEY_ITERATIONS = 0x4000;
+	static constexpr word32 MAX_KEY_ITERATIONS = 0x1000000;
+	// Argon2id memory is in KiB
+	static constexpr word32 MIN_ARGON2_MEMORY = 0x2000;
+	static constexpr word32 MAX_ARGON2_MEMORY = static_cast<word32>(MAX_SCRYPT_MEMORY / 1024);
+	static constexpr word32 MAX_ARGON2_PASSES = 16;
+	static constexpr word32 MAX_ARGON2_LANES = 16;
+	static constexpr unsigned int DEFAULT_UNLOCK_TARGET_MILLISECONDS = 500;
+	static constexpr size_t DIAGNOSTICS_BUFFER_SIZE = 0x800000;
+
 	// "LN2\x02" + one byte for KDF mode.
 	static constexpr unsigned int FORMAT_HEADER_SIZE = 5;
 	static constexpr unsigned int LEGACY_MINIMUM_CIPHERTEXT_LENGTH = MAX_PADDING_BYTES + IV_SIZE + IV_SEED_SIZE + HMAC<SHA256>::DIGESTSIZE;
@@ -56,6 +213,118 @@ public:
 	// that will be produced when encrypting plaintext of a specified size.
 	static unsigned int MaxCiphertextLen(unsigned int plaintextLen) { return plaintextLen + MINIMUM_CIPHERTEXT_LENGTH; }
 
+	// Segmented format:
+	// [magic "LN2\x03"][kdf_mode][cipher_mode][segment_size (LE32)]
+	// [kdf_parameters (3 x LE32)][salt][key_check]
+	// followed by segments [ciphertext][tag]. The top bit of cipher_mode is
+	// set if the plaintext was zlib-compressed before it was segmented;
+	// readers that predate it reject such payloads as an unknown mode. Every
+	// segment except the last carries exactly segment_size plaintext bytes;
+	// the last one carries the remainder (possibly nothing), plus PKCS#7
+	// padding in CBC mode. The tag is HMAC-SHA256 in CBC mode and the GCM tag
+	// in GCM mode. The KDF runs once; the encryption key, IV base, MAC key and
+	// the key check value are expanded from it with HKDF, so a wrong password
+	// is rejected right after the KDF.
+	static constexpr unsigned int KEY_CHECK_SIZE = 16;
+	static constexpr unsigned int SEGMENTED_HEADER_SIZE = FORMAT_HEADER_SIZE + 1 + 4 + 12 + SALT_SIZE + KEY_CHECK_SIZE;
+	static constexpr unsigned int SEGMENT_TAG_SIZE = HMAC<SHA256>::DIGESTSIZE;
+	static constexpr unsigned int AEAD_TAG_SIZE = AES::BLOCKSIZE;
+	static constexpr unsigned int DEFAULT_SEGMENT_SIZE = 0x10000;
+	static constexpr unsigned int MAX_SEGMENT_SIZE = 0x1000000;
+
+	// Indexed format ("LN2\x04"), written by IncrementalPayload:
+	// [magic "LN2\x04"][kdf_mode][flags][kdf_parameters (3 x LE32)][salt]
+	// [key_check][segment_count (LE32)][root_tag]
+	// [index: segment_count x [stored_length (LE32)][plaintext_length (LE32)][nonce][tag]]
+	// followed by the stored bytes of every segment in index order. Each
+	// segment is encrypted with AES-256-GCM under its own random nonce, with
+	// the header up to the key check as additional data; bit 0 of flags says
+	// every segment was zlib-compressed on its own first. The root tag is an
+	// HMAC-SHA256 over the header in front of it and the whole index, so
+	// segments cannot be dropped, reordered or mixed in from older saves,
+	// while unchanged segments carry over to the next save as they are.
+	static constexpr unsigned int INDEXED_HEADER_SIZE = FORMAT_HEADER_SIZE + 1 + 12 + SALT_SIZE + KEY_CHECK_SIZE + 4 + HMAC<SHA256>::DIGESTSIZE;
+	static constexpr unsigned int INDEX_ENTRY_SIZE = 4 + 4 + 12 + AEAD_TAG_SIZE;
+
+	// upper limit for the segmented format, used to reserve output buffers.
+	// Incompressible plaintext grows by a few bytes per 16 KB under zlib.
+	static size_t MaxSegmentedCiphertextLen(size_t plaintextLen, unsigned int segmentSize = DEFAULT_SEGMENT_SIZE, Compression compression = Compression::None)
+	{
+		if (compression != Compression::None)
+		{
+			plaintextLen += (plaintextLen >> 12) + (plaintextLen >> 14) + 64;
+		}
+		return SEGMENTED_HEADER_SIZE + plaintextLen + MAX_PADDING_BYTES + ((plaintextLen / segmentSize) + 1) * SEGMENT_TAG_SIZE;
+	}
+
+	struct EncryptionOptions
+	{
+		KdfMode m_kdfMode{ KdfMode::Scrypt };
+		// segmented format only; must be a non-zero multiple of the AES block size
+		unsigned int m_segmentSize{ DEFAULT_SEGMENT_SIZE };
+		// segmented format only; threads used to encrypt and authenticate
+		// segments, 0 means one per hardware thread. The output does not
+		// depend on this value.
+		unsigned int m_workerCount{ 0 };
+		// segmented format only
+		CipherMode m_cipherMode{ CipherMode::AesCbcHmacSha256 };
+		// segmented format only; all zero means DefaultKdfParameters(m_kdfMode)
+		KdfParameters m_kdfParameters;
+		// segmented format only; compressed payloads can only be opened by
+		// StreamDecryptor and by DecryptBatch() with a sink
+		Compression m_compression{ Compression::None };
+		// optional; reports the KDF and cancels it or the segment batches
+		ProgressMonitor* m_progress{ nullptr };
+	};
+
+	// the compile-time costs legacy and v2 payloads are always derived with
+	static KdfParameters DefaultKdfParameters(KdfMode mode);
+	static bool IsValidKdfParameters(KdfMode mode, const KdfParameters& parameters);
+
+	// KDF calibration: times a cheap derivation on this machine and scales
+	// the cost (scrypt N, PBKDF2 iterations, Argon2id memory with one lane
+	// per hardware thread) so one unlock takes about
+	// targetMilliseconds, within the MAX_ bounds above and never below
+	// DefaultKdfParameters(mode)
+	static KdfCalibration CalibrateKdf(KdfMode mode, unsigned int targetMilliseconds = DEFAULT_UNLOCK_TARGET_MILLISECONDS);
+	// benchmark mode: wall time of one derivation with the given parameters
+	static double MeasureKdf(KdfMode mode, const KdfParameters& parameters);
+
+	// diagnostics for slow-unlock reports: the active backends, and a quick
+	// benchmark (best of three passes over bufferSize bytes per cipher/MAC,
+	// one derivation per KDF)
+	static BackendInfo DescribeBackends();
+	static PrimitiveTimings MeasurePrimitives(size_t bufferSize = DIAGNOSTICS_BUFFER_SIZE);
+
+	// scrypt (RFC 7914) with N = m_cost, r = m_blockSize and p = m_parallelism,
+	// byte-for-byte the same as Scrypt::DeriveKey, but the p lanes run on
+	// separate threads, as many at once as there are hardware threads and
+	// MAX_SCRYPT_MEMORY allows. Throws InvalidArgument unless N is a power
+	// of two above 1 and r and p are non-zero. progress (optional) counts
+	// the 2 * N * p BlockMix calls.
+	static void DeriveScrypt(
+		byte* derived,
+		size_t derivedLength,
+		ConstByteArrayParameter const& passphrase,
+		ConstByteArrayParameter const& salt,
+		const KdfParameters& parameters,
+		ProgressMonitor* progress = nullptr);
+
+	// Argon2id (RFC 9106, version 0x13) with m_cost KiB of memory, m_blockSize
+	// passes and m_parallelism lanes; every lane is filled on its own thread.
+	// secret and associatedData may be empty. Throws InvalidArgument for
+	// parameters RFC 9106 doesn't allow or above MAX_ARGON2_MEMORY; the other
+	// MIN_/MAX_ARGON2 bounds only apply to payloads.
+	static void DeriveArgon2id(
+		byte* derived,
+		size_t derivedLength,
+		ConstByteArrayParameter const& passphrase,
+		ConstByteArrayParameter const& salt,
+		ConstByteArrayParameter const& secret,
+		ConstByteArrayParameter const& associatedData,
+		const KdfParameters& parameters,
+		ProgressMonitor* progress = nullptr);
+
 	// encryption:
 	// use PKCS#7 padding to align to block size for AES CBC mode
 	// derive a key from a salted passphrase using runtime-selected KDF
@@ -63,14 +332,239 @@ public:
 	// MAC is generated over the authenticated payload format
 	// before: use MaxCiphertextLen() to allocate an output buffer of appropriate size
 		static unsigned int Encrypt(RandomNumberGenerator& rng, ConstByteArrayParameter const& passphrase, byte* output, const std::string& plaintext, const EncryptionOptions& options);
+	// as above, straight from the caller's plaintext into the caller's
+	// output; throws InvalidArgument if output is smaller than MaxCiphertextLen()
+	static unsigned int Encrypt(RandomNumberGenerator& rng, ConstByteArrayParameter const& passphrase, std::span<byte> output, std::span<const byte> plaintext, const EncryptionOptions& options);
+	// as above, with the plaintext in the first plaintextLength bytes of
+	// buffer, which must hold MaxCiphertextLen(plaintextLength) bytes
+	static unsigned int EncryptInPlace(RandomNumberGenerator& rng, ConstByteArrayParameter const& passphrase, std::span<byte> buffer, size_t plaintextLength, const EncryptionOptions& options);
 
 	// decryption:
 	// parse payload format, derive keys using selected or fallback KDF
 	// check MAC tag by generating a HMAC-SHA256 over ciphertext and IV
 	// then decrypt and remove padding
 	// before: allocate an output buffer that is as large as the input
+	// compressed segmented and indexed payloads may not fit it and are
+	// refused, as by DecryptInPlace(); open them with StreamDecryptor or
+	// IncrementalPayload respectively
 	static DecodingResult Decrypt(ConstByteArrayParameter const& passphrase, byte* output, ConstByteArrayParameter const& input);
+	// as above; on success payloadInfo tells which format and KDF matched.
+	// progress (optional) may cancel the call with OperationCancelled.
+	static DecodingResult Decrypt(ConstByteArrayParameter const& passphrase, byte* output, ConstByteArrayParameter const& input, PayloadInfo& payloadInfo, ProgressMonitor* progress = nullptr);
+	// decrypts inside the payload buffer; on success the plaintext starts at
+	// buffer.data(), on failure the buffer may hold anything and should be
+	// discarded. Several candidate KDFs can be tried, so every MAC is
+	// verified before anything is decrypted in place.
+	static DecodingResult DecryptInPlace(ConstByteArrayParameter const& passphrase, std::span<byte> buffer, PayloadInfo& payloadInfo, ProgressMonitor* progress = nullptr);
+
+	// one payload of DecryptBatch(), decrypted in place as by DecryptInPlace()
+	struct BatchEntry
+	{
+		std::span<byte> m_buffer;
+		// optional; receives the plaintext (decompressed if need be) instead
+		// of the front of m_buffer, which is then wiped. Required for
+		// compressed payloads. Discard its output unless m_result is valid.
+		BufferedTransformation* m_sink{ nullptr };
+		DecodingResult m_result;
+		PayloadInfo m_payloadInfo;
+	};
+	// DecryptInPlace() for many payloads under one password, e.g. a folder of
+	// notes. Segmented, indexed and v2 payloads whose key comes from the same KDF,
+	// parameters and salt share one derivation; the distinct derivations run
+	// side by side (as many as workerCount, 0 meaning one per hardware
+	// thread, and MAX_SCRYPT_MEMORY allow), then the payloads are decrypted
+	// in parallel. With every salt unique that is still one derivation per
+	// payload, only without waiting for each in turn. Legacy payloads don't
+	// record their KDF and get no shared derivation, and unlike Decrypt() a
+	// v2 payload is not retried as a legacy one. Returns how many entries
+	// were decrypted.
+	static size_t DecryptBatch(ConstByteArrayParameter const& passphrase, std::span<BatchEntry> entries, unsigned int workerCount = 0, ProgressMonitor* progress = nullptr);
 
+	// true if the buffer starts with the segmented format magic
+	static bool IsSegmentedPayload(const byte* data, size_t size);
+	// true if the buffer starts with the indexed format magic
+	static bool IsIndexedPayload(const byte* data, size_t size);
+
+	// size of the tag stored after every segment
+	static constexpr unsigned int SegmentTagSize(CipherMode cipherMode)
+	{
+		return cipherMode == CipherMode::AesGcm ? AEAD_TAG_SIZE : SEGMENT_TAG_SIZE;
+	}
+
+	// streaming encryption into the segmented format:
+	// the header is written to the sink on construction. The plaintext is
+	// compressed first if the options ask for it. Segments are
+	// collected into batches that are encrypted on the worker threads and
+	// written in order; the final (padded) segment is written on Finish().
+	class StreamEncryptor
+	{
+	public:
+		StreamEncryptor(
+			RandomNumberGenerator& rng,
+			ConstByteArrayParameter const& passphrase,
+			BufferedTransformation& sink,
+			const EncryptionOptions& options);
+		StreamEncryptor(const StreamEncryptor&) = delete;
+		StreamEncryptor& operator=(const StreamEncryptor&) = delete;
+
+		void Put(const byte* data, size_t size);
+		void Finish();
+
+	private:
+		void PutSegmentData(const byte* data, size_t size);
+		void FlushBatch(size_t segmentCount, bool containsFinalSegment);
+
+		BufferedTransformation& m_sink;
+		// compresses into PutSegmentData(), null without compression
+		std::unique_ptr<BufferedTransformation> m_compressor;
+		std::array<byte, SEGMENTED_HEADER_SIZE> m_header{};
+		SecByteBlock m_key;
+		SecByteBlock m_iv;
+		SecByteBlock m_macKey;
+		SecByteBlock m_batch;
+		SecByteBlock m_tags;
+		size_t m_segmentSize{ 0 };
+		size_t m_batchSegments{ 0 };
+		size_t m_buffered{ 0 };
+		word64 m_segmentIndex{ 0 };
+		unsigned int m_workerCount{ 1 };
+		CipherMode m_cipherMode{ CipherMode::AesCbcHmacSha256 };
+		ProgressMonitor* m_progress{ nullptr };
+		bool m_finished{ false };
+	};
+
+	// streaming decryption of the segmented format:
+	// keys are derived once the header is complete, segments are verified
+	// and decrypted in batches on the worker threads (0 means one per
+	// hardware thread) and every segment is authenticated before its
+	// plaintext is passed on to the sink, through a streaming zlib
+	// decompressor if the header says the plaintext was compressed.
+	// Plaintext of earlier segments may already have reached the sink when a
+	// later segment fails, so callers must discard the output unless Finish()
+	// returns true. progress (optional) reports the KDF; Put() and Finish()
+	// throw OperationCancelled once it has been cancelled.
+	class StreamDecryptor
+	{
+	public:
+		StreamDecryptor(ConstByteArrayParameter const& passphrase, BufferedTransformation& sink, unsigned int workerCount = 0, ProgressMonitor* progress = nullptr);
+		StreamDecryptor(const StreamDecryptor&) = delete;
+		StreamDecryptor& operator=(const StreamDecryptor&) = delete;
+
+		bool Put(const byte* data, size_t size);
+		bool Finish();
+		bool Failed() const { return m_failed; }
+		// the header was valid but the key check did not match the password
+		bool PasswordRejected() const { return m_passwordRejected; }
+		// KDF recorded in the header, valid once the header has been parsed
+		KdfMode GetKdfMode() const { return m_kdfMode; }
+		CipherMode GetCipherMode() const { return m_cipherMode; }
+		const KdfParameters& GetKdfParameters() const { return m_kdfParameters; }
+		Compression GetCompression() const { return m_compression; }
+
+	private:
+		bool ParseHeader();
+		bool OpenBatch(bool containsFinalSegment);
+
+		BufferedTransformation& m_sink;
+		// decompresses into m_sink, null for uncompressed payloads
+		std::unique_ptr<BufferedTransformation> m_decompressor;
+		SecByteBlock m_passphrase;
+		std::array<byte, SEGMENTED_HEADER_SIZE> m_header{};
+		size_t m_headerLength{ 0 };
+		SecByteBlock m_key;
+		SecByteBlock m_iv;
+		SecByteBlock m_macKey;
+		SecByteBlock m_batch;
+		size_t m_segmentSize{ 0 };
+		size_t m_batchSegments{ 0 };
+		size_t m_buffered{ 0 };
+		word64 m_segmentIndex{ 0 };
+		unsigned int m_workerCount{ 1 };
+		KdfMode m_kdfMode{ KdfMode::Scrypt };
+		CipherMode m_cipherMode{ CipherMode::AesCbcHmacSha256 };
+		KdfParameters m_kdfParameters;
+		Compression m_compression{ Compression::None };
+		ProgressMonitor* m_progress{ nullptr };
+		bool m_failed{ false };
+		bool m_passwordRejected{ false };
+		bool m_finished{ false };
+	};
+
+	// incremental saves in the indexed format: keeps the keys and the last
+	// payload it opened or wrote, so the next Update() only encrypts what
+	// changed. Segments that lie within the common prefix and suffix of the
+	// previous and the new plaintext are carried over unchanged; the rest
+	// is cut into segments of at most the segment size and encrypted under
+	// fresh random nonces on the worker threads. The salt, and with it the
+	// key, stays the same for the lifetime of the object.
+	class IncrementalPayload
+	{
+	public:
+		// an empty payload under a fresh salt; runs the KDF. Uses the KDF,
+		// its parameters, the segment size, the worker count, the progress
+		// monitor and the compression of options; the cipher is always AES-GCM.
+		IncrementalPayload(RandomNumberGenerator& rng, ConstByteArrayParameter const& passphrase, const EncryptionOptions& options);
+		// an existing indexed payload: runs the KDF recorded in its header
+		// and checks the key check value and the root tag, but not the
+		// segments (see Decrypt()). Check Failed() before using the object.
+		// With borrowPayload the object reads payload in place until the
+		// first Update() instead of copying it, so payload must stay valid
+		// and unchanged until then (e.g. a mapped resource).
+		IncrementalPayload(ConstByteArrayParameter const& passphrase, ConstByteArrayParameter const& payload, unsigned int workerCount = 0, ProgressMonitor* progress = nullptr, bool borrowPayload = false);
+		IncrementalPayload(const IncrementalPayload&) = delete;
+		IncrementalPayload& operator=(const IncrementalPayload&) = delete;
+
+		bool Failed() const { return m_failed; }
+		// the header was valid but the key check did not match the password
+		bool PasswordRejected() const { return m_passwordRejected; }
+		PayloadInfo GetPayloadInfo() const;
+		std::span<const byte> GetPayload() const { return m_view; }
+		// total plaintext length of the current payload
+		size_t GetPlaintextLength() const;
+		// segments the last Update() carried over and encrypted
+		size_t GetReusedSegments() const { return m_reusedSegments; }
+		size_t GetEncryptedSegments() const { return m_encryptedSegments; }
+
+		// authenticates and decrypts every segment into sink, in batches on
+		// the worker threads. As with StreamDecryptor, discard the output
+		// unless it returns true.
+		bool Decrypt(BufferedTransformation& sink) const;
+		// as Decrypt(), but only for the plaintext bytes [offset, offset +
+		// length), clipped to the end of the plaintext: only the segments
+		// overlapping the range are authenticated and decrypted, so e.g. the
+		// first screen of a note costs the same however long the note is
+		bool DecryptRange(size_t offset, size_t length, BufferedTransformation& sink) const;
+		// replaces the payload with one for plaintext. previous must be the
+		// plaintext of the current payload (empty for a new object); throws
+		// InvalidArgument if its length does not match. Segments of an
+		// adopted payload are cut at DEFAULT_SEGMENT_SIZE.
+		void Update(RandomNumberGenerator& rng, std::span<const byte> previous, std::span<const byte> plaintext);
+
+	private:
+		std::vector<byte> m_payload;
+		// the current payload: m_payload, or the borrowed one
+		std::span<const byte> m_view;
+		SecByteBlock m_key;
+		SecByteBlock m_macKey;
+		KdfMode m_kdfMode{ KdfMode::Scrypt };
+		KdfParameters m_kdfParameters;
+		Compression m_compression{ Compression::None };
+		size_t m_segmentSize{ DEFAULT_SEGMENT_SIZE };
+		unsigned int m_workerCount{ 1 };
+		size_t m_reusedSegments{ 0 };
+		size_t m_encryptedSegments{ 0 };
+		bool m_failed{ false };
+		bool m_passwordRejected{ false };
+	};
+
+private:
+	static DecodingResult DecryptPayload(
+		ConstByteArrayParameter const& passphrase,
+		byte* output,
+		ConstByteArrayParameter const& input,
+		PayloadInfo& payloadInfo,
+		bool inPlace,
+		ProgressMonitor* progress);
 };
 
 NAMESPACE_END
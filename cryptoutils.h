@@ -0,0 +1,818 @@
+// Steganos LockNote - self-modifying encrypted notepad
+// Copyright (C) 2006-2010 Steganos GmbH
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+
+// The crypto half of the Utils helpers: hex-encoded note payloads, calibrated
+// KDF parameters and the diagnostics report. Nothing in here needs Windows, so
+// the Linux benchmark suite and tests can include it without windows.h.
+
+#include "aeslayer.h"
+#include "hexcodec.h"
+#include "securememory.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <span>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cryptopp/filters.h"
+#include "cryptopp/misc.h"
+#include "cryptopp/osrng.h"
+
+namespace Utils
+{
+	using namespace CryptoPP;
+
+	inline AESLayer::KdfMode ParseKdfModeValue(const int value)
+	{
+		if (value == static_cast<int>(AESLayer::KdfMode::Pbkdf2Sha256))
+		{
+			return AESLayer::KdfMode::Pbkdf2Sha256;
+		}
+		if (value == static_cast<int>(AESLayer::KdfMode::Argon2id))
+		{
+			return AESLayer::KdfMode::Argon2id;
+		}
+		return AESLayer::KdfMode::Scrypt;
+	}
+
+	inline bool ConstantTimeEquals(const std::string_view lhs, const std::string_view rhs)
+	{
+		if (lhs.size() != rhs.size())
+		{
+			return false;
+		}
+		return VerifyBufsEqual(
+			reinterpret_cast<const byte*>(lhs.data()),
+			reinterpret_cast<const byte*>(rhs.data()),
+			lhs.size());
+	}
+
+	// KDF cost for new saves, calibrated to AESLayer::DEFAULT_UNLOCK_TARGET_MILLISECONDS
+	// on this machine once per process; the parameters are stored in the payload
+	inline AESLayer::KdfParameters CalibratedKdfParameters(const AESLayer::KdfMode kdfMode)
+	{
+		if (kdfMode == AESLayer::KdfMode::Pbkdf2Sha256)
+		{
+			static const AESLayer::KdfParameters pbkdf2 = AESLayer::CalibrateKdf(AESLayer::KdfMode::Pbkdf2Sha256).m_parameters;
+			return pbkdf2;
+		}
+		if (kdfMode == AESLayer::KdfMode::Argon2id)
+		{
+			static const AESLayer::KdfParameters argon2 = AESLayer::CalibrateKdf(AESLayer::KdfMode::Argon2id).m_parameters;
+			return argon2;
+		}
+		static const AESLayer::KdfParameters scrypt = AESLayer::CalibrateKdf(AESLayer::KdfMode::Scrypt).m_parameters;
+		return scrypt;
+	}
+
+	// CalibratedKdfParameters() of every KDF mode, measured on a worker
+	// thread so a save on the UI thread doesn't run the calibration probes;
+	// Get() only waits if the measurement is still running
+	class KdfCalibrationTask
+	{
+	public:
+		KdfCalibrationTask()
+		{
+			try
+			{
+				m_thread = std::thread([]()
+				{
+					try
+					{
+						for (const AESLayer::KdfMode mode : { AESLayer::KdfMode::Scrypt, AESLayer::KdfMode::Pbkdf2Sha256, AESLayer::KdfMode::Argon2id })
+						{
+							CalibratedKdfParameters(mode);
+						}
+					}
+					catch (const std::exception&)
+					{
+					}
+				});
+			}
+			catch (const std::system_error&)
+			{
+				// Get() calibrates on the calling thread instead
+			}
+		}
+
+		KdfCalibrationTask(const KdfCalibrationTask&) = delete;
+		KdfCalibrationTask& operator=(const KdfCalibrationTask&) = delete;
+
+		~KdfCalibrationTask()
+		{
+			Wait();
+		}
+
+		AESLayer::KdfParameters Get(const AESLayer::KdfMode kdfMode)
+		{
+			Wait();
+			return CalibratedKdfParameters(kdfMode);
+		}
+
+	private:
+		void Wait()
+		{
+			if (m_thread.joinable())
+			{
+				m_thread.join();
+			}
+		}
+
+		std::thread m_thread;
+	};
+
+	// the KDF parameters of a save in kdfMode: calibrated, but never weaker
+	// than those of previous, the payload the note was opened from, if it
+	// used kdfMode too, so re-saving on a slower machine doesn't weaken it
+	inline AESLayer::KdfParameters SaveKdfParameters(
+		const AESLayer::KdfMode kdfMode,
+		const AESLayer::KdfParameters& calibrated,
+		const AESLayer::PayloadInfo& previous)
+	{
+		if (previous.m_kdfMode != kdfMode || !AESLayer::IsValidKdfParameters(kdfMode, previous.m_kdfParameters))
+		{
+			return calibrated;
+		}
+		AESLayer::KdfParameters parameters;
+		parameters.m_cost = (std::max)(calibrated.m_cost, previous.m_kdfParameters.m_cost);
+		parameters.m_blockSize = (std::max)(calibrated.m_blockSize, previous.m_kdfParameters.m_blockSize);
+		parameters.m_parallelism = (std::max)(calibrated.m_parallelism, previous.m_kdfParameters.m_parallelism);
+		// the larger of each field can exceed the memory bound together
+		return AESLayer::IsValidKdfParameters(kdfMode, parameters) ? parameters : previous.m_kdfParameters;
+	}
+
+	// plain-text report for "-diagnostics": the crypto backends in use and a
+	// quick throughput and KDF benchmark, to triage slow unlocks in the field
+	inline std::string CryptoDiagnosticsReport()
+	{
+		const AESLayer::BackendInfo backends = AESLayer::DescribeBackends();
+		const AESLayer::PrimitiveTimings timings = AESLayer::MeasurePrimitives();
+		const auto yesNo = [](const bool value) { return value ? "yes" : "no"; };
+		const AESLayer::KdfParameters scrypt = AESLayer::DefaultKdfParameters(AESLayer::KdfMode::Scrypt);
+		const AESLayer::KdfParameters pbkdf2 = AESLayer::DefaultKdfParameters(AESLayer::KdfMode::Pbkdf2Sha256);
+		const AESLayer::KdfParameters argon2 = AESLayer::DefaultKdfParameters(AESLayer::KdfMode::Argon2id);
+		const SecurePool::Statistics pool = SecurePool::Instance().GetStatistics();
+
+		std::ostringstream report;
+		report << std::fixed << std::setprecision(1)
+			<< "AES provider: " << backends.m_aesProvider << '\n'
+			<< "AES-GCM provider: " << backends.m_gcmProvider << '\n'
+			<< "SHA-256 provider: " << backends.m_sha256Provider << '\n'
+			<< "CPU: AES-NI " << yesNo(backends.m_hasAesNi)
+			<< ", CLMUL " << yesNo(backends.m_hasClmul)
+			<< ", SHA-NI " << yesNo(backends.m_hasSha)
+			<< ", SSSE3 " << yesNo(backends.m_hasSsse3)
+			<< ", AVX2 " << yesNo(backends.m_hasAvx2) << '\n'
+			<< "Hardware threads: " << backends.m_hardwareThreads << '\n'
+			<< "AES-256-CBC: " << timings.m_aesCbcMegabytesPerSecond << " MB/s\n"
+			<< "AES-256-GCM: " << timings.m_aesGcmMegabytesPerSecond << " MB/s\n"
+			<< "HMAC-SHA256: " << timings.m_hmacSha256MegabytesPerSecond << " MB/s\n"
+			<< "scrypt (N=" << scrypt.m_cost << ", r=" << scrypt.m_blockSize << ", p=" << scrypt.m_parallelism << "): "
+			<< timings.m_scryptMilliseconds << " ms\n"
+			<< "PBKDF2-SHA256 (" << pbkdf2.m_cost << " iterations): " << timings.m_pbkdf2Milliseconds << " ms\n"
+			<< "Argon2id (" << argon2.m_cost << " KiB, t=" << argon2.m_blockSize << ", p=" << argon2.m_parallelism << "): "
+			<< timings.m_argon2idMilliseconds << " ms\n"
+			<< "Secure pool: " << pool.m_allocations << " allocations (" << pool.m_reusedBlocks << " reused), "
+			<< pool.m_reservedBytes / 1024 << " KiB reserved, " << pool.m_lockedBytes / 1024 << " KiB locked, "
+			<< pool.m_lockFailures << " lock failures\n";
+		return report.str();
+	}
+
+	inline std::span<const byte> TextBytes(const std::string_view strText)
+	{
+		return std::span<const byte>(reinterpret_cast<const byte*>(strText.data()), strText.size());
+	}
+
+	inline void HexEncodePayload(const std::span<const byte> payload, std::string& strEncryptedData)
+	{
+		strEncryptedData.resize(payload.size() * 2);
+		HexEncode(payload, strEncryptedData.data());
+	}
+
+	// writes the indexed format. session (optional) receives the payload
+	// with its keys, so the next save can go through UpdateEncryptedString()
+	// without running the KDF again. kdfParameters that aren't valid for
+	// kdfMode, such as the all-zero default, mean CalibratedKdfParameters(),
+	// which calibrates on first use.
+	inline bool EncryptString(
+		const std::string_view strText,
+		const std::string_view strPassword,
+		std::string& strEncryptedData,
+		const AESLayer::KdfMode kdfMode = AESLayer::KdfMode::Scrypt,
+		AESLayer::ProgressMonitor* progress = nullptr,
+		std::unique_ptr<AESLayer::IncrementalPayload>* session = nullptr,
+		const AESLayer::KdfParameters& kdfParameters = {})
+	{
+		AutoSeededRandomPool rng;
+		AESLayer::EncryptionOptions options;
+		options.m_kdfMode = kdfMode;
+		options.m_progress = progress;
+		options.m_kdfParameters = AESLayer::IsValidKdfParameters(kdfMode, kdfParameters) ? kdfParameters : CalibratedKdfParameters(kdfMode);
+		// text shrinks several times over, and so does every save of the exe
+		options.m_compression = AESLayer::Compression::Zlib;
+
+		std::unique_ptr<AESLayer::IncrementalPayload> payload = std::make_unique<AESLayer::IncrementalPayload>(rng, strPassword, options);
+		payload->Update(rng, {}, TextBytes(strText));
+		HexEncodePayload(payload->GetPayload(), strEncryptedData);
+		if (session)
+		{
+			*session = std::move(payload);
+		}
+		return true;
+	}
+
+	// EncryptString() without the hex encoding: the payload bytes as they
+	// are stored in the CONTENT/PAYLOAD resource
+	inline bool EncryptPayload(
+		const std::string_view strText,
+		const std::string_view strPassword,
+		std::vector<byte>& encryptedPayload,
+		const AESLayer::KdfMode kdfMode = AESLayer::KdfMode::Scrypt,
+		AESLayer::ProgressMonitor* progress = nullptr,
+		std::unique_ptr<AESLayer::IncrementalPayload>* session = nullptr,
+		const AESLayer::KdfParameters& kdfParameters = {})
+	{
+		AutoSeededRandomPool rng;
+		AESLayer::EncryptionOptions options;
+		options.m_kdfMode = kdfMode;
+		options.m_progress = progress;
+		options.m_kdfParameters = AESLayer::IsValidKdfParameters(kdfMode, kdfParameters) ? kdfParameters : CalibratedKdfParameters(kdfMode);
+		options.m_compression = AESLayer::Compression::Zlib;
+
+		std::unique_ptr<AESLayer::IncrementalPayload> payload = std::make_unique<AESLayer::IncrementalPayload>(rng, strPassword, options);
+		payload->Update(rng, {}, TextBytes(strText));
+		encryptedPayload.assign(payload->GetPayload().begin(), payload->GetPayload().end());
+		if (session)
+		{
+			*session = std::move(payload);
+		}
+		return true;
+	}
+
+	// saves strText into the payload of the last EncryptString() or
+	// DecryptString() call, keeping its password and KDF: only the segments
+	// around the edit are compressed and encrypted again. strPreviousText
+	// must be the text of that call.
+	inline bool UpdateEncryptedString(
+		AESLayer::IncrementalPayload& session,
+		const std::string_view strPreviousText,
+		const std::string_view strText,
+		std::string& strEncryptedData)
+	{
+		AutoSeededRandomPool rng;
+		session.Update(rng, TextBytes(strPreviousText), TextBytes(strText));
+		HexEncodePayload(session.GetPayload(), strEncryptedData);
+		return true;
+	}
+
+	// UpdateEncryptedString() without the hex encoding
+	inline bool UpdateEncryptedPayload(
+		AESLayer::IncrementalPayload& session,
+		const std::string_view strPreviousText,
+		const std::string_view strText,
+		std::vector<byte>& encryptedPayload)
+	{
+		AutoSeededRandomPool rng;
+		session.Update(rng, TextBytes(strPreviousText), TextBytes(strText));
+		encryptedPayload.assign(session.GetPayload().begin(), session.GetPayload().end());
+		return true;
+	}
+
+	// The CONTENT/PAYLOAD resource holds the payload bytes. Older versions
+	// stored them as NUL-terminated hex text, which starts with a hex digit
+	// where a stored payload starts with its "LN2" format magic.
+	inline bool IsBinaryPayload(const std::span<const byte> payload)
+	{
+		return AESLayer::IsIndexedPayload(payload.data(), payload.size()) ||
+			AESLayer::IsSegmentedPayload(payload.data(), payload.size());
+	}
+
+	// a segmented payload through StreamDecryptor; feed puts the payload
+	// bytes into the decryptor and returns false once it rejects them
+	inline bool DecryptSegmented(
+		const std::string_view strPassword,
+		SecureString& strText,
+		AESLayer::PayloadInfo* payloadInfo,
+		AESLayer::ProgressMonitor* progress,
+		const size_t payloadLength,
+		const std::function<bool(AESLayer::StreamDecryptor&)>& feed)
+	{
+		strText.reserve(payloadLength);
+		StringSinkTemplate<SecureString> sink(strText);
+		AESLayer::StreamDecryptor decryptor(strPassword, sink, 0, progress);
+		if (!feed(decryptor) || !decryptor.Finish())
+		{
+			SecureWipeBuffer(strText.data(), strText.size());
+			strText.clear();
+			return false;
+		}
+		if (payloadInfo)
+		{
+			*payloadInfo = { AESLayer::PayloadFormat::Segmented, decryptor.GetKdfMode(), decryptor.GetCipherMode(), decryptor.GetKdfParameters(), decryptor.GetCompression() };
+		}
+		return true;
+	}
+
+	inline bool DecryptSegmentedString(
+		const std::string_view strEncryptedData,
+		const std::string_view strPassword,
+		SecureString& strText,
+		AESLayer::PayloadInfo* payloadInfo = nullptr,
+		AESLayer::ProgressMonitor* progress = nullptr)
+	{
+		return DecryptSegmented(strPassword, strText, payloadInfo, progress, strEncryptedData.size() / 2, [strEncryptedData](AESLayer::StreamDecryptor& decryptor)
+		{
+			constexpr size_t kHexChunkSize = 0x20000;
+			std::vector<byte> chunk(kHexChunkSize / 2, 0);
+			bool bResult = true;
+			for (size_t offset = 0; bResult && offset < strEncryptedData.size(); offset += kHexChunkSize)
+			{
+				const size_t hexLength = (std::min)(kHexChunkSize, strEncryptedData.size() - offset);
+				bResult = HexDecode(strEncryptedData.substr(offset, hexLength), chunk.data())
+					&& decryptor.Put(chunk.data(), hexLength / 2);
+			}
+			return bResult;
+		});
+	}
+
+	// how much of a long note DecryptString() hands to onFirstScreen, well
+	// over a screenful of text in any font
+	constexpr size_t FIRST_SCREEN_BYTES = 0x10000;
+
+	// length of the longest prefix of text that does not end inside a UTF-8
+	// sequence
+	inline size_t CompleteUtf8Length(const std::string_view text)
+	{
+		size_t lead = text.size();
+		while (lead > 0 && text.size() - lead < 4 && (static_cast<byte>(text[lead - 1]) & 0xC0) == 0x80)
+		{
+			--lead;
+		}
+		if (lead == 0)
+		{
+			return text.size();
+		}
+		const byte first = static_cast<byte>(text[lead - 1]);
+		const size_t sequenceLength = first < 0x80 ? 1 : first >= 0xF0 ? 4 : first >= 0xE0 ? 3 : first >= 0xC0 ? 2 : 1;
+		return text.size() - (lead - 1) >= sequenceLength ? text.size() : lead - 1;
+	}
+
+	inline bool DecryptIndexedPayload(
+		const std::span<const byte> encryptedPayload,
+		const std::string_view strPassword,
+		SecureString& strText,
+		AESLayer::PayloadInfo* payloadInfo,
+		AESLayer::ProgressMonitor* progress,
+		std::unique_ptr<AESLayer::IncrementalPayload>* session,
+		const std::function<void(std::string_view)>& onFirstScreen,
+		const bool borrowPayload = false)
+	{
+		const ConstByteArrayParameter input(encryptedPayload.data(), encryptedPayload.size());
+		std::unique_ptr<AESLayer::IncrementalPayload> payload = std::make_unique<AESLayer::IncrementalPayload>(strPassword, input, 0, progress, borrowPayload);
+		if (payload->Failed())
+		{
+			return false;
+		}
+		if (payloadInfo)
+		{
+			*payloadInfo = payload->GetPayloadInfo();
+		}
+
+		// the one allocation for the plaintext; the first screen is decrypted
+		// into it and the rest appended, so only a segment straddling the
+		// end of the first screen is opened twice
+		const size_t plainTextLength = payload->GetPlaintextLength();
+		strText.reserve(plainTextLength);
+		StringSinkTemplate<SecureString> sink(strText);
+		const bool firstScreen = onFirstScreen && plainTextLength > FIRST_SCREEN_BYTES;
+		if (firstScreen)
+		{
+			if (!payload->DecryptRange(0, FIRST_SCREEN_BYTES, sink))
+			{
+				SecureWipeBuffer(strText.data(), strText.size());
+				strText.clear();
+				return false;
+			}
+			onFirstScreen(std::string_view(strText).substr(0, CompleteUtf8Length(strText)));
+		}
+
+		if (!(firstScreen ? payload->DecryptRange(FIRST_SCREEN_BYTES, plainTextLength - FIRST_SCREEN_BYTES, sink) : payload->Decrypt(sink)))
+		{
+			SecureWipeBuffer(strText.data(), strText.size());
+			strText.clear();
+			return false;
+		}
+		if (session)
+		{
+			*session = std::move(payload);
+		}
+		return true;
+	}
+
+	inline bool DecryptIndexedString(
+		const std::string_view strEncryptedData,
+		const std::string_view strPassword,
+		SecureString& strText,
+		AESLayer::PayloadInfo* payloadInfo,
+		AESLayer::ProgressMonitor* progress,
+		std::unique_ptr<AESLayer::IncrementalPayload>* session,
+		const std::function<void(std::string_view)>& onFirstScreen)
+	{
+		std::vector<byte> buffer(strEncryptedData.size() / 2);
+		if (!HexDecode(strEncryptedData, buffer.data()))
+		{
+			return false;
+		}
+		return DecryptIndexedPayload(buffer, strPassword, strText, payloadInfo, progress, session, onFirstScreen);
+	}
+
+	// payloadInfo (optional) receives the format and KDF the payload was written with;
+	// a cancelled progress monitor makes the call return false. For indexed
+	// payloads session (optional) receives the payload for UpdateEncryptedString(),
+	// and if the note is longer than FIRST_SCREEN_BYTES, onFirstScreen (optional)
+	// gets its beginning right after the KDF, before the rest is decrypted.
+	inline bool DecryptString(
+		const std::string_view strEncryptedData,
+		const std::string_view strPassword,
+		SecureString& strText,
+		AESLayer::PayloadInfo* payloadInfo = nullptr,
+		AESLayer::ProgressMonitor* progress = nullptr,
+		std::unique_ptr<AESLayer::IncrementalPayload>* session = nullptr,
+		const std::function<void(std::string_view)>& onFirstScreen = {})
+	{
+		strText.clear();
+		if ((strEncryptedData.size() % 2) != 0)
+		{
+			return false;
+		}
+
+		try
+		{
+			std::array<byte, 4> magic{};
+			if (strEncryptedData.size() >= magic.size() * 2 && HexDecode(strEncryptedData.substr(0, magic.size() * 2), magic.data()))
+			{
+				if (AESLayer::IsSegmentedPayload(magic.data(), magic.size()))
+				{
+					return DecryptSegmentedString(strEncryptedData, strPassword, strText, payloadInfo, progress);
+				}
+				if (AESLayer::IsIndexedPayload(magic.data(), magic.size()))
+				{
+					return DecryptIndexedString(strEncryptedData, strPassword, strText, payloadInfo, progress, session, onFirstScreen);
+				}
+			}
+
+			// decrypted in place, so the only plaintext copies are this
+			// buffer and strText
+			SecureByteVector buffer(strEncryptedData.size() / 2);
+			if (!HexDecode(strEncryptedData, buffer.data()))
+			{
+				return false;
+			}
+
+			AESLayer::PayloadInfo info;
+			const DecodingResult result = AESLayer::DecryptInPlace(strPassword, std::span<byte>(buffer), info, progress);
+			if (!result.isValidCoding)
+			{
+				return false;
+			}
+			if (payloadInfo)
+			{
+				*payloadInfo = info;
+			}
+
+			strText.assign(reinterpret_cast<const char*>(buffer.data()), result.messageLength);
+			return true;
+		}
+		catch (const Exception&)
+		{
+			// cancelled part-way through a segmented payload
+			SecureWipeBuffer(strText.data(), strText.size());
+			strText.clear();
+			return false;
+		}
+	}
+
+	// DecryptString() for the contents of the payload resource: the payload
+	// bytes, or the hex text of older versions up to its terminating NUL.
+	// Binary payloads are decrypted straight out of encryptedPayload into
+	// strText; with borrowPayload an indexed session reads it in place too
+	// (see AESLayer::IncrementalPayload), so it must outlive the session.
+	inline bool DecryptPayload(
+		const std::span<const byte> encryptedPayload,
+		const std::string_view strPassword,
+		SecureString& strText,
+		AESLayer::PayloadInfo* payloadInfo = nullptr,
+		AESLayer::ProgressMonitor* progress = nullptr,
+		std::unique_ptr<AESLayer::IncrementalPayload>* session = nullptr,
+		const std::function<void(std::string_view)>& onFirstScreen = {},
+		const bool borrowPayload = false)
+	{
+		if (!IsBinaryPayload(encryptedPayload))
+		{
+			const std::string_view hex(reinterpret_cast<const char*>(encryptedPayload.data()), encryptedPayload.size());
+			return DecryptString(hex.substr(0, hex.find('\0')), strPassword, strText, payloadInfo, progress, session, onFirstScreen);
+		}
+
+		strText.clear();
+		try
+		{
+			if (AESLayer::IsIndexedPayload(encryptedPayload.data(), encryptedPayload.size()))
+			{
+				return DecryptIndexedPayload(encryptedPayload, strPassword, strText, payloadInfo, progress, session, onFirstScreen, borrowPayload);
+			}
+			return DecryptSegmented(strPassword, strText, payloadInfo, progress, encryptedPayload.size(), [encryptedPayload](AESLayer::StreamDecryptor& decryptor)
+			{
+				return decryptor.Put(encryptedPayload.data(), encryptedPayload.size());
+			});
+		}
+		catch (const Exception&)
+		{
+			SecureWipeBuffer(strText.data(), strText.size());
+			strText.clear();
+			return false;
+		}
+	}
+
+	// DecryptString() for many notes saved with the same password: notes
+	// that share a salt and KDF parameters share one derivation (see
+	// AESLayer::DecryptBatch()). strTexts[i] is only meaningful where
+	// decrypted[i] is true; returns the number of notes decrypted.
+	inline size_t DecryptStrings(
+		const std::vector<std::string>& encryptedData,
+		const std::string_view strPassword,
+		std::vector<SecureString>& strTexts,
+		std::vector<bool>& decrypted,
+		AESLayer::ProgressMonitor* progress = nullptr)
+	{
+		strTexts.assign(encryptedData.size(), SecureString());
+		decrypted.assign(encryptedData.size(), false);
+
+		std::vector<SecureByteVector> buffers(encryptedData.size());
+		std::vector<std::unique_ptr<StringSinkTemplate<SecureString>>> sinks(encryptedData.size());
+		std::vector<AESLayer::BatchEntry> entries(encryptedData.size());
+		for (size_t i = 0; i < encryptedData.size(); ++i)
+		{
+			// invalid hex is left empty and fails like a truncated payload
+			buffers[i].resize(encryptedData[i].size() / 2);
+			if (!HexDecode(encryptedData[i], buffers[i].data()))
+			{
+				buffers[i].clear();
+			}
+			entries[i].m_buffer = std::span<byte>(buffers[i]);
+			// compressed notes are inflated straight into their text
+			sinks[i] = std::make_unique<StringSinkTemplate<SecureString>>(strTexts[i]);
+			entries[i].m_sink = sinks[i].get();
+		}
+
+		try
+		{
+			AESLayer::DecryptBatch(strPassword, entries, 0, progress);
+		}
+		catch (const Exception&)
+		{
+			// cancelled; the buffers and texts are wiped when they are freed
+			strTexts.assign(encryptedData.size(), SecureString());
+			return 0;
+		}
+
+		size_t count = 0;
+		for (size_t i = 0; i < entries.size(); ++i)
+		{
+			if (entries[i].m_result.isValidCoding)
+			{
+				decrypted[i] = true;
+				++count;
+			}
+			else
+			{
+				// a payload that failed part-way may have left some of its text
+				SecureWipeBuffer(strTexts[i].data(), strTexts[i].size());
+				strTexts[i].clear();
+			}
+		}
+		return count;
+	}
+
+	// DecryptString()/EncryptString() on a worker thread, so the caller's
+	// UI stays responsive during the KDF. Progress can be polled or passed
+	// to a callback, which runs on the deriving threads. Cancel() stops the
+	// KDF or the segment loop at its next progress report; the destructor
+	// cancels and waits for the thread.
+	class AsyncCryptoTask
+	{
+	public:
+		enum class Status
+		{
+			Running,
+			Succeeded,
+			Failed,
+			Cancelled
+		};
+
+		// encryptedPayload as DecryptPayload() takes it: the payload bytes or
+		// hex text. It is read in place, not copied, so it must stay valid
+		// and unchanged until the task and the session it hands out are
+		// gone, as the payload resource of the running executable does.
+		static std::unique_ptr<AsyncCryptoTask> StartDecrypt(
+			const std::span<const byte> encryptedPayload,
+			const std::string_view strPassword,
+			AESLayer::ProgressMonitor::Callback callback = {})
+		{
+			std::unique_ptr<AsyncCryptoTask> task(new AsyncCryptoTask(std::string(), SecureString(strPassword), std::move(callback)));
+			task->StartDecryption(encryptedPayload, true);
+			return task;
+		}
+
+		// as above, but on a copy of strEncryptedData
+		static std::unique_ptr<AsyncCryptoTask> StartDecrypt(
+			const std::string& strEncryptedData,
+			const std::string_view strPassword,
+			AESLayer::ProgressMonitor::Callback callback = {})
+		{
+			std::unique_ptr<AsyncCryptoTask> task(new AsyncCryptoTask(strEncryptedData, SecureString(strPassword), std::move(callback)));
+			task->StartDecryption(TextBytes(task->m_payload), false);
+			return task;
+		}
+
+		// the result is taken with TakePayload()
+		static std::unique_ptr<AsyncCryptoTask> StartEncrypt(
+			const std::string_view strText,
+			const std::string_view strPassword,
+			const AESLayer::KdfMode kdfMode,
+			AESLayer::ProgressMonitor::Callback callback = {})
+		{
+			std::unique_ptr<AsyncCryptoTask> task(new AsyncCryptoTask(std::string(), SecureString(strPassword), std::move(callback)));
+			task->m_text.assign(strText);
+			task->Start([task = task.get(), kdfMode]()
+			{
+				return EncryptString(task->m_text, task->m_password, task->m_payload, kdfMode, &task->m_progress, &task->m_session);
+			});
+			return task;
+		}
+
+		AsyncCryptoTask(const AsyncCryptoTask&) = delete;
+		AsyncCryptoTask& operator=(const AsyncCryptoTask&) = delete;
+
+		~AsyncCryptoTask()
+		{
+			Cancel();
+			Wait();
+		}
+
+		void Cancel()
+		{
+			m_progress.Cancel();
+		}
+
+		Status GetStatus() const
+		{
+			return m_status;
+		}
+
+		// 0.0 to 1.0, see AESLayer::ProgressMonitor::GetFraction()
+		double GetProgress() const
+		{
+			return m_status == Status::Succeeded ? 1.0 : m_progress.GetFraction();
+		}
+
+		Status Wait()
+		{
+			if (m_thread.joinable())
+			{
+				m_thread.join();
+			}
+			return m_status;
+		}
+
+		// the decrypted plaintext, once the status is Succeeded
+		SecureString TakeText()
+		{
+			Wait();
+			return std::move(m_text);
+		}
+
+		// as TakeText(), but leaves the text for a later TakeText()
+		const SecureString& GetText()
+		{
+			Wait();
+			return m_text;
+		}
+
+		// decryption of an indexed note longer than FIRST_SCREEN_BYTES: true
+		// once its beginning is decrypted while the rest still is. The first
+		// screen and GetPayloadInfo() may be read from then on.
+		bool HasFirstScreen() const
+		{
+			return m_firstScreenReady.load(std::memory_order_acquire);
+		}
+
+		SecureString TakeFirstScreen()
+		{
+			return HasFirstScreen() ? std::move(m_firstScreen) : SecureString();
+		}
+
+		// the encrypted payload, once the status is Succeeded
+		std::string TakePayload()
+		{
+			Wait();
+			return std::move(m_payload);
+		}
+
+		const AESLayer::PayloadInfo& GetPayloadInfo() const
+		{
+			return m_payloadInfo;
+		}
+
+		// the indexed payload behind a successful encryption or decryption,
+		// for UpdateEncryptedString(); null for other formats
+		std::unique_ptr<AESLayer::IncrementalPayload> TakeIncrementalPayload()
+		{
+			Wait();
+			return std::move(m_session);
+		}
+
+	private:
+		AsyncCryptoTask(std::string payload, SecureString password, AESLayer::ProgressMonitor::Callback callback)
+			: m_payload(std::move(payload))
+			, m_password(std::move(password))
+			, m_progress(std::move(callback))
+		{
+		}
+
+		void StartDecryption(const std::span<const byte> encryptedPayload, const bool borrowPayload)
+		{
+			Start([this, encryptedPayload, borrowPayload]()
+			{
+				const auto onFirstScreen = [this](const std::string_view firstScreen)
+				{
+					m_firstScreen.assign(firstScreen);
+					m_firstScreenReady.store(true, std::memory_order_release);
+				};
+				return DecryptPayload(encryptedPayload, m_password, m_text, &m_payloadInfo, &m_progress, &m_session, onFirstScreen, borrowPayload);
+			});
+		}
+
+		void Start(std::function<bool()> work)
+		{
+			m_thread = std::thread([this, work = std::move(work)]()
+			{
+				bool succeeded = false;
+				try
+				{
+					succeeded = work();
+				}
+				catch (const std::exception&)
+				{
+				}
+				SecureWipeBuffer(m_password.data(), m_password.size());
+				if (m_progress.IsCancelled() && !succeeded)
+				{
+					m_status = Status::Cancelled;
+				}
+				else
+				{
+					m_status = succeeded ? Status::Succeeded : Status::Failed;
+				}
+			});
+		}
+
+		// the copied input of a decryption from a string, the hex-encoded
+		// result of an encryption
+		std::string m_payload;
+		SecureString m_password;
+		SecureString m_text;
+		AESLayer::PayloadInfo m_payloadInfo;
+		std::unique_ptr<AESLayer::IncrementalPayload> m_session;
+		SecureString m_firstScreen;
+		std::atomic<bool> m_firstScreenReady{ false };
+		AESLayer::ProgressMonitor m_progress;
+		std::atomic<Status> m_status{ Status::Running };
+		std::thread m_thread;
+	};
+}
@@ -0,0 +1,277 @@
+// Steganos LockNote - self-modifying encrypted notepad
+// Copyright (C) 2006-2010 Steganos GmbH
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+
+// Hex encoding and decoding of note payloads without a Crypto++ filter
+// pipeline: one call per buffer, 16 (SSSE3) or 32 (AVX2) bytes per step
+// where the CPU has them and a table lookup otherwise. Writes upper-case
+// hex like HexEncoder; reads either case but, unlike HexDecoder, rejects
+// any other character instead of skipping it.
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <span>
+#include <string_view>
+
+#include "cryptopp/config.h"
+#include "cryptopp/cpu.h"
+
+#if (CRYPTOPP_BOOL_X86 || CRYPTOPP_BOOL_X32 || CRYPTOPP_BOOL_X64)
+#include <immintrin.h>
+#define HEXCODEC_X86 1
+#if defined(__GNUC__) || defined(__clang__)
+#define HEXCODEC_TARGET(features) __attribute__((target(features)))
+#else
+#define HEXCODEC_TARGET(features)
+#endif
+#endif
+
+namespace Utils
+{
+	enum class HexCodecPath
+	{
+		Scalar,
+		Ssse3,
+		Avx2
+	};
+
+	inline const char* HexCodecPathName(const HexCodecPath path)
+	{
+		return path == HexCodecPath::Avx2 ? "avx2" : path == HexCodecPath::Ssse3 ? "ssse3" : "scalar";
+	}
+
+	// the fastest path this CPU supports, determined once
+	inline HexCodecPath BestHexCodecPath()
+	{
+#ifdef HEXCODEC_X86
+		static const HexCodecPath path = CryptoPP::HasAVX2() ? HexCodecPath::Avx2 : CryptoPP::HasSSSE3() ? HexCodecPath::Ssse3 : HexCodecPath::Scalar;
+		return path;
+#else
+		return HexCodecPath::Scalar;
+#endif
+	}
+
+	namespace HexCodec
+	{
+		constexpr std::array<char, 16> kDigits{ '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
+		constexpr unsigned char kInvalid = 0xFF;
+
+		constexpr std::array<unsigned char, 256> MakeNibbleTable()
+		{
+			std::array<unsigned char, 256> table{};
+			for (size_t i = 0; i < table.size(); ++i)
+			{
+				table[i] = kInvalid;
+			}
+			for (unsigned char i = 0; i < 10; ++i)
+			{
+				table['0' + i] = i;
+			}
+			for (unsigned char i = 0; i < 6; ++i)
+			{
+				table['A' + i] = static_cast<unsigned char>(10 + i);
+				table['a' + i] = static_cast<unsigned char>(10 + i);
+			}
+			return table;
+		}
+
+		inline constexpr std::array<unsigned char, 256> kNibbles = MakeNibbleTable();
+
+		inline void EncodeScalar(const unsigned char* input, const size_t size, char* output)
+		{
+			for (size_t i = 0; i < size; ++i)
+			{
+				output[2 * i] = kDigits[input[i] >> 4];
+				output[2 * i + 1] = kDigits[input[i] & 0x0F];
+			}
+		}
+
+		inline bool DecodeScalar(const char* hex, const size_t size, unsigned char* output)
+		{
+			unsigned char invalid = 0;
+			for (size_t i = 0; i < size / 2; ++i)
+			{
+				const unsigned char high = kNibbles[static_cast<unsigned char>(hex[2 * i])];
+				const unsigned char low = kNibbles[static_cast<unsigned char>(hex[2 * i + 1])];
+				invalid |= high | low;
+				output[i] = static_cast<unsigned char>((high << 4) | (low & 0x0F));
+			}
+			// kInvalid is the only table value with the top bit set
+			return (invalid & 0x80) == 0;
+		}
+
+#ifdef HEXCODEC_X86
+		// 16 bytes into 32 characters: each nibble indexes the digit table
+		// with pshufb, then the high and low digits are interleaved
+		HEXCODEC_TARGET("ssse3")
+		inline size_t EncodeSsse3(const unsigned char* input, const size_t size, char* output)
+		{
+			const __m128i digits = _mm_loadu_si128(reinterpret_cast<const __m128i*>(kDigits.data()));
+			const __m128i mask = _mm_set1_epi8(0x0F);
+			size_t i = 0;
+			for (; i + 16 <= size; i += 16)
+			{
+				const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+				const __m128i high = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(bytes, 4), mask));
+				const __m128i low = _mm_shuffle_epi8(digits, _mm_and_si128(bytes, mask));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(output + 2 * i), _mm_unpacklo_epi8(high, low));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(output + 2 * i + 16), _mm_unpackhi_epi8(high, low));
+			}
+			return i;
+		}
+
+		// 16 characters into nibble values; valid has a set byte for every
+		// character in [0-9A-Fa-f]. Letters are folded to lower case, which
+		// only maps 'A'-'F' onto 'a'-'f'; digits are checked unfolded, and
+		// the signed compares reject bytes from 0x80 up.
+		HEXCODEC_TARGET("ssse3")
+		inline __m128i NibblesSsse3(const __m128i characters, __m128i& valid)
+		{
+			const __m128i folded = _mm_or_si128(characters, _mm_set1_epi8(0x20));
+			const __m128i isDigit = _mm_and_si128(_mm_cmpgt_epi8(characters, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(characters, _mm_set1_epi8('9' + 1)));
+			const __m128i isLetter = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(folded, _mm_set1_epi8('f' + 1)));
+			valid = _mm_or_si128(isDigit, isLetter);
+			return _mm_or_si128(
+				_mm_and_si128(isDigit, _mm_sub_epi8(characters, _mm_set1_epi8('0'))),
+				_mm_and_si128(isLetter, _mm_sub_epi8(folded, _mm_set1_epi8('a' - 10))));
+		}
+
+		// 32 characters into 16 bytes: pmaddubsw combines each pair of
+		// nibbles into high * 16 + low
+		HEXCODEC_TARGET("ssse3")
+		inline size_t DecodeSsse3(const char* hex, const size_t size, unsigned char* output, bool& valid)
+		{
+			const __m128i weights = _mm_set1_epi16(0x0110);
+			__m128i allValid = _mm_set1_epi8(-1);
+			size_t i = 0;
+			for (; i + 32 <= size; i += 32)
+			{
+				__m128i validFirst;
+				__m128i validSecond;
+				const __m128i first = NibblesSsse3(_mm_loadu_si128(reinterpret_cast<const __m128i*>(hex + i)), validFirst);
+				const __m128i second = NibblesSsse3(_mm_loadu_si128(reinterpret_cast<const __m128i*>(hex + i + 16)), validSecond);
+				allValid = _mm_and_si128(allValid, _mm_and_si128(validFirst, validSecond));
+				const __m128i bytes = _mm_packus_epi16(_mm_maddubs_epi16(first, weights), _mm_maddubs_epi16(second, weights));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(output + i / 2), bytes);
+			}
+			valid = _mm_movemask_epi8(allValid) == 0xFFFF;
+			return i;
+		}
+
+		// as EncodeSsse3() on 32 bytes; unpacking works within each 128-bit
+		// lane, so the lanes are put back in order before storing
+		HEXCODEC_TARGET("avx2")
+		inline size_t EncodeAvx2(const unsigned char* input, const size_t size, char* output)
+		{
+			const __m256i digits = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(kDigits.data())));
+			const __m256i mask = _mm256_set1_epi8(0x0F);
+			size_t i = 0;
+			for (; i + 32 <= size; i += 32)
+			{
+				const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i));
+				const __m256i high = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), mask));
+				const __m256i low = _mm256_shuffle_epi8(digits, _mm256_and_si256(bytes, mask));
+				const __m256i first = _mm256_unpacklo_epi8(high, low);
+				const __m256i second = _mm256_unpackhi_epi8(high, low);
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(output + 2 * i), _mm256_permute2x128_si256(first, second, 0x20));
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(output + 2 * i + 32), _mm256_permute2x128_si256(first, second, 0x31));
+			}
+			return i;
+		}
+
+		HEXCODEC_TARGET("avx2")
+		inline __m256i NibblesAvx2(const __m256i characters, __m256i& valid)
+		{
+			const __m256i folded = _mm256_or_si256(characters, _mm256_set1_epi8(0x20));
+			const __m256i isDigit = _mm256_and_si256(_mm256_cmpgt_epi8(characters, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), characters));
+			const __m256i isLetter = _mm256_and_si256(_mm256_cmpgt_epi8(folded, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), folded));
+			valid = _mm256_or_si256(isDigit, isLetter);
+			return _mm256_or_si256(
+				_mm256_and_si256(isDigit, _mm256_sub_epi8(characters, _mm256_set1_epi8('0'))),
+				_mm256_and_si256(isLetter, _mm256_sub_epi8(folded, _mm256_set1_epi8('a' - 10))));
+		}
+
+		// as DecodeSsse3() on 64 characters; packing works within each
+		// 128-bit lane, so the 64-bit quarters are reordered before storing
+		HEXCODEC_TARGET("avx2")
+		inline size_t DecodeAvx2(const char* hex, const size_t size, unsigned char* output, bool& valid)
+		{
+			const __m256i weights = _mm256_set1_epi16(0x0110);
+			__m256i allValid = _mm256_set1_epi8(-1);
+			size_t i = 0;
+			for (; i + 64 <= size; i += 64)
+			{
+				__m256i validFirst;
+				__m256i validSecond;
+				const __m256i first = NibblesAvx2(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(hex + i)), validFirst);
+				const __m256i second = NibblesAvx2(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(hex + i + 32)), validSecond);
+				allValid = _mm256_and_si256(allValid, _mm256_and_si256(validFirst, validSecond));
+				const __m256i bytes = _mm256_packus_epi16(_mm256_maddubs_epi16(first, weights), _mm256_maddubs_epi16(second, weights));
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i / 2), _mm256_permute4x64_epi64(bytes, 0xD8));
+			}
+			valid = _mm256_movemask_epi8(allValid) == -1;
+			return i;
+		}
+#endif
+	}
+
+	// writes 2 * input.size() upper-case hex digits to output. path is
+	// lowered to what the CPU supports.
+	inline void HexEncode(const std::span<const unsigned char> input, char* output, HexCodecPath path = BestHexCodecPath())
+	{
+		path = (std::min)(path, BestHexCodecPath());
+		size_t done = 0;
+#ifdef HEXCODEC_X86
+		if (path == HexCodecPath::Avx2)
+		{
+			done = HexCodec::EncodeAvx2(input.data(), input.size(), output);
+		}
+		if (path >= HexCodecPath::Ssse3)
+		{
+			done += HexCodec::EncodeSsse3(input.data() + done, input.size() - done, output + 2 * done);
+		}
+#endif
+		HexCodec::EncodeScalar(input.data() + done, input.size() - done, output + 2 * done);
+	}
+
+	// writes hex.size() / 2 bytes to output; false (with output partly
+	// written) if hex has an odd length or any character outside [0-9A-Fa-f]
+	inline bool HexDecode(const std::string_view hex, unsigned char* output, HexCodecPath path = BestHexCodecPath())
+	{
+		if ((hex.size() % 2) != 0)
+		{
+			return false;
+		}
+
+		path = (std::min)(path, BestHexCodecPath());
+		size_t done = 0;
+		bool valid = true;
+#ifdef HEXCODEC_X86
+		if (path == HexCodecPath::Avx2)
+		{
+			done = HexCodec::DecodeAvx2(hex.data(), hex.size(), output, valid);
+		}
+		if (valid && path >= HexCodecPath::Ssse3)
+		{
+			done += HexCodec::DecodeSsse3(hex.data() + done, hex.size() - done, output + done / 2, valid);
+		}
+#endif
+		return valid && HexCodec::DecodeScalar(hex.data() + done, hex.size() - done, output + done / 2);
+	}
+}
@@ -85,16 +85,69 @@ namespace
 		return !::PathFileExists(target);
 	}
 
-	bool StageWritebackFromMainFrame(const CMainFrame& wndMain, std::string password)
+	// "-diagnostics": written to the console locknote was started from (or
+	// the file its output is redirected to), otherwise shown in a message box
+	int ShowCryptoDiagnostics()
 	{
-		std::string encryptedData;
-		if (!wndMain.m_text.empty())
+		const std::string report = Utils::CryptoDiagnosticsReport();
+		const std::wstring wideReport = utf8_to_wstring(report);
+		if (::AttachConsole(ATTACH_PARENT_PROCESS))
 		{
-			Utils::EncryptString(
+			DWORD written = 0;
+			bool printed = false;
+			const HANDLE output = ::GetStdHandle(STD_OUTPUT_HANDLE);
+			if (output != nullptr && output != INVALID_HANDLE_VALUE)
+			{
+				// a console handle takes UTF-16, a redirected file or pipe UTF-8
+				printed = ::WriteConsoleW(output, wideReport.c_str(), static_cast<DWORD>(wideReport.size()), &written, nullptr) ||
+					::WriteFile(output, report.data(), static_cast<DWORD>(report.size()), &written, nullptr);
+			}
+			if (!printed)
+			{
+				const HANDLE console = ::CreateFileW(L"CONOUT$", GENERIC_WRITE, FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+				if (console != INVALID_HANDLE_VALUE)
+				{
+					printed = ::WriteConsoleW(console, wideReport.c_str(), static_cast<DWORD>(wideReport.size()), &written, nullptr) != FALSE;
+					::CloseHandle(console);
+				}
+			}
+			::FreeConsole();
+			if (printed)
+			{
+				return 0;
+			}
+		}
+
+		Utils::MessageBox(nullptr, wideReport, MB_OK | MB_ICONINFORMATION);
+		return 0;
+	}
+
+	// session is the payload the note was unlocked from (null for new or
+	// older notes) and previousText its text; while the password and the KDF
+	// stay the same only the edited segments are encrypted again
+	bool StageWritebackFromMainFrame(
+		const CMainFrame& wndMain,
+		const SecureString& password,
+		const bool passwordChanged,
+		AESLayer::IncrementalPayload* session,
+		const SecureString& previousText)
+	{
+		std::vector<unsigned char> encryptedData;
+		const AESLayer::KdfMode kdfMode = Utils::ParseKdfModeValue(wndMain.GetKdfMode());
+		if (!wndMain.m_text.empty() && session != nullptr && !passwordChanged && session->GetPayloadInfo().m_kdfMode == kdfMode)
+		{
+			Utils::UpdateEncryptedPayload(*session, previousText, wndMain.m_text, encryptedData);
+		}
+		else if (!wndMain.m_text.empty())
+		{
+			Utils::EncryptPayload(
 				wndMain.m_text,
 				password,
 				encryptedData,
-				Utils::ParseKdfModeValue(wndMain.GetKdfMode()));
+				kdfMode,
+				nullptr,
+				nullptr,
+				wndMain.GetSaveKdfParameters());
 		}
 		else
 		{
@@ -135,7 +188,9 @@ namespace
 			return false;
 		}
 
-		bool writeResult = Utils::UpdateResource(fileNameUtf8, "CONTENT", "PAYLOAD", encryptedData);
+		// the payload and the traits in one rewrite of the copy
+		Utils::ResourceBatch batch(fileNameUtf8);
+		batch.Add("CONTENT", "PAYLOAD", std::move(encryptedData));
 
 		LOCKNOTEWINTRAITS traits{};
 		traits.m_nWindowSizeX = wndMain.m_nWindowSizeX;
@@ -145,9 +200,9 @@ namespace
 		traits.m_nKdfMode = wndMain.GetKdfMode();
 		traits.m_nThemeMode = wndMain.GetThemeMode();
 		traits.m_strFontName = wndMain.m_strFontName;
-		writeResult &= Utils::WriteWinTraitsResources(fileNameUtf8, traits);
+		Utils::AddWinTraitsResources(batch, traits);
 
-		if (!writeResult)
+		if (!batch.Commit())
 		{
 			::DeleteFileW(fileName.data());
 			return false;
@@ -216,6 +271,18 @@ int Run(LPTSTR /*lpstrCmdLine*/ = NULL, int nCmdShow = SW_SHOWDEFAULT)
 			return 0;
 		}
 	}
+	else if (__argc == 2)
+	{
+#ifdef _UNICODE
+		TCHAR* lpszCommand = __wargv[1];
+#else
+		char* lpszCommand = __argv[1];
+#endif
+		if (!_tcscmp(lpszCommand, _T("-diagnostics")))
+		{
+			return ShowCryptoDiagnostics();
+		}
+	}
 
 	if (__argc > 1)
 	{
@@ -223,7 +290,9 @@ int Run(LPTSTR /*lpstrCmdLine*/ = NULL, int nCmdShow = SW_SHOWDEFAULT)
 		if (nResult == IDYES)
 		{
 			int nConverted = 0;
-			std::string encryptPassword;
+			SecureString encryptPassword;
+			// calibrates while the password is entered
+			Utils::KdfCalibrationTask kdfCalibration;
 			for (int nIndex = 1; nIndex < __argc; nIndex++)
 			{
 #ifdef _UNICODE
@@ -235,11 +304,11 @@ int Run(LPTSTR /*lpstrCmdLine*/ = NULL, int nCmdShow = SW_SHOWDEFAULT)
 				{
 					std::string newfilename = filename.substr(0, filename.size() - 4);
 					newfilename += ".exe";
-					std::string text;
-					std::string password;
+					SecureString text;
+					SecureString password;
 					if (LoadTextFromFile(filename, text, password))
 					{
-						if (SaveTextToFile(newfilename, text, encryptPassword))
+						if (SaveTextToFile(newfilename, text, encryptPassword, kdfCalibration.Get(AESLayer::KdfMode::Scrypt)))
 						{
 							nConverted += 1;
 						}
@@ -285,18 +354,31 @@ int Run(LPTSTR /*lpstrCmdLine*/ = NULL, int nCmdShow = SW_SHOWDEFAULT)
 		return 0;
 	}
 
-	std::string text;
-	std::string data;
-	std::string password;
-	Utils::LoadResource("CONTENT", "PAYLOAD", data);
-	if (!data.empty())
+	SecureString text;
+	SecureString password;
+	AESLayer::PayloadInfo payloadInfo;
+	std::unique_ptr<AESLayer::IncrementalPayload> session;
+	std::unique_ptr<Utils::AsyncCryptoTask> loadTask;
+	// decrypted straight out of the mapped resource, which stays valid for
+	// the life of the process
+	const std::span<const unsigned char> data = Utils::LoadResourceView("CONTENT", "PAYLOAD");
+	// an empty note of an older version was stored as a lone NUL
+	const bool hasPayload = !data.empty() && data.front() != '\0';
+	if (hasPayload)
 	{
-		password = GetPasswordDlg();
-		if (password.empty())
+		// the note and the editor's copies of it come from the secure pool;
+		// map and lock its chunks now rather than one by one while the note
+		// is decrypted. Texts above MAX_POOLED_BLOCK are mapped on their own.
+		Utils::SecurePool::Instance().Reserve(4 * (std::min)(data.size(), Utils::SecurePool::MAX_POOLED_BLOCK));
+
+		// the KDF runs on a worker thread behind the password dialog,
+		// which shows its progress and can cancel it
+		const INT_PTR unlocked = UnlockDlg(data, password, text, payloadInfo, session, loadTask);
+		if (unlocked == IDCANCEL)
 		{
 			return -1;
 		}
-		if (!Utils::DecryptString(data, password, text))
+		if (unlocked != IDOK)
 		{
 			MessageBox(NULL, WSTR(IDS_INVALID_PASSWORD), MB_OK | MB_ICONERROR);
 			return -1;
@@ -307,10 +389,18 @@ int Run(LPTSTR /*lpstrCmdLine*/ = NULL, int nCmdShow = SW_SHOWDEFAULT)
 		text = STR(IDS_WELCOME);
 	}
 
+	// started once the unlock KDF is done, so the two don't compete for
+	// the cores; saves take their parameters from it
+	Utils::KdfCalibrationTask kdfCalibration;
+
 	CMainFrame wndMain;
 
 	wndMain.m_password = password;
 	wndMain.m_text = text;
+	// text is only the first screen of a long note while loadTask runs
+	wndMain.m_pLoadTask = loadTask.get();
+	wndMain.m_pKdfCalibration = &kdfCalibration;
+	wndMain.m_payloadInfo = payloadInfo;
 
 	// get window sizes from resource
 	std::string strSizeX;
@@ -372,9 +462,15 @@ int Run(LPTSTR /*lpstrCmdLine*/ = NULL, int nCmdShow = SW_SHOWDEFAULT)
 	}
 	else
 	{
-		wndMain.SetKdfMode(static_cast<int>(AESLayer::KdfMode::Scrypt));
+		// no trait stored (older notes): keep the KDF the payload was written with
+		wndMain.SetKdfMode(static_cast<int>(payloadInfo.m_kdfMode));
 	}
 
+	// Older payloads are rewritten on exit in the indexed format, which
+	// records the KDF in its header and lets later saves re-encrypt only
+	// what was edited, and as bytes rather than hex text.
+	const bool upgradePayload = hasPayload && (payloadInfo.m_format != AESLayer::PayloadFormat::Indexed || !Utils::IsBinaryPayload(data));
+
 	std::string themeMode;
 	Utils::LoadResource("THEMEMODE", "INFORMATION", themeMode);
 	if (Utils::TryParseInt(themeMode, parsedValue))
@@ -406,10 +502,28 @@ int Run(LPTSTR /*lpstrCmdLine*/ = NULL, int nCmdShow = SW_SHOWDEFAULT)
 
 	_Module.RemoveMessageLoop();
 
-	if (((wndMain.m_text != text) || (wndMain.m_password != password) || wndMain.m_bTraitsChanged) && (wndMain.m_password.size()))
+	if (loadTask)
+	{
+		// nothing is saved from a note that never finished decrypting. If
+		// the window closed before the rest arrived the editor was still
+		// read-only, so the whole note is saved as it was.
+		if (loadTask->Wait() != Utils::AsyncCryptoTask::Status::Succeeded)
+		{
+			return nRet;
+		}
+		if (wndMain.m_pLoadTask != nullptr)
+		{
+			wndMain.m_text = loadTask->GetText();
+		}
+		text = loadTask->TakeText();
+		session = loadTask->TakeIncrementalPayload();
+	}
+
+	if (((wndMain.m_text != text) || (wndMain.m_password != password) || wndMain.m_bTraitsChanged || upgradePayload) && (wndMain.m_password.size()))
 	{
+		const bool passwordChanged = wndMain.m_password != password;
 		password = wndMain.m_password;
-		if (!StageWritebackFromMainFrame(wndMain, password))
+		if (!StageWritebackFromMainFrame(wndMain, password, passwordChanged, session.get(), text))
 		{
 			Utils::MessageBox(nullptr, L"Saving changes failed.", MB_OK | MB_ICONERROR);
 		}
@@ -429,7 +543,7 @@ int WINAPI _tWinMain(HINSTANCE hInstance, HINSTANCE /*hPrevInstance*/, LPTSTR lp
 	// this resolves ATL window thunking problem when Microsoft Layer for Unicode (MSLU) is used
 	::DefWindowProc(NULL, 0, 0, 0L);
 
-	AtlInitCommonControls(ICC_BAR_CLASSES);	// add flags to support other controls
+	AtlInitCommonControls(ICC_BAR_CLASSES | ICC_PROGRESS_CLASS);	// add flags to support other controls
 
 	hRes = _Module.Init(NULL, hInstance);
 	ATLASSERT(SUCCEEDED(hRes));
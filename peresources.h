@@ -0,0 +1,981 @@
+// Steganos LockNote - self-modifying encrypted notepad
+// Copyright (C) 2006-2010 Steganos GmbH
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+
+// The resources of a PE32 or PE32+ image read and rewritten without the
+// Win32 resource API, so the payload and traits of a LockNote executable
+// can be inspected and patched on any platform, and a batch of updates
+// costs one rewrite of the image. PeResources parses the type/name/
+// language tree of the resource section and reads the data in place;
+// Write() rebuilds the section from the current set of resources. Needs
+// neither windows.h nor Crypto++.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace Utils
+{
+	// a resource type, name or language key: a 16-bit ID or a UTF-16 string
+	struct PeResourceId
+	{
+		PeResourceId() = default;
+
+		PeResourceId(const std::uint16_t id)
+			: m_id(id)
+		{
+		}
+
+		// UTF-8; "#123" is ID 123, as for FindResourceA()
+		PeResourceId(const std::string_view name)
+		{
+			if (name.size() > 1 && name.front() == '#' && name.size() <= 6 &&
+				std::all_of(name.begin() + 1, name.end(), [](const char c) { return c >= '0' && c <= '9'; }))
+			{
+				const unsigned long id = std::stoul(std::string(name.substr(1)));
+				if (id <= 0xFFFF)
+				{
+					m_id = static_cast<std::uint16_t>(id);
+					return;
+				}
+			}
+			for (size_t i = 0; i < name.size();)
+			{
+				const unsigned char lead = static_cast<unsigned char>(name[i]);
+				const size_t length = lead < 0x80 ? 1 : lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+				char32_t c = length == 1 ? lead : lead & (0x3F >> (length - 1));
+				for (size_t j = 1; j < length && i + j < name.size(); ++j)
+				{
+					c = (c << 6) | (static_cast<unsigned char>(name[i + j]) & 0x3F);
+				}
+				if (c >= 0x10000)
+				{
+					m_name += static_cast<char16_t>(0xD800 + ((c - 0x10000) >> 10));
+					m_name += static_cast<char16_t>(0xDC00 + ((c - 0x10000) & 0x3FF));
+				}
+				else
+				{
+					m_name += static_cast<char16_t>(c);
+				}
+				i += length;
+			}
+		}
+
+		PeResourceId(const char* name)
+			: PeResourceId(std::string_view(name))
+		{
+		}
+
+		PeResourceId(const std::string& name)
+			: PeResourceId(std::string_view(name))
+		{
+		}
+
+		bool IsName() const
+		{
+			return !m_name.empty();
+		}
+
+		// UTF-8, or "#" and the ID
+		std::string ToString() const
+		{
+			if (!IsName())
+			{
+				return "#" + std::to_string(m_id);
+			}
+			std::string text;
+			for (size_t i = 0; i < m_name.size(); ++i)
+			{
+				char32_t c = m_name[i];
+				if (c >= 0xD800 && c < 0xDC00 && i + 1 < m_name.size())
+				{
+					c = 0x10000 + ((c - 0xD800) << 10) + (m_name[++i] - 0xDC00);
+				}
+				if (c < 0x80)
+				{
+					text += static_cast<char>(c);
+				}
+				else if (c < 0x800)
+				{
+					text += static_cast<char>(0xC0 | (c >> 6));
+					text += static_cast<char>(0x80 | (c & 0x3F));
+				}
+				else if (c < 0x10000)
+				{
+					text += static_cast<char>(0xE0 | (c >> 12));
+					text += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+					text += static_cast<char>(0x80 | (c & 0x3F));
+				}
+				else
+				{
+					text += static_cast<char>(0xF0 | (c >> 18));
+					text += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+					text += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+					text += static_cast<char>(0x80 | (c & 0x3F));
+				}
+			}
+			return text;
+		}
+
+		// the order of a resource directory: names before IDs, names
+		// compared case-insensitively like the loader does (ASCII letters
+		// only), IDs by value
+		static int Compare(const PeResourceId& left, const PeResourceId& right)
+		{
+			if (left.IsName() != right.IsName())
+			{
+				return left.IsName() ? -1 : 1;
+			}
+			if (!left.IsName())
+			{
+				return left.m_id == right.m_id ? 0 : left.m_id < right.m_id ? -1 : 1;
+			}
+			const auto upper = [](const char16_t c) { return c >= u'a' && c <= u'z' ? static_cast<char16_t>(c - 0x20) : c; };
+			for (size_t i = 0; i < left.m_name.size() && i < right.m_name.size(); ++i)
+			{
+				if (upper(left.m_name[i]) != upper(right.m_name[i]))
+				{
+					return upper(left.m_name[i]) < upper(right.m_name[i]) ? -1 : 1;
+				}
+			}
+			return left.m_name.size() == right.m_name.size() ? 0 : left.m_name.size() < right.m_name.size() ? -1 : 1;
+		}
+
+		bool operator==(const PeResourceId& other) const
+		{
+			return Compare(*this, other) == 0;
+		}
+
+		std::u16string m_name;
+		std::uint16_t m_id{ 0 };
+	};
+
+	class PeResources
+	{
+	public:
+		// File: the image as stored on disk (sections at PointerToRawData);
+		// Loaded: as mapped by the loader (sections at their RVA), e.g. the
+		// image of a running module
+		enum class Layout
+		{
+			File,
+			Loaded
+		};
+
+		struct Resource
+		{
+			PeResourceId m_type;
+			PeResourceId m_name;
+			std::uint16_t m_language{ 0 };
+			std::uint32_t m_codePage{ 0 };
+			// points into the image, or into the object after Update()
+			std::span<const unsigned char> m_data;
+		};
+
+		// resource trees with more leaves than this are rejected as damaged
+		static constexpr size_t MAX_RESOURCES = 0x10000;
+
+		PeResources() = default;
+		PeResources(const PeResources&) = delete;
+		PeResources& operator=(const PeResources&) = delete;
+
+		// parses the headers and the resource tree of image. The data is
+		// read in place, so image must stay valid while the object is used.
+		// False if image is not a PE32/PE32+ image or its resource tree is
+		// damaged; an image without resources loads with none.
+		bool Load(const std::span<const unsigned char> image, const Layout layout = Layout::File)
+		{
+			m_image = {};
+			m_resources.clear();
+			m_storage.clear();
+			m_sections.clear();
+			m_resourceSection = NO_SECTION;
+			if (!ReadHeaders(image, layout))
+			{
+				return false;
+			}
+			m_image = image;
+			m_layout = layout;
+
+			const DataDirectory resources = GetDataDirectory(RESOURCE_DIRECTORY);
+			if (resources.m_rva == 0 || resources.m_size == 0)
+			{
+				return true;
+			}
+			for (size_t i = 0; i < m_sections.size(); ++i)
+			{
+				if (resources.m_rva >= m_sections[i].m_virtualAddress && resources.m_rva - m_sections[i].m_virtualAddress < m_sections[i].MappedSize(layout))
+				{
+					m_resourceSection = i;
+				}
+			}
+			if (m_resourceSection == NO_SECTION)
+			{
+				m_image = {};
+				return false;
+			}
+
+			// offsets in the tree are relative to its root and may reach up
+			// to the end of the section
+			const Section& section = m_sections[m_resourceSection];
+			const std::span<const unsigned char> tree = MapRva(resources.m_rva, section.m_virtualAddress + section.MappedSize(layout) - resources.m_rva);
+			if (tree.empty() || !ReadTree(tree))
+			{
+				m_image = {};
+				m_resources.clear();
+				return false;
+			}
+			return true;
+		}
+
+		// the image of a module mapped by the loader (an HMODULE), for
+		// Load(..., Layout::Loaded); empty if base holds no PE headers
+		static std::span<const unsigned char> ModuleImage(const void* base)
+		{
+			const unsigned char* headers = static_cast<const unsigned char*>(base);
+			if (!headers || Read16(headers) != DOS_MAGIC)
+			{
+				return {};
+			}
+			const unsigned char* pe = headers + Read32(headers + DOS_PE_OFFSET);
+			if (Read32(pe) != PE_SIGNATURE)
+			{
+				return {};
+			}
+			return std::span<const unsigned char>(headers, Read32(pe + OPTIONAL_HEADER_OFFSET + SIZE_OF_IMAGE_OFFSET));
+		}
+
+		const std::vector<Resource>& GetResources() const
+		{
+			return m_resources;
+		}
+
+		// the neutral language if there is one, else the lowest; null if
+		// there is no such resource
+		const Resource* Find(const PeResourceId& type, const PeResourceId& name) const
+		{
+			const Resource* found = nullptr;
+			for (const Resource& resource : m_resources)
+			{
+				if (resource.m_type == type && resource.m_name == name &&
+					(!found || (found->m_language != 0 && (resource.m_language == 0 || resource.m_language < found->m_language))))
+				{
+					found = &resource;
+				}
+			}
+			return found;
+		}
+
+		const Resource* Find(const PeResourceId& type, const PeResourceId& name, const std::uint16_t language) const
+		{
+			const auto it = std::find_if(m_resources.begin(), m_resources.end(), [&](const Resource& resource)
+			{
+				return resource.m_type == type && resource.m_name == name && resource.m_language == language;
+			});
+			return it != m_resources.end() ? &*it : nullptr;
+		}
+
+		// adds the resource or replaces its data, like UpdateResourceW()
+		// with data; the object keeps data until it is replaced again
+		void Update(const PeResourceId& type, const PeResourceId& name, std::vector<unsigned char> data, const std::uint16_t language = 0)
+		{
+			Resource* resource = const_cast<Resource*>(Find(type, name, language));
+			if (resource)
+			{
+				ReleaseStorage(resource->m_data);
+			}
+			else
+			{
+				m_resources.push_back({ type, name, language, 0, {} });
+				resource = &m_resources.back();
+			}
+			m_storage.push_back(std::move(data));
+			resource->m_data = m_storage.back();
+		}
+
+		// like UpdateResourceW() without data; false if there was no such
+		// resource
+		bool Remove(const PeResourceId& type, const PeResourceId& name, const std::uint16_t language = 0)
+		{
+			const auto it = std::find_if(m_resources.begin(), m_resources.end(), [&](const Resource& resource)
+			{
+				return resource.m_type == type && resource.m_name == name && resource.m_language == language;
+			});
+			if (it == m_resources.end())
+			{
+				return false;
+			}
+			ReleaseStorage(it->m_data);
+			m_resources.erase(it);
+			return true;
+		}
+
+		// a copy of the loaded File-layout image with the resource section
+		// rebuilt from GetResources(), the headers adjusted and the checksum
+		// recomputed. If the section has to grow past the next section, the
+		// sections after it are moved, which is only done if they hold
+		// nothing but base relocations (the .reloc that follows .rsrc in
+		// linker output). An Authenticode signature no longer matches and is
+		// dropped. False if the image has no resource section that does not
+		// start at its resource tree, or the sections cannot be moved.
+		bool Write(std::vector<unsigned char>& output) const
+		{
+			if (m_image.empty() || m_layout != Layout::File || m_resourceSection == NO_SECTION ||
+				GetDataDirectory(RESOURCE_DIRECTORY).m_rva != m_sections[m_resourceSection].m_virtualAddress)
+			{
+				return false;
+			}
+
+			const Section& resources = m_sections[m_resourceSection];
+			const std::vector<unsigned char> tree = BuildTree(resources.m_virtualAddress);
+			if (tree.size() > (std::numeric_limits<std::uint32_t>::max)() - m_fileAlignment)
+			{
+				return false;
+			}
+			const std::uint32_t treeSize = static_cast<std::uint32_t>(tree.size());
+			const std::uint32_t rawSize = AlignUp(treeSize, m_fileAlignment);
+			const size_t resourcesEnd = static_cast<size_t>(resources.m_pointerToRawData) + resources.m_sizeOfRawData;
+
+			// sections after the resource section in memory must also follow
+			// it on disk, and those before it must end before it
+			std::vector<size_t> later;
+			size_t rawEnd = m_sizeOfHeaders;
+			for (size_t i = 0; i < m_sections.size(); ++i)
+			{
+				const Section& section = m_sections[i];
+				if (section.m_sizeOfRawData != 0)
+				{
+					rawEnd = (std::max)(rawEnd, static_cast<size_t>(section.m_pointerToRawData) + section.m_sizeOfRawData);
+				}
+				if (i == m_resourceSection)
+				{
+					continue;
+				}
+				if (section.m_virtualAddress > resources.m_virtualAddress)
+				{
+					if (section.m_sizeOfRawData != 0 && section.m_pointerToRawData < resourcesEnd)
+					{
+						return false;
+					}
+					later.push_back(i);
+				}
+				else if (section.m_sizeOfRawData != 0 && section.m_pointerToRawData + static_cast<size_t>(section.m_sizeOfRawData) > resources.m_pointerToRawData)
+				{
+					return false;
+				}
+			}
+
+			// the later sections keep their RVAs if the new tree fits below
+			// the next one; otherwise they move by whole section alignments
+			std::int64_t deltaVa = 0;
+			if (!later.empty())
+			{
+				std::uint32_t nextVa = (std::numeric_limits<std::uint32_t>::max)();
+				for (const size_t i : later)
+				{
+					nextVa = (std::min)(nextVa, m_sections[i].m_virtualAddress);
+				}
+				const std::int64_t needed = static_cast<std::int64_t>(resources.m_virtualAddress) + AlignUp(treeSize, m_sectionAlignment) - nextVa;
+				if (needed != 0 && CanMove(later))
+				{
+					deltaVa = needed;
+				}
+				else if (needed > 0)
+				{
+					return false;
+				}
+			}
+			const std::int64_t deltaRaw = static_cast<std::int64_t>(rawSize) - resources.m_sizeOfRawData;
+
+			// the certificate table is addressed by file offset and lies
+			// after the sections; it is left out
+			const DataDirectory certificate = GetDataDirectory(CERTIFICATE_DIRECTORY);
+			const size_t certificateBegin = certificate.m_size != 0 && certificate.m_rva >= rawEnd ? certificate.m_rva : m_image.size();
+			const size_t certificateEnd = (std::min)(m_image.size(), certificateBegin + certificate.m_size);
+
+			output.clear();
+			output.reserve(m_image.size() + (deltaRaw > 0 ? static_cast<size_t>(deltaRaw) : 0));
+			output.insert(output.end(), m_image.begin(), m_image.begin() + resources.m_pointerToRawData);
+			output.insert(output.end(), tree.begin(), tree.end());
+			output.resize(output.size() + (rawSize - treeSize), 0);
+			if (rawEnd > resourcesEnd)
+			{
+				output.insert(output.end(), m_image.begin() + resourcesEnd, m_image.begin() + rawEnd);
+			}
+			if (m_image.size() > rawEnd)
+			{
+				output.insert(output.end(), m_image.begin() + rawEnd, m_image.begin() + (std::max)(rawEnd, certificateBegin));
+				output.insert(output.end(), m_image.begin() + (std::max)(rawEnd, certificateEnd), m_image.end());
+			}
+
+			// section headers
+			std::uint32_t sizeOfImage = AlignUp(m_sizeOfHeaders, m_sectionAlignment);
+			for (size_t i = 0; i < m_sections.size(); ++i)
+			{
+				Section section = m_sections[i];
+				if (i == m_resourceSection)
+				{
+					section.m_virtualSize = treeSize;
+					section.m_sizeOfRawData = rawSize;
+				}
+				else if (std::find(later.begin(), later.end(), i) != later.end())
+				{
+					section.m_virtualAddress = static_cast<std::uint32_t>(section.m_virtualAddress + deltaVa);
+					if (section.m_sizeOfRawData != 0)
+					{
+						section.m_pointerToRawData = static_cast<std::uint32_t>(section.m_pointerToRawData + deltaRaw);
+					}
+				}
+				unsigned char* header = output.data() + section.m_headerOffset;
+				Write32(header + SECTION_VIRTUAL_SIZE_OFFSET, section.m_virtualSize);
+				Write32(header + SECTION_VIRTUAL_ADDRESS_OFFSET, section.m_virtualAddress);
+				Write32(header + SECTION_RAW_SIZE_OFFSET, section.m_sizeOfRawData);
+				Write32(header + SECTION_RAW_POINTER_OFFSET, section.m_pointerToRawData);
+				sizeOfImage = (std::max)(sizeOfImage, AlignUp(section.m_virtualAddress + (section.m_virtualSize != 0 ? section.m_virtualSize : section.m_sizeOfRawData), m_sectionAlignment));
+			}
+
+			// data directories and the debug entries, which hold file offsets
+			unsigned char* optional = output.data() + m_optionalHeaderOffset;
+			Write32(optional + SIZE_OF_IMAGE_OFFSET, sizeOfImage);
+			if ((resources.m_characteristics & SECTION_INITIALIZED_DATA) != 0)
+			{
+				Write32(optional + SIZE_OF_INITIALIZED_DATA_OFFSET, static_cast<std::uint32_t>(Read32(optional + SIZE_OF_INITIALIZED_DATA_OFFSET) + deltaRaw));
+			}
+			Write32(output.data() + DataDirectoryOffset(RESOURCE_DIRECTORY) + 4, treeSize);
+			if (certificateBegin < m_image.size())
+			{
+				Write32(output.data() + DataDirectoryOffset(CERTIFICATE_DIRECTORY), 0);
+				Write32(output.data() + DataDirectoryOffset(CERTIFICATE_DIRECTORY) + 4, 0);
+			}
+			if (deltaVa != 0)
+			{
+				const DataDirectory relocations = GetDataDirectory(BASE_RELOCATION_DIRECTORY);
+				Write32(output.data() + DataDirectoryOffset(BASE_RELOCATION_DIRECTORY), static_cast<std::uint32_t>(relocations.m_rva + deltaVa));
+			}
+			const DataDirectory debug = GetDataDirectory(DEBUG_DIRECTORY);
+			const std::span<const unsigned char> debugEntries = MapRva(debug.m_rva, debug.m_size);
+			if (!debugEntries.empty() && deltaRaw != 0)
+			{
+				const size_t offset = static_cast<size_t>(debugEntries.data() - m_image.data());
+				unsigned char* entries = output.data() + (offset >= resourcesEnd ? static_cast<size_t>(offset + deltaRaw) : offset);
+				for (size_t i = 0; i + DEBUG_ENTRY_SIZE <= debugEntries.size(); i += DEBUG_ENTRY_SIZE)
+				{
+					const std::uint32_t pointer = Read32(entries + i + DEBUG_RAW_POINTER_OFFSET);
+					if (pointer >= resourcesEnd)
+					{
+						Write32(entries + i + DEBUG_RAW_POINTER_OFFSET, static_cast<std::uint32_t>(pointer + deltaRaw));
+					}
+				}
+			}
+
+			Write32(optional + CHECKSUM_OFFSET, ComputeChecksum(output, m_optionalHeaderOffset + CHECKSUM_OFFSET));
+			return true;
+		}
+
+		// the PE checksum of image, with the 4 bytes at checksumOffset (the
+		// CheckSum field) counted as zero
+		static std::uint32_t ComputeChecksum(const std::span<const unsigned char> image, const size_t checksumOffset)
+		{
+			std::uint64_t sum = 0;
+			for (size_t i = 0; i < image.size(); i += 2)
+			{
+				if (i >= checksumOffset && i < checksumOffset + 4)
+				{
+					continue;
+				}
+				sum += image[i] | (i + 1 < image.size() ? image[i + 1] << 8 : 0);
+				sum = (sum & 0xFFFF) + (sum >> 16);
+			}
+			sum = (sum & 0xFFFF) + (sum >> 16);
+			return static_cast<std::uint32_t>(sum + image.size());
+		}
+
+	private:
+		struct Section
+		{
+			std::uint32_t m_virtualSize{ 0 };
+			std::uint32_t m_virtualAddress{ 0 };
+			std::uint32_t m_sizeOfRawData{ 0 };
+			std::uint32_t m_pointerToRawData{ 0 };
+			std::uint32_t m_characteristics{ 0 };
+			size_t m_headerOffset{ 0 };
+
+			// bytes of the section present in an image of layout
+			std::uint32_t MappedSize(const Layout layout) const
+			{
+				return layout == Layout::File ? m_sizeOfRawData : (std::max)(m_virtualSize, m_sizeOfRawData);
+			}
+		};
+
+		struct DataDirectory
+		{
+			std::uint32_t m_rva{ 0 };
+			std::uint32_t m_size{ 0 };
+		};
+
+		static constexpr std::uint16_t DOS_MAGIC = 0x5A4D;
+		static constexpr size_t DOS_PE_OFFSET = 0x3C;
+		static constexpr std::uint32_t PE_SIGNATURE = 0x00004550;
+		static constexpr size_t FILE_HEADER_SIZE = 20;
+		static constexpr size_t OPTIONAL_HEADER_OFFSET = 4 + FILE_HEADER_SIZE;
+		static constexpr std::uint16_t PE32_MAGIC = 0x10B;
+		static constexpr std::uint16_t PE32_PLUS_MAGIC = 0x20B;
+		static constexpr size_t SIZE_OF_INITIALIZED_DATA_OFFSET = 8;
+		static constexpr size_t ENTRY_POINT_OFFSET = 16;
+		static constexpr size_t SECTION_ALIGNMENT_OFFSET = 32;
+		static constexpr size_t FILE_ALIGNMENT_OFFSET = 36;
+		static constexpr size_t SIZE_OF_IMAGE_OFFSET = 56;
+		static constexpr size_t SIZE_OF_HEADERS_OFFSET = 60;
+		static constexpr size_t CHECKSUM_OFFSET = 64;
+		static constexpr size_t PE32_DIRECTORIES_OFFSET = 96;
+		static constexpr size_t PE32_PLUS_DIRECTORIES_OFFSET = 112;
+		static constexpr size_t CERTIFICATE_DIRECTORY = 4;
+		static constexpr size_t RESOURCE_DIRECTORY = 2;
+		static constexpr size_t BASE_RELOCATION_DIRECTORY = 5;
+		static constexpr size_t DEBUG_DIRECTORY = 6;
+		static constexpr size_t DEBUG_ENTRY_SIZE = 28;
+		static constexpr size_t DEBUG_RAW_POINTER_OFFSET = 24;
+		static constexpr size_t SECTION_HEADER_SIZE = 40;
+		static constexpr size_t SECTION_VIRTUAL_SIZE_OFFSET = 8;
+		static constexpr size_t SECTION_VIRTUAL_ADDRESS_OFFSET = 12;
+		static constexpr size_t SECTION_RAW_SIZE_OFFSET = 16;
+		static constexpr size_t SECTION_RAW_POINTER_OFFSET = 20;
+		static constexpr size_t SECTION_CHARACTERISTICS_OFFSET = 36;
+		static constexpr std::uint32_t SECTION_INITIALIZED_DATA = 0x40;
+		static constexpr size_t DIRECTORY_SIZE = 16;
+		static constexpr size_t DIRECTORY_ENTRY_SIZE = 8;
+		static constexpr size_t DATA_ENTRY_SIZE = 16;
+		static constexpr std::uint32_t SUBDIRECTORY_FLAG = 0x80000000;
+		static constexpr size_t NO_SECTION = static_cast<size_t>(-1);
+
+		static std::uint16_t Read16(const unsigned char* data)
+		{
+			return static_cast<std::uint16_t>(data[0] | (data[1] << 8));
+		}
+
+		static std::uint32_t Read32(const unsigned char* data)
+		{
+			return static_cast<std::uint32_t>(data[0]) | (static_cast<std::uint32_t>(data[1]) << 8) |
+				(static_cast<std::uint32_t>(data[2]) << 16) | (static_cast<std::uint32_t>(data[3]) << 24);
+		}
+
+		static void Write16(unsigned char* data, const std::uint16_t value)
+		{
+			data[0] = static_cast<unsigned char>(value);
+			data[1] = static_cast<unsigned char>(value >> 8);
+		}
+
+		static void Write32(unsigned char* data, const std::uint32_t value)
+		{
+			for (size_t i = 0; i < 4; ++i)
+			{
+				data[i] = static_cast<unsigned char>(value >> (8 * i));
+			}
+		}
+
+		static std::uint32_t AlignUp(const std::uint32_t value, const std::uint32_t alignment)
+		{
+			return alignment > 1 ? (value + alignment - 1) / alignment * alignment : value;
+		}
+
+		bool ReadHeaders(const std::span<const unsigned char> image, const Layout layout)
+		{
+			if (image.size() < DOS_PE_OFFSET + 4 || Read16(image.data()) != DOS_MAGIC)
+			{
+				return false;
+			}
+			const size_t pe = Read32(image.data() + DOS_PE_OFFSET);
+			if (pe > image.size() || image.size() - pe < OPTIONAL_HEADER_OFFSET + 2 || Read32(image.data() + pe) != PE_SIGNATURE)
+			{
+				return false;
+			}
+			const size_t sectionCount = Read16(image.data() + pe + 6);
+			const size_t optionalSize = Read16(image.data() + pe + 20);
+			m_optionalHeaderOffset = pe + OPTIONAL_HEADER_OFFSET;
+			const std::uint16_t magic = Read16(image.data() + m_optionalHeaderOffset);
+			const size_t directoriesOffset = magic == PE32_MAGIC ? PE32_DIRECTORIES_OFFSET : PE32_PLUS_DIRECTORIES_OFFSET;
+			const size_t sectionTable = m_optionalHeaderOffset + optionalSize;
+			if ((magic != PE32_MAGIC && magic != PE32_PLUS_MAGIC) || optionalSize < directoriesOffset ||
+				sectionTable > image.size() || (image.size() - sectionTable) / SECTION_HEADER_SIZE < sectionCount)
+			{
+				return false;
+			}
+
+			const unsigned char* optional = image.data() + m_optionalHeaderOffset;
+			m_sectionAlignment = Read32(optional + SECTION_ALIGNMENT_OFFSET);
+			m_fileAlignment = Read32(optional + FILE_ALIGNMENT_OFFSET);
+			m_sizeOfHeaders = Read32(optional + SIZE_OF_HEADERS_OFFSET);
+			m_entryPoint = Read32(optional + ENTRY_POINT_OFFSET);
+			m_directoriesOffset = m_optionalHeaderOffset + directoriesOffset;
+			m_directoryCount = (std::min<size_t>)(Read32(optional + directoriesOffset - 4), (optionalSize - directoriesOffset) / 8);
+			if (m_fileAlignment == 0 || m_sectionAlignment == 0 || m_sizeOfHeaders > image.size())
+			{
+				return false;
+			}
+
+			for (size_t i = 0; i < sectionCount; ++i)
+			{
+				Section section;
+				section.m_headerOffset = sectionTable + i * SECTION_HEADER_SIZE;
+				const unsigned char* header = image.data() + section.m_headerOffset;
+				section.m_virtualSize = Read32(header + SECTION_VIRTUAL_SIZE_OFFSET);
+				section.m_virtualAddress = Read32(header + SECTION_VIRTUAL_ADDRESS_OFFSET);
+				section.m_sizeOfRawData = Read32(header + SECTION_RAW_SIZE_OFFSET);
+				section.m_pointerToRawData = Read32(header + SECTION_RAW_POINTER_OFFSET);
+				section.m_characteristics = Read32(header + SECTION_CHARACTERISTICS_OFFSET);
+				const size_t end = layout == Layout::File ?
+					static_cast<size_t>(section.m_pointerToRawData) + section.m_sizeOfRawData :
+					static_cast<size_t>(section.m_virtualAddress) + section.MappedSize(layout);
+				if (section.m_sizeOfRawData != 0 && end > image.size())
+				{
+					return false;
+				}
+				m_sections.push_back(section);
+			}
+			return true;
+		}
+
+		size_t DataDirectoryOffset(const size_t index) const
+		{
+			return m_directoriesOffset + index * 8;
+		}
+
+		DataDirectory GetDataDirectory(const size_t index) const
+		{
+			if (index >= m_directoryCount || m_image.empty())
+			{
+				return {};
+			}
+			const unsigned char* directory = m_image.data() + DataDirectoryOffset(index);
+			return { Read32(directory), Read32(directory + 4) };
+		}
+
+		// the size bytes at rva; empty if they are not all in one section
+		std::span<const unsigned char> MapRva(const std::uint32_t rva, const size_t size) const
+		{
+			for (const Section& section : m_sections)
+			{
+				const std::uint32_t mapped = section.MappedSize(m_layout);
+				if (rva >= section.m_virtualAddress && rva - section.m_virtualAddress < mapped && size <= mapped - (rva - section.m_virtualAddress))
+				{
+					const size_t offset = m_layout == Layout::File ? section.m_pointerToRawData + static_cast<size_t>(rva - section.m_virtualAddress) : rva;
+					return offset <= m_image.size() && size <= m_image.size() - offset ? m_image.subspan(offset, size) : std::span<const unsigned char>();
+				}
+			}
+			return {};
+		}
+
+		bool ReadTree(const std::span<const unsigned char> tree)
+		{
+			const auto readDirectory = [&tree](const size_t offset, std::vector<std::pair<std::uint32_t, std::uint32_t>>& entries)
+			{
+				if (offset > tree.size() || tree.size() - offset < DIRECTORY_SIZE)
+				{
+					return false;
+				}
+				const size_t count = static_cast<size_t>(Read16(tree.data() + offset + 12)) + Read16(tree.data() + offset + 14);
+				if ((tree.size() - offset - DIRECTORY_SIZE) / DIRECTORY_ENTRY_SIZE < count)
+				{
+					return false;
+				}
+				entries.clear();
+				for (size_t i = 0; i < count; ++i)
+				{
+					const unsigned char* entry = tree.data() + offset + DIRECTORY_SIZE + i * DIRECTORY_ENTRY_SIZE;
+					entries.emplace_back(Read32(entry), Read32(entry + 4));
+				}
+				return true;
+			};
+			const auto readId = [&tree](const std::uint32_t field, PeResourceId& id)
+			{
+				id = PeResourceId();
+				if ((field & SUBDIRECTORY_FLAG) == 0)
+				{
+					id.m_id = static_cast<std::uint16_t>(field);
+					return field <= 0xFFFF;
+				}
+				const size_t offset = field & ~SUBDIRECTORY_FLAG;
+				if (offset > tree.size() || tree.size() - offset < 2)
+				{
+					return false;
+				}
+				const size_t length = Read16(tree.data() + offset);
+				if (length == 0 || (tree.size() - offset - 2) / 2 < length)
+				{
+					return false;
+				}
+				for (size_t i = 0; i < length; ++i)
+				{
+					id.m_name += static_cast<char16_t>(Read16(tree.data() + offset + 2 + 2 * i));
+				}
+				return true;
+			};
+
+			// exactly three levels: type, name and language
+			std::vector<std::pair<std::uint32_t, std::uint32_t>> types;
+			std::vector<std::pair<std::uint32_t, std::uint32_t>> names;
+			std::vector<std::pair<std::uint32_t, std::uint32_t>> languages;
+			if (!readDirectory(0, types))
+			{
+				return false;
+			}
+			for (const auto& [typeField, typeOffset] : types)
+			{
+				PeResourceId type;
+				if (!readId(typeField, type) || (typeOffset & SUBDIRECTORY_FLAG) == 0 || !readDirectory(typeOffset & ~SUBDIRECTORY_FLAG, names))
+				{
+					return false;
+				}
+				for (const auto& [nameField, nameOffset] : names)
+				{
+					PeResourceId name;
+					if (!readId(nameField, name) || (nameOffset & SUBDIRECTORY_FLAG) == 0 || !readDirectory(nameOffset & ~SUBDIRECTORY_FLAG, languages))
+					{
+						return false;
+					}
+					for (const auto& [language, dataOffset] : languages)
+					{
+						if (language > 0xFFFF || (dataOffset & SUBDIRECTORY_FLAG) != 0 || dataOffset > tree.size() ||
+							tree.size() - dataOffset < DATA_ENTRY_SIZE || m_resources.size() == MAX_RESOURCES)
+						{
+							return false;
+						}
+						const unsigned char* entry = tree.data() + dataOffset;
+						const std::uint32_t size = Read32(entry + 4);
+						const std::span<const unsigned char> data = MapRva(Read32(entry), size);
+						if (data.size() != size)
+						{
+							return false;
+						}
+						m_resources.push_back({ type, name, static_cast<std::uint16_t>(language), Read32(entry + 8), data });
+					}
+				}
+			}
+			return true;
+		}
+
+		// a section may only move if it holds the base relocations and
+		// nothing else the image refers to by RVA: relocations are read by
+		// the loader alone, while code may point anywhere else
+		bool CanMove(const std::vector<size_t>& sections) const
+		{
+			const auto contains = [](const Section& section, const std::uint32_t rva)
+			{
+				return rva >= section.m_virtualAddress && rva - section.m_virtualAddress < (std::max)(section.m_virtualSize, section.m_sizeOfRawData);
+			};
+			for (const size_t i : sections)
+			{
+				const Section& section = m_sections[i];
+				if (!contains(section, GetDataDirectory(BASE_RELOCATION_DIRECTORY).m_rva) || contains(section, m_entryPoint))
+				{
+					return false;
+				}
+				for (size_t directory = 0; directory < m_directoryCount; ++directory)
+				{
+					const DataDirectory entry = GetDataDirectory(directory);
+					if (directory != BASE_RELOCATION_DIRECTORY && directory != CERTIFICATE_DIRECTORY && entry.m_size != 0 && contains(section, entry.m_rva))
+					{
+						return false;
+					}
+				}
+			}
+			return true;
+		}
+
+		// directories first (root, type level, name level), then the data
+		// entries, the name strings and the data, each blob 8-byte aligned
+		std::vector<unsigned char> BuildTree(const std::uint32_t baseRva) const
+		{
+			struct NameNode
+			{
+				const PeResourceId* m_id;
+				std::vector<const Resource*> m_languages;
+			};
+			struct TypeNode
+			{
+				const PeResourceId* m_id;
+				std::vector<NameNode> m_names;
+			};
+
+			std::vector<const Resource*> sorted;
+			for (const Resource& resource : m_resources)
+			{
+				sorted.push_back(&resource);
+			}
+			std::stable_sort(sorted.begin(), sorted.end(), [](const Resource* left, const Resource* right)
+			{
+				const int type = PeResourceId::Compare(left->m_type, right->m_type);
+				const int name = PeResourceId::Compare(left->m_name, right->m_name);
+				return type != 0 ? type < 0 : name != 0 ? name < 0 : left->m_language < right->m_language;
+			});
+
+			std::vector<TypeNode> types;
+			size_t directoriesSize = DIRECTORY_SIZE;
+			size_t stringsSize = 0;
+			const auto stringSize = [](const PeResourceId& id) { return id.IsName() ? 2 + 2 * id.m_name.size() : 0; };
+			for (const Resource* resource : sorted)
+			{
+				if (types.empty() || !(*types.back().m_id == resource->m_type))
+				{
+					types.push_back({ &resource->m_type, {} });
+					directoriesSize += DIRECTORY_ENTRY_SIZE + DIRECTORY_SIZE;
+					stringsSize += stringSize(resource->m_type);
+				}
+				std::vector<NameNode>& names = types.back().m_names;
+				if (names.empty() || !(*names.back().m_id == resource->m_name))
+				{
+					names.push_back({ &resource->m_name, {} });
+					directoriesSize += DIRECTORY_ENTRY_SIZE + DIRECTORY_SIZE;
+					stringsSize += stringSize(resource->m_name);
+				}
+				names.back().m_languages.push_back(resource);
+				directoriesSize += DIRECTORY_ENTRY_SIZE;
+			}
+
+			const size_t entriesOffset = directoriesSize;
+			const size_t stringsOffset = entriesOffset + sorted.size() * DATA_ENTRY_SIZE;
+			size_t dataSize = 0;
+			for (const Resource* resource : sorted)
+			{
+				dataSize += AlignUp(static_cast<std::uint32_t>(resource->m_data.size()), 8);
+			}
+			const size_t dataOffset = AlignUp(static_cast<std::uint32_t>(stringsOffset + stringsSize), 8);
+			std::vector<unsigned char> tree(dataOffset + dataSize, 0);
+
+			size_t directory = DIRECTORY_SIZE + types.size() * DIRECTORY_ENTRY_SIZE;
+			size_t entry = entriesOffset;
+			size_t string = stringsOffset;
+			size_t data = dataOffset;
+			const auto writeDirectory = [&tree](const size_t offset, const size_t named, const size_t ids)
+			{
+				Write16(tree.data() + offset + 12, static_cast<std::uint16_t>(named));
+				Write16(tree.data() + offset + 14, static_cast<std::uint16_t>(ids));
+			};
+			const auto writeId = [&tree, &string](unsigned char* field, const PeResourceId& id)
+			{
+				if (!id.IsName())
+				{
+					Write32(field, id.m_id);
+					return;
+				}
+				Write32(field, SUBDIRECTORY_FLAG | static_cast<std::uint32_t>(string));
+				Write16(tree.data() + string, static_cast<std::uint16_t>(id.m_name.size()));
+				for (size_t i = 0; i < id.m_name.size(); ++i)
+				{
+					Write16(tree.data() + string + 2 + 2 * i, static_cast<std::uint16_t>(id.m_name[i]));
+				}
+				string += 2 + 2 * id.m_name.size();
+			};
+			const auto countNamed = [](const auto& nodes)
+			{
+				return static_cast<size_t>(std::count_if(nodes.begin(), nodes.end(), [](const auto& node) { return node.m_id->IsName(); }));
+			};
+
+			writeDirectory(0, countNamed(types), types.size() - countNamed(types));
+			std::vector<size_t> typeDirectories;
+			for (size_t t = 0; t < types.size(); ++t)
+			{
+				typeDirectories.push_back(directory);
+				unsigned char* field = tree.data() + DIRECTORY_SIZE + t * DIRECTORY_ENTRY_SIZE;
+				writeId(field, *types[t].m_id);
+				Write32(field + 4, SUBDIRECTORY_FLAG | static_cast<std::uint32_t>(directory));
+				directory += DIRECTORY_SIZE + types[t].m_names.size() * DIRECTORY_ENTRY_SIZE;
+			}
+			for (size_t t = 0; t < types.size(); ++t)
+			{
+				const std::vector<NameNode>& names = types[t].m_names;
+				writeDirectory(typeDirectories[t], countNamed(names), names.size() - countNamed(names));
+				for (size_t n = 0; n < names.size(); ++n)
+				{
+					unsigned char* field = tree.data() + typeDirectories[t] + DIRECTORY_SIZE + n * DIRECTORY_ENTRY_SIZE;
+					writeId(field, *names[n].m_id);
+					Write32(field + 4, SUBDIRECTORY_FLAG | static_cast<std::uint32_t>(directory));
+
+					writeDirectory(directory, 0, names[n].m_languages.size());
+					for (size_t l = 0; l < names[n].m_languages.size(); ++l)
+					{
+						const Resource& resource = *names[n].m_languages[l];
+						unsigned char* language = tree.data() + directory + DIRECTORY_SIZE + l * DIRECTORY_ENTRY_SIZE;
+						Write32(language, resource.m_language);
+						Write32(language + 4, static_cast<std::uint32_t>(entry));
+						Write32(tree.data() + entry, static_cast<std::uint32_t>(baseRva + data));
+						Write32(tree.data() + entry + 4, static_cast<std::uint32_t>(resource.m_data.size()));
+						Write32(tree.data() + entry + 8, resource.m_codePage);
+						std::copy(resource.m_data.begin(), resource.m_data.end(), tree.begin() + data);
+						entry += DATA_ENTRY_SIZE;
+						data += AlignUp(static_cast<std::uint32_t>(resource.m_data.size()), 8);
+					}
+					directory += DIRECTORY_SIZE + names[n].m_languages.size() * DIRECTORY_ENTRY_SIZE;
+				}
+			}
+			return tree;
+		}
+
+		void ReleaseStorage(const std::span<const unsigned char> data)
+		{
+			m_storage.remove_if([&data](const std::vector<unsigned char>& storage)
+			{
+				return !storage.empty() && storage.data() == data.data();
+			});
+		}
+
+		std::span<const unsigned char> m_image;
+		Layout m_layout{ Layout::File };
+		std::vector<Resource> m_resources;
+		// data passed to Update(); a list, so the spans stay valid
+		std::list<std::vector<unsigned char>> m_storage;
+		std::vector<Section> m_sections;
+		size_t m_resourceSection{ NO_SECTION };
+		size_t m_optionalHeaderOffset{ 0 };
+		size_t m_directoriesOffset{ 0 };
+		size_t m_directoryCount{ 0 };
+		std::uint32_t m_sectionAlignment{ 0 };
+		std::uint32_t m_fileAlignment{ 0 };
+		std::uint32_t m_sizeOfHeaders{ 0 };
+		std::uint32_t m_entryPoint{ 0 };
+	};
+
+	inline bool ReadPeFile(const std::filesystem::path& path, std::vector<unsigned char>& image)
+	{
+		std::ifstream file(path, std::ios::binary);
+		if (!file)
+		{
+			return false;
+		}
+		image.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		return !file.bad();
+	}
+
+	inline bool WritePeFile(const std::filesystem::path& path, const std::span<const unsigned char> image)
+	{
+		std::ofstream file(path, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char*>(image.data()), static_cast<std::streamsize>(image.size()));
+		file.flush();
+		return file.good();
+	}
+}
@@ -63,6 +63,7 @@
 #define IDC_STATIC_PASSWORD2            1005
 #define IDC_VISIT_WEBSITE               1006
 #define IDC_COPYRIGHT                   1007
+#define IDC_UNLOCK_PROGRESS             1008
 #define ID_FONT_ARIAL                   32586
 #define ID_FONT_COURIER_NEW             32587
 #define ID_FONT_LUCIDA_CONSOLE          32588
@@ -114,7 +115,7 @@
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NEXT_RESOURCE_VALUE        237
 #define _APS_NEXT_COMMAND_VALUE         32801
-#define _APS_NEXT_CONTROL_VALUE         1008
+#define _APS_NEXT_CONTROL_VALUE         1009
 #define _APS_NEXT_SYMED_VALUE           101
 #endif
 #endif
@@ -0,0 +1,30 @@
+#!/usr/bin/env sh
+# Builds tests/aeslayer_bench_suite.cpp with the system compiler and Crypto++
+# and runs it; arguments are passed through, e.g. --max-size 16M --runs 5.
+# Output is JSON Lines, so redirect it to a file to compare runs.
+set -eu
+
+repo_root=$(CDPATH= cd -- "$(dirname -- "$0")/.." && pwd)
+cd "$repo_root"
+
+cxx=${CXX:-c++}
+if pkg-config --exists libcrypto++ 2>/dev/null; then
+    cryptopp_cflags=$(pkg-config --cflags libcrypto++)
+    cryptopp_libs=$(pkg-config --libs libcrypto++)
+elif pkg-config --exists cryptopp 2>/dev/null; then
+    cryptopp_cflags=$(pkg-config --cflags cryptopp)
+    cryptopp_libs=$(pkg-config --libs cryptopp)
+else
+    cryptopp_cflags=""
+    cryptopp_libs="-lcryptopp"
+fi
+
+out_exe="tests/aeslayer_bench_suite"
+rm -f "$out_exe"
+
+# shellcheck disable=SC2086
+"$cxx" -std=c++20 -O2 -DNDEBUG -Wall -Wextra -I. $cryptopp_cflags \
+    tests/aeslayer_bench_suite.cpp aeslayer.cpp \
+    -o "$out_exe" $cryptopp_libs -pthread
+
+"$out_exe" "$@"
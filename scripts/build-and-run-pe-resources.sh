@@ -0,0 +1,21 @@
+#!/usr/bin/env sh
+# Builds tests/peresources_smoke.cpp and tests/peresources_bench.cpp with the
+# system compiler, runs the smoke tests and then the benchmark; arguments
+# are passed to the benchmark, e.g. --max-size 16M --runs 5. peresources.h
+# needs nothing beyond the standard library.
+set -eu
+
+repo_root=$(CDPATH= cd -- "$(dirname -- "$0")/.." && pwd)
+cd "$repo_root"
+
+cxx=${CXX:-c++}
+
+smoke_exe="tests/peresources_smoke"
+bench_exe="tests/peresources_bench"
+rm -f "$smoke_exe" "$bench_exe"
+
+"$cxx" -std=c++20 -O2 -Wall -Wextra -I. tests/peresources_smoke.cpp -o "$smoke_exe"
+"$cxx" -std=c++20 -O2 -DNDEBUG -Wall -Wextra -I. tests/peresources_bench.cpp -o "$bench_exe"
+
+"$smoke_exe"
+"$bench_exe" "$@"
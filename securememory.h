@@ -0,0 +1,434 @@
+// Steganos LockNote - self-modifying encrypted notepad
+// Copyright (C) 2006-2010 Steganos GmbH
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+
+// Page-locked memory for note text and passwords. SecurePool hands out
+// blocks from locked arena chunks (VirtualLock/mlock) so plaintext never
+// reaches the page file, wipes every block when it is given back and keeps
+// it for the next allocation of its size class instead of returning it to
+// the general heap. SecureString is std::string on top of it.
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "cryptopp/config.h"
+#include "cryptopp/misc.h"
+
+namespace Utils
+{
+	class SecurePool
+	{
+	public:
+		// allocation counters, e.g. for the benchmark suite and -diagnostics
+		struct Statistics
+		{
+			size_t m_allocations{ 0 };
+			size_t m_deallocations{ 0 };
+			// allocations served from a block an earlier one gave back
+			size_t m_reusedBlocks{ 0 };
+			// allocations above MAX_POOLED_BLOCK, mapped on their own
+			size_t m_largeAllocations{ 0 };
+			size_t m_bytesInUse{ 0 };
+			size_t m_peakBytesInUse{ 0 };
+			// arena chunks plus the live large mappings
+			size_t m_reservedBytes{ 0 };
+			size_t m_lockedBytes{ 0 };
+			// mappings the OS refused to lock (working set quota,
+			// RLIMIT_MEMLOCK); they are still wiped, just pageable
+			size_t m_lockFailures{ 0 };
+		};
+
+		// size classes are powers of two from MIN_BLOCK_SIZE to MAX_POOLED_BLOCK
+		static constexpr size_t MIN_BLOCK_SIZE = 64;
+		static constexpr size_t MAX_POOLED_BLOCK = 0x40000;
+		static constexpr size_t CHUNK_SIZE = 0x100000;
+
+		static SecurePool& Instance()
+		{
+			// never destroyed: strings owned by other statics may still give
+			// their blocks back during exit
+			static SecurePool* pool = new SecurePool();
+			return *pool;
+		}
+
+		SecurePool(const SecurePool&) = delete;
+		SecurePool& operator=(const SecurePool&) = delete;
+
+		void* Allocate(const size_t size)
+		{
+			const std::lock_guard<std::mutex> lock(m_mutex);
+			void* block = nullptr;
+			if (size > MAX_POOLED_BLOCK)
+			{
+				const size_t mappedSize = RoundToPages(size);
+				LargeBlock largeBlock;
+				block = MapLocked(mappedSize, largeBlock.m_locked, largeBlock.m_grewWorkingSet);
+				try
+				{
+					m_largeBlocks.emplace(block, largeBlock);
+				}
+				catch (...)
+				{
+					Unmap(block, mappedSize, largeBlock);
+					throw;
+				}
+				++m_statistics.m_largeAllocations;
+				m_statistics.m_reservedBytes += mappedSize;
+			}
+			else
+			{
+				const size_t sizeClass = SizeClass(size);
+				if (m_freeBlocks[sizeClass] != nullptr)
+				{
+					block = m_freeBlocks[sizeClass];
+					m_freeBlocks[sizeClass] = *static_cast<void**>(block);
+					*static_cast<void**>(block) = nullptr;
+					++m_statistics.m_reusedBlocks;
+				}
+				else
+				{
+					block = Carve(sizeClass);
+				}
+			}
+
+			++m_statistics.m_allocations;
+			m_statistics.m_bytesInUse += size;
+			m_statistics.m_peakBytesInUse = (std::max)(m_statistics.m_peakBytesInUse, m_statistics.m_bytesInUse);
+			return block;
+		}
+
+		// size must be the one the block was allocated with
+		void Deallocate(void* block, const size_t size) noexcept
+		{
+			if (block == nullptr)
+			{
+				return;
+			}
+
+			CryptoPP::SecureWipeBuffer(static_cast<CryptoPP::byte*>(block), size);
+			const std::lock_guard<std::mutex> lock(m_mutex);
+			++m_statistics.m_deallocations;
+			m_statistics.m_bytesInUse -= size;
+			if (size > MAX_POOLED_BLOCK)
+			{
+				const size_t mappedSize = RoundToPages(size);
+				LargeBlock largeBlock;
+				const auto found = m_largeBlocks.find(block);
+				if (found != m_largeBlocks.end())
+				{
+					largeBlock = found->second;
+					m_largeBlocks.erase(found);
+				}
+				Unmap(block, mappedSize, largeBlock);
+				m_statistics.m_reservedBytes -= mappedSize;
+				return;
+			}
+
+			PushFree(block, SizeClass(size));
+		}
+
+		// maps and locks arena chunks up front until at least bytes of them
+		// are unused, e.g. before a note is decrypted
+		void Reserve(const size_t bytes)
+		{
+			const std::lock_guard<std::mutex> lock(m_mutex);
+			size_t unused = m_chunkRemaining;
+			while (unused < bytes)
+			{
+				// AddChunk() moves what is left of the current chunk to the
+				// free lists, so it stays unused
+				AddChunk();
+				unused += CHUNK_SIZE;
+			}
+		}
+
+		Statistics GetStatistics() const
+		{
+			const std::lock_guard<std::mutex> lock(m_mutex);
+			return m_statistics;
+		}
+
+	private:
+		static constexpr size_t SIZE_CLASS_COUNT = std::countr_zero(MAX_POOLED_BLOCK) - std::countr_zero(MIN_BLOCK_SIZE) + 1;
+
+		struct LargeBlock
+		{
+			// false if the OS refused to lock it
+			bool m_locked{ false };
+			// the working set was grown to lock it, and shrinks back on unmap
+			bool m_grewWorkingSet{ false };
+		};
+
+		SecurePool()
+		{
+			AddChunk();
+		}
+
+		static size_t SizeClass(const size_t size)
+		{
+			return static_cast<size_t>(std::bit_width((std::max)(size, MIN_BLOCK_SIZE) - 1)) - std::countr_zero(MIN_BLOCK_SIZE);
+		}
+
+		static size_t ClassSize(const size_t sizeClass)
+		{
+			return MIN_BLOCK_SIZE << sizeClass;
+		}
+
+		static size_t RoundToPages(const size_t size)
+		{
+#ifdef _WIN32
+			SYSTEM_INFO systemInfo{};
+			::GetSystemInfo(&systemInfo);
+			const size_t pageSize = systemInfo.dwPageSize;
+#else
+			const size_t pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+#endif
+			if (size > (std::numeric_limits<size_t>::max)() - pageSize)
+			{
+				throw std::bad_alloc();
+			}
+			return (size + pageSize - 1) / pageSize * pageSize;
+		}
+
+		// one mapping straight from the OS, locked if the quota allows.
+		// grewWorkingSet: the process working set was grown by size to lock
+		// it; Unmap() shrinks it back
+		void* MapLocked(const size_t size, bool& locked, bool& grewWorkingSet)
+		{
+			grewWorkingSet = false;
+#ifdef _WIN32
+			void* mapping = ::VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+			if (mapping == nullptr)
+			{
+				throw std::bad_alloc();
+			}
+			locked = ::VirtualLock(mapping, size) != FALSE;
+			if (!locked)
+			{
+				// the default minimum working set only allows a few locked
+				// pages; grow it by this mapping and try once more
+				grewWorkingSet = ResizeWorkingSet(size, true);
+				locked = grewWorkingSet && ::VirtualLock(mapping, size);
+				if (grewWorkingSet && !locked)
+				{
+					ResizeWorkingSet(size, false);
+					grewWorkingSet = false;
+				}
+			}
+#else
+			void* mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (mapping == MAP_FAILED)
+			{
+				throw std::bad_alloc();
+			}
+#ifdef MADV_DONTDUMP
+			::madvise(mapping, size, MADV_DONTDUMP);
+#endif
+			locked = ::mlock(mapping, size) == 0;
+#endif
+			if (locked)
+			{
+				m_statistics.m_lockedBytes += size;
+			}
+			else
+			{
+				++m_statistics.m_lockFailures;
+			}
+			return mapping;
+		}
+
+		void Unmap(void* mapping, const size_t size, const LargeBlock largeBlock) noexcept
+		{
+			if (largeBlock.m_locked)
+			{
+				m_statistics.m_lockedBytes -= size;
+			}
+#ifdef _WIN32
+			if (largeBlock.m_locked)
+			{
+				::VirtualUnlock(mapping, size);
+			}
+			::VirtualFree(mapping, 0, MEM_RELEASE);
+			if (largeBlock.m_grewWorkingSet)
+			{
+				ResizeWorkingSet(size, false);
+			}
+#else
+			if (largeBlock.m_locked)
+			{
+				::munlock(mapping, size);
+			}
+			::munmap(mapping, size);
+#endif
+		}
+
+#ifdef _WIN32
+		// grows or shrinks the minimum and maximum working set by size
+		static bool ResizeWorkingSet(const size_t size, const bool grow) noexcept
+		{
+			SIZE_T minimumWorkingSet = 0;
+			SIZE_T maximumWorkingSet = 0;
+			const HANDLE process = ::GetCurrentProcess();
+			if (!::GetProcessWorkingSetSize(process, &minimumWorkingSet, &maximumWorkingSet) ||
+				(!grow && minimumWorkingSet < size))
+			{
+				return false;
+			}
+			return grow ?
+				::SetProcessWorkingSetSize(process, minimumWorkingSet + size, maximumWorkingSet + size) != FALSE :
+				::SetProcessWorkingSetSize(process, minimumWorkingSet - size, maximumWorkingSet - size) != FALSE;
+		}
+#endif
+
+		void AddChunk()
+		{
+			// what is left of the current chunk goes to the free lists, so
+			// carving never wastes it
+			while (m_chunkRemaining >= MIN_BLOCK_SIZE)
+			{
+				const size_t sizeClass = (std::min)(SizeClass(std::bit_floor(m_chunkRemaining)), SIZE_CLASS_COUNT - 1);
+				const size_t blockSize = ClassSize(sizeClass);
+				PushFree(m_chunkNext, sizeClass);
+				m_chunkNext += blockSize;
+				m_chunkRemaining -= blockSize;
+			}
+
+			// chunks are never unmapped, so a working set grown for one stays
+			bool locked = false;
+			bool grewWorkingSet = false;
+			m_chunkNext = static_cast<CryptoPP::byte*>(MapLocked(CHUNK_SIZE, locked, grewWorkingSet));
+			m_chunkRemaining = CHUNK_SIZE;
+			++m_chunkCount;
+			m_statistics.m_reservedBytes += CHUNK_SIZE;
+		}
+
+		void* Carve(const size_t sizeClass)
+		{
+			const size_t blockSize = ClassSize(sizeClass);
+			if (m_chunkRemaining < blockSize)
+			{
+				AddChunk();
+			}
+			void* block = m_chunkNext;
+			m_chunkNext += blockSize;
+			m_chunkRemaining -= blockSize;
+			return block;
+		}
+
+		void PushFree(void* block, const size_t sizeClass)
+		{
+			*static_cast<void**>(block) = m_freeBlocks[sizeClass];
+			m_freeBlocks[sizeClass] = block;
+		}
+
+		mutable std::mutex m_mutex;
+		std::array<void*, SIZE_CLASS_COUNT> m_freeBlocks{};
+		CryptoPP::byte* m_chunkNext{ nullptr };
+		size_t m_chunkRemaining{ 0 };
+		size_t m_chunkCount{ 0 };
+		std::map<void*, LargeBlock> m_largeBlocks;
+		Statistics m_statistics;
+	};
+
+	// standard allocator over SecurePool::Instance()
+	template <class T>
+	class SecureAllocator
+	{
+	public:
+		using value_type = T;
+
+		SecureAllocator() noexcept = default;
+
+		template <class U>
+		SecureAllocator(const SecureAllocator<U>&) noexcept
+		{
+		}
+
+		T* allocate(const size_t count)
+		{
+			if (count > (std::numeric_limits<size_t>::max)() / sizeof(T))
+			{
+				throw std::bad_array_new_length();
+			}
+			return static_cast<T*>(SecurePool::Instance().Allocate(count * sizeof(T)));
+		}
+
+		void deallocate(T* block, const size_t count) noexcept
+		{
+			SecurePool::Instance().Deallocate(block, count * sizeof(T));
+		}
+
+		template <class U>
+		bool operator==(const SecureAllocator<U>&) const noexcept
+		{
+			return true;
+		}
+	};
+
+	// std::basic_string in the SecurePool. Its whole capacity is wiped on
+	// destruction as well, which covers short strings kept inside the object.
+	template <class CharT>
+	class BasicSecureString : public std::basic_string<CharT, std::char_traits<CharT>, SecureAllocator<CharT>>
+	{
+	public:
+		using Base = std::basic_string<CharT, std::char_traits<CharT>, SecureAllocator<CharT>>;
+		using Base::Base;
+		using Base::operator=;
+
+		BasicSecureString() = default;
+		BasicSecureString(const BasicSecureString&) = default;
+		BasicSecureString(BasicSecureString&&) = default;
+		BasicSecureString& operator=(const BasicSecureString&) = default;
+		BasicSecureString& operator=(BasicSecureString&&) = default;
+
+		// results of substr(), operator+ and the like
+		BasicSecureString(const Base& other)
+			: Base(other)
+		{
+		}
+
+		BasicSecureString(Base&& other) noexcept
+			: Base(std::move(other))
+		{
+		}
+
+		~BasicSecureString()
+		{
+			CryptoPP::SecureWipeBuffer(reinterpret_cast<CryptoPP::byte*>(this->data()), (this->capacity() + 1) * sizeof(CharT));
+		}
+	};
+
+	using SecureString = BasicSecureString<char>;
+	using SecureWString = BasicSecureString<wchar_t>;
+	using SecureByteVector = std::vector<CryptoPP::byte, SecureAllocator<CryptoPP::byte>>;
+}
@@ -0,0 +1,448 @@
+#include "aeslayer.h"
+#include "cryptopp/filters.h"
+#include "cryptopp/osrng.h"
+#include "cryptopp/pwdbased.h"
+#include "cryptopp/scrypt.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace
+{
+	using Clock = std::chrono::steady_clock;
+
+	constexpr int kUnlockRuns = 5;
+
+	double ElapsedMilliseconds(const Clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}
+
+	double Median(std::vector<double> samples)
+	{
+		std::sort(samples.begin(), samples.end());
+		return samples[samples.size() / 2];
+	}
+
+	const char* KdfModeName(const CryptoPP::AESLayer::KdfMode mode)
+	{
+		if (mode == CryptoPP::AESLayer::KdfMode::Argon2id)
+		{
+			return "argon2id";
+		}
+		return mode == CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256 ? "pbkdf2-sha256" : "scrypt";
+	}
+
+	std::vector<CryptoPP::byte> EncryptCompatible(const std::string& plaintext, const std::string& password, const CryptoPP::AESLayer::KdfMode mode)
+	{
+		CryptoPP::AutoSeededRandomPool rng;
+		CryptoPP::AESLayer::EncryptionOptions options;
+		options.m_kdfMode = mode;
+
+		std::vector<CryptoPP::byte> cipher(CryptoPP::AESLayer::MaxCiphertextLen(static_cast<unsigned int>(plaintext.size())), 0);
+		cipher.resize(CryptoPP::AESLayer::Encrypt(rng, password, cipher.data(), plaintext, options));
+		return cipher;
+	}
+
+	std::vector<CryptoPP::byte> EncryptSegmented(
+		const std::string& plaintext,
+		const std::string& password,
+		const CryptoPP::AESLayer::KdfMode mode,
+		const CryptoPP::AESLayer::CipherMode cipherMode = CryptoPP::AESLayer::CipherMode::AesCbcHmacSha256)
+	{
+		CryptoPP::AutoSeededRandomPool rng;
+		CryptoPP::AESLayer::EncryptionOptions options;
+		options.m_kdfMode = mode;
+		options.m_cipherMode = cipherMode;
+
+		std::string cipher;
+		CryptoPP::StringSink sink(cipher);
+		CryptoPP::AESLayer::StreamEncryptor encryptor(rng, password, sink, options);
+		encryptor.Put(reinterpret_cast<const CryptoPP::byte*>(plaintext.data()), plaintext.size());
+		encryptor.Finish();
+		return std::vector<CryptoPP::byte>(cipher.begin(), cipher.end());
+	}
+
+	// median wall time of AESLayer::Decrypt, i.e. what the user waits for
+	// after entering the password
+	double MeasureUnlock(const std::vector<CryptoPP::byte>& cipher, const std::string& password)
+	{
+		std::vector<double> samples;
+		std::vector<CryptoPP::byte> output(cipher.size(), 0);
+		for (int run = 0; run < kUnlockRuns; ++run)
+		{
+			const Clock::time_point start = Clock::now();
+			const CryptoPP::DecodingResult result = CryptoPP::AESLayer::Decrypt(
+				password,
+				output.data(),
+				CryptoPP::ConstByteArrayParameter(cipher.data(), cipher.size()));
+			samples.push_back(ElapsedMilliseconds(start));
+			if (!result.isValidCoding)
+			{
+				std::cout << "decryption failed" << '\n';
+				return -1.0;
+			}
+		}
+		return Median(samples);
+	}
+
+	// median time until AESLayer::Decrypt rejects a wrong password
+	double MeasureRejection(const std::vector<CryptoPP::byte>& cipher, const std::string& wrongPassword)
+	{
+		std::vector<double> samples;
+		std::vector<CryptoPP::byte> output(cipher.size(), 0);
+		for (int run = 0; run < kUnlockRuns; ++run)
+		{
+			const Clock::time_point start = Clock::now();
+			const CryptoPP::DecodingResult result = CryptoPP::AESLayer::Decrypt(
+				wrongPassword,
+				output.data(),
+				CryptoPP::ConstByteArrayParameter(cipher.data(), cipher.size()));
+			samples.push_back(ElapsedMilliseconds(start));
+			if (result.isValidCoding)
+			{
+				std::cout << "wrong password accepted" << '\n';
+				return -1.0;
+			}
+		}
+		return Median(samples);
+	}
+
+	void PrintRow(const char* benchmark, const char* variant, const CryptoPP::AESLayer::KdfMode mode, const double value, const char* unit)
+	{
+		std::cout << std::left << std::setw(10) << benchmark
+			<< std::setw(30) << variant
+			<< std::setw(16) << KdfModeName(mode)
+			<< std::right << std::setw(12) << std::fixed << std::setprecision(2) << value
+			<< ' ' << unit << '\n';
+	}
+
+	// one hardened derivation with the parameters AESLayer uses for keys
+	double MeasureSingleDerivation(const std::string& password, const CryptoPP::AESLayer::KdfMode mode)
+	{
+		const CryptoPP::byte* secret = reinterpret_cast<const CryptoPP::byte*>(password.data());
+		CryptoPP::SecByteBlock salt(CryptoPP::AESLayer::SALT_SIZE);
+		CryptoPP::SecByteBlock key(CryptoPP::SHA256::DIGESTSIZE);
+		CryptoPP::AutoSeededRandomPool().GenerateBlock(salt, salt.size());
+
+		std::vector<double> samples;
+		for (int run = 0; run < kUnlockRuns; ++run)
+		{
+			const Clock::time_point start = Clock::now();
+			if (mode == CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256)
+			{
+				CryptoPP::PKCS5_PBKDF2_HMAC<CryptoPP::SHA256>().DeriveKey(
+					key, key.size(), 0, secret, password.size(), salt, salt.size(), CryptoPP::AESLayer::KEY_ITERATIONS, 0.0);
+			}
+			else
+			{
+				CryptoPP::Scrypt().DeriveKey(
+					key, key.size(), secret, password.size(), salt, salt.size(), CryptoPP::AESLayer::DERIVATION_COST, 8, 5);
+			}
+			samples.push_back(ElapsedMilliseconds(start));
+		}
+		return Median(samples);
+	}
+
+	// KDF latency of legacy/v2 payloads: unlocking costs the key and the IV
+	// derivation; with a second hardware thread they overlap in PBKDF2 mode,
+	// so the unlock should take about one derivation instead of two
+	void RunKdfBenchmark()
+	{
+		const std::string password = "correct horse battery staple";
+		const std::string plaintext = "LockNote2 benchmark note";
+		std::cout << "hardware threads: " << std::thread::hardware_concurrency() << '\n';
+
+		for (const CryptoPP::AESLayer::KdfMode mode : { CryptoPP::AESLayer::KdfMode::Scrypt, CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256 })
+		{
+			const double derivation = MeasureSingleDerivation(password, mode);
+			const double unlock = MeasureUnlock(EncryptCompatible(plaintext, password, mode), password);
+			const double sequential = mode == CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256 ? 2.0 * derivation : derivation;
+			PrintRow("kdf", "one key derivation", mode, derivation, "ms");
+			PrintRow("kdf", "key + IV, sequential (est.)", mode, sequential, "ms");
+			PrintRow("kdf", "v2 unlock (measured)", mode, unlock, "ms");
+			PrintRow("kdf", "speedup vs sequential", mode, unlock > 0.0 ? sequential / unlock : 0.0, "x");
+		}
+	}
+
+	// save and open throughput of a large segmented note per cipher mode;
+	// PBKDF2 keeps the single KDF run small next to the bulk work
+	void RunCipherBenchmark()
+	{
+		constexpr size_t kNoteSize = 64 * 1024 * 1024;
+		constexpr double kNoteMegabytes = kNoteSize / (1024.0 * 1024.0);
+		const std::string password = "correct horse battery staple";
+		const std::string plaintext(kNoteSize, 'n');
+		const CryptoPP::AESLayer::KdfMode mode = CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256;
+
+		for (const CryptoPP::AESLayer::CipherMode cipherMode : { CryptoPP::AESLayer::CipherMode::AesCbcHmacSha256, CryptoPP::AESLayer::CipherMode::AesGcm })
+		{
+			const bool gcm = cipherMode == CryptoPP::AESLayer::CipherMode::AesGcm;
+			std::vector<double> samples;
+			std::vector<CryptoPP::byte> cipher;
+			for (int run = 0; run < kUnlockRuns; ++run)
+			{
+				const Clock::time_point start = Clock::now();
+				cipher = EncryptSegmented(plaintext, password, mode, cipherMode);
+				samples.push_back(ElapsedMilliseconds(start));
+			}
+			PrintRow("cipher", gcm ? "save AES-GCM (v3, 64 MB)" : "save CBC+HMAC (v3, 64 MB)", mode, kNoteMegabytes * 1000.0 / Median(samples), "MB/s");
+
+			const double unlock = MeasureUnlock(cipher, password);
+			PrintRow("cipher", gcm ? "open AES-GCM (v3, 64 MB)" : "open CBC+HMAC (v3, 64 MB)", mode, unlock > 0.0 ? kNoteMegabytes * 1000.0 / unlock : 0.0, "MB/s");
+		}
+	}
+
+	struct CompatibleTimings
+	{
+		double m_encryptMilliseconds{ 0.0 };
+		double m_decryptMilliseconds{ 0.0 };
+	};
+
+	// median Encrypt/Decrypt wall time of a v2 payload (PBKDF2)
+	CompatibleTimings MeasureCompatible(const size_t size, const int runs)
+	{
+		const std::string password = "correct horse battery staple";
+		const std::string plaintext(size, 'n');
+		CryptoPP::AutoSeededRandomPool rng;
+		CryptoPP::AESLayer::EncryptionOptions options;
+		options.m_kdfMode = CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256;
+
+		std::vector<CryptoPP::byte> cipher(CryptoPP::AESLayer::MaxCiphertextLen(static_cast<unsigned int>(size)), 0);
+		std::vector<CryptoPP::byte> output(cipher.size(), 0);
+		std::vector<double> encryptSamples;
+		std::vector<double> decryptSamples;
+		for (int run = 0; run < runs; ++run)
+		{
+			Clock::time_point start = Clock::now();
+			const unsigned int cipherLength = CryptoPP::AESLayer::Encrypt(rng, password, cipher.data(), plaintext, options);
+			encryptSamples.push_back(ElapsedMilliseconds(start));
+
+			start = Clock::now();
+			const CryptoPP::DecodingResult result = CryptoPP::AESLayer::Decrypt(
+				password,
+				output.data(),
+				CryptoPP::ConstByteArrayParameter(static_cast<const CryptoPP::byte*>(cipher.data()), cipherLength));
+			decryptSamples.push_back(ElapsedMilliseconds(start));
+			if (!result.isValidCoding)
+			{
+				std::cout << "decryption failed" << '\n';
+			}
+		}
+		return { Median(encryptSamples), Median(decryptSamples) };
+	}
+
+	// "-" when the bulk work drowns in the KDF's run-to-run noise
+	std::string FormatNetThroughput(const double megabytes, const double totalMilliseconds, const double kdfMilliseconds)
+	{
+		const double bulkMilliseconds = totalMilliseconds - kdfMilliseconds;
+		if (bulkMilliseconds < 0.05 * kdfMilliseconds)
+		{
+			return "-";
+		}
+
+		std::ostringstream text;
+		text << std::fixed << std::setprecision(1) << megabytes * 1000.0 / bulkMilliseconds;
+		return text.str();
+	}
+
+	// bulk throughput of the fused CBC+HMAC pipeline for v2 payloads: wall
+	// time per call, and MB/s with the time of an empty note (the KDF)
+	// subtracted so only the bulk work is counted
+	void RunThroughputBenchmark()
+	{
+		const CompatibleTimings kdfOnly = MeasureCompatible(0, kUnlockRuns);
+		const std::array<std::pair<const char*, size_t>, 3> sizes{ {
+			{ "1 KB (v2)", 1024 },
+			{ "1 MB (v2)", 1024 * 1024 },
+			{ "256 MB (v2)", 256 * 1024 * 1024 } } };
+
+		std::cout << std::left << std::setw(10) << "bulk" << std::setw(14) << "size"
+			<< std::right << std::setw(12) << "enc ms" << std::setw(12) << "dec ms"
+			<< std::setw(12) << "enc MB/s" << std::setw(12) << "dec MB/s" << '\n';
+		for (const auto& [variant, size] : sizes)
+		{
+			const CompatibleTimings timings = MeasureCompatible(size, size > 64 * 1024 * 1024 ? 3 : kUnlockRuns);
+			const double megabytes = size / (1024.0 * 1024.0);
+			std::cout << std::left << std::setw(10) << "bulk" << std::setw(14) << variant
+				<< std::right << std::fixed << std::setprecision(2)
+				<< std::setw(12) << timings.m_encryptMilliseconds
+				<< std::setw(12) << timings.m_decryptMilliseconds
+				<< std::setw(12) << FormatNetThroughput(megabytes, timings.m_encryptMilliseconds, kdfOnly.m_encryptMilliseconds)
+				<< std::setw(12) << FormatNetThroughput(megabytes, timings.m_decryptMilliseconds, kdfOnly.m_decryptMilliseconds) << '\n';
+		}
+	}
+
+	// KDF calibration: parameters chosen for a few target unlock times, the
+	// calibration's estimate, and the time one derivation really takes
+	void RunCalibrationBenchmark()
+	{
+		for (const CryptoPP::AESLayer::KdfMode mode : { CryptoPP::AESLayer::KdfMode::Scrypt, CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256, CryptoPP::AESLayer::KdfMode::Argon2id })
+		{
+			for (const unsigned int target : { 250u, 500u, 1000u })
+			{
+				const Clock::time_point start = Clock::now();
+				const CryptoPP::AESLayer::KdfCalibration calibration = CryptoPP::AESLayer::CalibrateKdf(mode, target);
+				const double calibrationTime = ElapsedMilliseconds(start);
+				const double measured = CryptoPP::AESLayer::MeasureKdf(mode, calibration.m_parameters);
+
+				std::cout << std::left << std::setw(10) << "calibrate"
+					<< std::setw(8) << (std::to_string(target) + "ms")
+					<< std::setw(16) << KdfModeName(mode)
+					<< "cost=" << std::setw(9) << calibration.m_parameters.m_cost
+					<< "r=" << std::setw(4) << calibration.m_parameters.m_blockSize
+					<< "p=" << std::setw(4) << calibration.m_parameters.m_parallelism
+					<< std::right << std::fixed << std::setprecision(2)
+					<< std::setw(10) << calibration.m_estimatedMilliseconds << " ms est."
+					<< std::setw(10) << measured << " ms measured"
+					<< std::setw(10) << calibrationTime << " ms to calibrate" << '\n';
+			}
+		}
+	}
+
+	// scrypt latency, Crypto++'s Scrypt::DeriveKey (lanes one after another
+	// unless it is built with OpenMP) against AESLayer::DeriveScrypt (one
+	// thread per lane), at the legacy cost and at a calibrated-size N
+	void RunScryptBenchmark()
+	{
+		const std::string password = "correct horse battery staple";
+		const CryptoPP::byte* secret = reinterpret_cast<const CryptoPP::byte*>(password.data());
+		CryptoPP::SecByteBlock salt(CryptoPP::AESLayer::SALT_SIZE);
+		CryptoPP::SecByteBlock key(CryptoPP::SHA256::DIGESTSIZE);
+		CryptoPP::AutoSeededRandomPool().GenerateBlock(salt, salt.size());
+		const CryptoPP::AESLayer::KdfMode mode = CryptoPP::AESLayer::KdfMode::Scrypt;
+
+		for (const CryptoPP::word32 cost : { static_cast<CryptoPP::word32>(CryptoPP::AESLayer::DERIVATION_COST), CryptoPP::word32{ 0x10000 } })
+		{
+			CryptoPP::AESLayer::KdfParameters parameters = CryptoPP::AESLayer::DefaultKdfParameters(mode);
+			parameters.m_cost = cost;
+			std::vector<double> serial;
+			std::vector<double> parallel;
+			for (int run = 0; run < kUnlockRuns; ++run)
+			{
+				Clock::time_point start = Clock::now();
+				CryptoPP::Scrypt().DeriveKey(
+					key, key.size(), secret, password.size(), salt, salt.size(), parameters.m_cost, parameters.m_blockSize, parameters.m_parallelism);
+				serial.push_back(ElapsedMilliseconds(start));
+
+				start = Clock::now();
+				CryptoPP::AESLayer::DeriveScrypt(
+					key, key.size(), CryptoPP::ConstByteArrayParameter(password), CryptoPP::ConstByteArrayParameter(static_cast<const CryptoPP::byte*>(salt.begin()), salt.size()), parameters);
+				parallel.push_back(ElapsedMilliseconds(start));
+			}
+
+			const std::string suffix = " N=" + std::to_string(cost);
+			PrintRow("scrypt", ("DeriveKey" + suffix).c_str(), mode, Median(serial), "ms");
+			PrintRow("scrypt", ("lane-parallel" + suffix).c_str(), mode, Median(parallel), "ms");
+			PrintRow("scrypt", "speedup", mode, Median(parallel) > 0.0 ? Median(serial) / Median(parallel) : 0.0, "x");
+		}
+	}
+
+	// Argon2id at the default 64 MiB and three passes with 1 to 8 lanes, one
+	// thread per lane: the memory and work stay the same, only the split
+	// changes, so the time should drop with the lane count up to the
+	// number of hardware threads
+	void RunArgon2Benchmark()
+	{
+		const CryptoPP::AESLayer::KdfMode mode = CryptoPP::AESLayer::KdfMode::Argon2id;
+		CryptoPP::AESLayer::KdfParameters parameters = CryptoPP::AESLayer::DefaultKdfParameters(mode);
+		double singleLane = 0.0;
+		for (const CryptoPP::word32 lanes : { 1u, 2u, 4u, 8u })
+		{
+			parameters.m_parallelism = lanes;
+			std::vector<double> samples;
+			for (int run = 0; run < kUnlockRuns; ++run)
+			{
+				samples.push_back(CryptoPP::AESLayer::MeasureKdf(mode, parameters));
+			}
+			const double derivation = Median(samples);
+			if (lanes == 1)
+			{
+				singleLane = derivation;
+			}
+			const std::string label = "64 MiB, t=3, " + std::to_string(lanes) + (lanes == 1 ? " lane" : " lanes");
+			PrintRow("argon2", label.c_str(), mode, derivation, "ms");
+			PrintRow("argon2", "speedup vs 1 lane", mode, derivation > 0.0 ? singleLane / derivation : 0.0, "x");
+		}
+	}
+
+	// unlock latency of a small note: legacy/v2 payloads run the KDF twice
+	// (key and IV), segmented payloads once
+	void RunUnlockBenchmark()
+	{
+		const std::string password = "correct horse battery staple";
+		const std::string plaintext = "LockNote2 benchmark note";
+
+		for (const CryptoPP::AESLayer::KdfMode mode : { CryptoPP::AESLayer::KdfMode::Scrypt, CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256 })
+		{
+			PrintRow("unlock", "two derivations (v2/legacy)", mode, MeasureUnlock(EncryptCompatible(plaintext, password, mode), password), "ms");
+			PrintRow("unlock", "single derivation (v3)", mode, MeasureUnlock(EncryptSegmented(plaintext, password, mode), password), "ms");
+		}
+	}
+
+	// wrong password on a large note: legacy/v2 payloads MAC the whole
+	// ciphertext (and fall back to further KDFs), segmented payloads stop at
+	// the key check
+	void RunWrongPasswordBenchmark()
+	{
+		constexpr size_t kNoteSize = 64 * 1024 * 1024;
+		const std::string password = "correct horse battery staple";
+		const std::string plaintext(kNoteSize, 'n');
+
+		for (const CryptoPP::AESLayer::KdfMode mode : { CryptoPP::AESLayer::KdfMode::Scrypt, CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256 })
+		{
+			PrintRow("reject", "full MAC (v2/legacy, 64 MB)", mode, MeasureRejection(EncryptCompatible(plaintext, password, mode), password + "x"), "ms");
+			PrintRow("reject", "key check (v3, 64 MB)", mode, MeasureRejection(EncryptSegmented(plaintext, password, mode), password + "x"), "ms");
+		}
+	}
+}
+
+// no argument runs everything; "kdf", "calibrate", "scrypt", "argon2",
+// "unlock", "reject", "cipher" or "throughput" runs one target
+int main(int argc, char* argv[])
+{
+	const std::string_view target = argc > 1 ? argv[1] : "";
+	if (target.empty() || target == "kdf")
+	{
+		RunKdfBenchmark();
+	}
+	if (target.empty() || target == "calibrate")
+	{
+		RunCalibrationBenchmark();
+	}
+	if (target.empty() || target == "scrypt")
+	{
+		RunScryptBenchmark();
+	}
+	if (target.empty() || target == "argon2")
+	{
+		RunArgon2Benchmark();
+	}
+	if (target.empty() || target == "unlock")
+	{
+		RunUnlockBenchmark();
+	}
+	if (target.empty() || target == "reject")
+	{
+		RunWrongPasswordBenchmark();
+	}
+	if (target.empty() || target == "cipher")
+	{
+		RunCipherBenchmark();
+	}
+	if (target.empty() || target == "throughput")
+	{
+		RunThroughputBenchmark();
+	}
+	return 0;
+}
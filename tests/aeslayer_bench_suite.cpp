@@ -0,0 +1,748 @@
+// Portable regression benchmark for aeslayer.cpp and the crypto half of
+// utils.h (cryptoutils.h). Builds with a stock compiler and Crypto++ on
+// Linux and Windows, see scripts/build-and-run-aes-bench-suite.sh.
+//
+// Output is JSON Lines on stdout, one object per measurement:
+//   {"bench":"meta",...}    machine, compiler and backend description
+//   {"bench":"kdf",...}     KDF latency per mode, default and calibrated cost
+//   {"bench":"cipher",...}  encrypt/decrypt per format, KDF mode and size:
+//                           median milliseconds, MB/s, peak RSS and heap
+//                           allocations per operation, and the payload size
+//                           (hex characters for utils-hex; utils-hex and
+//                           utils-binary compress)
+//   {"bench":"save",...}    utils-hex incremental save of a one-character
+//                           edit per KDF mode and size (non-empty sizes)
+//   {"bench":"first_screen",...}  decryption of the first screen of an
+//                           indexed note against the whole note, after the KDF
+//   {"bench":"hex",...}     hex encode/decode MB/s of HexEncoder/HexDecoder
+//                           and of each Utils::HexEncode/HexDecode path the
+//                           CPU supports (non-empty sizes, utils-hex only)
+//
+// usage: aeslayer_bench_suite [--max-size BYTES[K|M|G]] [--runs N]
+//                             [--format NAME] [--kdf NAME]
+
+#include "aeslayer.h"
+#include "cryptoutils.h"
+#include "cryptopp/filters.h"
+#include "cryptopp/hex.h"
+#include "cryptopp/osrng.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <span>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+namespace
+{
+	// every heap allocation made by the process, including Crypto++'s
+	// SecBlock buffers and the worker threads
+	std::atomic<unsigned long long> g_allocations{ 0 };
+}
+
+#if defined(__GLIBC__)
+// glibc: interpose the malloc family, which operator new and Crypto++'s
+// allocators both end up in
+extern "C"
+{
+	void* __libc_malloc(size_t size);
+	void* __libc_calloc(size_t count, size_t size);
+	void* __libc_realloc(void* pointer, size_t size);
+	void* __libc_memalign(size_t alignment, size_t size);
+
+	void* malloc(size_t size)
+	{
+		g_allocations.fetch_add(1, std::memory_order_relaxed);
+		return __libc_malloc(size);
+	}
+
+	void* calloc(size_t count, size_t size)
+	{
+		g_allocations.fetch_add(1, std::memory_order_relaxed);
+		return __libc_calloc(count, size);
+	}
+
+	void* realloc(void* pointer, size_t size)
+	{
+		g_allocations.fetch_add(1, std::memory_order_relaxed);
+		return __libc_realloc(pointer, size);
+	}
+
+	void* memalign(size_t alignment, size_t size)
+	{
+		g_allocations.fetch_add(1, std::memory_order_relaxed);
+		return __libc_memalign(alignment, size);
+	}
+
+	void* aligned_alloc(size_t alignment, size_t size)
+	{
+		g_allocations.fetch_add(1, std::memory_order_relaxed);
+		return __libc_memalign(alignment, size);
+	}
+
+	int posix_memalign(void** pointer, size_t alignment, size_t size)
+	{
+		g_allocations.fetch_add(1, std::memory_order_relaxed);
+		void* memory = __libc_memalign(alignment, size);
+		if (!memory)
+		{
+			return ENOMEM;
+		}
+		*pointer = memory;
+		return 0;
+	}
+}
+#else
+// elsewhere only C++ allocations are counted; Crypto++ allocates SecBlock
+// buffers with malloc, so those are missing from the totals
+void* operator new(size_t size)
+{
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* memory = std::malloc(size ? size : 1))
+	{
+		return memory;
+	}
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+	return ::operator new(size);
+}
+
+void operator delete(void* pointer) noexcept
+{
+	std::free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept
+{
+	std::free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept
+{
+	std::free(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept
+{
+	std::free(pointer);
+}
+#endif
+
+namespace
+{
+	using Clock = std::chrono::steady_clock;
+
+	constexpr size_t KiB = 1024;
+	constexpr size_t MiB = 1024 * KiB;
+	constexpr size_t GiB = 1024 * MiB;
+	constexpr std::array<size_t, 7> kSizes{ 0, KiB, 64 * KiB, MiB, 16 * MiB, 256 * MiB, GiB };
+	// sizes from here on are measured once, the bulk work dwarfs the noise
+	constexpr size_t kSingleRunSize = 256 * MiB;
+	constexpr int kSchemaVersion = 1;
+
+	struct Options
+	{
+		size_t m_maxSize{ GiB };
+		int m_runs{ 3 };
+		std::string m_format;
+		std::string m_kdf;
+	};
+
+	// the payload formats a note can be saved in
+	enum class Format
+	{
+		V2,			// AESLayer::Encrypt/Decrypt, LN2\x02
+		V3Cbc,		// StreamEncryptor/StreamDecryptor, CBC + HMAC-SHA256
+		V3Gcm,		// StreamEncryptor/StreamDecryptor, AES-GCM
+		UtilsHex,	// Utils::EncryptString/DecryptString, calibrated KDF cost
+		UtilsBinary	// Utils::EncryptPayload/DecryptPayload, as stored in the resource
+	};
+
+	constexpr std::array<Format, 5> kFormats{ Format::V2, Format::V3Cbc, Format::V3Gcm, Format::UtilsHex, Format::UtilsBinary };
+	constexpr std::array<CryptoPP::AESLayer::KdfMode, 3> kKdfModes{
+		CryptoPP::AESLayer::KdfMode::Scrypt,
+		CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256,
+		CryptoPP::AESLayer::KdfMode::Argon2id };
+
+	const char* FormatName(const Format format)
+	{
+		switch (format)
+		{
+		case Format::V2:
+			return "v2";
+		case Format::V3Cbc:
+			return "v3-cbc";
+		case Format::V3Gcm:
+			return "v3-gcm";
+		case Format::UtilsHex:
+			return "utils-hex";
+		default:
+			return "utils-binary";
+		}
+	}
+
+	const char* KdfModeName(const CryptoPP::AESLayer::KdfMode mode)
+	{
+		if (mode == CryptoPP::AESLayer::KdfMode::Argon2id)
+		{
+			return "argon2id";
+		}
+		return mode == CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256 ? "pbkdf2-sha256" : "scrypt";
+	}
+
+	bool SupportsKdfMode(const Format format, const CryptoPP::AESLayer::KdfMode mode)
+	{
+		return format != Format::V2 || mode != CryptoPP::AESLayer::KdfMode::Argon2id;
+	}
+
+	double ElapsedMilliseconds(const Clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}
+
+	double Median(std::vector<double> samples)
+	{
+		std::sort(samples.begin(), samples.end());
+		return samples[samples.size() / 2];
+	}
+
+	// restarts the peak RSS window where the OS allows it; returns false if
+	// the peak can only be read for the whole process
+	bool ResetPeakRss()
+	{
+#if defined(__linux__)
+		std::ofstream clearRefs("/proc/self/clear_refs");
+		clearRefs << "5";
+		clearRefs.flush();
+		return clearRefs.good();
+#else
+		return false;
+#endif
+	}
+
+	// peak resident set size in KiB since the last ResetPeakRss()
+	unsigned long long PeakRssKilobytes()
+	{
+#if defined(_WIN32)
+		PROCESS_MEMORY_COUNTERS counters{};
+		if (::GetProcessMemoryInfo(::GetCurrentProcess(), &counters, sizeof(counters)))
+		{
+			return counters.PeakWorkingSetSize / KiB;
+		}
+		return 0;
+#else
+#if defined(__linux__)
+		std::ifstream status("/proc/self/status");
+		std::string line;
+		while (std::getline(status, line))
+		{
+			if (line.rfind("VmHWM:", 0) == 0)
+			{
+				return std::strtoull(line.c_str() + 6, nullptr, 10);
+			}
+		}
+#endif
+		rusage usage{};
+		getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+		return static_cast<unsigned long long>(usage.ru_maxrss) / KiB;
+#else
+		return static_cast<unsigned long long>(usage.ru_maxrss);
+#endif
+#endif
+	}
+
+	std::string JsonString(const std::string_view value)
+	{
+		std::string quoted = "\"";
+		for (const char c : value)
+		{
+			if (c == '"' || c == '\\')
+			{
+				quoted += '\\';
+			}
+			quoted += c;
+		}
+		return quoted + '"';
+	}
+
+	// JSON has no infinity, so rates of empty plaintexts are null
+	std::string Rate(const size_t bytes, const double milliseconds)
+	{
+		if (bytes == 0 || milliseconds <= 0.0)
+		{
+			return "null";
+		}
+		std::ostringstream rate;
+		rate << std::fixed << std::setprecision(2) << (bytes / static_cast<double>(MiB)) * 1000.0 / milliseconds;
+		return rate.str();
+	}
+
+	// timing, memory and allocation figures of one operation
+	struct Measurement
+	{
+		double m_milliseconds{ 0.0 };
+		unsigned long long m_peakRssKilobytes{ 0 };
+		unsigned long long m_allocations{ 0 };
+		bool m_ok{ true };
+	};
+
+	template <typename Operation>
+	Measurement Measure(const int runs, Operation&& operation)
+	{
+		Measurement measurement;
+		std::vector<double> samples;
+		ResetPeakRss();
+		const unsigned long long allocationsBefore = g_allocations.load(std::memory_order_relaxed);
+		for (int run = 0; run < runs; ++run)
+		{
+			const Clock::time_point start = Clock::now();
+			measurement.m_ok &= operation();
+			samples.push_back(ElapsedMilliseconds(start));
+		}
+		measurement.m_allocations = (g_allocations.load(std::memory_order_relaxed) - allocationsBefore) / runs;
+		measurement.m_peakRssKilobytes = PeakRssKilobytes();
+		measurement.m_milliseconds = Median(samples);
+		return measurement;
+	}
+
+	// buffers for the largest size, allocated and touched once so they show
+	// up in every RSS figure the same way instead of in the first row
+	struct Buffers
+	{
+		std::string m_plaintext;
+		std::vector<CryptoPP::byte> m_cipher;
+		std::vector<CryptoPP::byte> m_output;
+		std::string m_hex;
+		std::vector<CryptoPP::byte> m_payload;
+		Utils::SecureString m_text;
+	};
+
+	CryptoPP::AESLayer::EncryptionOptions MakeOptions(const Format format, const CryptoPP::AESLayer::KdfMode mode)
+	{
+		CryptoPP::AESLayer::EncryptionOptions options;
+		options.m_kdfMode = mode;
+		options.m_cipherMode = format == Format::V3Gcm ? CryptoPP::AESLayer::CipherMode::AesGcm : CryptoPP::AESLayer::CipherMode::AesCbcHmacSha256;
+		return options;
+	}
+
+	bool RunCipherRow(const Options& options, Buffers& buffers, const Format format, const CryptoPP::AESLayer::KdfMode mode, const size_t size)
+	{
+		const std::string password = "correct horse battery staple";
+		const int runs = size >= kSingleRunSize ? 1 : options.m_runs;
+		const CryptoPP::AESLayer::EncryptionOptions encryptionOptions = MakeOptions(format, mode);
+		const std::span<const CryptoPP::byte> plaintext(reinterpret_cast<const CryptoPP::byte*>(buffers.m_plaintext.data()), size);
+		const std::string_view text = std::string_view(buffers.m_plaintext).substr(0, size);
+		CryptoPP::AutoSeededRandomPool rng;
+		size_t cipherLength = 0;
+
+		const Measurement encrypt = Measure(runs, [&]() {
+			if (format == Format::V2)
+			{
+				cipherLength = CryptoPP::AESLayer::Encrypt(rng, password, std::span<CryptoPP::byte>(buffers.m_cipher), plaintext, encryptionOptions);
+				return true;
+			}
+			if (format == Format::UtilsHex)
+			{
+				return Utils::EncryptString(text, password, buffers.m_hex, mode);
+			}
+			if (format == Format::UtilsBinary)
+			{
+				return Utils::EncryptPayload(text, password, buffers.m_payload, mode);
+			}
+			CryptoPP::ArraySink sink(buffers.m_cipher.data(), buffers.m_cipher.size());
+			CryptoPP::AESLayer::StreamEncryptor encryptor(rng, password, sink, encryptionOptions);
+			encryptor.Put(plaintext.data(), plaintext.size());
+			encryptor.Finish();
+			cipherLength = static_cast<size_t>(sink.TotalPutLength());
+			return true;
+		});
+
+		const Measurement decrypt = Measure(runs, [&]() {
+			if (format == Format::V2)
+			{
+				const CryptoPP::DecodingResult result = CryptoPP::AESLayer::Decrypt(
+					password,
+					buffers.m_output.data(),
+					CryptoPP::ConstByteArrayParameter(static_cast<const CryptoPP::byte*>(buffers.m_cipher.data()), cipherLength));
+				return result.isValidCoding && result.messageLength == size;
+			}
+			if (format == Format::UtilsHex)
+			{
+				return Utils::DecryptString(buffers.m_hex, password, buffers.m_text) && buffers.m_text.size() == size;
+			}
+			if (format == Format::UtilsBinary)
+			{
+				return Utils::DecryptPayload(buffers.m_payload, password, buffers.m_text) && buffers.m_text.size() == size;
+			}
+			CryptoPP::ArraySink sink(buffers.m_output.data(), buffers.m_output.size());
+			CryptoPP::AESLayer::StreamDecryptor decryptor(password, sink);
+			return decryptor.Put(buffers.m_cipher.data(), cipherLength) && decryptor.Finish() && sink.TotalPutLength() == size;
+		});
+
+		std::cout << "{\"bench\":\"cipher\",\"format\":" << JsonString(FormatName(format))
+			<< ",\"kdf\":" << JsonString(KdfModeName(mode))
+			<< ",\"size\":" << size
+			<< ",\"runs\":" << runs
+			<< ",\"payload_bytes\":" << (format == Format::UtilsHex ? buffers.m_hex.size() : format == Format::UtilsBinary ? buffers.m_payload.size() : cipherLength)
+			<< std::fixed << std::setprecision(3)
+			<< ",\"encrypt_ms\":" << encrypt.m_milliseconds
+			<< ",\"decrypt_ms\":" << decrypt.m_milliseconds
+			<< ",\"encrypt_mbps\":" << Rate(size, encrypt.m_milliseconds)
+			<< ",\"decrypt_mbps\":" << Rate(size, decrypt.m_milliseconds)
+			<< ",\"encrypt_peak_rss_kb\":" << encrypt.m_peakRssKilobytes
+			<< ",\"decrypt_peak_rss_kb\":" << decrypt.m_peakRssKilobytes
+			<< ",\"encrypt_allocations\":" << encrypt.m_allocations
+			<< ",\"decrypt_allocations\":" << decrypt.m_allocations
+			<< ",\"ok\":" << (encrypt.m_ok && decrypt.m_ok ? "true" : "false")
+			<< "}" << std::endl;
+		return encrypt.m_ok && decrypt.m_ok;
+	}
+
+	// an incremental save after a one-character edit in the middle of the
+	// note, against the full saves of the utils-hex cipher rows
+	bool RunSaveRow(const Options& options, Buffers& buffers, const CryptoPP::AESLayer::KdfMode mode, const size_t size)
+	{
+		const std::string password = "correct horse battery staple";
+		const int runs = size >= kSingleRunSize ? 1 : options.m_runs;
+		const std::string_view text = std::string_view(buffers.m_plaintext).substr(0, size);
+		std::string edited(text);
+		edited[size / 2] = 'e';
+		std::unique_ptr<CryptoPP::AESLayer::IncrementalPayload> session;
+		Utils::EncryptString(text, password, buffers.m_hex, mode, nullptr, &session);
+
+		// alternates between the two texts, so every run saves one edit
+		bool toggled = false;
+		const Measurement save = Measure(runs, [&]() {
+			const std::string_view previous = toggled ? std::string_view(edited) : text;
+			toggled = !toggled;
+			return Utils::UpdateEncryptedString(*session, previous, toggled ? std::string_view(edited) : text, buffers.m_hex);
+		});
+
+		std::cout << "{\"bench\":\"save\",\"kdf\":" << JsonString(KdfModeName(mode))
+			<< ",\"size\":" << size
+			<< ",\"runs\":" << runs
+			<< ",\"payload_bytes\":" << buffers.m_hex.size()
+			<< ",\"reused_segments\":" << session->GetReusedSegments()
+			<< ",\"encrypted_segments\":" << session->GetEncryptedSegments()
+			<< std::fixed << std::setprecision(3)
+			<< ",\"save_ms\":" << save.m_milliseconds
+			<< ",\"save_peak_rss_kb\":" << save.m_peakRssKilobytes
+			<< ",\"save_allocations\":" << save.m_allocations
+			<< ",\"ok\":" << (save.m_ok ? "true" : "false")
+			<< "}" << std::endl;
+		return save.m_ok;
+	}
+
+	// after the KDF: decrypting the first screen of an indexed note against
+	// decrypting all of it
+	bool RunFirstScreenRow(const Options& options, Buffers& buffers, const CryptoPP::AESLayer::KdfMode mode, const size_t size)
+	{
+		const std::string password = "correct horse battery staple";
+		const int runs = size >= kSingleRunSize ? 1 : options.m_runs;
+		const std::string_view text = std::string_view(buffers.m_plaintext).substr(0, size);
+		std::unique_ptr<CryptoPP::AESLayer::IncrementalPayload> session;
+		Utils::EncryptString(text, password, buffers.m_hex, mode, nullptr, &session);
+
+		const Measurement firstScreen = Measure(runs, [&]() {
+			buffers.m_text.clear();
+			CryptoPP::StringSinkTemplate<Utils::SecureString> sink(buffers.m_text);
+			return session->DecryptRange(0, Utils::FIRST_SCREEN_BYTES, sink) && buffers.m_text.size() == (std::min)(size, Utils::FIRST_SCREEN_BYTES);
+		});
+		const Measurement full = Measure(runs, [&]() {
+			buffers.m_text.clear();
+			CryptoPP::StringSinkTemplate<Utils::SecureString> sink(buffers.m_text);
+			return session->Decrypt(sink) && buffers.m_text.size() == size;
+		});
+
+		std::cout << "{\"bench\":\"first_screen\",\"kdf\":" << JsonString(KdfModeName(mode))
+			<< ",\"size\":" << size
+			<< ",\"runs\":" << runs
+			<< std::fixed << std::setprecision(3)
+			<< ",\"first_screen_ms\":" << firstScreen.m_milliseconds
+			<< ",\"full_ms\":" << full.m_milliseconds
+			<< ",\"first_screen_peak_rss_kb\":" << firstScreen.m_peakRssKilobytes
+			<< ",\"full_peak_rss_kb\":" << full.m_peakRssKilobytes
+			<< ",\"ok\":" << (firstScreen.m_ok && full.m_ok ? "true" : "false")
+			<< "}" << std::endl;
+		return firstScreen.m_ok && full.m_ok;
+	}
+
+	void PrintHexRow(const char* codec, const size_t size, const int runs, const Measurement& encode, const Measurement& decode)
+	{
+		std::cout << "{\"bench\":\"hex\",\"codec\":" << JsonString(codec)
+			<< ",\"size\":" << size
+			<< ",\"runs\":" << runs
+			<< std::fixed << std::setprecision(3)
+			<< ",\"encode_ms\":" << encode.m_milliseconds
+			<< ",\"decode_ms\":" << decode.m_milliseconds
+			<< ",\"encode_mb_per_s\":" << Rate(size, encode.m_milliseconds)
+			<< ",\"decode_mb_per_s\":" << Rate(size, decode.m_milliseconds)
+			<< ",\"ok\":" << (encode.m_ok && decode.m_ok ? "true" : "false")
+			<< "}" << std::endl;
+	}
+
+	// the hex step of utils-hex on its own: the Crypto++ filters against
+	// every codec path this CPU has, size counting the binary side
+	bool RunHexRow(const Options& options, Buffers& buffers, const size_t size)
+	{
+		const int runs = size >= kSingleRunSize ? 1 : options.m_runs;
+		const std::span<const CryptoPP::byte> input(buffers.m_cipher.data(), size);
+		for (size_t i = 0; i < size; ++i)
+		{
+			buffers.m_cipher[i] = static_cast<CryptoPP::byte>(i * 167 + (i >> 8));
+		}
+		buffers.m_hex.resize(size * 2);
+
+		const auto decoded = [&]() {
+			return std::equal(input.begin(), input.end(), buffers.m_output.begin());
+		};
+
+		const Measurement filterEncode = Measure(runs, [&]() {
+			CryptoPP::HexEncoder hex(new CryptoPP::ArraySink(reinterpret_cast<CryptoPP::byte*>(buffers.m_hex.data()), buffers.m_hex.size()));
+			hex.Put(input.data(), input.size());
+			hex.MessageEnd();
+			return true;
+		});
+		const Measurement filterDecode = Measure(runs, [&]() {
+			CryptoPP::HexDecoder hex(new CryptoPP::ArraySink(buffers.m_output.data(), size));
+			hex.Put(reinterpret_cast<const CryptoPP::byte*>(buffers.m_hex.data()), buffers.m_hex.size());
+			hex.MessageEnd();
+			return true;
+		});
+		PrintHexRow("hexencoder", size, runs, filterEncode, filterDecode);
+		bool ok = decoded();
+
+		for (const Utils::HexCodecPath path : { Utils::HexCodecPath::Scalar, Utils::HexCodecPath::Ssse3, Utils::HexCodecPath::Avx2 })
+		{
+			if (path > Utils::BestHexCodecPath())
+			{
+				continue;
+			}
+			const Measurement encode = Measure(runs, [&]() {
+				Utils::HexEncode(input, buffers.m_hex.data(), path);
+				return true;
+			});
+			std::fill_n(buffers.m_output.begin(), size, CryptoPP::byte(0));
+			const Measurement decode = Measure(runs, [&]() {
+				return Utils::HexDecode(buffers.m_hex, buffers.m_output.data(), path);
+			});
+			PrintHexRow(Utils::HexCodecPathName(path), size, runs, encode, decode);
+			ok &= decode.m_ok && decoded();
+		}
+		return ok;
+	}
+
+	void PrintKdfRow(const CryptoPP::AESLayer::KdfMode mode, const char* cost, const CryptoPP::AESLayer::KdfParameters& parameters, const int runs)
+	{
+		std::vector<double> samples;
+		for (int run = 0; run < runs; ++run)
+		{
+			samples.push_back(CryptoPP::AESLayer::MeasureKdf(mode, parameters));
+		}
+		std::cout << "{\"bench\":\"kdf\",\"kdf\":" << JsonString(KdfModeName(mode))
+			<< ",\"cost\":" << JsonString(cost)
+			<< ",\"parameters\":[" << parameters.m_cost << ',' << parameters.m_blockSize << ',' << parameters.m_parallelism << ']'
+			<< ",\"runs\":" << runs
+			<< std::fixed << std::setprecision(3)
+			<< ",\"ms\":" << Median(samples)
+			<< "}" << std::endl;
+	}
+
+	void PrintMeta(const Options& options, const bool rssPerOperation)
+	{
+		const CryptoPP::AESLayer::BackendInfo backends = CryptoPP::AESLayer::DescribeBackends();
+#if defined(_MSC_VER)
+		const std::string compiler = "msvc " + std::to_string(_MSC_VER);
+#elif defined(__clang__)
+		const std::string compiler = "clang " __clang_version__;
+#elif defined(__GNUC__)
+		const std::string compiler = "gcc " __VERSION__;
+#else
+		const std::string compiler = "unknown";
+#endif
+		std::cout << "{\"bench\":\"meta\",\"schema\":" << kSchemaVersion
+			<< ",\"compiler\":" << JsonString(compiler)
+			<< ",\"hardware_threads\":" << backends.m_hardwareThreads
+			<< ",\"aes_provider\":" << JsonString(backends.m_aesProvider)
+			<< ",\"gcm_provider\":" << JsonString(backends.m_gcmProvider)
+			<< ",\"sha256_provider\":" << JsonString(backends.m_sha256Provider)
+			<< ",\"max_size\":" << options.m_maxSize
+			<< ",\"runs\":" << options.m_runs
+			<< ",\"peak_rss_scope\":" << (rssPerOperation ? "\"operation\"" : "\"process\"")
+#if defined(__GLIBC__)
+			<< ",\"allocations_scope\":\"malloc\""
+#else
+			<< ",\"allocations_scope\":\"operator new\""
+#endif
+			<< "}" << std::endl;
+	}
+
+	// "64K", "16M", "1G" or plain bytes
+	bool ParseSize(const std::string& value, size_t& size)
+	{
+		char* end = nullptr;
+		const unsigned long long parsed = std::strtoull(value.c_str(), &end, 10);
+		if (end == value.c_str())
+		{
+			return false;
+		}
+		const std::string_view suffix(end);
+		const size_t scale = suffix == "K" ? KiB : suffix == "M" ? MiB : suffix == "G" ? GiB : suffix.empty() ? 1 : 0;
+		size = static_cast<size_t>(parsed) * scale;
+		return scale != 0;
+	}
+
+	bool ParseOptions(const int argc, char* argv[], Options& options)
+	{
+		for (int i = 1; i + 1 < argc; i += 2)
+		{
+			const std::string_view name = argv[i];
+			const std::string value = argv[i + 1];
+			if (name == "--max-size")
+			{
+				if (!ParseSize(value, options.m_maxSize))
+				{
+					return false;
+				}
+			}
+			else if (name == "--runs")
+			{
+				options.m_runs = std::atoi(value.c_str());
+				if (options.m_runs < 1)
+				{
+					return false;
+				}
+			}
+			else if (name == "--format")
+			{
+				options.m_format = value;
+			}
+			else if (name == "--kdf")
+			{
+				options.m_kdf = value;
+			}
+			else
+			{
+				return false;
+			}
+		}
+		return argc % 2 == 1;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		std::cerr << "usage: aeslayer_bench_suite [--max-size BYTES[K|M|G]] [--runs N] [--format v2|v3-cbc|v3-gcm|utils-hex|utils-binary] [--kdf scrypt|pbkdf2-sha256|argon2id]" << '\n';
+		return 2;
+	}
+
+	PrintMeta(options, ResetPeakRss());
+
+	for (const CryptoPP::AESLayer::KdfMode mode : kKdfModes)
+	{
+		if (!options.m_kdf.empty() && options.m_kdf != KdfModeName(mode))
+		{
+			continue;
+		}
+		PrintKdfRow(mode, "default", CryptoPP::AESLayer::DefaultKdfParameters(mode), options.m_runs);
+		if (options.m_format.empty() || options.m_format == FormatName(Format::UtilsHex) || options.m_format == FormatName(Format::UtilsBinary))
+		{
+			PrintKdfRow(mode, "calibrated", Utils::CalibratedKdfParameters(mode), options.m_runs);
+		}
+	}
+
+	size_t largest = 0;
+	for (const size_t size : kSizes)
+	{
+		if (size <= options.m_maxSize)
+		{
+			largest = size;
+		}
+	}
+
+	Buffers buffers;
+	buffers.m_plaintext.assign(largest, 'n');
+	buffers.m_cipher.assign(CryptoPP::AESLayer::MaxSegmentedCiphertextLen(largest), 0);
+	buffers.m_output.assign(buffers.m_cipher.size(), 0);
+
+	bool ok = true;
+	for (const Format format : kFormats)
+	{
+		if (!options.m_format.empty() && options.m_format != FormatName(format))
+		{
+			continue;
+		}
+		for (const CryptoPP::AESLayer::KdfMode mode : kKdfModes)
+		{
+			if (!SupportsKdfMode(format, mode) || (!options.m_kdf.empty() && options.m_kdf != KdfModeName(mode)))
+			{
+				continue;
+			}
+			for (const size_t size : kSizes)
+			{
+				if (size <= largest)
+				{
+					ok &= RunCipherRow(options, buffers, format, mode, size);
+				}
+			}
+		}
+	}
+
+	for (const CryptoPP::AESLayer::KdfMode mode : kKdfModes)
+	{
+		if ((!options.m_format.empty() && options.m_format != FormatName(Format::UtilsHex)) || (!options.m_kdf.empty() && options.m_kdf != KdfModeName(mode)))
+		{
+			continue;
+		}
+		for (const size_t size : kSizes)
+		{
+			if (size != 0 && size <= largest)
+			{
+				ok &= RunSaveRow(options, buffers, mode, size);
+				ok &= RunFirstScreenRow(options, buffers, mode, size);
+			}
+		}
+	}
+
+	if (options.m_format.empty() || options.m_format == FormatName(Format::UtilsHex))
+	{
+		for (const size_t size : kSizes)
+		{
+			if (size != 0 && size <= largest)
+			{
+				ok &= RunHexRow(options, buffers, size);
+			}
+		}
+	}
+	return ok ? 0 : 1;
+}
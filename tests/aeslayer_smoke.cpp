@@ -1,13 +1,39 @@
 #include "aeslayer.h"
+#include "cryptoutils.h"
+#include "cryptopp/filters.h"
+#include "cryptopp/hex.h"
+#include "cryptopp/modes.h"
 #include "cryptopp/osrng.h"
+#include "cryptopp/pwdbased.h"
+#include "cryptopp/scrypt.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <iostream>
+#include <span>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace
 {
+	// deterministic stand-in for AutoSeededRandomPool so outputs can be compared
+	class CountingRandomNumberGenerator : public CryptoPP::RandomNumberGenerator
+	{
+	public:
+		void GenerateBlock(CryptoPP::byte* output, size_t size) override
+		{
+			for (size_t i = 0; i < size; ++i)
+			{
+				output[i] = static_cast<CryptoPP::byte>(m_counter++);
+			}
+		}
+
+	private:
+		unsigned int m_counter{ 0 };
+	};
+
 	bool TryDecrypt(const std::vector<CryptoPP::byte>& cipher, const std::string& password, std::string& outPlaintext)
 	{
 		outPlaintext.clear();
@@ -60,6 +86,1138 @@ namespace
 		return !TryDecrypt(cipher, password, decrypted);
 	}
 
+	std::string MakePlaintext(const size_t size)
+	{
+		std::string plaintext(size, '\0');
+		for (size_t i = 0; i < size; ++i)
+		{
+			plaintext[i] = static_cast<char>('a' + (i * 7) % 26);
+		}
+		return plaintext;
+	}
+
+	std::string SegmentedEncrypt(
+		const std::string& plaintext,
+		const std::string& password,
+		const CryptoPP::AESLayer::KdfMode mode,
+		const unsigned int segmentSize,
+		const CryptoPP::AESLayer::CipherMode cipherMode = CryptoPP::AESLayer::CipherMode::AesCbcHmacSha256,
+		const CryptoPP::AESLayer::Compression compression = CryptoPP::AESLayer::Compression::None)
+	{
+		CryptoPP::AutoSeededRandomPool rng;
+		CryptoPP::AESLayer::EncryptionOptions options;
+		options.m_kdfMode = mode;
+		options.m_segmentSize = segmentSize;
+		options.m_cipherMode = cipherMode;
+		options.m_compression = compression;
+
+		std::string cipher;
+		CryptoPP::StringSink sink(cipher);
+		CryptoPP::AESLayer::StreamEncryptor encryptor(rng, password, sink, options);
+		encryptor.Put(reinterpret_cast<const CryptoPP::byte*>(plaintext.data()), plaintext.size());
+		encryptor.Finish();
+		return cipher;
+	}
+
+	bool SegmentedStreamDecrypt(const std::string& cipher, const std::string& password, const size_t chunkSize, std::string& outPlaintext)
+	{
+		outPlaintext.clear();
+		CryptoPP::StringSink sink(outPlaintext);
+		CryptoPP::AESLayer::StreamDecryptor decryptor(password, sink);
+		for (size_t offset = 0; offset < cipher.size(); offset += chunkSize)
+		{
+			const size_t length = (std::min)(chunkSize, cipher.size() - offset);
+			if (!decryptor.Put(reinterpret_cast<const CryptoPP::byte*>(cipher.data() + offset), length))
+			{
+				return false;
+			}
+		}
+		return decryptor.Finish();
+	}
+
+	bool SegmentedRoundTrip(
+		const size_t plaintextSize,
+		const std::string& password,
+		const CryptoPP::AESLayer::KdfMode mode,
+		const CryptoPP::AESLayer::CipherMode cipherMode = CryptoPP::AESLayer::CipherMode::AesCbcHmacSha256)
+	{
+		constexpr unsigned int segmentSize = 64;
+		const std::string plaintext = MakePlaintext(plaintextSize);
+		const std::string cipher = SegmentedEncrypt(plaintext, password, mode, segmentSize, cipherMode);
+		if (!CryptoPP::AESLayer::IsSegmentedPayload(reinterpret_cast<const CryptoPP::byte*>(cipher.data()), cipher.size()) ||
+			cipher.size() > CryptoPP::AESLayer::MaxSegmentedCiphertextLen(plaintext.size(), segmentSize))
+		{
+			return false;
+		}
+
+		std::string streamed;
+		if (!SegmentedStreamDecrypt(cipher, password, 7, streamed) || streamed != plaintext)
+		{
+			return false;
+		}
+
+		std::string decrypted;
+		const std::vector<CryptoPP::byte> cipherBytes(cipher.begin(), cipher.end());
+		return TryDecrypt(cipherBytes, password, decrypted) && decrypted == plaintext;
+	}
+
+	bool SegmentedDamageIsRejected(const std::string& password, const CryptoPP::AESLayer::CipherMode cipherMode)
+	{
+		constexpr unsigned int segmentSize = 64;
+		const std::string plaintext = MakePlaintext(segmentSize * 3 + 5);
+		const std::string cipher = SegmentedEncrypt(plaintext, password, CryptoPP::AESLayer::KdfMode::Scrypt, segmentSize, cipherMode);
+		const size_t segmentStride = segmentSize + CryptoPP::AESLayer::SegmentTagSize(cipherMode);
+
+		std::string tampered = cipher;
+		tampered[CryptoPP::AESLayer::SEGMENTED_HEADER_SIZE + segmentStride + 3] ^= 0x5A;
+
+		const std::string truncated = cipher.substr(0, CryptoPP::AESLayer::SEGMENTED_HEADER_SIZE + segmentStride * 3);
+
+		std::string swapped = cipher;
+		std::swap_ranges(
+			swapped.begin() + CryptoPP::AESLayer::SEGMENTED_HEADER_SIZE,
+			swapped.begin() + CryptoPP::AESLayer::SEGMENTED_HEADER_SIZE + segmentStride,
+			swapped.begin() + CryptoPP::AESLayer::SEGMENTED_HEADER_SIZE + segmentStride);
+
+		std::string decrypted;
+		return !SegmentedStreamDecrypt(tampered, password, cipher.size(), decrypted) &&
+			!SegmentedStreamDecrypt(truncated, password, cipher.size(), decrypted) &&
+			!SegmentedStreamDecrypt(swapped, password, cipher.size(), decrypted) &&
+			!SegmentedStreamDecrypt(cipher, password + "x", cipher.size(), decrypted);
+	}
+
+	bool WrongPasswordFailsOnHeader(const std::string& password)
+	{
+		constexpr unsigned int segmentSize = 64;
+		const std::string cipher = SegmentedEncrypt(MakePlaintext(segmentSize * 4), password, CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256, segmentSize);
+		const CryptoPP::byte* header = reinterpret_cast<const CryptoPP::byte*>(cipher.data());
+
+		std::string wrongOutput;
+		CryptoPP::StringSink wrongSink(wrongOutput);
+		CryptoPP::AESLayer::StreamDecryptor wrongPassword(password + "x", wrongSink);
+		if (wrongPassword.Put(header, CryptoPP::AESLayer::SEGMENTED_HEADER_SIZE) || !wrongPassword.PasswordRejected())
+		{
+			return false;
+		}
+
+		std::string tampered = cipher;
+		tampered.back() ^= 0x01;
+		std::string output;
+		CryptoPP::StringSink sink(output);
+		CryptoPP::AESLayer::StreamDecryptor rightPassword(password, sink);
+		return rightPassword.Put(reinterpret_cast<const CryptoPP::byte*>(tampered.data()), tampered.size()) &&
+			!rightPassword.Finish() &&
+			!rightPassword.PasswordRejected();
+	}
+
+	std::string SegmentedEncryptWithWorkers(const std::string& plaintext, const std::string& password, const unsigned int workerCount)
+	{
+		CountingRandomNumberGenerator rng;
+		CryptoPP::AESLayer::EncryptionOptions options;
+		options.m_kdfMode = CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256;
+		options.m_segmentSize = 64;
+		options.m_workerCount = workerCount;
+
+		std::string cipher;
+		CryptoPP::StringSink sink(cipher);
+		CryptoPP::AESLayer::StreamEncryptor encryptor(rng, password, sink, options);
+		encryptor.Put(reinterpret_cast<const CryptoPP::byte*>(plaintext.data()), plaintext.size());
+		encryptor.Finish();
+		return cipher;
+	}
+
+	bool ParallelSegmentsAreDeterministic(const std::string& password)
+	{
+		const std::string plaintext = MakePlaintext(64 * 37 + 9);
+		const std::string serial = SegmentedEncryptWithWorkers(plaintext, password, 1);
+		if (serial != SegmentedEncryptWithWorkers(plaintext, password, 2) ||
+			serial != SegmentedEncryptWithWorkers(plaintext, password, 8))
+		{
+			return false;
+		}
+
+		for (const unsigned int workerCount : { 1u, 3u, 8u })
+		{
+			std::string decrypted;
+			CryptoPP::StringSink sink(decrypted);
+			CryptoPP::AESLayer::StreamDecryptor decryptor(password, sink, workerCount);
+			if (!decryptor.Put(reinterpret_cast<const CryptoPP::byte*>(serial.data()), serial.size()) ||
+				!decryptor.Finish() ||
+				decrypted != plaintext)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// header-less payload as written by releases that had a PBKDF2 option but
+	// no format header: [salt][ciphertext][iv seed][HMAC]
+	std::vector<CryptoPP::byte> MakeLegacyPbkdf2Payload(const std::string& plaintext, const std::string& password)
+	{
+		using namespace CryptoPP;
+		AutoSeededRandomPool rng;
+		SecByteBlock salt(AESLayer::SALT_SIZE);
+		SecByteBlock ivSeed(AESLayer::IV_SEED_SIZE);
+		rng.GenerateBlock(salt, salt.size());
+		rng.GenerateBlock(ivSeed, ivSeed.size());
+
+		const byte* secret = reinterpret_cast<const byte*>(password.data());
+		SecByteBlock key(SHA256::DIGESTSIZE);
+		SecByteBlock iv(AESLayer::IV_SIZE);
+		CryptoPP::PKCS5_PBKDF2_HMAC<SHA256> kdf;
+		kdf.DeriveKey(key, key.size(), 0, secret, password.size(), salt, salt.size(), AESLayer::KEY_ITERATIONS, 0);
+		kdf.DeriveKey(iv, iv.size(), 0, secret, password.size(), ivSeed, ivSeed.size(), AESLayer::KEY_ITERATIONS, 0);
+
+		const size_t padding = AES::BLOCKSIZE - (plaintext.size() % AES::BLOCKSIZE);
+		std::vector<byte> padded(plaintext.begin(), plaintext.end());
+		padded.insert(padded.end(), padding, static_cast<byte>(padding));
+
+		std::vector<byte> payload(salt.begin(), salt.end());
+		payload.resize(salt.size() + padded.size());
+		CBC_Mode<AES>::Encryption encryptor(key, key.size(), iv);
+		encryptor.ProcessData(payload.data() + salt.size(), padded.data(), padded.size());
+		payload.insert(payload.end(), ivSeed.begin(), ivSeed.end());
+		payload.resize(payload.size() + HMAC<SHA256>::DIGESTSIZE);
+		HMAC<SHA256>(key, key.size()).CalculateDigest(
+			payload.data() + payload.size() - HMAC<SHA256>::DIGESTSIZE,
+			payload.data() + salt.size(),
+			padded.size() + ivSeed.size());
+		return payload;
+	}
+
+	bool PayloadInfoMatches(
+		const std::vector<CryptoPP::byte>& cipher,
+		const std::string& password,
+		const std::string& plaintext,
+		const CryptoPP::AESLayer::PayloadFormat format,
+		const CryptoPP::AESLayer::KdfMode mode)
+	{
+		std::vector<CryptoPP::byte> output(cipher.size(), 0);
+		CryptoPP::AESLayer::PayloadInfo info;
+		const CryptoPP::DecodingResult result = CryptoPP::AESLayer::Decrypt(
+			password,
+			output.data(),
+			CryptoPP::ConstByteArrayParameter(cipher.data(), cipher.size()),
+			info);
+		return result.isValidCoding &&
+			std::string(reinterpret_cast<const char*>(output.data()), result.messageLength) == plaintext &&
+			info.m_format == format &&
+			info.m_kdfMode == mode;
+	}
+
+	bool PayloadInfoIsReported(const std::string& password)
+	{
+		using CryptoPP::AESLayer;
+		const std::string plaintext = "payload info";
+		CryptoPP::AutoSeededRandomPool rng;
+		AESLayer::EncryptionOptions options;
+
+		std::vector<CryptoPP::byte> cipher(AESLayer::MaxCiphertextLen(static_cast<unsigned int>(plaintext.size())), 0);
+		cipher.resize(AESLayer::Encrypt(rng, password, cipher.data(), plaintext, options));
+		if (!PayloadInfoMatches(cipher, password, plaintext, AESLayer::PayloadFormat::Legacy, AESLayer::KdfMode::Scrypt))
+		{
+			return false;
+		}
+
+		options.m_kdfMode = AESLayer::KdfMode::Pbkdf2Sha256;
+		cipher.assign(AESLayer::MaxCiphertextLen(static_cast<unsigned int>(plaintext.size())), 0);
+		cipher.resize(AESLayer::Encrypt(rng, password, cipher.data(), plaintext, options));
+		if (!PayloadInfoMatches(cipher, password, plaintext, AESLayer::PayloadFormat::Compatible, AESLayer::KdfMode::Pbkdf2Sha256))
+		{
+			return false;
+		}
+
+		const std::string segmented = SegmentedEncrypt(plaintext, password, AESLayer::KdfMode::Pbkdf2Sha256, 64);
+		if (!PayloadInfoMatches(
+			std::vector<CryptoPP::byte>(segmented.begin(), segmented.end()),
+			password,
+			plaintext,
+			AESLayer::PayloadFormat::Segmented,
+			AESLayer::KdfMode::Pbkdf2Sha256))
+		{
+			return false;
+		}
+
+		return PayloadInfoMatches(
+			MakeLegacyPbkdf2Payload(plaintext, password),
+			password,
+			plaintext,
+			AESLayer::PayloadFormat::Legacy,
+			AESLayer::KdfMode::Pbkdf2Sha256);
+	}
+
+	bool LegacyPbkdf2WrongPasswordIsRejected(const std::string& password)
+	{
+		std::string decrypted;
+		return !TryDecrypt(MakeLegacyPbkdf2Payload("legacy", password), password + "!", decrypted);
+	}
+
+	std::vector<CryptoPP::byte> EncryptWithCountingRng(const std::string& plaintext, const std::string& password, const CryptoPP::AESLayer::KdfMode mode)
+	{
+		CountingRandomNumberGenerator rng;
+		CryptoPP::AESLayer::EncryptionOptions options;
+		options.m_kdfMode = mode;
+		std::vector<CryptoPP::byte> cipher(CryptoPP::AESLayer::MaxCiphertextLen(static_cast<unsigned int>(plaintext.size())), 0);
+		cipher.resize(CryptoPP::AESLayer::Encrypt(rng, password, cipher.data(), plaintext, options));
+		return cipher;
+	}
+
+	// the span and in-place overloads write exactly what the string overload writes
+	bool SpanEncryptMatches(const std::string& password)
+	{
+		using CryptoPP::AESLayer;
+		for (const AESLayer::KdfMode mode : { AESLayer::KdfMode::Scrypt, AESLayer::KdfMode::Pbkdf2Sha256 })
+		{
+			for (const size_t size : { size_t{ 0 }, size_t{ 15 }, size_t{ 16 }, size_t{ 40000 } })
+			{
+				const std::string plaintext = MakePlaintext(size);
+				const std::vector<CryptoPP::byte> expected = EncryptWithCountingRng(plaintext, password, mode);
+				AESLayer::EncryptionOptions options;
+				options.m_kdfMode = mode;
+
+				CountingRandomNumberGenerator spanRng;
+				std::vector<CryptoPP::byte> output(AESLayer::MaxCiphertextLen(static_cast<unsigned int>(size)), 0);
+				output.resize(AESLayer::Encrypt(
+					spanRng,
+					password,
+					std::span<CryptoPP::byte>(output),
+					std::span<const CryptoPP::byte>(reinterpret_cast<const CryptoPP::byte*>(plaintext.data()), plaintext.size()),
+					options));
+
+				CountingRandomNumberGenerator inPlaceRng;
+				std::vector<CryptoPP::byte> buffer(plaintext.begin(), plaintext.end());
+				buffer.resize(AESLayer::MaxCiphertextLen(static_cast<unsigned int>(size)));
+				buffer.resize(AESLayer::EncryptInPlace(inPlaceRng, password, std::span<CryptoPP::byte>(buffer), size, options));
+
+				if (output != expected || buffer != expected)
+				{
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	bool DecryptsInPlace(std::vector<CryptoPP::byte> buffer, const std::string& password, const std::string& plaintext)
+	{
+		CryptoPP::AESLayer::PayloadInfo info;
+		const CryptoPP::DecodingResult result = CryptoPP::AESLayer::DecryptInPlace(password, std::span<CryptoPP::byte>(buffer), info);
+		return result.isValidCoding &&
+			std::string(reinterpret_cast<const char*>(buffer.data()), result.messageLength) == plaintext;
+	}
+
+	bool InPlaceDecryptWorksForEveryFormat(const std::string& password)
+	{
+		using CryptoPP::AESLayer;
+		const std::string plaintext = MakePlaintext(64 * 5 + 3);
+		const std::string segmented = SegmentedEncrypt(plaintext, password, AESLayer::KdfMode::Pbkdf2Sha256, 64, AESLayer::CipherMode::AesGcm);
+		const std::vector<CryptoPP::byte> legacyPbkdf2 = MakeLegacyPbkdf2Payload(plaintext, password);
+
+		std::vector<CryptoPP::byte> wrongPassword = legacyPbkdf2;
+		CryptoPP::AESLayer::PayloadInfo info;
+		return DecryptsInPlace(EncryptWithCountingRng(plaintext, password, AESLayer::KdfMode::Scrypt), password, plaintext) &&
+			DecryptsInPlace(EncryptWithCountingRng(plaintext, password, AESLayer::KdfMode::Pbkdf2Sha256), password, plaintext) &&
+			DecryptsInPlace(std::vector<CryptoPP::byte>(segmented.begin(), segmented.end()), password, plaintext) &&
+			DecryptsInPlace(legacyPbkdf2, password, plaintext) &&
+			!AESLayer::DecryptInPlace(password + "x", std::span<CryptoPP::byte>(wrongPassword), info).isValidCoding &&
+			wrongPassword == legacyPbkdf2;
+	}
+
+	bool KdfParametersAreRecorded(const std::string& password)
+	{
+		using CryptoPP::AESLayer;
+		const std::string plaintext = MakePlaintext(100);
+		AESLayer::KdfParameters scrypt;
+		scrypt.m_cost = AESLayer::MIN_SCRYPT_COST;
+		scrypt.m_blockSize = 4;
+		scrypt.m_parallelism = 2;
+		AESLayer::KdfParameters pbkdf2;
+		pbkdf2.m_cost = AESLayer::MIN_KEY_ITERATIONS + 1000;
+		AESLayer::KdfParameters argon2;
+		argon2.m_cost = AESLayer::MIN_ARGON2_MEMORY;
+		argon2.m_blockSize = 1;
+		argon2.m_parallelism = 3;
+
+		for (const auto& [mode, parameters] : {
+			std::pair{ AESLayer::KdfMode::Scrypt, scrypt },
+			std::pair{ AESLayer::KdfMode::Pbkdf2Sha256, pbkdf2 },
+			std::pair{ AESLayer::KdfMode::Argon2id, argon2 } })
+		{
+			CryptoPP::AutoSeededRandomPool rng;
+			AESLayer::EncryptionOptions options;
+			options.m_kdfMode = mode;
+			options.m_kdfParameters = parameters;
+			std::string cipher;
+			CryptoPP::StringSink sink(cipher);
+			AESLayer::StreamEncryptor encryptor(rng, password, sink, options);
+			encryptor.Put(reinterpret_cast<const CryptoPP::byte*>(plaintext.data()), plaintext.size());
+			encryptor.Finish();
+
+			std::string decrypted;
+			CryptoPP::StringSink plainSink(decrypted);
+			AESLayer::StreamDecryptor decryptor(password, plainSink);
+			if (!decryptor.Put(reinterpret_cast<const CryptoPP::byte*>(cipher.data()), cipher.size()) ||
+				!decryptor.Finish() ||
+				decrypted != plaintext ||
+				decryptor.GetKdfParameters().m_cost != parameters.m_cost ||
+				decryptor.GetKdfParameters().m_blockSize != parameters.m_blockSize ||
+				decryptor.GetKdfParameters().m_parallelism != parameters.m_parallelism)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// out-of-range parameters are refused on both sides: the encryptor
+	// throws, the decryptor fails on the header without running the KDF
+	bool KdfParametersAreBounded(const std::string& password)
+	{
+		using CryptoPP::AESLayer;
+		CryptoPP::AutoSeededRandomPool rng;
+		AESLayer::EncryptionOptions options;
+		options.m_kdfParameters.m_cost = AESLayer::MAX_SCRYPT_COST * 2;
+		options.m_kdfParameters.m_blockSize = 8;
+		options.m_kdfParameters.m_parallelism = 1;
+		std::string cipher;
+		CryptoPP::StringSink sink(cipher);
+		try
+		{
+			AESLayer::StreamEncryptor encryptor(rng, password, sink, options);
+			return false;
+		}
+		catch (const CryptoPP::InvalidArgument&)
+		{
+		}
+
+		std::string header = SegmentedEncrypt("x", password, AESLayer::KdfMode::Scrypt, 64).substr(0, AESLayer::SEGMENTED_HEADER_SIZE);
+		header[AESLayer::FORMAT_HEADER_SIZE + 1 + 4 + 3] = 0x40;
+		std::string output;
+		CryptoPP::StringSink outputSink(output);
+		AESLayer::StreamDecryptor decryptor(password, outputSink);
+		return !decryptor.Put(reinterpret_cast<const CryptoPP::byte*>(header.data()), header.size()) &&
+			!decryptor.PasswordRejected();
+	}
+
+	bool CalibrationStaysInBounds()
+	{
+		using CryptoPP::AESLayer;
+		for (const AESLayer::KdfMode mode : { AESLayer::KdfMode::Scrypt, AESLayer::KdfMode::Pbkdf2Sha256, AESLayer::KdfMode::Argon2id })
+		{
+			const AESLayer::KdfCalibration calibration = AESLayer::CalibrateKdf(mode, 50);
+			if (!AESLayer::IsValidKdfParameters(mode, calibration.m_parameters) || calibration.m_estimatedMilliseconds <= 0.0 ||
+				calibration.m_parameters.m_cost < AESLayer::DefaultKdfParameters(mode).m_cost)
+			{
+				return false;
+			}
+		}
+
+		// a save keeps stronger parameters the note was opened with, but
+		// not those of another KDF mode
+		AESLayer::PayloadInfo previous;
+		previous.m_kdfMode = AESLayer::KdfMode::Pbkdf2Sha256;
+		previous.m_kdfParameters.m_cost = 4 * AESLayer::KEY_ITERATIONS;
+		const AESLayer::KdfParameters pbkdf2 = AESLayer::DefaultKdfParameters(AESLayer::KdfMode::Pbkdf2Sha256);
+		const AESLayer::KdfParameters scrypt = AESLayer::DefaultKdfParameters(AESLayer::KdfMode::Scrypt);
+		return Utils::SaveKdfParameters(AESLayer::KdfMode::Pbkdf2Sha256, pbkdf2, previous).m_cost == 4 * AESLayer::KEY_ITERATIONS &&
+			Utils::SaveKdfParameters(AESLayer::KdfMode::Scrypt, scrypt, previous).m_cost == scrypt.m_cost;
+	}
+
+	std::string ToHex(const std::vector<CryptoPP::byte>& data)
+	{
+		std::string hex;
+		CryptoPP::HexEncoder encoder(new CryptoPP::StringSink(hex), false);
+		encoder.Put(data.data(), data.size());
+		encoder.MessageEnd();
+		return hex;
+	}
+
+	std::vector<CryptoPP::byte> DeriveScrypt(
+		const std::string& passphrase,
+		const std::string& salt,
+		const CryptoPP::word32 cost,
+		const CryptoPP::word32 blockSize,
+		const CryptoPP::word32 parallelism)
+	{
+		CryptoPP::AESLayer::KdfParameters parameters;
+		parameters.m_cost = cost;
+		parameters.m_blockSize = blockSize;
+		parameters.m_parallelism = parallelism;
+		std::vector<CryptoPP::byte> derived(64);
+		CryptoPP::AESLayer::DeriveScrypt(
+			derived.data(),
+			derived.size(),
+			CryptoPP::ConstByteArrayParameter(passphrase),
+			CryptoPP::ConstByteArrayParameter(salt),
+			parameters);
+		return derived;
+	}
+
+	// RFC 7914 section 12 test vectors (the 1 GiB N=1048576 one is left out)
+	bool ScryptMatchesRfc7914()
+	{
+		return ToHex(DeriveScrypt("", "", 16, 1, 1)) ==
+				"77d6576238657b203b19ca42c18a0497f16b4844e3074ae8dfdffa3fede21442fcd0069ded0948f8326a753a0fc81f17e8d3e0fb2e0d3628cf35e20c38d18906" &&
+			ToHex(DeriveScrypt("password", "NaCl", 1024, 8, 16)) ==
+				"fdbabe1c9d3472007856e7190d01e9fe7c6ad7cbc8237830e77376634b3731622eaf30d92e22a3886ff109279d9830dac727afb94a83ee6d8360cbdfa2cc0640" &&
+			ToHex(DeriveScrypt("pleaseletmein", "SodiumChloride", 16384, 8, 1)) ==
+				"7023bdcb3afd7348461c06cd81fd38ebfda8fbba904f8e3ea9b543f6545da1f2d5432955613f0fcf62d49705242a9af9e61e85dc0d651e40dfcf017b45575887";
+	}
+
+	// the lane-parallel driver must stay interchangeable with Crypto++'s
+	// own scrypt, which every existing note was written with
+	bool ScryptMatchesCryptoPP(const std::string& password)
+	{
+		const std::string salt = "0123456789abcdef";
+		const std::vector<CryptoPP::byte> parallel = DeriveScrypt(password, salt, CryptoPP::AESLayer::DERIVATION_COST, 8, 5);
+		std::vector<CryptoPP::byte> reference(parallel.size());
+		CryptoPP::Scrypt().DeriveKey(
+			reference.data(),
+			reference.size(),
+			reinterpret_cast<const CryptoPP::byte*>(password.data()),
+			password.size(),
+			reinterpret_cast<const CryptoPP::byte*>(salt.data()),
+			salt.size(),
+			CryptoPP::AESLayer::DERIVATION_COST,
+			8,
+			5);
+		return parallel == reference;
+	}
+
+	bool DiagnosticsReportBackendsAndTimings()
+	{
+		using CryptoPP::AESLayer;
+		const AESLayer::BackendInfo backends = AESLayer::DescribeBackends();
+		const AESLayer::PrimitiveTimings timings = AESLayer::MeasurePrimitives(0x100000);
+		return !backends.m_aesProvider.empty() &&
+			!backends.m_gcmProvider.empty() &&
+			!backends.m_sha256Provider.empty() &&
+			timings.m_aesCbcMegabytesPerSecond > 0.0 &&
+			timings.m_aesGcmMegabytesPerSecond > 0.0 &&
+			timings.m_hmacSha256MegabytesPerSecond > 0.0 &&
+			timings.m_scryptMilliseconds > 0.0 &&
+			timings.m_pbkdf2Milliseconds > 0.0 &&
+			timings.m_argon2idMilliseconds > 0.0;
+	}
+
+	// RFC 9106 section 5.3 test vector
+	bool Argon2idMatchesRfc9106()
+	{
+		using CryptoPP::AESLayer;
+		const std::vector<CryptoPP::byte> passphrase(32, 0x01);
+		const std::vector<CryptoPP::byte> salt(16, 0x02);
+		const std::vector<CryptoPP::byte> secret(8, 0x03);
+		const std::vector<CryptoPP::byte> associatedData(12, 0x04);
+		AESLayer::KdfParameters parameters;
+		parameters.m_cost = 32;
+		parameters.m_blockSize = 3;
+		parameters.m_parallelism = 4;
+
+		std::vector<CryptoPP::byte> tag(32);
+		AESLayer::DeriveArgon2id(
+			tag.data(),
+			tag.size(),
+			CryptoPP::ConstByteArrayParameter(passphrase.data(), passphrase.size()),
+			CryptoPP::ConstByteArrayParameter(salt.data(), salt.size()),
+			CryptoPP::ConstByteArrayParameter(secret.data(), secret.size()),
+			CryptoPP::ConstByteArrayParameter(associatedData.data(), associatedData.size()),
+			parameters);
+
+		return ToHex(tag) == "0d640df58d78766c08c037a34a8b53c9d01ef0452d75b65eb52520e96b01e659";
+	}
+
+	// Argon2id is recorded in the segmented header only; legacy and v2
+	// payloads have nowhere to store its parameters
+	bool Argon2idIsSegmentedOnly(const std::string& password)
+	{
+		using CryptoPP::AESLayer;
+		CryptoPP::AutoSeededRandomPool rng;
+		AESLayer::EncryptionOptions options;
+		options.m_kdfMode = AESLayer::KdfMode::Argon2id;
+		std::vector<CryptoPP::byte> output(AESLayer::MaxCiphertextLen(1));
+		try
+		{
+			AESLayer::Encrypt(rng, password, output.data(), "x", options);
+			return false;
+		}
+		catch (const CryptoPP::InvalidArgument&)
+		{
+		}
+		return SegmentedRoundTrip(64 * 2 + 7, password, AESLayer::KdfMode::Argon2id, AESLayer::CipherMode::AesGcm);
+	}
+
+	// every KDF reports all the work it announced, the spelled-out PBKDF2
+	// loop matches Crypto++, and a cancelled monitor stops the derivation
+	bool KdfReportsProgressAndCancels(const std::string& password)
+	{
+		const CryptoPP::byte* secret = reinterpret_cast<const CryptoPP::byte*>(password.data());
+		const CryptoPP::ConstByteArrayParameter passphrase(secret, password.size());
+		const std::array<CryptoPP::byte, CryptoPP::AESLayer::SALT_SIZE> salt{ 's', 'a', 'l', 't' };
+		const CryptoPP::ConstByteArrayParameter saltParameter(salt.data(), salt.size());
+		const auto isComplete = [](const CryptoPP::AESLayer::ProgressMonitor& monitor, const CryptoPP::word64 expectedTotal)
+		{
+			return monitor.GetTotal() == expectedTotal && monitor.GetCompleted() == expectedTotal && monitor.GetFraction() == 1.0;
+		};
+
+		std::atomic<int> reports{ 0 };
+		CryptoPP::AESLayer::ProgressMonitor scryptMonitor([&reports](CryptoPP::word64, CryptoPP::word64) { ++reports; });
+		const CryptoPP::AESLayer::KdfParameters scryptParameters{ 1024, 8, 2 };
+		std::array<CryptoPP::byte, 32> reported{};
+		std::array<CryptoPP::byte, 32> plain{};
+		CryptoPP::AESLayer::DeriveScrypt(reported.data(), reported.size(), passphrase, saltParameter, scryptParameters, &scryptMonitor);
+		CryptoPP::AESLayer::DeriveScrypt(plain.data(), plain.size(), passphrase, saltParameter, scryptParameters);
+		if (reported != plain || !isComplete(scryptMonitor, 2 * 1024 * 2) || reports == 0)
+		{
+			return false;
+		}
+
+		CryptoPP::AESLayer::ProgressMonitor argon2Monitor;
+		const CryptoPP::AESLayer::KdfParameters argon2Parameters{ 256, 2, 2 };
+		const CryptoPP::ConstByteArrayParameter none;
+		CryptoPP::AESLayer::DeriveArgon2id(reported.data(), reported.size(), passphrase, saltParameter, none, none, argon2Parameters, &argon2Monitor);
+		CryptoPP::AESLayer::DeriveArgon2id(plain.data(), plain.size(), passphrase, saltParameter, none, none, argon2Parameters);
+		if (reported != plain || !isComplete(argon2Monitor, 256 * 2))
+		{
+			return false;
+		}
+
+		// v2 PBKDF2 payloads derive key and IV, both reported
+		CryptoPP::AutoSeededRandomPool rng;
+		CryptoPP::AESLayer::EncryptionOptions options;
+		options.m_kdfMode = CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256;
+		const std::string plaintext = "progress";
+		std::vector<CryptoPP::byte> cipher(CryptoPP::AESLayer::MaxCiphertextLen(static_cast<unsigned int>(plaintext.size())), 0);
+		cipher.resize(CryptoPP::AESLayer::Encrypt(rng, password, cipher.data(), plaintext, options));
+		CryptoPP::AESLayer::ProgressMonitor pbkdf2Monitor;
+		CryptoPP::AESLayer::PayloadInfo info;
+		std::vector<CryptoPP::byte> output(cipher.size(), 0);
+		const CryptoPP::DecodingResult result = CryptoPP::AESLayer::Decrypt(
+			password,
+			output.data(),
+			CryptoPP::ConstByteArrayParameter(static_cast<const CryptoPP::byte*>(cipher.data()), cipher.size()),
+			info,
+			&pbkdf2Monitor);
+		if (!result.isValidCoding || !isComplete(pbkdf2Monitor, 2 * CryptoPP::AESLayer::KEY_ITERATIONS))
+		{
+			return false;
+		}
+
+		CryptoPP::AESLayer::ProgressMonitor* cancelling = nullptr;
+		CryptoPP::AESLayer::ProgressMonitor cancelMonitor([&cancelling](CryptoPP::word64, CryptoPP::word64) { cancelling->Cancel(); });
+		cancelling = &cancelMonitor;
+		try
+		{
+			CryptoPP::AESLayer::DeriveScrypt(reported.data(), reported.size(), passphrase, saltParameter, scryptParameters, &cancelMonitor);
+			return false;
+		}
+		catch (const CryptoPP::AESLayer::OperationCancelled&)
+		{
+		}
+		return cancelMonitor.GetCompleted() < cancelMonitor.GetTotal();
+	}
+
+	// payloads sharing a salt share one derivation, the others still get
+	// their own, and a damaged payload only fails its own entry
+	bool BatchDecryptSharesDerivations(const std::string& password)
+	{
+		using Layer = CryptoPP::AESLayer;
+		const std::vector<std::string> plaintexts{ MakePlaintext(64 * 37 + 9), MakePlaintext(5), "v2 payload", MakePlaintext(64 * 2) };
+
+		// SegmentedEncryptWithWorkers() always draws the same salt
+		std::vector<std::string> ciphers{
+			SegmentedEncryptWithWorkers(plaintexts[0], password, 1),
+			SegmentedEncryptWithWorkers(plaintexts[1], password, 2),
+			std::string(),
+			SegmentedEncryptWithWorkers(plaintexts[3], password, 1) };
+		ciphers[3].back() ^= 0x01;
+
+		CryptoPP::AutoSeededRandomPool rng;
+		Layer::EncryptionOptions options;
+		options.m_kdfMode = Layer::KdfMode::Pbkdf2Sha256;
+		ciphers[2].resize(Layer::MaxCiphertextLen(static_cast<unsigned int>(plaintexts[2].size())));
+		ciphers[2].resize(Layer::Encrypt(rng, password, reinterpret_cast<CryptoPP::byte*>(ciphers[2].data()), plaintexts[2], options));
+
+		std::vector<std::vector<CryptoPP::byte>> buffers;
+		std::vector<Layer::BatchEntry> entries(ciphers.size());
+		for (size_t i = 0; i < ciphers.size(); ++i)
+		{
+			buffers.emplace_back(ciphers[i].begin(), ciphers[i].end());
+		}
+		for (size_t i = 0; i < ciphers.size(); ++i)
+		{
+			entries[i].m_buffer = std::span<CryptoPP::byte>(buffers[i]);
+		}
+
+		// one derivation for the three segmented payloads, key and IV for the v2 one
+		Layer::ProgressMonitor monitor;
+		if (Layer::DecryptBatch(password, entries, 0, &monitor) != 3 ||
+			monitor.GetTotal() != 3 * Layer::KEY_ITERATIONS ||
+			entries[3].m_result.isValidCoding ||
+			entries[0].m_payloadInfo.m_format != Layer::PayloadFormat::Segmented ||
+			entries[2].m_payloadInfo.m_format != Layer::PayloadFormat::Compatible ||
+			entries[2].m_payloadInfo.m_kdfMode != Layer::KdfMode::Pbkdf2Sha256)
+		{
+			return false;
+		}
+		for (size_t i = 0; i < 3; ++i)
+		{
+			if (std::string(reinterpret_cast<const char*>(buffers[i].data()), entries[i].m_result.messageLength) != plaintexts[i])
+			{
+				return false;
+			}
+		}
+
+		std::vector<std::string> hexPayloads(ciphers.size());
+		for (size_t i = 0; i < ciphers.size(); ++i)
+		{
+			CryptoPP::HexEncoder hex(new CryptoPP::StringSink(hexPayloads[i]));
+			hex.Put(reinterpret_cast<const CryptoPP::byte*>(ciphers[i].data()), ciphers[i].size());
+			hex.MessageEnd();
+		}
+		hexPayloads[1].pop_back();
+
+		std::vector<Utils::SecureString> texts;
+		std::vector<bool> decrypted;
+		if (Utils::DecryptStrings(hexPayloads, password + "x", texts, decrypted) != 0 ||
+			Utils::DecryptStrings(hexPayloads, password, texts, decrypted) != 2)
+		{
+			return false;
+		}
+		return decrypted == std::vector<bool>{ true, false, true, false } &&
+			texts[0].compare(plaintexts[0]) == 0 &&
+			texts[2].compare(plaintexts[2]) == 0;
+	}
+
+	// compressed payloads shrink, stream back through the decompressor in
+	// any chunking, open in a batch only with a sink and are refused by
+	// the buffer-sized Decrypt()
+	bool CompressedRoundTrip(const std::string& password)
+	{
+		using Layer = CryptoPP::AESLayer;
+		const std::string plaintext = MakePlaintext(64 * 40 + 3);
+		const std::string cipher = SegmentedEncrypt(plaintext, password, Layer::KdfMode::Pbkdf2Sha256, 64, Layer::CipherMode::AesGcm, Layer::Compression::Zlib);
+		if (cipher.size() >= plaintext.size() / 4 ||
+			cipher.size() > Layer::MaxSegmentedCiphertextLen(plaintext.size(), 64, Layer::Compression::Zlib))
+		{
+			return false;
+		}
+
+		std::string streamed;
+		std::string tampered = cipher;
+		tampered[Layer::SEGMENTED_HEADER_SIZE + 3] ^= 0x01;
+		std::string decrypted;
+		if (!SegmentedStreamDecrypt(cipher, password, 7, streamed) || streamed != plaintext ||
+			SegmentedStreamDecrypt(tampered, password, cipher.size(), decrypted) ||
+			TryDecrypt(std::vector<CryptoPP::byte>(cipher.begin(), cipher.end()), password, decrypted))
+		{
+			return false;
+		}
+
+		std::vector<CryptoPP::byte> withSink(cipher.begin(), cipher.end());
+		std::vector<CryptoPP::byte> withoutSink(cipher.begin(), cipher.end());
+		std::string batched;
+		CryptoPP::StringSink sink(batched);
+		std::vector<Layer::BatchEntry> entries(2);
+		entries[0].m_buffer = std::span<CryptoPP::byte>(withSink);
+		entries[0].m_sink = &sink;
+		entries[1].m_buffer = std::span<CryptoPP::byte>(withoutSink);
+		if (Layer::DecryptBatch(password, entries) != 1 ||
+			batched != plaintext ||
+			entries[0].m_result.messageLength != plaintext.size() ||
+			entries[0].m_payloadInfo.m_compression != Layer::Compression::Zlib)
+		{
+			return false;
+		}
+
+		std::string hex;
+		Utils::SecureString text;
+		Layer::PayloadInfo info;
+		return Utils::EncryptString(plaintext, password, hex, Layer::KdfMode::Pbkdf2Sha256) &&
+			hex.size() < plaintext.size() / 2 &&
+			Utils::DecryptString(hex, password, text, &info) &&
+			text.compare(plaintext) == 0 &&
+			info.m_compression == Layer::Compression::Zlib;
+	}
+
+	// an edit in the middle of an indexed payload re-encrypts only the
+	// segments around it; the result still opens through every API, and
+	// damage to the index, the root tag or a segment is rejected
+	bool IncrementalSaveReusesSegments(const std::string& password)
+	{
+		using Layer = CryptoPP::AESLayer;
+		using Payload = Layer::IncrementalPayload;
+		const auto bytes = [](const std::string& text) { return std::span<const CryptoPP::byte>(reinterpret_cast<const CryptoPP::byte*>(text.data()), text.size()); };
+		const auto decrypt = [](const Payload& payload, std::string& text)
+		{
+			text.clear();
+			CryptoPP::StringSink sink(text);
+			return payload.Decrypt(sink);
+		};
+
+		CryptoPP::AutoSeededRandomPool rng;
+		Layer::EncryptionOptions options;
+		options.m_kdfMode = Layer::KdfMode::Pbkdf2Sha256;
+		options.m_segmentSize = 64;
+		options.m_workerCount = 3;
+		Payload payload(rng, password, options);
+		const std::string first = MakePlaintext(64 * 20 + 9);
+		payload.Update(rng, {}, bytes(first));
+		std::string decrypted;
+		if (payload.GetEncryptedSegments() != 21 || payload.GetPlaintextLength() != first.size() ||
+			!decrypt(payload, decrypted) || decrypted != first)
+		{
+			return false;
+		}
+
+		std::string second = first;
+		second.insert(64 * 10 + 5, "inserted");
+		const std::vector<CryptoPP::byte> before(payload.GetPayload().begin(), payload.GetPayload().end());
+		payload.Update(rng, bytes(first), bytes(second));
+		const std::span<const CryptoPP::byte> after = payload.GetPayload();
+		if (payload.GetEncryptedSegments() != 2 || payload.GetReusedSegments() != 20 ||
+			!std::equal(before.end() - 64 * 5, before.end(), after.end() - 64 * 5) ||
+			!decrypt(payload, decrypted) || decrypted != second)
+		{
+			return false;
+		}
+
+		// adopting the payload checks the password and the root tag
+		const std::vector<CryptoPP::byte> saved(after.begin(), after.end());
+		Payload adopted(password, saved);
+		Payload rejected(password + "x", saved);
+		if (adopted.Failed() || !decrypt(adopted, decrypted) || decrypted != second ||
+			adopted.GetPayloadInfo().m_format != Layer::PayloadFormat::Indexed ||
+			!rejected.Failed() || !rejected.PasswordRejected())
+		{
+			return false;
+		}
+		adopted.Update(rng, bytes(second), bytes(first));
+		if (!decrypt(adopted, decrypted) || decrypted != first)
+		{
+			return false;
+		}
+
+		// uncompressed indexed payloads also open through Decrypt() and in a batch
+		std::string opened;
+		std::vector<CryptoPP::byte> batched = saved;
+		std::vector<Layer::BatchEntry> entries(1);
+		entries[0].m_buffer = std::span<CryptoPP::byte>(batched);
+		if (!TryDecrypt(saved, password, opened) || opened != second ||
+			Layer::DecryptBatch(password, entries) != 1 ||
+			std::string(reinterpret_cast<const char*>(batched.data()), entries[0].m_result.messageLength) != second)
+		{
+			return false;
+		}
+
+		const size_t index = Layer::INDEXED_HEADER_SIZE;
+		const size_t data = index + (saved.size() - index - second.size());
+		std::vector<std::vector<CryptoPP::byte>> damaged(4, saved);
+		damaged[0][Layer::INDEXED_HEADER_SIZE - 1] ^= 0x01;
+		std::swap_ranges(damaged[1].begin() + index, damaged[1].begin() + index + Layer::INDEX_ENTRY_SIZE, damaged[1].begin() + index + Layer::INDEX_ENTRY_SIZE);
+		damaged[2][data + 70] ^= 0x01;
+		damaged[3].resize(saved.size() - 1);
+		for (const std::vector<CryptoPP::byte>& cipher : damaged)
+		{
+			Payload damagedPayload(password, cipher);
+			if ((!damagedPayload.Failed() && decrypt(damagedPayload, decrypted)) || TryDecrypt(cipher, password, opened))
+			{
+				return false;
+			}
+		}
+
+		// compressed segments: smaller, refused by the buffer-sized Decrypt()
+		options.m_compression = Layer::Compression::Zlib;
+		Payload compressed(rng, password, options);
+		compressed.Update(rng, {}, bytes(second));
+		const std::vector<CryptoPP::byte> packed(compressed.GetPayload().begin(), compressed.GetPayload().end());
+		if (packed.size() >= saved.size() ||
+			TryDecrypt(packed, password, opened) ||
+			!decrypt(compressed, decrypted) || decrypted != second)
+		{
+			return false;
+		}
+
+		// the hex-encoded note: a save through the session of the unlock
+		std::string hex;
+		Utils::SecureString text;
+		std::unique_ptr<Payload> session;
+		if (!Utils::EncryptString(first, password, hex, Layer::KdfMode::Pbkdf2Sha256) ||
+			!Utils::DecryptString(hex, password, text, nullptr, nullptr, &session) || !session ||
+			!Utils::UpdateEncryptedString(*session, text, second, hex))
+		{
+			return false;
+		}
+		return Utils::DecryptString(hex, password, text) && text.compare(second) == 0 &&
+			session->GetReusedSegments() == 0 && session->GetEncryptedSegments() == 1;
+	}
+
+	// ranges decrypt only the segments they overlap, across segment
+	// boundaries and clipped at the end; the unlock task hands out the
+	// first screen of a long note, cut at a UTF-8 boundary
+	bool RangeDecryptOpensOnlyOverlappingSegments(const std::string& password)
+	{
+		using Layer = CryptoPP::AESLayer;
+		using Payload = Layer::IncrementalPayload;
+		const std::string plaintext = MakePlaintext(64 * 30 + 17);
+		const auto range = [](const Payload& payload, const size_t offset, const size_t length, std::string& text)
+		{
+			text.clear();
+			CryptoPP::StringSink sink(text);
+			return payload.DecryptRange(offset, length, sink);
+		};
+
+		CryptoPP::AutoSeededRandomPool rng;
+		for (const Layer::Compression compression : { Layer::Compression::None, Layer::Compression::Zlib })
+		{
+			Layer::EncryptionOptions options;
+			options.m_kdfMode = Layer::KdfMode::Pbkdf2Sha256;
+			options.m_segmentSize = 64;
+			options.m_compression = compression;
+			Payload payload(rng, password, options);
+			payload.Update(rng, {}, std::span<const CryptoPP::byte>(reinterpret_cast<const CryptoPP::byte*>(plaintext.data()), plaintext.size()));
+
+			const std::vector<std::pair<size_t, size_t>> ranges{
+				{ 0, 10 }, { 0, 64 }, { 60, 10 }, { 64 * 7, 64 * 3 }, { 100, 1000 }, { plaintext.size() - 5, 100 },
+				{ 0, static_cast<size_t>(-1) }, { plaintext.size(), 10 }, { plaintext.size() + 10, 10 } };
+			std::string text;
+			for (const std::pair<size_t, size_t>& r : ranges)
+			{
+				const std::string expected = r.first < plaintext.size() ? plaintext.substr(r.first, r.second) : std::string();
+				if (!range(payload, r.first, r.second, text) || text != expected)
+				{
+					return false;
+				}
+			}
+
+			// a damaged segment only fails the ranges that include it
+			std::vector<CryptoPP::byte> damaged(payload.GetPayload().begin(), payload.GetPayload().end());
+			damaged.back() ^= 0x01;
+			Payload adopted(password, damaged);
+			if (adopted.Failed() ||
+				!range(adopted, 0, 64 * 30, text) || text != plaintext.substr(0, 64 * 30) ||
+				range(adopted, 64 * 30, 1, text))
+			{
+				return false;
+			}
+		}
+
+		std::string note = "a";
+		while (note.size() <= Utils::FIRST_SCREEN_BYTES + 100)
+		{
+			note += "\xC3\xA9";
+		}
+		std::string hex;
+		if (!Utils::EncryptString(note, password, hex, Layer::KdfMode::Pbkdf2Sha256))
+		{
+			return false;
+		}
+		const std::unique_ptr<Utils::AsyncCryptoTask> task = Utils::AsyncCryptoTask::StartDecrypt(hex, password);
+		const bool succeeded = task->Wait() == Utils::AsyncCryptoTask::Status::Succeeded && task->GetText().compare(note) == 0;
+		const Utils::SecureString firstScreen = task->TakeFirstScreen();
+		return succeeded &&
+			firstScreen.size() == Utils::FIRST_SCREEN_BYTES - 1 &&
+			note.compare(0, firstScreen.size(), firstScreen.data(), firstScreen.size()) == 0;
+	}
+
+	// the payload resource holds the payload bytes, half the size of the hex
+	// text older versions stored (NUL-terminated), which still opens
+	bool BinaryPayloadResourceRoundTrip(const std::string& password)
+	{
+		using Layer = CryptoPP::AESLayer;
+		const std::string plaintext = MakePlaintext(200000);
+		std::vector<CryptoPP::byte> payload;
+		std::string hex;
+		std::unique_ptr<Layer::IncrementalPayload> session;
+		if (!Utils::EncryptPayload(plaintext, password, payload, Layer::KdfMode::Pbkdf2Sha256, nullptr, &session) ||
+			!Utils::IsBinaryPayload(payload) ||
+			!Utils::EncryptString(plaintext, password, hex, Layer::KdfMode::Pbkdf2Sha256) ||
+			payload.size() * 2 != hex.size())
+		{
+			return false;
+		}
+
+		Utils::SecureString text;
+		Layer::PayloadInfo info;
+		std::vector<CryptoPP::byte> resource(hex.begin(), hex.end());
+		resource.push_back(0);
+		if (!Utils::DecryptPayload(payload, password, text, &info) || text.compare(plaintext) != 0 ||
+			info.m_format != Layer::PayloadFormat::Indexed ||
+			Utils::DecryptPayload(payload, password + "x", text) ||
+			Utils::IsBinaryPayload(resource) ||
+			!Utils::DecryptPayload(resource, password, text) || text.compare(plaintext) != 0)
+		{
+			return false;
+		}
+
+		std::string edited = plaintext;
+		edited.replace(1000, 5, "edit");
+		const std::string segmented = SegmentedEncrypt(plaintext, password, Layer::KdfMode::Pbkdf2Sha256, 64, Layer::CipherMode::AesGcm, Layer::Compression::Zlib);
+		const std::vector<CryptoPP::byte> segmentedPayload(segmented.begin(), segmented.end());
+		if (!Utils::UpdateEncryptedPayload(*session, plaintext, edited, payload) ||
+			!Utils::DecryptPayload(segmentedPayload, password, text) || text.compare(plaintext) != 0)
+		{
+			return false;
+		}
+		const std::unique_ptr<Utils::AsyncCryptoTask> task = Utils::AsyncCryptoTask::StartDecrypt(payload, password);
+		return task->Wait() == Utils::AsyncCryptoTask::Status::Succeeded && task->TakeText().compare(edited) == 0;
+	}
+
+	// a session opened from a resource view reads the payload in place
+	// until its first update, which leaves the borrowed bytes untouched
+	bool BorrowedPayloadIsReadInPlace(const std::string& password)
+	{
+		using Layer = CryptoPP::AESLayer;
+		const std::string plaintext = MakePlaintext(200000);
+		std::vector<CryptoPP::byte> payload;
+		if (!Utils::EncryptPayload(plaintext, password, payload, Layer::KdfMode::Pbkdf2Sha256))
+		{
+			return false;
+		}
+		const std::vector<CryptoPP::byte> original = payload;
+
+		const std::unique_ptr<Utils::AsyncCryptoTask> task = Utils::AsyncCryptoTask::StartDecrypt(std::span<const CryptoPP::byte>(payload), password);
+		std::unique_ptr<Layer::IncrementalPayload> session = task->TakeIncrementalPayload();
+		if (task->GetStatus() != Utils::AsyncCryptoTask::Status::Succeeded ||
+			task->TakeText().compare(plaintext) != 0 ||
+			!session ||
+			session->GetPayload().data() != payload.data())
+		{
+			return false;
+		}
+
+		std::string edited = plaintext;
+		edited.replace(150000, 4, "edit");
+		std::vector<CryptoPP::byte> updated;
+		Utils::SecureString text;
+		return Utils::UpdateEncryptedPayload(*session, plaintext, edited, updated) &&
+			session->GetPayload().data() != payload.data() &&
+			payload == original &&
+			session->GetReusedSegments() != 0 &&
+			Utils::DecryptPayload(updated, password, text) && text.compare(edited) == 0;
+	}
+
+	// freed blocks are wiped and handed out again for their size class,
+	// large blocks get their own mapping, Reserve() maps chunks even when
+	// those already mapped are partly used, and the counters follow along
+	bool SecurePoolReusesAndWipes()
+	{
+		Utils::SecurePool& pool = Utils::SecurePool::Instance();
+		const Utils::SecurePool::Statistics before = pool.GetStatistics();
+
+		char* block = static_cast<char*>(pool.Allocate(100));
+		std::fill_n(block, 100, 'k');
+		pool.Deallocate(block, 100);
+		// the first bytes of a free block link it into its free list
+		if (std::count(block + sizeof(void*), block + 100, 'k') != 0 || pool.Allocate(120) != block)
+		{
+			return false;
+		}
+		pool.Deallocate(block, 120);
+
+		void* large = pool.Allocate(Utils::SecurePool::MAX_POOLED_BLOCK + 1);
+		std::fill_n(static_cast<char*>(large), Utils::SecurePool::MAX_POOLED_BLOCK + 1, 'k');
+		pool.Deallocate(large, Utils::SecurePool::MAX_POOLED_BLOCK + 1);
+
+		Utils::SecureString text(5000, 'x');
+		text += text;
+		const size_t reservedBefore = pool.GetStatistics().m_reservedBytes;
+		pool.Reserve(Utils::SecurePool::CHUNK_SIZE);
+		const Utils::SecurePool::Statistics after = pool.GetStatistics();
+		return after.m_allocations - before.m_allocations >= 4 &&
+			after.m_reusedBlocks > before.m_reusedBlocks &&
+			after.m_largeAllocations == before.m_largeAllocations + 1 &&
+			after.m_bytesInUse - before.m_bytesInUse >= text.size() &&
+			after.m_peakBytesInUse >= Utils::SecurePool::MAX_POOLED_BLOCK &&
+			after.m_reservedBytes == reservedBefore + Utils::SecurePool::CHUNK_SIZE &&
+			text.size() == 10000;
+	}
+
+	// the worker-thread API: round trip, wrong password and cancellation
+	bool AsyncTaskDecryptsAndCancels(const std::string& password)
+	{
+		using Task = Utils::AsyncCryptoTask;
+		const std::string plaintext(200000, 'a');
+		const std::unique_ptr<Task> encryption = Task::StartEncrypt(plaintext, password, CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256);
+		if (encryption->Wait() != Task::Status::Succeeded)
+		{
+			return false;
+		}
+		const std::string payload = encryption->TakePayload();
+
+		std::atomic<int> reports{ 0 };
+		const std::unique_ptr<Task> decryption = Task::StartDecrypt(payload, password, [&reports](CryptoPP::word64, CryptoPP::word64) { ++reports; });
+		if (decryption->Wait() != Task::Status::Succeeded ||
+			decryption->GetProgress() != 1.0 ||
+			decryption->GetPayloadInfo().m_kdfMode != CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256 ||
+			decryption->TakeText().compare(plaintext) != 0 ||
+			reports == 0)
+		{
+			return false;
+		}
+
+		if (Task::StartDecrypt(payload, password + "x")->Wait() != Task::Status::Failed)
+		{
+			return false;
+		}
+
+		const std::unique_ptr<Task> cancelled = Task::StartDecrypt(payload, password);
+		cancelled->Cancel();
+		return cancelled->Wait() == Task::Status::Cancelled && cancelled->TakeText().empty();
+	}
+
+	// every codec path the CPU has matches HexEncoder, reads either case
+	// and rejects odd lengths and non-hex characters at any position
+	bool HexCodecMatchesHexEncoder()
+	{
+		std::vector<CryptoPP::byte> bytes(300);
+		for (size_t i = 0; i < bytes.size(); ++i)
+		{
+			bytes[i] = static_cast<CryptoPP::byte>(i * 37 + 11);
+		}
+
+		for (const Utils::HexCodecPath path : { Utils::HexCodecPath::Scalar, Utils::HexCodecPath::Ssse3, Utils::HexCodecPath::Avx2 })
+		{
+			for (size_t size = 0; size <= 130; ++size)
+			{
+				std::string expected;
+				CryptoPP::HexEncoder encoder(new CryptoPP::StringSink(expected));
+				encoder.Put(bytes.data() + size, size);
+				encoder.MessageEnd();
+
+				std::string hex(size * 2, '\0');
+				Utils::HexEncode(std::span<const CryptoPP::byte>(bytes.data() + size, size), hex.data(), path);
+				std::vector<CryptoPP::byte> decoded(size);
+				std::string lower = hex;
+				std::transform(lower.begin(), lower.end(), lower.begin(), [](char c) { return static_cast<char>(c | (c >= 'A' ? 0x20 : 0)); });
+				if (hex != expected ||
+					!Utils::HexDecode(lower, decoded.data(), path) ||
+					!std::equal(decoded.begin(), decoded.end(), bytes.begin() + size))
+				{
+					return false;
+				}
+
+				if (size != 0 && Utils::HexDecode(std::string_view(hex).substr(1), decoded.data(), path))
+				{
+					return false;
+				}
+				for (const char invalid : { 'G', 'g', ' ', '/', ':', '@', '`', '\x80', '\xC6' })
+				{
+					if (size != 0)
+					{
+						std::string damaged = hex;
+						damaged[(size * 7) % damaged.size()] = invalid;
+						if (Utils::HexDecode(damaged, decoded.data(), path))
+						{
+							return false;
+						}
+					}
+				}
+			}
+		}
+		return true;
+	}
+
 	void Expect(const bool condition, const char* testName, int& failures)
 	{
 		if (condition)
@@ -82,6 +1240,38 @@ int main()
 	Expect(RoundTrip("LockNote2 smoke payload", password, CryptoPP::AESLayer::KdfMode::Scrypt), "roundtrip non-empty plaintext with scrypt", failures);
 	Expect(RoundTrip("LockNote2 smoke payload", password, CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256), "roundtrip non-empty plaintext with PBKDF2-SHA256", failures);
 	Expect(TamperIsRejected("tamper-detection", password, CryptoPP::AESLayer::KdfMode::Scrypt), "tampered ciphertext rejected", failures);
+	Expect(SegmentedRoundTrip(0, password, CryptoPP::AESLayer::KdfMode::Scrypt), "segmented roundtrip empty plaintext", failures);
+	Expect(SegmentedRoundTrip(64, password, CryptoPP::AESLayer::KdfMode::Scrypt), "segmented roundtrip exactly one segment", failures);
+	Expect(SegmentedRoundTrip(64 * 3 + 5, password, CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256), "segmented roundtrip multiple segments with PBKDF2-SHA256", failures);
+	Expect(SegmentedDamageIsRejected(password, CryptoPP::AESLayer::CipherMode::AesCbcHmacSha256), "segmented tampering, truncation, reordering and wrong password rejected", failures);
+	Expect(WrongPasswordFailsOnHeader(password), "segmented wrong password rejected by key check", failures);
+	Expect(ParallelSegmentsAreDeterministic(password), "segmented output identical with 1, 2 and 8 workers", failures);
+	Expect(SegmentedRoundTrip(0, password, CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256, CryptoPP::AESLayer::CipherMode::AesGcm), "segmented AES-GCM roundtrip empty plaintext", failures);
+	Expect(SegmentedRoundTrip(64, password, CryptoPP::AESLayer::KdfMode::Pbkdf2Sha256, CryptoPP::AESLayer::CipherMode::AesGcm), "segmented AES-GCM roundtrip exactly one segment", failures);
+	Expect(SegmentedRoundTrip(64 * 3 + 5, password, CryptoPP::AESLayer::KdfMode::Scrypt, CryptoPP::AESLayer::CipherMode::AesGcm), "segmented AES-GCM roundtrip multiple segments", failures);
+	Expect(SegmentedDamageIsRejected(password, CryptoPP::AESLayer::CipherMode::AesGcm), "segmented AES-GCM tampering, truncation, reordering and wrong password rejected", failures);
+	Expect(PayloadInfoIsReported(password), "decrypt reports payload format and KDF, including legacy PBKDF2", failures);
+	Expect(LegacyPbkdf2WrongPasswordIsRejected(password), "legacy PBKDF2 payload rejects wrong password", failures);
+	Expect(SpanEncryptMatches(password), "span and in-place encryption match the string overload", failures);
+	Expect(InPlaceDecryptWorksForEveryFormat(password), "in-place decryption of legacy, v2 and segmented payloads", failures);
+	Expect(KdfParametersAreRecorded(password), "segmented header records scrypt, PBKDF2 and Argon2id parameters", failures);
+	Expect(KdfParametersAreBounded(password), "out-of-range KDF parameters rejected", failures);
+	Expect(CalibrationStaysInBounds(), "KDF calibration returns valid parameters, never below the defaults or the note's own", failures);
+	Expect(ScryptMatchesRfc7914(), "parallel scrypt matches the RFC 7914 test vectors", failures);
+	Expect(ScryptMatchesCryptoPP(password), "parallel scrypt matches Scrypt::DeriveKey", failures);
+	Expect(Argon2idMatchesRfc9106(), "Argon2id matches the RFC 9106 test vector", failures);
+	Expect(Argon2idIsSegmentedOnly(password), "Argon2id segmented roundtrip, refused for v2 payloads", failures);
+	Expect(DiagnosticsReportBackendsAndTimings(), "diagnostics report backends and primitive timings", failures);
+	Expect(KdfReportsProgressAndCancels(password), "scrypt, Argon2id and PBKDF2 report progress and can be cancelled", failures);
+	Expect(AsyncTaskDecryptsAndCancels(password), "asynchronous decrypt succeeds, rejects a wrong password and cancels", failures);
+	Expect(BatchDecryptSharesDerivations(password), "batch decryption shares one derivation per salt", failures);
+	Expect(CompressedRoundTrip(password), "compressed payloads shrink and stream-decompress", failures);
+	Expect(SecurePoolReusesAndWipes(), "secure pool wipes, reuses and counts blocks", failures);
+	Expect(IncrementalSaveReusesSegments(password), "indexed payloads re-encrypt only edited segments and reject damage", failures);
+	Expect(RangeDecryptOpensOnlyOverlappingSegments(password), "indexed ranges decrypt only overlapping segments; unlock hands out the first screen", failures);
+	Expect(BinaryPayloadResourceRoundTrip(password), "binary payload resource round trip; NUL-terminated hex still opens", failures);
+	Expect(BorrowedPayloadIsReadInPlace(password), "sessions read a borrowed payload in place until the first save", failures);
+	Expect(HexCodecMatchesHexEncoder(), "scalar, SSSE3 and AVX2 hex codecs match HexEncoder and reject invalid input", failures);
 
 	if (failures != 0)
 	{
@@ -0,0 +1,224 @@
+// Benchmark for peresources.h on the synthetic image of
+// tests/peresources_image.h, see scripts/build-and-run-pe-resources.sh.
+//
+// Output is JSON Lines on stdout, one object per measurement:
+//   {"bench":"pe_load",...}   Load() and Find() of the payload of an image
+//                             holding a payload of the given size
+//   {"bench":"pe_write",...}  Update() of the payload and Write() of the
+//                             image, as done by a save
+//   {"bench":"pe_batch",...}  a save's eight resource updates written as
+//                             eight successive rewrites and as one batch
+// Times are medians in milliseconds; MB/s refers to the payload size.
+//
+// usage: peresources_bench [--max-size BYTES[K|M|G]] [--runs N]
+
+#include "peresources.h"
+#include "peresources_image.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace
+{
+	using Clock = std::chrono::steady_clock;
+	using Utils::PeResources;
+
+	constexpr size_t KiB = 1024;
+	constexpr size_t MiB = 1024 * KiB;
+	constexpr size_t GiB = 1024 * MiB;
+	constexpr size_t kSizes[] = { KiB, 16 * KiB, 256 * KiB, MiB, 16 * MiB, 64 * MiB };
+	// the INFORMATION resources LockNote writes next to its payload
+	constexpr const char* kTraits[] = { "SIZEX", "SIZEY", "FONTSIZE", "TYPEFACE", "KDFMODE", "THEMEMODE", "LANGID" };
+
+	struct Options
+	{
+		size_t m_maxSize{ 64 * MiB };
+		int m_runs{ 5 };
+	};
+
+	template <typename Operation>
+	double Measure(const int runs, bool& ok, Operation&& operation)
+	{
+		std::vector<double> samples;
+		for (int run = 0; run < runs; ++run)
+		{
+			const Clock::time_point start = Clock::now();
+			ok &= operation();
+			samples.push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+		}
+		std::sort(samples.begin(), samples.end());
+		return samples[samples.size() / 2];
+	}
+
+	std::string Rate(const size_t bytes, const double milliseconds)
+	{
+		if (milliseconds <= 0.0)
+		{
+			return "null";
+		}
+		std::ostringstream rate;
+		rate << std::fixed << std::setprecision(2) << (bytes / static_cast<double>(MiB)) * 1000.0 / milliseconds;
+		return rate.str();
+	}
+
+	std::string Milliseconds(const double milliseconds)
+	{
+		std::ostringstream text;
+		text << std::fixed << std::setprecision(4) << milliseconds;
+		return text.str();
+	}
+
+	// the synthetic image with a payload of size and LockNote's traits
+	std::vector<unsigned char> ImageWithPayload(const size_t size)
+	{
+		const std::vector<unsigned char> empty = PeTestImage::Build(false, false);
+		PeResources resources;
+		std::vector<unsigned char> image;
+		resources.Load(empty);
+		resources.Update("PAYLOAD", "CONTENT", std::vector<unsigned char>(size, 'p'));
+		for (const char* trait : kTraits)
+		{
+			resources.Update("INFORMATION", trait, { '1', 0 });
+		}
+		resources.Write(image);
+		return image;
+	}
+
+	bool RunSize(const size_t size, const int runs)
+	{
+		bool ok = true;
+		const std::vector<unsigned char> image = ImageWithPayload(size);
+		const std::vector<unsigned char> payload(size, 'q');
+		std::vector<unsigned char> output;
+
+		const double load = Measure(runs, ok, [&]() {
+			PeResources resources;
+			const PeResources::Resource* found = resources.Load(image) ? resources.Find("PAYLOAD", "CONTENT") : nullptr;
+			return found && found->m_data.size() == size;
+		});
+		std::cout << "{\"bench\":\"pe_load\",\"size\":" << size << ",\"image\":" << image.size() << ",\"runs\":" << runs
+			<< ",\"ms\":" << Milliseconds(load) << ",\"mb_s\":" << Rate(size, load) << "}" << std::endl;
+
+		const double write = Measure(runs, ok, [&]() {
+			PeResources resources;
+			resources.Load(image);
+			resources.Update("PAYLOAD", "CONTENT", payload);
+			return resources.Write(output) && output.size() == image.size();
+		});
+		std::cout << "{\"bench\":\"pe_write\",\"size\":" << size << ",\"image\":" << image.size() << ",\"runs\":" << runs
+			<< ",\"ms\":" << Milliseconds(write) << ",\"mb_s\":" << Rate(size, write) << "}" << std::endl;
+
+		// what one UpdateResource() per resource costs against one batch
+		const double separate = Measure(runs, ok, [&]() {
+			std::vector<unsigned char> current = image;
+			bool written = true;
+			for (size_t update = 0; update <= std::size(kTraits); ++update)
+			{
+				PeResources resources;
+				written &= resources.Load(current);
+				if (update == 0)
+				{
+					resources.Update("PAYLOAD", "CONTENT", payload);
+				}
+				else
+				{
+					resources.Update("INFORMATION", kTraits[update - 1], { '2', 0 });
+				}
+				written &= resources.Write(output);
+				current.swap(output);
+			}
+			return written;
+		});
+		const double batched = Measure(runs, ok, [&]() {
+			PeResources resources;
+			resources.Load(image);
+			resources.Update("PAYLOAD", "CONTENT", payload);
+			for (const char* trait : kTraits)
+			{
+				resources.Update("INFORMATION", trait, { '2', 0 });
+			}
+			return resources.Write(output);
+		});
+		std::cout << "{\"bench\":\"pe_batch\",\"size\":" << size << ",\"updates\":" << std::size(kTraits) + 1 << ",\"runs\":" << runs
+			<< ",\"separate_ms\":" << Milliseconds(separate) << ",\"batched_ms\":" << Milliseconds(batched) << "}" << std::endl;
+		return ok;
+	}
+
+	// "64K", "16M", "1G" or plain bytes
+	bool ParseSize(const std::string& value, size_t& size)
+	{
+		char* end = nullptr;
+		const unsigned long long parsed = std::strtoull(value.c_str(), &end, 10);
+		if (end == value.c_str())
+		{
+			return false;
+		}
+		const std::string_view suffix(end);
+		const size_t scale = suffix == "K" ? KiB : suffix == "M" ? MiB : suffix == "G" ? GiB : suffix.empty() ? 1 : 0;
+		size = static_cast<size_t>(parsed) * scale;
+		return scale != 0;
+	}
+
+	bool ParseOptions(const int argc, char* argv[], Options& options)
+	{
+		for (int i = 1; i + 1 < argc; i += 2)
+		{
+			const std::string_view name = argv[i];
+			const std::string value = argv[i + 1];
+			if (name == "--max-size")
+			{
+				if (!ParseSize(value, options.m_maxSize))
+				{
+					return false;
+				}
+			}
+			else if (name == "--runs")
+			{
+				options.m_runs = std::atoi(value.c_str());
+				if (options.m_runs < 1)
+				{
+					return false;
+				}
+			}
+			else
+			{
+				return false;
+			}
+		}
+		return argc % 2 == 1;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		std::cerr << "usage: peresources_bench [--max-size BYTES[K|M|G]] [--runs N]" << '\n';
+		return 2;
+	}
+
+	bool ok = true;
+	for (const size_t size : kSizes)
+	{
+		if (size <= options.m_maxSize)
+		{
+			ok &= RunSize(size, options.m_runs);
+		}
+	}
+	if (!ok)
+	{
+		std::cerr << "a PE resource operation failed" << '\n';
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,134 @@
+// A minimal PE image for tests/peresources_smoke.cpp and
+// tests/peresources_bench.cpp, laid out the way the linker lays out
+// LockNote: .text, then an empty .rsrc, then .reloc with one block, and
+// optionally an Authenticode-style certificate table after the sections.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace PeTestImage
+{
+	constexpr std::uint32_t FILE_ALIGNMENT = 0x200;
+	constexpr std::uint32_t SECTION_ALIGNMENT = 0x1000;
+	constexpr size_t PE_OFFSET = 0x80;
+	constexpr size_t OPTIONAL_HEADER = PE_OFFSET + 24;
+	constexpr std::uint32_t TEXT_RVA = 0x1000;
+	constexpr std::uint32_t RSRC_RVA = 0x2000;
+	constexpr std::uint32_t RELOC_RVA = 0x3000;
+	constexpr std::uint32_t CERTIFICATE_OFFSET = 0x800;
+	constexpr std::uint32_t CERTIFICATE_SIZE = 0x18;
+	constexpr unsigned char TEXT_BYTES[] = { 0x55, 0x8B, 0xEC, 0x33, 0xC0, 0x5D, 0xC3 };
+	constexpr unsigned char RELOC_BYTES[] = { 0x00, 0x10, 0x00, 0x00, 0x0C, 0x00, 0x00, 0x00, 0x04, 0x30, 0x00, 0x00 };
+
+	inline void Put16(std::vector<unsigned char>& image, const size_t offset, const std::uint16_t value)
+	{
+		image[offset] = static_cast<unsigned char>(value);
+		image[offset + 1] = static_cast<unsigned char>(value >> 8);
+	}
+
+	inline void Put32(std::vector<unsigned char>& image, const size_t offset, const std::uint32_t value)
+	{
+		for (size_t i = 0; i < 4; ++i)
+		{
+			image[offset + i] = static_cast<unsigned char>(value >> (8 * i));
+		}
+	}
+
+	inline std::uint32_t Get32(const std::vector<unsigned char>& image, const size_t offset)
+	{
+		return static_cast<std::uint32_t>(image[offset]) | (static_cast<std::uint32_t>(image[offset + 1]) << 8) |
+			(static_cast<std::uint32_t>(image[offset + 2]) << 16) | (static_cast<std::uint32_t>(image[offset + 3]) << 24);
+	}
+
+	inline size_t DirectoriesOffset(const bool pe32Plus)
+	{
+		return OPTIONAL_HEADER + (pe32Plus ? 112 : 96);
+	}
+
+	inline size_t SectionTable(const bool pe32Plus)
+	{
+		return OPTIONAL_HEADER + (pe32Plus ? 240 : 224);
+	}
+
+	// section header field of section 0 (.text), 1 (.rsrc) or 2 (.reloc)
+	inline std::uint32_t SectionField(const std::vector<unsigned char>& image, const bool pe32Plus, const size_t section, const size_t field)
+	{
+		return Get32(image, SectionTable(pe32Plus) + section * 40 + field);
+	}
+
+	inline std::vector<unsigned char> Build(const bool pe32Plus, const bool certificate)
+	{
+		std::vector<unsigned char> image(0x800 + (certificate ? CERTIFICATE_SIZE : 0), 0);
+		Put16(image, 0, 0x5A4D);
+		Put32(image, 0x3C, PE_OFFSET);
+		Put32(image, PE_OFFSET, 0x00004550);
+		Put16(image, PE_OFFSET + 4, pe32Plus ? 0x8664 : 0x014C);
+		Put16(image, PE_OFFSET + 6, 3);
+		Put16(image, PE_OFFSET + 20, pe32Plus ? 240 : 224);
+		Put16(image, PE_OFFSET + 22, pe32Plus ? 0x2022 : 0x2102);
+
+		Put16(image, OPTIONAL_HEADER, pe32Plus ? 0x20B : 0x10B);
+		Put32(image, OPTIONAL_HEADER + 4, FILE_ALIGNMENT);
+		Put32(image, OPTIONAL_HEADER + 8, 2 * FILE_ALIGNMENT);
+		Put32(image, OPTIONAL_HEADER + 16, TEXT_RVA);
+		Put32(image, OPTIONAL_HEADER + 32, SECTION_ALIGNMENT);
+		Put32(image, OPTIONAL_HEADER + 36, FILE_ALIGNMENT);
+		Put16(image, OPTIONAL_HEADER + 40, 6);
+		Put32(image, OPTIONAL_HEADER + 56, 0x4000);
+		Put32(image, OPTIONAL_HEADER + 60, FILE_ALIGNMENT);
+		Put16(image, OPTIONAL_HEADER + 68, 2);
+		Put32(image, OPTIONAL_HEADER + (pe32Plus ? 108 : 92), 16);
+		const size_t directories = DirectoriesOffset(pe32Plus);
+		Put32(image, directories + 2 * 8, RSRC_RVA);
+		Put32(image, directories + 2 * 8 + 4, 16);
+		Put32(image, directories + 5 * 8, RELOC_RVA);
+		Put32(image, directories + 5 * 8 + 4, sizeof(RELOC_BYTES));
+		if (certificate)
+		{
+			Put32(image, directories + 4 * 8, CERTIFICATE_OFFSET);
+			Put32(image, directories + 4 * 8 + 4, CERTIFICATE_SIZE);
+			Put32(image, CERTIFICATE_OFFSET, CERTIFICATE_SIZE);
+			Put16(image, CERTIFICATE_OFFSET + 4, 0x0200);
+			Put16(image, CERTIFICATE_OFFSET + 6, 0x0002);
+		}
+
+		struct SectionHeader
+		{
+			const char* m_name;
+			std::uint32_t m_virtualSize;
+			std::uint32_t m_virtualAddress;
+			std::uint32_t m_characteristics;
+		};
+		const SectionHeader sections[] = {
+			{ ".text", sizeof(TEXT_BYTES), TEXT_RVA, 0x60000020 },
+			{ ".rsrc", 16, RSRC_RVA, 0x40000040 },
+			{ ".reloc", sizeof(RELOC_BYTES), RELOC_RVA, 0x42000040 },
+		};
+		for (size_t i = 0; i < 3; ++i)
+		{
+			const size_t header = SectionTable(pe32Plus) + i * 40;
+			for (size_t c = 0; sections[i].m_name[c] != '\0'; ++c)
+			{
+				image[header + c] = static_cast<unsigned char>(sections[i].m_name[c]);
+			}
+			Put32(image, header + 8, sections[i].m_virtualSize);
+			Put32(image, header + 12, sections[i].m_virtualAddress);
+			Put32(image, header + 16, FILE_ALIGNMENT);
+			Put32(image, header + 20, static_cast<std::uint32_t>((i + 1) * FILE_ALIGNMENT));
+			Put32(image, header + 36, sections[i].m_characteristics);
+		}
+
+		for (size_t i = 0; i < sizeof(TEXT_BYTES); ++i)
+		{
+			image[FILE_ALIGNMENT + i] = TEXT_BYTES[i];
+		}
+		for (size_t i = 0; i < sizeof(RELOC_BYTES); ++i)
+		{
+			image[3 * FILE_ALIGNMENT + i] = RELOC_BYTES[i];
+		}
+		return image;
+	}
+}
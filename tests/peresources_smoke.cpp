@@ -0,0 +1,294 @@
+// Smoke tests for peresources.h against the synthetic image of
+// tests/peresources_image.h; builds with a stock compiler and no other
+// dependency, see scripts/build-and-run-pe-resources.sh.
+
+#include "peresources.h"
+#include "peresources_image.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace
+{
+	using Utils::PeResources;
+
+	std::vector<unsigned char> Bytes(const size_t size, const unsigned char seed)
+	{
+		std::vector<unsigned char> data(size);
+		for (size_t i = 0; i < size; ++i)
+		{
+			data[i] = static_cast<unsigned char>(seed + i * 7);
+		}
+		return data;
+	}
+
+	bool Equal(const std::span<const unsigned char> left, const std::vector<unsigned char>& right)
+	{
+		return std::equal(left.begin(), left.end(), right.begin(), right.end());
+	}
+
+	bool HasData(const PeResources& resources, const Utils::PeResourceId& type, const Utils::PeResourceId& name, const std::vector<unsigned char>& data)
+	{
+		const PeResources::Resource* resource = resources.Find(type, name);
+		return resource && Equal(resource->m_data, data);
+	}
+
+	// the .text and .reloc bytes of image, wherever the sections are now
+	bool SectionsIntact(const std::vector<unsigned char>& image, const bool pe32Plus)
+	{
+		const size_t text = PeTestImage::SectionField(image, pe32Plus, 0, 20);
+		const size_t reloc = PeTestImage::SectionField(image, pe32Plus, 2, 20);
+		return text + sizeof(PeTestImage::TEXT_BYTES) <= image.size() && reloc + sizeof(PeTestImage::RELOC_BYTES) <= image.size() &&
+			std::equal(std::begin(PeTestImage::TEXT_BYTES), std::end(PeTestImage::TEXT_BYTES), image.begin() + text) &&
+			std::equal(std::begin(PeTestImage::RELOC_BYTES), std::end(PeTestImage::RELOC_BYTES), image.begin() + reloc);
+	}
+
+	bool ChecksumMatches(const std::vector<unsigned char>& image)
+	{
+		const size_t checksum = PeTestImage::OPTIONAL_HEADER + 64;
+		return PeTestImage::Get32(image, checksum) == PeResources::ComputeChecksum(image, checksum);
+	}
+
+	// the image as the loader maps it: headers and every section at its RVA
+	std::vector<unsigned char> MapImage(const std::vector<unsigned char>& image, const bool pe32Plus)
+	{
+		std::vector<unsigned char> mapped(PeTestImage::Get32(image, PeTestImage::OPTIONAL_HEADER + 56), 0);
+		std::copy(image.begin(), image.begin() + PeTestImage::FILE_ALIGNMENT, mapped.begin());
+		for (size_t i = 0; i < 3; ++i)
+		{
+			const size_t rva = PeTestImage::SectionField(image, pe32Plus, i, 12);
+			const size_t rawSize = PeTestImage::SectionField(image, pe32Plus, i, 16);
+			const size_t pointer = PeTestImage::SectionField(image, pe32Plus, i, 20);
+			std::copy(image.begin() + pointer, image.begin() + pointer + rawSize, mapped.begin() + rva);
+		}
+		return mapped;
+	}
+
+	bool ParsesIdsAndNames()
+	{
+		const Utils::PeResourceId numbered("#16");
+		const Utils::PeResourceId named("Payload");
+		const Utils::PeResourceId wide("N\xC3\xB6tiz\xF0\x9F\x94\x92");
+		return !numbered.IsName() && numbered.m_id == 16 && numbered.ToString() == "#16" &&
+			named.IsName() && named == Utils::PeResourceId("PAYLOAD") && !(named == Utils::PeResourceId("PAYLOADS")) &&
+			wide.m_name.size() == 7 && wide.ToString() == "N\xC3\xB6tiz\xF0\x9F\x94\x92" &&
+			Utils::PeResourceId("#70000").IsName() && Utils::PeResourceId::Compare(named, numbered) < 0;
+	}
+
+	// adding LockNote's resources to an image without any, then replacing
+	// one in a second pass over the written image
+	bool AddsAndReplacesResources(const bool pe32Plus)
+	{
+		const std::vector<unsigned char> image = PeTestImage::Build(pe32Plus, false);
+		PeResources resources;
+		if (!resources.Load(image) || !resources.GetResources().empty())
+		{
+			return false;
+		}
+
+		const std::vector<unsigned char> payload = Bytes(300, 1);
+		const std::vector<unsigned char> traits = { 'F', 'o', 'n', 't', 0 };
+		const std::vector<unsigned char> version = Bytes(92, 9);
+		resources.Update("PAYLOAD", "CONTENT", payload);
+		resources.Update("INFORMATION", "TYPEFACE", traits);
+		resources.Update(16, 1, version, 1033);
+		std::vector<unsigned char> written;
+		if (!resources.Write(written) || !SectionsIntact(written, pe32Plus) || !ChecksumMatches(written))
+		{
+			return false;
+		}
+
+		PeResources reloaded;
+		if (!reloaded.Load(written) || reloaded.GetResources().size() != 3 ||
+			!HasData(reloaded, "payload", "Content", payload) || !HasData(reloaded, "INFORMATION", "TYPEFACE", traits) ||
+			!HasData(reloaded, "#16", "#1", version) || !reloaded.Find(16, 1, 1033) || reloaded.Find(16, 1, 0))
+		{
+			return false;
+		}
+
+		const std::vector<unsigned char> replaced = Bytes(17, 3);
+		reloaded.Update("PAYLOAD", "CONTENT", replaced);
+		if (reloaded.GetResources().size() != 3 || !reloaded.Remove("INFORMATION", "TYPEFACE") || reloaded.Remove("INFORMATION", "TYPEFACE"))
+		{
+			return false;
+		}
+		std::vector<unsigned char> rewritten;
+		PeResources last;
+		return reloaded.Write(rewritten) && last.Load(rewritten) && last.GetResources().size() == 2 &&
+			HasData(last, "PAYLOAD", "CONTENT", replaced) && !last.Find("INFORMATION", "TYPEFACE") && ChecksumMatches(rewritten);
+	}
+
+	// a payload larger than the gap to .reloc moves .reloc, and shrinking
+	// it again moves .reloc back
+	bool GrowsAndShrinksResourceSection(const bool pe32Plus)
+	{
+		const std::vector<unsigned char> image = PeTestImage::Build(pe32Plus, false);
+		PeResources resources;
+		const std::vector<unsigned char> payload = Bytes(64 * 1024 + 5, 2);
+		resources.Load(image);
+		resources.Update("PAYLOAD", "CONTENT", payload);
+		std::vector<unsigned char> grown;
+		if (!resources.Write(grown) || !SectionsIntact(grown, pe32Plus) || !ChecksumMatches(grown))
+		{
+			return false;
+		}
+
+		const std::uint32_t rsrcSize = PeTestImage::SectionField(grown, pe32Plus, 1, 8);
+		const std::uint32_t relocRva = PeTestImage::SectionField(grown, pe32Plus, 2, 12);
+		const std::uint32_t expectedRva = PeTestImage::RSRC_RVA + (rsrcSize + PeTestImage::SECTION_ALIGNMENT - 1) / PeTestImage::SECTION_ALIGNMENT * PeTestImage::SECTION_ALIGNMENT;
+		const size_t directories = PeTestImage::DirectoriesOffset(pe32Plus);
+		if (rsrcSize <= payload.size() || relocRva != expectedRva || PeTestImage::Get32(grown, directories + 5 * 8) != relocRva ||
+			PeTestImage::Get32(grown, directories + 2 * 8 + 4) != rsrcSize ||
+			PeTestImage::Get32(grown, PeTestImage::OPTIONAL_HEADER + 56) != relocRva + PeTestImage::SECTION_ALIGNMENT ||
+			PeTestImage::Get32(grown, PeTestImage::OPTIONAL_HEADER + 8) != PeTestImage::SectionField(grown, pe32Plus, 1, 16) + PeTestImage::FILE_ALIGNMENT)
+		{
+			return false;
+		}
+
+		PeResources reloaded;
+		const std::vector<unsigned char> small = Bytes(10, 4);
+		if (!reloaded.Load(grown) || !HasData(reloaded, "PAYLOAD", "CONTENT", payload))
+		{
+			return false;
+		}
+		reloaded.Update("PAYLOAD", "CONTENT", small);
+		std::vector<unsigned char> shrunk;
+		PeResources last;
+		return reloaded.Write(shrunk) && shrunk.size() == image.size() && SectionsIntact(shrunk, pe32Plus) &&
+			PeTestImage::SectionField(shrunk, pe32Plus, 2, 12) == PeTestImage::RELOC_RVA &&
+			PeTestImage::Get32(shrunk, directories + 5 * 8) == PeTestImage::RELOC_RVA &&
+			last.Load(shrunk) && HasData(last, "PAYLOAD", "CONTENT", small);
+	}
+
+	// growing past .reloc is refused when the sections behind .rsrc hold
+	// more than base relocations
+	bool RefusesToMoveReferencedSections()
+	{
+		std::vector<unsigned char> image = PeTestImage::Build(false, false);
+		PeTestImage::Put32(image, PeTestImage::DirectoriesOffset(false) + 1 * 8, PeTestImage::RELOC_RVA + 0x10);
+		PeTestImage::Put32(image, PeTestImage::DirectoriesOffset(false) + 1 * 8 + 4, 0x14);
+		PeResources resources;
+		std::vector<unsigned char> written;
+		if (!resources.Load(image))
+		{
+			return false;
+		}
+		resources.Update("PAYLOAD", "CONTENT", Bytes(100, 5));
+		const bool fits = resources.Write(written);
+		resources.Update("PAYLOAD", "CONTENT", Bytes(8192, 5));
+		return fits && !resources.Write(written);
+	}
+
+	bool DropsCertificate()
+	{
+		const std::vector<unsigned char> image = PeTestImage::Build(true, true);
+		PeResources resources;
+		const std::vector<unsigned char> payload = Bytes(5000, 6);
+		resources.Load(image);
+		resources.Update("PAYLOAD", "CONTENT", payload);
+		std::vector<unsigned char> written;
+		const size_t certificate = PeTestImage::DirectoriesOffset(true) + 4 * 8;
+		return resources.Write(written) && PeTestImage::Get32(written, certificate) == 0 && PeTestImage::Get32(written, certificate + 4) == 0 &&
+			written.size() == PeTestImage::SectionField(written, true, 2, 20) + PeTestImage::FILE_ALIGNMENT && ChecksumMatches(written);
+	}
+
+	bool ReadsLoadedImage(const bool pe32Plus)
+	{
+		const std::vector<unsigned char> image = PeTestImage::Build(pe32Plus, false);
+		PeResources resources;
+		const std::vector<unsigned char> payload = Bytes(6000, 7);
+		resources.Load(image);
+		resources.Update("PAYLOAD", "CONTENT", payload);
+		std::vector<unsigned char> written;
+		if (!resources.Write(written))
+		{
+			return false;
+		}
+
+		const std::vector<unsigned char> mapped = MapImage(written, pe32Plus);
+		const std::span<const unsigned char> module = PeResources::ModuleImage(mapped.data());
+		PeResources loaded;
+		std::vector<unsigned char> unused;
+		return module.data() == mapped.data() && module.size() == mapped.size() &&
+			loaded.Load(module, PeResources::Layout::Loaded) && HasData(loaded, "PAYLOAD", "CONTENT", payload) &&
+			!loaded.Write(unused);
+	}
+
+	bool RejectsDamagedImages()
+	{
+		const std::vector<unsigned char> image = PeTestImage::Build(false, false);
+		PeResources resources;
+		resources.Load(image);
+		resources.Update("PAYLOAD", "CONTENT", Bytes(40, 8));
+		std::vector<unsigned char> valid;
+		resources.Write(valid);
+		const size_t rsrc = PeTestImage::SectionField(valid, false, 1, 20);
+
+		const auto rejected = [](const std::vector<unsigned char>& damaged)
+		{
+			PeResources parser;
+			return !parser.Load(damaged) && parser.GetResources().empty();
+		};
+		std::vector<unsigned char> badMagic = valid;
+		badMagic[0] = 'Z';
+		std::vector<unsigned char> badSignature = valid;
+		badSignature[PeTestImage::PE_OFFSET + 1] = 'F';
+		std::vector<unsigned char> truncated(valid.begin(), valid.begin() + rsrc + 8);
+		std::vector<unsigned char> entryCount = valid;
+		PeTestImage::Put16(entryCount, rsrc + 14, 0xFFFF);
+		std::vector<unsigned char> cycle = valid;
+		PeTestImage::Put32(cycle, rsrc + 16 + 4, 0x80000000);
+		std::vector<unsigned char> dataOutside = valid;
+		const size_t entry = rsrc + 3 * 16 + 3 * 8;
+		PeTestImage::Put32(dataOutside, entry + 4, 0x10000);
+		std::vector<unsigned char> sectionOutside = valid;
+		PeTestImage::Put32(sectionOutside, PeTestImage::SectionTable(false) + 2 * 40 + 16, 0x10000);
+
+		PeResources empty;
+		std::vector<unsigned char> unused;
+		return rejected({}) && rejected(badMagic) && rejected(badSignature) && rejected(truncated) && rejected(entryCount) &&
+			rejected(cycle) && rejected(dataOutside) && rejected(sectionOutside) && !empty.Write(unused) &&
+			PeResources::ModuleImage(badMagic.data()).empty();
+	}
+
+	void Expect(const bool condition, const char* testName, int& failures)
+	{
+		if (condition)
+		{
+			std::cout << "[PASS] " << testName << '\n';
+			return;
+		}
+
+		std::cout << "[FAIL] " << testName << '\n';
+		++failures;
+	}
+}
+
+int main()
+{
+	int failures = 0;
+	Expect(ParsesIdsAndNames(), "resource IDs parse \"#n\", UTF-8 names and compare names case-insensitively", failures);
+	Expect(AddsAndReplacesResources(false), "PE32 resources added, found, replaced and removed", failures);
+	Expect(AddsAndReplacesResources(true), "PE32+ resources added, found, replaced and removed", failures);
+	Expect(GrowsAndShrinksResourceSection(false), "PE32 resource section grows and shrinks, moving .reloc", failures);
+	Expect(GrowsAndShrinksResourceSection(true), "PE32+ resource section grows and shrinks, moving .reloc", failures);
+	Expect(RefusesToMoveReferencedSections(), "sections holding more than relocations are not moved", failures);
+	Expect(DropsCertificate(), "rewriting drops the certificate table", failures);
+	Expect(ReadsLoadedImage(false), "PE32 resources read from a mapped image", failures);
+	Expect(ReadsLoadedImage(true), "PE32+ resources read from a mapped image", failures);
+	Expect(RejectsDamagedImages(), "damaged headers and resource trees rejected", failures);
+
+	if (failures != 0)
+	{
+		std::cout << "PE resource smoke tests failed: " << failures << '\n';
+		return 1;
+	}
+
+	std::cout << "All PE resource smoke tests passed." << '\n';
+	return 0;
+}
@@ -8,7 +8,10 @@
 
 #include <windows.h>
 
-std::string wchar_to_utf8(LPCWSTR lpString, bool bIncludeZero = false)
+// Utf8String may be any std::basic_string<char>, e.g. Utils::SecureString
+// for note text and passwords
+template <class Utf8String = std::string>
+Utf8String wchar_to_utf8(LPCWSTR lpString, bool bIncludeZero = false)
 {
 	if (lpString == nullptr)
 	{
@@ -29,7 +32,7 @@ std::string wchar_to_utf8(LPCWSTR lpString, bool bIncludeZero = false)
 		return {};
 	}
 
-	std::string result(static_cast<size_t>(requiredChars), '\0');
+	Utf8String result(static_cast<size_t>(requiredChars), '\0');
 	const int writtenChars = WideCharToMultiByte(
 		CP_UTF8,
 		0,
@@ -56,7 +59,8 @@ std::string wstring_to_utf8(const std::wstring& str, bool bIncludeZero = false)
 	return wchar_to_utf8(str.c_str(), bIncludeZero);
 }
 
-std::wstring utf8_to_wstring(LPCSTR lpString)
+template <class WideString = std::wstring>
+WideString utf8_to_wstring(LPCSTR lpString)
 {
 	if (lpString == nullptr)
 	{
@@ -75,7 +79,7 @@ std::wstring utf8_to_wstring(LPCSTR lpString)
 		return {};
 	}
 
-	std::wstring result(static_cast<size_t>(requiredChars), L'\0');
+	WideString result(static_cast<size_t>(requiredChars), L'\0');
 	const int writtenChars = MultiByteToWideChar(
 		CP_UTF8,
 		0,
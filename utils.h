@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include "cryptoutils.h"
 #include "utf8unicode.h"
 
 #include <algorithm>
@@ -26,6 +27,8 @@
 #include <cstdio>
 #include <cstring>
 #include <limits>
+#include <memory>
+#include <span>
 #include <sstream>
 #include <string>
 #include <string_view>
@@ -34,8 +37,13 @@
 
 #include "cryptopp/misc.h"
 
-std::string GetPasswordDlg(HWND hWnd = nullptr);
-std::string GetNewPasswordDlg(HWND hWnd = nullptr);
+#ifdef LOCKNOTE_PORTABLE_RESOURCES
+#include "peresources.h"
+#endif
+
+Utils::SecureString GetPasswordDlg(HWND hWnd = nullptr);
+Utils::SecureString GetNewPasswordDlg(HWND hWnd = nullptr);
+INT_PTR UnlockDlg(std::span<const CryptoPP::byte> encryptedPayload, Utils::SecureString& strPassword, Utils::SecureString& strText, CryptoPP::AESLayer::PayloadInfo& payloadInfo, std::unique_ptr<CryptoPP::AESLayer::IncrementalPayload>& session, std::unique_ptr<Utils::AsyncCryptoTask>& loadTask, HWND hWnd = nullptr);
 
 typedef struct wintraits_t
 {
@@ -86,7 +94,8 @@ namespace Utils
 	}
 
 	// lower a std::string. from https://en.cppreference.com/w/cpp/string/byte/tolower
-	inline std::string str_tolower(std::string s)
+	template <class String>
+	String str_tolower(String s)
 	{
 		std::transform(s.begin(), s.end(), s.begin(),
 			[](unsigned char c) { return static_cast<unsigned char>(std::tolower(c)); }
@@ -119,77 +128,141 @@ namespace Utils
 		return ec == std::errc{} && parsedUntil == end;
 	}
 
-		inline AESLayer::KdfMode ParseKdfModeValue(const int value)
-		{
-			return value == static_cast<int>(AESLayer::KdfMode::Pbkdf2Sha256)
-				? AESLayer::KdfMode::Pbkdf2Sha256
-				: AESLayer::KdfMode::Scrypt;
-		}
-
-		inline bool ConstantTimeEquals(const std::string_view lhs, const std::string_view rhs)
-		{
-			if (lhs.size() != rhs.size())
-			{
-				return false;
-			}
-			return VerifyBufsEqual(
-				reinterpret_cast<const byte*>(lhs.data()),
-				reinterpret_cast<const byte*>(rhs.data()),
-				lhs.size());
-		}
-
+	// Collects resource updates for one executable and writes them in one
+	// BeginUpdateResourceW()/EndUpdateResourceW() transaction. Every
+	// EndUpdateResourceW() rewrites the whole image, so a save that changes
+	// the payload and the window traits commits them together instead of
+	// rewriting the file once per resource. If any update fails, none is
+	// written. With LOCKNOTE_PORTABLE_RESOURCES defined the batch is applied
+	// by PeResources (peresources.h) instead of the resource update API.
+	class ResourceBatch
+	{
+	public:
+		explicit ResourceBatch(const std::string& strExePath)
+			: m_strExePath(strExePath)
+		{
+		}
+
+		void Add(const std::string& strResourceName, const std::string& strResourceSection, std::vector<unsigned char> arrayBuffer)
+		{
+			m_updates.push_back({ utf8_to_wstring(strResourceName), utf8_to_wstring(strResourceSection), std::move(arrayBuffer) });
+		}
+
+		// strText is stored with its terminating NUL, as LoadResource() expects
+		void Add(const std::string& strResourceName, const std::string& strResourceSection, const std::string& strText)
+		{
+			const unsigned char* text = reinterpret_cast<const unsigned char*>(strText.c_str());
+			Add(strResourceName, strResourceSection, std::vector<unsigned char>(text, text + strText.size() + 1));
+		}
+
+		bool Commit()
+		{
+			const std::wstring exePath = utf8_to_wstring(m_strExePath);
+			if (exePath.empty())
+			{
+				return false;
+			}
+			for (const Update& update : m_updates)
+			{
+				if (update.m_name.empty() || update.m_section.empty() || update.m_data.size() > static_cast<size_t>((std::numeric_limits<DWORD>::max)()))
+				{
+					return false;
+				}
+			}
+
+#ifdef LOCKNOTE_PORTABLE_RESOURCES
+			// the image is rebuilt in memory and written back in one piece;
+			// a failed update leaves the file untouched like a discarded
+			// EndUpdateResourceW()
+			std::vector<unsigned char> image;
+			PeResources resources;
+			if (!ReadPeFile(exePath, image) || !resources.Load(image))
+			{
+				return false;
+			}
+			for (const Update& update : m_updates)
+			{
+				const PeResourceId type(wstring_to_utf8(update.m_section));
+				const PeResourceId name(wstring_to_utf8(update.m_name));
+				if (update.m_data.empty())
+				{
+					resources.Remove(type, name);
+				}
+				else
+				{
+					resources.Update(type, name, update.m_data);
+				}
+			}
+			std::vector<unsigned char> output;
+			return resources.Write(output) && WritePeFile(exePath, output);
+#else
+			bool bResult = false;
+			HANDLE hFile = ::BeginUpdateResourceW(exePath.c_str(), FALSE);
+			if (hFile)
+			{
+				bResult = true;
+				for (size_t i = 0; bResult && i < m_updates.size(); ++i)
+				{
+					const Update& update = m_updates[i];
+					void* resourceData = update.m_data.empty() ? nullptr : const_cast<unsigned char*>(update.m_data.data());
+					bResult = ::UpdateResourceW(
+						hFile,
+						update.m_section.c_str(),
+						update.m_name.c_str(),
+						MAKELANGID(LANG_NEUTRAL, SUBLANG_NEUTRAL),
+						resourceData,
+						static_cast<DWORD>(update.m_data.size())) ? true : false;
+				}
+
+				if (!::EndUpdateResourceW(hFile, bResult ? FALSE : TRUE))
+				{
+					bResult = false;
+				}
+			}
+			return bResult;
+#endif
+		}
+
+	private:
+		struct Update
+		{
+			std::wstring m_name;
+			std::wstring m_section;
+			std::vector<unsigned char> m_data;
+		};
+
+		std::string m_strExePath;
+		std::vector<Update> m_updates;
+	};
+
 	inline bool UpdateResource(
 		const std::string& strExePath,
 		const std::string& strResourceName,
 		const std::string& strResourceSection,
 		const std::vector<unsigned char>& arrayBuffer)
 	{
-		if (arrayBuffer.size() > static_cast<size_t>((std::numeric_limits<DWORD>::max)()))
-		{
-			return false;
-		}
-
-		const std::wstring exePath = utf8_to_wstring(strExePath);
-		const std::wstring resourceName = utf8_to_wstring(strResourceName);
-		const std::wstring resourceSection = utf8_to_wstring(strResourceSection);
-		if (exePath.empty() || resourceName.empty() || resourceSection.empty())
-		{
-			return false;
-		}
-
-		bool bResult = false;
-		HANDLE hFile = ::BeginUpdateResourceW(exePath.c_str(), FALSE);
-		if (hFile)
-		{
-			void* resourceData = arrayBuffer.empty() ? nullptr : const_cast<unsigned char*>(arrayBuffer.data());
-			bResult = ::UpdateResourceW(
-				hFile,
-				resourceSection.c_str(),
-				resourceName.c_str(),
-				MAKELANGID(LANG_NEUTRAL, SUBLANG_NEUTRAL),
-				resourceData,
-				static_cast<DWORD>(arrayBuffer.size())) ? true : false;
-
-			if (!::EndUpdateResourceW(hFile, bResult ? FALSE : TRUE))
-			{
-				bResult = false;
-			}
-		}
-		return bResult;
+		ResourceBatch batch(strExePath);
+		batch.Add(strResourceName, strResourceSection, arrayBuffer);
+		return batch.Commit();
 	}
 
 	inline bool UpdateResource(const std::string& strExePath, const std::string& strResourceName, const std::string& strResourceSection, const std::string& strText)
 	{
-		std::vector<unsigned char> arrayBuffer;
-		size_t dwSize = (strText.size() + 1) * sizeof(char);
-		arrayBuffer.resize(dwSize);
-		std::memcpy(arrayBuffer.data(), strText.c_str(), dwSize);
-		return UpdateResource(strExePath, strResourceName, strResourceSection, arrayBuffer);
+		ResourceBatch batch(strExePath);
+		batch.Add(strResourceName, strResourceSection, strText);
+		return batch.Commit();
 	}
 
-	inline bool LoadResource(const std::string& strResourceName, const std::string& strResourceSection, std::vector<unsigned char>& arrayBuffer, HMODULE hModule = GetModuleHandle())
+	// the resource data where LockResource() mapped it, valid for as long as
+	// hModule stays loaded; empty if the resource is missing or empty
+	inline std::span<const unsigned char> LoadResourceView(const std::string& strResourceName, const std::string& strResourceSection, HMODULE hModule = GetModuleHandle())
 	{
-		bool bResult = false;
+#ifdef LOCKNOTE_PORTABLE_RESOURCES
+		PeResources resources;
+		const PeResources::Resource* resource = resources.Load(PeResources::ModuleImage(hModule), PeResources::Layout::Loaded) ?
+			resources.Find(strResourceSection, strResourceName) : nullptr;
+		return resource ? resource->m_data : std::span<const unsigned char>();
+#else
 		HRSRC hResInfo = ::FindResourceA(hModule, strResourceName.c_str(), strResourceSection.c_str());
 		if (hResInfo)
 		{
@@ -197,110 +270,63 @@ namespace Utils
 			HGLOBAL hRes = ::LoadResource(hModule, hResInfo);
 			if (hRes && dwSize)
 			{
-				void* pData = ::LockResource(hRes);
+				const void* pData = ::LockResource(hRes);
 				if (pData)
 				{
-					arrayBuffer.resize(dwSize, 0);
-					std::memcpy(arrayBuffer.data(), pData, dwSize);
-					bResult = true;
+					return std::span<const unsigned char>(static_cast<const unsigned char*>(pData), dwSize);
 				}
 			}
 		}
-		return bResult;
+		return {};
+#endif
 	}
 
+	inline bool LoadResource(const std::string& strResourceName, const std::string& strResourceSection, std::vector<unsigned char>& arrayBuffer, HMODULE hModule = GetModuleHandle())
+	{
+		const std::span<const unsigned char> resource = LoadResourceView(strResourceName, strResourceSection, hModule);
+		if (resource.empty())
+		{
+			return false;
+		}
+		arrayBuffer.assign(resource.begin(), resource.end());
+		return true;
+	}
+
+	// the resource as a string stored with its terminating NUL
 	inline bool LoadResource(const std::string& strResourceName, const std::string& strResourceSection, std::string& strText, HMODULE hModule = GetModuleHandle())
 	{
-		bool bResult = false;
-		std::vector<unsigned char> arrayBuffer;
-		bResult = LoadResource(strResourceName, strResourceSection, arrayBuffer, hModule);
-		if (bResult)
+		const std::span<const unsigned char> resource = LoadResourceView(strResourceName, strResourceSection, hModule);
+		if (resource.empty())
 		{
-			if (arrayBuffer.empty())
-			{
-				strText.clear();
-				return true;
-			}
-
-			arrayBuffer.back() = '\0';
-			strText = reinterpret_cast<char*>(arrayBuffer.data());
+			return false;
 		}
-		return bResult;
-	}
-
-	inline bool EncryptString(
-		const std::string& strText,
-		const std::string& strPassword,
-		std::string& strEncryptedData,
-		const AESLayer::KdfMode kdfMode = AESLayer::KdfMode::Scrypt)
-	{
-		AutoSeededRandomPool rng;
-		AESLayer aes;
-		std::vector<byte> cipher(aes.MaxCiphertextLen(static_cast<unsigned int>(strText.length())), 0);
-		AESLayer::EncryptionOptions options;
-		options.m_kdfMode = kdfMode;
-		const unsigned int cipherLen = aes.Encrypt(rng, strPassword, cipher.data(), strText, options);
-
-		strEncryptedData.clear();
-		HexEncoder hex(new StringSink(strEncryptedData));
-		hex.Put(cipher.data(), cipherLen);
-		hex.MessageEnd();
-		return true;
+		const std::string_view text(reinterpret_cast<const char*>(resource.data()), resource.size() - 1);
+		strText.assign(text.substr(0, text.find('\0')));
+		return true;
 	}
 
-	inline bool DecryptString(const std::string& strEncryptedData, const std::string& strPassword, std::string& strText)
+	inline void AddWinTraitsResources(ResourceBatch& batch, const LOCKNOTEWINTRAITS& wintraits)
 	{
-		strText.clear();
-		if ((strEncryptedData.size() % 2) != 0)
-		{
-			return false;
-		}
-
-		try
-		{
-			AESLayer aes;
-			const size_t cipherTextLength = strEncryptedData.size() / 2;
-			std::vector<byte> cipher(cipherTextLength, 0);
-
-			HexDecoder hex(new ArraySink(cipher.data(), cipher.size()));
-			hex.Put(reinterpret_cast<const byte*>(strEncryptedData.data()), strEncryptedData.size());
-			hex.MessageEnd();
-
-			ConstByteArrayParameter cbar(static_cast<const byte*>(cipher.data()), cipherTextLength);
-			std::vector<byte> plainText(cipherTextLength, 0);
-			const DecodingResult result = aes.Decrypt(strPassword, plainText.data(), cbar);
-			if (!result.isValidCoding)
-			{
-				return false;
-			}
-
-			strText.assign(reinterpret_cast<const char*>(plainText.data()), result.messageLength);
-			SecureWipeBuffer(plainText.data(), plainText.size());
-			return true;
-		}
-		catch (const Exception&)
+		batch.Add("SIZEX", "INFORMATION", std::to_string(wintraits.m_nWindowSizeX));
+		batch.Add("SIZEY", "INFORMATION", std::to_string(wintraits.m_nWindowSizeY));
+		batch.Add("FONTSIZE", "INFORMATION", std::to_string(wintraits.m_nFontSize));
+		batch.Add("TYPEFACE", "INFORMATION", wintraits.m_strFontName);
+		batch.Add("KDFMODE", "INFORMATION", std::to_string(wintraits.m_nKdfMode));
+		batch.Add("THEMEMODE", "INFORMATION", std::to_string(wintraits.m_nThemeMode));
+		if (wintraits.m_nLangId != 0)
 		{
-			return false;
+			batch.Add("LANGID", "INFORMATION", std::to_string(wintraits.m_nLangId));
 		}
 	}
 
 	inline bool WriteWinTraitsResources(const std::string& path, const LOCKNOTEWINTRAITS& wintraits)
 	{
-		bool result = true;
-		result &= UpdateResource(path, "SIZEX", "INFORMATION", std::to_string(wintraits.m_nWindowSizeX));
-		result &= UpdateResource(path, "SIZEY", "INFORMATION", std::to_string(wintraits.m_nWindowSizeY));
-		result &= UpdateResource(path, "FONTSIZE", "INFORMATION", std::to_string(wintraits.m_nFontSize));
-		result &= UpdateResource(path, "TYPEFACE", "INFORMATION", wintraits.m_strFontName);
-		result &= UpdateResource(path, "KDFMODE", "INFORMATION", std::to_string(wintraits.m_nKdfMode));
-		result &= UpdateResource(path, "THEMEMODE", "INFORMATION", std::to_string(wintraits.m_nThemeMode));
-		if (wintraits.m_nLangId != 0)
-		{
-			result &= UpdateResource(path, "LANGID", "INFORMATION", std::to_string(wintraits.m_nLangId));
-		}
-		return result;
+		ResourceBatch batch(path);
+		AddWinTraitsResources(batch, wintraits);
+		return batch.Commit();
 	}
 
-	inline bool LoadTextFromFile(const std::string& path, std::string& text, std::string& password)
+	inline bool LoadTextFromFile(const std::string& path, SecureString& text, SecureString& password)
 	{
 		text.clear();
 		password.clear();
@@ -352,7 +378,15 @@ namespace Utils
 		return true;
 	}
 
-	inline bool SaveTextToFile(const std::string& path, const std::string& text, std::string& password, HWND hWnd = 0, LPLOCKNOTEWINTRAITS wintraits = nullptr)
+	// kdfParameters: see SaveKdfParameters(); the caller passes them in so
+	// the KDF calibration doesn't run here, on the UI thread
+	inline bool SaveTextToFile(
+		const std::string& path,
+		const std::string_view text,
+		SecureString& password,
+		const AESLayer::KdfParameters& kdfParameters,
+		HWND hWnd = 0,
+		LPLOCKNOTEWINTRAITS wintraits = nullptr)
 	{
 		if (HasExtension(path, ".txt"))
 		{
@@ -383,7 +417,7 @@ namespace Utils
 			}
 		}
 
-		std::string data = "";
+		std::vector<unsigned char> data;
 		if (!text.empty())
 		{
 			AESLayer::KdfMode kdfMode = AESLayer::KdfMode::Scrypt;
@@ -391,7 +425,7 @@ namespace Utils
 			{
 				kdfMode = ParseKdfModeValue(wintraits->m_nKdfMode);
 			}
-			Utils::EncryptString(text, password, data, kdfMode);
+			Utils::EncryptPayload(text, password, data, kdfMode, nullptr, nullptr, kdfParameters);
 		}
 		else
 		{
@@ -411,14 +445,13 @@ namespace Utils
 			return false;
 		}
 
-		bool bResult = Utils::UpdateResource(path, "CONTENT", "PAYLOAD", data);
-
+		ResourceBatch batch(path);
+		batch.Add("CONTENT", "PAYLOAD", std::move(data));
 		if (wintraits)
 		{
-			bResult &= WriteWinTraitsResources(path, *wintraits);
+			AddWinTraitsResources(batch, *wintraits);
 		}
-
-		return bResult;
+		return batch.Commit();
 	}
 }
 